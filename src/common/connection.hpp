@@ -1,6 +1,9 @@
 #pragma once
 
+#include <array>
 #include <deque>
+#include <string>
+#include <vector>
 #include <functional>
 #include <memory>
 
@@ -13,6 +16,7 @@
 #include <uuid.hpp>
 
 #include "linebuffer.hpp"
+#include "frame.hpp"
 
 namespace util
 {
@@ -22,6 +26,21 @@ namespace util
 	//! Specifies that util::connection should use a read signaller.
 	struct connection_multiple_handler_tag {};
 
+	//! The classes of traffic a connection queues writes by.
+	/*!
+	 *  Each class has its own queue, and the queues are written in this
+	 *  order of priority, so a long transfer can't hold up raft.
+	 */
+	enum traffic_class : unsigned char
+	{
+		control, //!< Raft; never waits behind the others.
+		admin, //!< Everything else that's small.
+		bulk, //!< File transfers.
+	};
+
+	//! The number of traffic classes.
+	const std::size_t traffic_classes = 3;
+
 	template <class T>
 	struct connection_traits;
 
@@ -119,7 +138,10 @@ namespace util
 			socket_detail(std::shared_ptr<connection_type> connection)
 				:connection_(connection),
 				writing_(false),
-				closing_(false)
+				closing_(false),
+				follow_framing_(false),
+				framed_reads_(false),
+				framed_writes_(false)
 			{ }
 
 		public:
@@ -131,16 +153,49 @@ namespace util
 				return ptr;
 			}
 
-			void queue_write(const std::string& msg)
+			void queue_write(std::string msg, traffic_class cls)
 			{
-				write_queue_.push_back(msg);
+				queue_write(std::make_shared<const std::string>(std::move(msg)), cls);
+			}
+
+			void queue_write(std::shared_ptr<const std::string> msg, traffic_class cls)
+			{
+				write_queues_[cls].push_back(std::move(msg));
 
 				setup_write();
 			}
 
 			bool queue_empty() const
 			{
-				return write_queue_.empty();
+				return next_queue() == nullptr;
+			}
+
+			void follow_framing()
+			{
+				follow_framing_ = true;
+			}
+
+			void start_framing()
+			{
+				if(!framed_writes_)
+				{
+					framed_writes_ = true;
+
+					//Lines already queued must be written before the marker
+					auto& first = write_queues_[control];
+					for(std::size_t cls = control + 1; cls < traffic_classes; ++cls)
+					{
+						first.insert(first.end(), write_queues_[cls].begin(), write_queues_[cls].end());
+						write_queues_[cls].clear();
+					}
+
+					queue_write(frame::marker + '\n', control);
+				}
+			}
+
+			bool framed() const
+			{
+				return framed_writes_;
 			}
 
 			void close()
@@ -153,18 +208,88 @@ namespace util
 		protected:
 			std::weak_ptr<connection_type> connection_;
 
-			//! The message queue to be placed on the socket.
-			std::deque<std::string> write_queue_;
+			typedef std::deque<std::shared_ptr<const std::string>> write_queue_type;
+
+			//! The message queues to be placed on the socket, one for each
+			//! traffic class; messages may be shared with other connections.
+			std::array<write_queue_type, traffic_classes> write_queues_;
+
+			//! The queue of the most important class with anything queued,
+			//! or null if they're all empty.
+			write_queue_type* next_queue()
+			{
+				for(auto& queue : write_queues_)
+					if(!queue.empty())
+						return &queue;
+
+				return nullptr;
+			}
+
+			//! \overload
+			const write_queue_type* next_queue() const
+			{
+				return const_cast<socket_detail*>(this)->next_queue();
+			}
 
 			//! For handling the write queue
 			bool writing_;
 
-			typedef util::line_buffer<std::array<char, 4096>> line_buffer_type;
-			//! Forms complete lines from buffers.
+			typedef util::line_buffer<std::string> line_buffer_type;
+			//! Forms complete lines from buffers; reads go straight into it.
 			line_buffer_type lb;
 
+			//! The most read from the socket at once.
+			static const std::size_t read_size = 4096;
+
+			//! The most queued bytes gathered into one write; a longer
+			//! message is still written whole.
+			static const std::size_t write_limit = 64 * 1024;
+
 			bool closing_;
 
+			//! Forms complete frames once the peer has switched to them.
+			frame::buffer fb;
+
+			//! True if the peer's marker line switches this connection to frames.
+			bool follow_framing_;
+
+			//! True once the peer has sent the marker line.
+			bool framed_reads_;
+
+			//! True once we have sent the marker line.
+			bool framed_writes_;
+
+			//! Pass the lines or frames read to the read handler.
+			void deliver(std::shared_ptr<connection_type> conn)
+			{
+				if(!framed_reads_)
+				{
+					line_buffer_type::view_type line;
+					while(lb.next(line))
+					{
+						if(follow_framing_ && line == line_buffer_type::view_type(frame::marker))
+						{
+							framed_reads_ = true;
+							start_framing();
+							break;
+						}
+
+						conn->read_handler_(std::string(line.data(), line.size()));
+					}
+
+					if(!framed_reads_)
+						return;
+				}
+
+				//Everything after the marker is framed
+				auto rest = lb.pending();
+				auto frames = fb(rest.data(), rest.size());
+				lb.clear();
+
+				for(const std::string& msg : frames)
+					conn->read_handler_(msg);
+			}
+
 			void close_impl()
 			{
 				if(!connection_.expired())
@@ -221,8 +346,6 @@ namespace util
 			//! Setup a read
 			void setup_read()
 			{
-				auto buf = std::make_shared<line_buffer_type::buffer_type>();
-
 				//Compiler won't look for shared_from_this in this class unless we tell it to
 				auto shared(this->shared_from_this());
 
@@ -231,8 +354,8 @@ namespace util
 					auto conn = connection_.lock();
 					auto socket = conn->socket_;
 
-					socket->async_receive(boost::asio::buffer(*buf),
-							[this, shared, buf, socket](const boost::system::error_code& ec, std::size_t bytes_tx)
+					socket->async_receive(boost::asio::buffer(lb.prepare(read_size), read_size),
+							[this, shared, socket](const boost::system::error_code& ec, std::size_t bytes_tx)
 							{
 								bool go = handle_error(ec);
 
@@ -240,9 +363,24 @@ namespace util
 								{
 									if(auto conn = connection_.lock())
 									{
-										auto lines = lb(*buf, bytes_tx);
-										for(const std::string& line : lines)
-											conn->read_handler_(line);
+										lb.commit(bytes_tx);
+										try
+										{
+											deliver(conn);
+										}
+										catch(frame::bad_frame& ex)
+										{
+											BOOST_LOG_TRIVIAL(warning) << "Shutting down socket: "
+												<< ex.what();
+
+											//As in handle_error, close outside the handler
+											conn->socket_->get_io_service().post(
+													[shared, conn]()
+													{
+														conn->close();
+													});
+											return;
+										}
 
 										if(conn->is_open())
 											setup_read();
@@ -253,22 +391,42 @@ namespace util
 			}
 
 			//! Setup a write
+			/*!
+			 *  This gathers as much of the queue as fits in write_limit into a
+			 *  single write, so a burst of small messages costs one syscall.
+			 */
 			void setup_write()
 			{
-				if(!writing_ && !write_queue_.empty())
+				write_queue_type* queue = next_queue();
+				if(!writing_ && queue)
 				{
 					writing_ = true;
 
-					auto msg = std::make_shared<std::string>(write_queue_.front());
-					write_queue_.pop_front();
+					//Take from the most important queue each time, so a
+					//batch is mostly control traffic when there's any
+					auto msgs = std::make_shared<std::vector<std::shared_ptr<const std::string>>>();
+					std::size_t bytes = 0;
+					do
+					{
+						bytes += queue->front()->size();
+						msgs->push_back(std::move(queue->front()));
+						queue->pop_front();
+						queue = next_queue();
+					}
+					while(queue && bytes + queue->front()->size() <= write_limit);
+
+					std::vector<boost::asio::const_buffer> buffers;
+					buffers.reserve(msgs->size());
+					for(const auto& msg : *msgs)
+						buffers.push_back(boost::asio::buffer(*msg));
 
 					//Compiler won't look for shared_from_this in this class unless we tell it to
 					auto shared(this->shared_from_this());
 					auto conn = connection_.lock();
 
-					boost::asio::async_write(*(conn->socket_), boost::asio::buffer(*msg),
-							//Capture shared & msg to ensure lifetime
-							[this, shared, conn, msg](const boost::system::error_code& ec, std::size_t /*bytes_tx*/)
+					boost::asio::async_write(*(conn->socket_), buffers,
+							//Capture shared & msgs to ensure lifetime
+							[this, shared, conn, msgs](const boost::system::error_code& ec, std::size_t /*bytes_tx*/)
 							{
 								bool go = handle_error(ec);
 
@@ -282,7 +440,7 @@ namespace util
 								}
 							});
 				}
-				else if(write_queue_.empty() && closing_)
+				else if(!queue && closing_)
 					close_impl();
 			}
 		};
@@ -381,11 +539,53 @@ namespace util
 		 *  This function adds a message to the queue to be asynchronously sent
 		 *  when the socket is available for writing. Thread safe.
 		 *
-		 *  \param msg The message to add to the message queue.
+		 *  \param msg The message to add to the message queue; pass an
+		 *  rvalue to avoid copying it.
+		 *
+		 *  \param cls The message's traffic class; messages are written in
+		 *  order within a class, and ahead of those of less important
+		 *  classes.
 		 */
-		void queue_write(const std::string& msg)
+		void queue_write(std::string msg, traffic_class cls = admin)
+		{
+			socket_manager_->queue_write(std::move(msg), cls);
+		}
+
+		//! \overload
+		/*!
+		 *  The message is queued without being copied, so it can be shared
+		 *  by several connections; it must not change once queued.
+		 */
+		void queue_write(std::shared_ptr<const std::string> msg, traffic_class cls = admin)
+		{
+			socket_manager_->queue_write(std::move(msg), cls);
+		}
+
+		//! Switch to frames when the peer does.
+		/*!
+		 *  Once this is called, the marker line from the peer switches reads
+		 *  to frames (see util::frame), and this connection answers with the
+		 *  marker so that writes are framed too.
+		 */
+		void follow_framing()
+		{
+			socket_manager_->follow_framing();
+		}
+
+		//! Send the marker line; everything written after it must be framed.
+		/*!
+		 *  The peer has to have agreed to framing, and must follow it.
+		 *  Calling this more than once has no further effect.
+		 */
+		void start_framing()
+		{
+			socket_manager_->start_framing();
+		}
+
+		//! True if writes to this connection must be frames.
+		bool framed() const
 		{
-			socket_manager_->queue_write(msg);
+			return socket_manager_->framed();
 		}
 
 		//! Register a callback for a read event.
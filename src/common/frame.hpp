@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace util
+{
+	//! Length-prefixed binary framing for peer connections.
+	/*!
+	 *  A frame is a big-endian 32-bit length followed by that many bytes: a
+	 *  version byte, the payload type, the raft group (big-endian, 32 bits),
+	 *  the target and reply module IDs, each prefixed with a length byte, and
+	 *  then the payload, which runs to the end of the frame.
+	 *
+	 *  A connection carries lines until one side sends the marker line; every
+	 *  byte it sends after that is framed.
+	 */
+	namespace frame
+	{
+		//! The line sent to switch a connection's direction to frames.
+		const std::string marker = "#frames";
+
+		//! The first byte of every frame; a line of JSON can't start with it.
+		const unsigned char version = 0xcf;
+
+		//! The size of the length prefix.
+		const std::size_t length_size = 4;
+
+		//! The largest frame accepted; anything longer is a corrupt stream.
+		const uint32_t max_length = 64 * 1024 * 1024;
+
+		//! The encoding of a frame's payload.
+		enum payload_type : unsigned char
+		{
+			json = 0, //!< A JSON value, as the content member of a line.
+			binary = 1, //!< Opaque bytes for the module to interpret.
+		};
+
+		//! Thrown when a frame is malformed or too long.
+		struct bad_frame : std::runtime_error
+		{
+			bad_frame(const std::string& what)
+				:std::runtime_error("Bad frame: " + what)
+			{}
+		};
+
+		//! The decoded header of a frame.
+		struct header
+		{
+			payload_type type;
+			uint32_t group;
+			std::string module;
+			std::string reply;
+
+			//! Where in the frame the payload starts.
+			std::size_t payload_offset;
+		};
+
+		namespace detail
+		{
+			inline void put_u32(std::string& out, uint32_t value)
+			{
+				out.push_back(static_cast<char>(value >> 24));
+				out.push_back(static_cast<char>(value >> 16));
+				out.push_back(static_cast<char>(value >> 8));
+				out.push_back(static_cast<char>(value));
+			}
+
+			inline uint32_t get_u32(const char* in)
+			{
+				const unsigned char* bytes = reinterpret_cast<const unsigned char*>(in);
+				return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16)
+					| (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+			}
+
+			inline void put_id(std::string& out, const std::string& id)
+			{
+				if(id.size() > 255)
+					throw bad_frame("module ID " + id + " is too long");
+
+				out.push_back(static_cast<char>(id.size()));
+				out += id;
+			}
+		}
+
+		//! Encode a frame, ready to be written to a framed connection.
+		/*!
+		 *  \param module The module the frame is for.
+		 *  \param reply The module replies should go to.
+		 *  \param group The raft group of both modules.
+		 *  \param type How the payload is encoded.
+		 *  \param payload The payload.
+		 *
+		 *  \returns The frame, including its length prefix.
+		 */
+		inline std::string encode(const std::string& module, const std::string& reply,
+				uint32_t group, payload_type type, const std::string& payload)
+		{
+			const std::size_t length = 1 + 1 + 4 + 1 + module.size() + 1
+				+ reply.size() + payload.size();
+			if(length > max_length)
+				throw bad_frame("payload for " + module + " is too long");
+
+			std::string frame;
+			frame.reserve(length_size + length);
+			detail::put_u32(frame, length);
+			frame.push_back(static_cast<char>(version));
+			frame.push_back(static_cast<char>(type));
+			detail::put_u32(frame, group);
+			detail::put_id(frame, module);
+			detail::put_id(frame, reply);
+			frame += payload;
+
+			return frame;
+		}
+
+		//! Checks whether a message read from a connection is a frame.
+		/*!
+		 *  \param msg A frame, without its length prefix, or a line.
+		 */
+		inline bool is_frame(const std::string& msg)
+		{
+			return !msg.empty() && static_cast<unsigned char>(msg[0]) == version;
+		}
+
+		//! Decode the header of a frame.
+		/*!
+		 *  \param msg A frame, without its length prefix, as read from a
+		 *  connection.
+		 *
+		 *  \returns The header; the payload is the rest of msg.
+		 *
+		 *  \throws bad_frame if the header doesn't fit in msg.
+		 */
+		inline header decode(const std::string& msg)
+		{
+			if(!is_frame(msg))
+				throw bad_frame("unknown version");
+
+			if(msg.size() < 7)
+				throw bad_frame("truncated header");
+
+			header hdr;
+			hdr.type = static_cast<payload_type>(msg[1]);
+			if(hdr.type != json && hdr.type != binary)
+				throw bad_frame("unknown payload type");
+
+			hdr.group = detail::get_u32(msg.data() + 2);
+
+			std::size_t pos = 6;
+			for(std::string* id : {&hdr.module, &hdr.reply})
+			{
+				if(pos >= msg.size())
+					throw bad_frame("truncated header");
+
+				const std::size_t size = static_cast<unsigned char>(msg[pos++]);
+				if(pos + size > msg.size())
+					throw bad_frame("truncated module ID");
+
+				id->assign(msg, pos, size);
+				pos += size;
+			}
+
+			hdr.payload_offset = pos;
+			return hdr;
+		}
+
+		//! Forms complete frames from the bytes read from a connection.
+		class buffer
+		{
+		public:
+			//! Add bytes read from the connection.
+			/*!
+			 *  \returns The frames completed by these bytes, without their
+			 *  length prefixes.
+			 *
+			 *  \throws bad_frame if a frame is longer than max_length.
+			 */
+			std::vector<std::string> operator()(const char* data, std::size_t size)
+			{
+				pending_.append(data, size);
+
+				std::vector<std::string> frames;
+				std::size_t pos = 0;
+				while(pending_.size() - pos >= length_size)
+				{
+					const uint32_t length = detail::get_u32(pending_.data() + pos);
+					if(length > max_length)
+						throw bad_frame("frame of " + std::to_string(length) + " bytes");
+
+					if(pending_.size() - pos - length_size < length)
+						break;
+
+					frames.emplace_back(pending_, pos + length_size, length);
+					pos += length_size + length;
+				}
+
+				pending_.erase(0, pos);
+				return frames;
+			}
+
+			//! The bytes of a frame not yet completed.
+			std::string remainder() const
+			{
+				return pending_;
+			}
+
+		protected:
+			std::string pending_;
+		};
+	}
+}
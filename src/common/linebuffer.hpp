@@ -1,61 +1,170 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
 namespace util
 {
+	namespace detail
+	{
+		//! Find the first newline in [first, last), or last.
+		template <class CharT>
+		const CharT* find_newline(const CharT* first, const CharT* last)
+		{
+			return std::find(first, last, CharT('\n'));
+		}
+
+		//! memchr is vectorised by the C library, so use it where we can.
+		inline const char* find_newline(const char* first, const char* last)
+		{
+			const void* found = std::memchr(first, '\n', last - first);
+			return found ? static_cast<const char*>(found) : last;
+		}
+	}
+
+	//! Splits a stream of bytes into lines.
+	/*!
+	 *  Bytes are kept in one growable buffer: consumed lines are dropped from
+	 *  the front by moving the start along, and the unconsumed bytes are moved
+	 *  back to the front when more space is needed at the end, so a line is
+	 *  always contiguous and can be handed out as a view. Searching for the
+	 *  newline resumes where it left off, so a long line isn't rescanned as
+	 *  each part of it arrives.
+	 */
 	template <class Buffer>
 	class line_buffer
 	{
 	public:
 		typedef Buffer buffer_type;
-		typedef std::basic_string<typename buffer_type::value_type> string_type;
-		typedef std::basic_stringstream<typename buffer_type::value_type> stringstream_type;
-		typedef std::basic_streambuf<typename stringstream_type::char_type,
-				typename stringstream_type::traits_type> streambuf_type;
+		typedef typename buffer_type::value_type char_type;
+		typedef std::basic_string<char_type> string_type;
+		typedef boost::basic_string_ref<char_type> view_type;
 
-		line_buffer() = default;
+		line_buffer()
+			:begin_(0),
+			end_(0),
+			scan_(0)
+		{}
 
 		line_buffer(const string_type& buf)
-			:remainder_(buf)
-		{}
+			:line_buffer()
+		{
+			append(buf.data(), buf.size());
+		}
 
-		std::vector<string_type> operator()(const buffer_type& buf, typename buffer_type::size_type size)
+		//! Space to read up to size more bytes into; see commit().
+		/*!
+		 *  Invalidates views given by next().
+		 */
+		char_type* prepare(std::size_t size)
 		{
-			/* For it to read the initialised data, we need to seek to the end
-			 *-- the ios_base::ate flag. The other two are there for a normal open.
-			 */
-			stringstream_type ss(remainder_, std::ios_base::in | std::ios_base::out | std::ios_base::ate);
-			remainder_.clear();
+			if(data_.size() - end_ < size)
+			{
+				//Drop the consumed lines before growing
+				std::copy(data_.begin() + begin_, data_.begin() + end_, data_.begin());
+				end_ -= begin_;
+				scan_ -= begin_;
+				begin_ = 0;
 
-			//Read from the buffer
-			ss.write(buf.data(), size);
+				if(data_.size() - end_ < size)
+					data_.resize(std::max(data_.size() * 2, end_ + size));
+			}
 
-			std::vector<string_type> lines;
+			return data_.data() + end_;
+		}
+
+		//! Add size bytes written to the space given by prepare().
+		void commit(std::size_t size)
+		{
+			end_ += size;
+		}
+
+		//! Add a copy of size bytes.
+		void append(const char_type* buf, std::size_t size)
+		{
+			std::copy(buf, buf + size, prepare(size));
+			commit(size);
+		}
 
-			std::string line;
-			while(std::getline(ss, line))
+		//! Take the next complete line, without its newline.
+		/*!
+		 *  \param line Set to a view of the line, valid until the buffer is
+		 *  next added to.
+		 *
+		 *  \returns False if there is no complete line.
+		 */
+		bool next(view_type& line)
+		{
+			const char_type* start = data_.data();
+			const char_type* newline = detail::find_newline(start + scan_, start + end_);
+			if(newline == start + end_)
 			{
-				ss.unget();
-				if('\n' == ss.get())
-					lines.push_back(line);
-				else
-					remainder_ = line;
+				scan_ = end_;
+				return false;
 			}
 
+			line = view_type(start + begin_, newline - (start + begin_));
+			begin_ = scan_ = newline - start + 1;
+			return true;
+		}
+
+		//! Add size bytes of buf, returning the lines they complete.
+		std::vector<string_type> operator()(const buffer_type& buf, typename buffer_type::size_type size)
+		{
+			return (*this)(buf.data(), size);
+		}
+
+		//! \overload
+		std::vector<string_type> operator()(const char_type* buf, std::size_t size)
+		{
+			append(buf, size);
+
+			std::vector<string_type> lines;
+			view_type line;
+			while(next(line))
+				lines.emplace_back(line.data(), line.size());
+
 			return lines;
 		}
 
+		//! \overload
 		std::vector<string_type> operator()(const buffer_type& buf)
 		{
 			return (*this)(buf, buf.size());
 		}
 
+		//! The bytes after the last complete line.
+		view_type pending() const
+		{
+			return view_type(data_.data() + begin_, end_ - begin_);
+		}
+
 		string_type remainder() const
 		{
-			return remainder_;
+			return string_type(data_.data() + begin_, end_ - begin_);
+		}
+
+		//! Drop every byte held.
+		void clear()
+		{
+			begin_ = end_ = scan_ = 0;
 		}
 
 	protected:
-			string_type remainder_;
+		std::vector<char_type> data_;
+
+		//! The start of the unconsumed bytes.
+		std::size_t begin_;
+
+		//! The end of the bytes held.
+		std::size_t end_;
+
+		//! Where the search for the next newline resumes.
+		std::size_t scan_;
 	};
 
 
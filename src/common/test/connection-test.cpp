@@ -159,3 +159,113 @@ BOOST_AUTO_TEST_CASE(multiple_handler_trait)
 	BOOST_REQUIRE_MESSAGE(!t.timed_out(), "Test took too long.");
 	BOOST_REQUIRE_MESSAGE(ca.success(), "Remaining: " << ca.remaining());
 }
+
+BOOST_AUTO_TEST_CASE(framing_follows_marker)
+{
+	boost::asio::io_service io;
+	auto sock1 = std::make_shared<socket_type>(io);
+	auto sock2 = std::make_shared<socket_type>(io);
+
+	boost::asio::local::connect_pair(*sock1, *sock2);
+
+	auto conn1 = single_connection::create(sock1);
+	auto conn2 = single_connection::create(sock2);
+	conn1->follow_framing();
+	conn2->follow_framing();
+
+	//A frame may contain newlines; it arrives whole
+	const std::string frame = util::frame::encode("m", "r", 0, util::frame::binary,
+			std::string("foo\nbar\0", 8));
+	const std::string body = frame.substr(util::frame::length_size);
+
+	std::deque<std::string> read2;
+	conn2->connect_read([&read2, conn2, &frame](const std::string& msg)
+			{
+				read2.push_back(msg);
+				//conn2 switched on seeing the marker, so it answers in frames
+				if(conn2->framed())
+					conn2->queue_write(frame);
+			});
+
+	check_array ca(io, std::deque<std::string>{body});
+	conn1->connect_read([&ca](const std::string& msg){ca(msg);});
+
+	conn1->queue_write("Fnord\n");
+	conn1->start_framing();
+	conn1->queue_write(frame);
+	BOOST_CHECK(conn1->framed());
+	BOOST_CHECK(!conn2->framed());
+
+	timer t(io);
+
+	io.run();
+
+	BOOST_REQUIRE_MESSAGE(!t.timed_out(), "Test took too long.");
+	BOOST_REQUIRE_MESSAGE(ca.success(), "Remaining: " << ca.remaining());
+	BOOST_CHECK(conn2->framed());
+	BOOST_REQUIRE_EQUAL(read2.size(), 2);
+	BOOST_CHECK_EQUAL(read2[0], "Fnord");
+	BOOST_CHECK_EQUAL(read2[1], body);
+}
+
+BOOST_AUTO_TEST_CASE(queued_burst_arrives_in_order)
+{
+	boost::asio::io_service io;
+	auto sock1 = std::make_shared<socket_type>(io);
+	auto sock2 = std::make_shared<socket_type>(io);
+
+	boost::asio::local::connect_pair(*sock1, *sock2);
+
+	auto conn1 = single_connection::create(sock1);
+	auto conn2 = single_connection::create(sock2);
+
+	//Enough to be gathered into several writes, with one longer than a write
+	std::deque<std::string> expected;
+	for(unsigned i = 0; i < 2000; ++i)
+		expected.push_back("Hail Eris! " + std::to_string(i));
+	expected[1000] = std::string(100000, 'x');
+
+	check_array ca(io, expected);
+
+	conn2->connect_read([&ca](const std::string& msg){ca(msg);});
+
+	for(const std::string& msg : expected)
+		conn1->queue_write(msg + '\n');
+
+	timer t(io);
+
+	io.run();
+
+	BOOST_REQUIRE_MESSAGE(!t.timed_out(), "Test took too long.");
+	BOOST_REQUIRE_MESSAGE(ca.success(), "Remaining: " << ca.remaining());
+}
+
+BOOST_AUTO_TEST_CASE(control_traffic_overtakes_bulk)
+{
+	boost::asio::io_service io;
+	auto sock1 = std::make_shared<socket_type>(io);
+	auto sock2 = std::make_shared<socket_type>(io);
+
+	boost::asio::local::connect_pair(*sock1, *sock2);
+
+	auto conn1 = single_connection::create(sock1);
+	auto conn2 = single_connection::create(sock2);
+
+	//The first write starts at once; the rest queue behind it by class
+	check_array ca(io, std::deque<std::string>{"bulk 0", "control", "admin", "bulk 1", "bulk 2"});
+
+	conn2->connect_read([&ca](const std::string& msg){ca(msg);});
+
+	conn1->queue_write("bulk 0\n", util::bulk);
+	conn1->queue_write("bulk 1\n", util::bulk);
+	conn1->queue_write("bulk 2\n", util::bulk);
+	conn1->queue_write("admin\n", util::admin);
+	conn1->queue_write("control\n", util::control);
+
+	timer t(io);
+
+	io.run();
+
+	BOOST_REQUIRE_MESSAGE(!t.timed_out(), "Test took too long.");
+	BOOST_REQUIRE_MESSAGE(ca.success(), "Remaining: " << ca.remaining());
+}
@@ -0,0 +1,120 @@
+#include <cstdint>
+
+#include <array>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../linebuffer.hpp"
+
+//! The line buffer as it was before it kept a single buffer: the remainder
+//! and each read are copied into a stringstream and split with getline.
+class stringstream_line_buffer
+{
+public:
+	std::vector<std::string> operator()(const char* buf, std::size_t size)
+	{
+		std::stringstream ss(remainder_, std::ios_base::in | std::ios_base::out | std::ios_base::ate);
+		remainder_.clear();
+
+		ss.write(buf, size);
+
+		std::vector<std::string> lines;
+
+		std::string line;
+		while(std::getline(ss, line))
+		{
+			ss.unget();
+			if('\n' == ss.get())
+				lines.push_back(line);
+			else
+				remainder_ = line;
+		}
+
+		return lines;
+	}
+
+protected:
+	std::string remainder_;
+};
+
+//! A stream of lines like the RPC traffic between nodes: mostly short
+//! heartbeats and acknowledgements, with the occasional long batch.
+static std::string make_stream(std::size_t size)
+{
+	std::mt19937 gen(42);
+	std::uniform_int_distribution<int> kind(0, 99);
+	std::uniform_int_distribution<std::size_t> long_length(1000, 20000);
+
+	std::string stream;
+	stream.reserve(size + 20000);
+	while(stream.size() < size)
+	{
+		const std::size_t length = kind(gen) < 95 ? 80 + kind(gen) : long_length(gen);
+		stream += R"({"module":"raftstate","reply":"raftstate","content":")";
+		stream.append(length, 'x');
+		stream += "\"}\n";
+	}
+
+	return stream;
+}
+
+template <typename Split>
+static void run(const std::string& name, const std::string& stream, Split&& split)
+{
+	typedef std::chrono::steady_clock clock;
+	const std::size_t read_size = 4096;
+
+	std::size_t lines = 0;
+	std::size_t bytes = 0;
+	const auto start = clock::now();
+	for(std::size_t pos = 0; pos < stream.size(); pos += read_size)
+		split(stream.data() + pos, std::min(read_size, stream.size() - pos), lines, bytes);
+
+	const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	std::cout << std::fixed << std::setprecision(2)
+		<< name << ":\n"
+		<< "  " << lines << " lines, " << bytes << " bytes in " << seconds * 1000 << "ms\n"
+		<< "  MB/s " << stream.size() / seconds / 1e6
+		<< ", lines/s " << lines / seconds << "\n";
+}
+
+int main(int argc, char** argv)
+{
+	const std::size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 256;
+	const std::string stream = make_stream(megabytes * 1000 * 1000);
+
+	run("stringstream", stream, [](const char* buf, std::size_t size,
+				std::size_t& lines, std::size_t& bytes)
+			{
+				static stringstream_line_buffer lb;
+				for(const std::string& line : lb(buf, size))
+				{
+					++lines;
+					bytes += line.size();
+				}
+			});
+
+	//As util::connection uses it: read into the buffer, take views
+	run("line_buffer", stream, [](const char* buf, std::size_t size,
+				std::size_t& lines, std::size_t& bytes)
+			{
+				static util::line_buffer<std::string> lb;
+				std::copy(buf, buf + size, lb.prepare(size));
+				lb.commit(size);
+
+				util::line_buffer<std::string>::view_type line;
+				while(lb.next(line))
+				{
+					++lines;
+					bytes += line.size();
+				}
+			});
+
+	return 0;
+}
@@ -103,3 +103,51 @@ BOOST_AUTO_TEST_CASE(remainder_empty)
 }
 
 
+BOOST_AUTO_TEST_CASE(next_gives_views_of_lines)
+{
+	lbuf_type sut("fnord");
+	lbuf_type::view_type line;
+
+	BOOST_REQUIRE(!sut.next(line));
+
+	const std::string buf = "\nfoo\nbar";
+	sut.append(buf.data(), buf.size());
+
+	BOOST_REQUIRE(sut.next(line));
+	BOOST_CHECK_EQUAL(line, "fnord");
+	BOOST_REQUIRE(sut.next(line));
+	BOOST_CHECK_EQUAL(line, "foo");
+	BOOST_REQUIRE(!sut.next(line));
+
+	BOOST_CHECK_EQUAL(sut.pending(), "bar");
+}
+
+BOOST_AUTO_TEST_CASE(reads_into_prepared_space)
+{
+	lbuf_type sut;
+	lbuf_type::view_type line;
+
+	//Lines longer than the buffer grow it; consumed lines make room
+	std::string expected;
+	for(std::size_t i = 0; i < 100; ++i)
+	{
+		const std::string part = std::to_string(i) + (i % 7 ? "," : "\n");
+		std::copy(part.begin(), part.end(), sut.prepare(part.size()));
+		sut.commit(part.size());
+
+		expected += part;
+		if(part.back() == '\n')
+		{
+			BOOST_REQUIRE(sut.next(line));
+			BOOST_CHECK_EQUAL(line.to_string() + '\n', expected);
+			expected.clear();
+		}
+
+		BOOST_REQUIRE(!sut.next(line));
+	}
+
+	BOOST_CHECK_EQUAL(sut.remainder(), expected);
+
+	sut.clear();
+	BOOST_CHECK_EQUAL(sut.remainder(), "");
+}
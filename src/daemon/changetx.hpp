@@ -214,6 +214,13 @@ namespace change
 			}
 		}
 
+		//! Replace the nodes transfers are requested from, as the membership
+		//! changes.
+		void nodes(const std::vector<std::string>& nodes)
+		{
+			nodes_ = nodes;
+		}
+
 		//! Handler for request rpcs
 		rpc::response request(const rpc::request& rpc)
 		{
@@ -11,13 +11,15 @@
 
 comms_man::comms_man(const std::string& id, boost::asio::io_service& io,
 			const boost::asio::ip::tcp::endpoint& endpoint,
-			const node_map_type& nodes, TCPConnectionPool& pool)
+			const node_map_type& nodes, TCPConnectionPool& pool,
+			bool framing)
 	:id_(id),
 	io_(io),
 	acc_(io, endpoint),
 	res_(io),
 	nodes_(nodes),
-	pool_(pool)
+	pool_(pool),
+	framing_(framing)
 {
 	BOOST_LOG_TRIVIAL(info) << "RPC listening on port " << endpoint.port();
 	//Start the accept
@@ -28,6 +30,32 @@ comms_man::comms_man(const std::string& id, boost::asio::io_service& io,
 		start_connect(node);
 }
 
+void comms_man::add_node(const std::string& name, const std::string& host,
+		const std::string& service)
+{
+	auto info = std::make_tuple(host, service);
+	auto it = nodes_.find(name);
+	if(it != nodes_.end() && it->second == info)
+		return;
+
+	BOOST_LOG_TRIVIAL(info) << "Adding node " << name << " at " << host << ":" << service;
+	nodes_[name] = info;
+	if(pool_.exists(name))
+		pool_.delete_connection(name);
+
+	start_connect(name, host, service);
+}
+
+void comms_man::remove_node(const std::string& name)
+{
+	if(!nodes_.erase(name))
+		return;
+
+	BOOST_LOG_TRIVIAL(info) << "Removing node " << name;
+	if(pool_.exists(name))
+		pool_.delete_connection(name);
+}
+
 void comms_man::start_accept()
 {
 	auto sock = std::make_shared<boost::asio::ip::tcp::socket>(io_);
@@ -43,12 +71,19 @@ void comms_man::start_accept()
 
 					//wrap in our connection type
 					auto conn = TCPConnectionPool::connection_type::create(sock);
+					if(framing_)
+						conn->follow_framing();
 
 					*read_connection =
 						conn->connect_read([this, conn, read_connection]
 								(const std::string& line)
 								{
-									handle_connection(conn, line, false);
+									//The hello is the node's ID, then whether
+									//it can use frames
+									const auto space = line.find(' ');
+									handle_connection(conn, line.substr(0, space), false,
+											space != std::string::npos
+											&& line.substr(space + 1) == "frames");
 									//clean up the handler
 									read_connection->disconnect();
 								});
@@ -104,29 +139,30 @@ void comms_man::start_connect(const std::string& name, const std::string& host,
 
 void comms_man::handle_connection(
 		std::shared_ptr<TCPConnectionPool::connection_type> conn,
-			const std::string& endpoint, bool ours)
+			const std::string& endpoint, bool ours, bool framing)
 {
 	//check this is a valid connection
 	if(nodes_.count(endpoint))
 	{
 		//determine if we already have a connection for this endpoint
+		bool use = true;
 		if(pool_.exists(endpoint))
 		{
-			if((endpoint > id_ && !ours)
-					|| (endpoint < id_ && ours))
-			{
+			use = (endpoint > id_ && !ours) || (endpoint < id_ && ours);
+			if(use)
 				pool_.delete_connection(endpoint);
-				pool_.add_connection(endpoint, conn);
-				install_handlers(conn, endpoint);
-				BOOST_LOG_TRIVIAL(info) << "Successful connection to " << endpoint;
-			}
-
 		}
-		else
+
+		if(use)
 		{
+			//The connecting node follows us into frames once it sees the marker
+			if(framing && framing_)
+				conn->start_framing();
+
 			pool_.add_connection(endpoint, conn);
 			install_handlers(conn, endpoint);
-			BOOST_LOG_TRIVIAL(info) << "Successful connection to " << endpoint;
+			BOOST_LOG_TRIVIAL(info) << "Successful connection to " << endpoint
+				<< (conn->framed() ? " using frames" : "");
 		}
 	}
 	else
@@ -143,7 +179,16 @@ void comms_man::setup_connection(const std::string& name,
 		auto conn = TCPConnectionPool::connection_type::create(sock);
 		BOOST_LOG_TRIVIAL(trace) << "Setting up connection to " << name
 			<< " with ID " << conn->uuid();
-		conn->queue_write(id_ + '\n');
+
+		//Offer frames in the hello; the other node switches if it agrees.
+		//It's queued as control so that nothing can be written before it.
+		if(framing_)
+		{
+			conn->follow_framing();
+			conn->queue_write(id_ + " frames\n", util::control);
+		}
+		else
+			conn->queue_write(id_ + '\n', util::control);
 		handle_connection(conn, name, true);
 	}
 	else
@@ -160,7 +205,7 @@ void comms_man::setup_connection(const std::string& name,
 				{
 					if(!ec)
 					{
-						if(retry_timer && !pool_.exists(name))
+						if(retry_timer && !pool_.exists(name) && nodes_.count(name))
 							start_connect(name);
 
 						//drop our timer ref
@@ -184,7 +229,8 @@ void comms_man::install_handlers(TCPConnectionPool::connection_type::pointer con
 					//a lambda because bind can't cope with overloads
 					io_.post([this, endpoint]
 							{
-								if(!pool_.exists(endpoint))
+								//unless it's been removed since
+								if(!pool_.exists(endpoint) && nodes_.count(endpoint))
 									start_connect(endpoint);
 							});
 				}
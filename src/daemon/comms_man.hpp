@@ -18,10 +18,19 @@ public:
 	 *  \param nodes A map of connection IDs to their ip/port details
 	 *	\param pool The connection pool to hand completed connections
 	 *	to.
+	 *	\param framing True to offer length-prefixed frames (see
+	 *	util::frame) to other nodes in place of lines.
 	 */
 	comms_man(const std::string& id, boost::asio::io_service& io,
 			const boost::asio::ip::tcp::endpoint& endpoint,
-			const node_map_type& nodes, TCPConnectionPool& pool);
+			const node_map_type& nodes, TCPConnectionPool& pool,
+			bool framing = true);
+
+	//! Connect to a node, or reconnect if its address has changed
+	void add_node(const std::string& name, const std::string& host, const std::string& service);
+
+	//! Stop connecting to a node, dropping any connection to it
+	void remove_node(const std::string& name);
 
 protected:
 	void start_accept();
@@ -31,7 +40,7 @@ protected:
 	void start_connect(const std::string& name, const std::string& host, const std::string& service);
 
 	void handle_connection(TCPConnectionPool::connection_type::pointer conn,
-			const std::string& endpoint, bool ours);
+			const std::string& endpoint, bool ours, bool framing = false);
 
 
 	void setup_connection(const std::string& name,
@@ -48,4 +57,5 @@ protected:
 	boost::asio::ip::tcp::resolver res_;
 	node_map_type nodes_;
 	TCPConnectionPool& pool_;
+	bool framing_;
 };
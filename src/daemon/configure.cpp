@@ -1,5 +1,6 @@
 #include <iostream>
 #include <unordered_map>
+#include <algorithm>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -35,6 +36,13 @@ std::map<std::string, boost::log::trivial::severity_level> DaemonConfigure::leve
 	{"fatal", boost::log::trivial::fatal},
 };
 
+std::map<std::string, raft::log::durability> DaemonConfigure::durability_map =
+{
+	{"none", raft::log::durability_none},
+	{"batched", raft::log::durability_batched},
+	{"per-entry", raft::log::durability_per_entry},
+};
+
 void DaemonConfigure::init(const std::string& program_name)
 {
 	cli_.add_options()
@@ -45,8 +53,22 @@ void DaemonConfigure::init(const std::string& program_name)
 		("log", po::value<std::string>()->default_value(LOG_LOCATION), "Path to the log file.")
 		("working_directory", po::value<std::string>()->default_value("~/." PACKAGE_NAME), "Working directory.")
 		("id", po::value<std::string>(), "The ID of this node")
-		("nodes", po::value<std::string>(), "JSON node info")
-		("no-mount", "Do not mount the filesystem");
+		("nodes", po::value<std::string>(), "JSON node info; nodes marked \"learner\": true follow the Raft log without voting")
+		("no-mount", "Do not mount the filesystem")
+		("raft_durability", po::value<std::string>()->default_value("batched"), "How the Raft log is synced to disk: none, batched or per-entry.")
+		("raft_snapshot_interval", po::value<uint32_t>()->default_value(10000), "Applied Raft entries between log compactions; 0 disables them.")
+		("raft_log_window", po::value<std::size_t>()->default_value(4096), "Recent Raft log entries kept in memory.")
+		("raft_log_cache", po::value<std::size_t>()->default_value(1024), "Older Raft log entries cached after being read from disk.")
+		("raft_pipeline_window", po::value<uint32_t>()->default_value(8), "Batches of Raft entries sent to a follower before waiting for acknowledgements.")
+		("raft_lease", po::value<uint32_t>()->default_value(0), "Milliseconds a Raft leader serves reads without confirming its leadership; must be below the election timeout. 0 confirms every read.")
+		("raft_batch_size", po::value<uint32_t>()->default_value(256), "Most client requests a Raft leader appends to its log in one batch.")
+		("raft_batch_linger", po::value<uint32_t>()->default_value(0), "Milliseconds a Raft leader waits for more client requests before appending a batch; 0 batches those arriving together.")
+		("raft_pre_vote", po::value<bool>()->default_value(true), "Ask whether a Raft election could be won before starting it, so rejoining nodes don't depose the leader.")
+		("raft_commit_interval", po::value<uint32_t>()->default_value(1024), "Raft entries committed between checkpoints of the commit index in the log; 0 only records it with snapshots.")
+		("raft_checkpoint_interval", po::value<uint32_t>()->default_value(1000), "Applied Raft entries between checkpoints of the applied state, so restarts don't apply them again; 0 disables them.")
+		("raft_groups", po::value<uint32_t>()->default_value(1), "Raft groups the filesystem is sharded across by top-level directory, each with its own log and leader; every node must agree.")
+		("raft_balance_interval", po::value<uint32_t>()->default_value(5000), "Milliseconds between checks that each Raft group is led by its preferred node, spreading leaders across the nodes; 0 disables them. Unused with a single group.")
+		("rpc_framing", po::value<bool>()->default_value(true), "Offer other nodes length-prefixed binary frames in place of JSON lines; disable when nodes predating frames are in the cluster.");
 
 	hidden_.add_options()
 		("fuse_mount", "The mount point");
@@ -82,12 +104,25 @@ void DaemonConfigure::init(const std::string& program_name)
 		log_level_ = boost::log::trivial::info;
 	}
 
+	std::string durability_string = vm_["raft_durability"].as<std::string>();
+	if(durability_map.count(durability_string))
+		raft_durability_ = durability_map[durability_string];
+	else
+	{
+		std::cerr << "Configuration warning: raft durability `" << durability_string
+			<<"' invalid, defaulting to batched.\n";
+		raft_durability_ = raft::log::durability_batched;
+	}
+
 	id_ = vm_["id"].as<std::string>();
 
 	auto nodes = json_help::parse(vm_["nodes"].as<std::string>());
 
 	for(unsigned i = 0; i < nodes.size(); ++i)
 	{
+		if(nodes[i].get("learner", false).asBool())
+			learners_.push_back(nodes[i]["id"].asString());
+
 		if(nodes[i]["id"].asString() == id_)
 			port_ = nodes[i]["port"].asString();
 		else
@@ -175,11 +210,86 @@ std::vector<std::string> DaemonConfigure::node_list() const
 	return ret;
 }
 
+std::vector<std::string> DaemonConfigure::learner_list() const
+{
+	return learners_;
+}
+
 boost::filesystem::path DaemonConfigure::raft_log() const
 {
 	return working_root_ / "raftlog";
 }
 
+raft::log::durability DaemonConfigure::raft_durability() const
+{
+	return raft_durability_;
+}
+
+uint32_t DaemonConfigure::raft_snapshot_interval() const
+{
+	return vm_["raft_snapshot_interval"].as<uint32_t>();
+}
+
+std::size_t DaemonConfigure::raft_log_window() const
+{
+	return vm_["raft_log_window"].as<std::size_t>();
+}
+
+std::size_t DaemonConfigure::raft_log_cache() const
+{
+	return vm_["raft_log_cache"].as<std::size_t>();
+}
+
+uint32_t DaemonConfigure::raft_pipeline_window() const
+{
+	return vm_["raft_pipeline_window"].as<uint32_t>();
+}
+
+uint32_t DaemonConfigure::raft_lease() const
+{
+	return vm_["raft_lease"].as<uint32_t>();
+}
+
+uint32_t DaemonConfigure::raft_batch_size() const
+{
+	return vm_["raft_batch_size"].as<uint32_t>();
+}
+
+uint32_t DaemonConfigure::raft_batch_linger() const
+{
+	return vm_["raft_batch_linger"].as<uint32_t>();
+}
+
+bool DaemonConfigure::raft_pre_vote() const
+{
+	return vm_["raft_pre_vote"].as<bool>();
+}
+
+uint32_t DaemonConfigure::raft_commit_interval() const
+{
+	return vm_["raft_commit_interval"].as<uint32_t>();
+}
+
+uint32_t DaemonConfigure::raft_checkpoint_interval() const
+{
+	return vm_["raft_checkpoint_interval"].as<uint32_t>();
+}
+
+uint32_t DaemonConfigure::raft_groups() const
+{
+	return std::max(1u, vm_["raft_groups"].as<uint32_t>());
+}
+
+uint32_t DaemonConfigure::raft_balance_interval() const
+{
+	return vm_["raft_balance_interval"].as<uint32_t>();
+}
+
+bool DaemonConfigure::rpc_framing() const
+{
+	return vm_["rpc_framing"].as<bool>();
+}
+
 boost::filesystem::path DaemonConfigure::persistence_root() const
 {
 	return working_root_ / "persistence";
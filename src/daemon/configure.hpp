@@ -2,11 +2,13 @@
 
 
 #include "../common/configure.hpp"
+#include "raftsegment.hpp"
 
 //!Class for the daemon's configuration.
 class DaemonConfigure : public Configure
 {
 	static std::map<std::string, boost::log::trivial::severity_level> level_map;
+	static std::map<std::string, raft::log::durability> durability_map;
 
 	//! Initialises the configuration class
 	/*!
@@ -64,8 +66,55 @@ public:
 
 	std::vector<std::string> node_list() const;
 
+	//! The nodes, possibly including this one, that follow the Raft log
+	//! without voting.
+	std::vector<std::string> learner_list() const;
+
 	boost::filesystem::path raft_log() const;
 
+	//! How hard the Raft log works to make its records durable.
+	raft::log::durability raft_durability() const;
+
+	//! The number of applied Raft entries between snapshots of the log.
+	uint32_t raft_snapshot_interval() const;
+
+	//! The number of recent Raft log entries kept in memory.
+	std::size_t raft_log_window() const;
+
+	//! The number of older Raft log entries cached once read from disk.
+	std::size_t raft_log_cache() const;
+
+	//! The number of batches of Raft entries in flight to each follower.
+	uint32_t raft_pipeline_window() const;
+
+	//! The length of the Raft leader lease in milliseconds; 0 disables it.
+	uint32_t raft_lease() const;
+
+	//! The most client requests appended to the Raft log in one batch.
+	uint32_t raft_batch_size() const;
+
+	//! Milliseconds to wait for more client requests before a batch.
+	uint32_t raft_batch_linger() const;
+
+	//! True if Raft elections are preceded by a pre-vote.
+	bool raft_pre_vote() const;
+
+	//! The Raft entries committed between checkpoints of the commit index.
+	uint32_t raft_commit_interval() const;
+
+	//! The applied Raft entries between checkpoints of the applied state.
+	uint32_t raft_checkpoint_interval() const;
+
+	//! The number of Raft groups the keys are sharded across.
+	uint32_t raft_groups() const;
+
+	//! The milliseconds between checks that Raft leaders are spread across
+	//! the nodes.
+	uint32_t raft_balance_interval() const;
+
+	//! True if connections to other nodes are offered length-prefixed frames.
+	bool rpc_framing() const;
+
 	boost::filesystem::path persistence_root() const;
 
 	uid_t fuse_uid() const;
@@ -78,10 +127,12 @@ public:
 
 protected:
 	boost::log::trivial::severity_level log_level_;
+	raft::log::durability raft_durability_;
 
 	std::string id_;
 	std::string port_;
 	boost::filesystem::path working_root_;
 	boost::optional<boost::filesystem::path> fuse_mount_;
 	std::unordered_map<std::string, std::tuple<std::string, std::string>> nodes_;
+	std::vector<std::string> learners_;
 };
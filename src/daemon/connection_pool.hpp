@@ -2,6 +2,8 @@
 
 #include <map>
 #include <functional>
+#include <memory>
+#include <vector>
 
 #include "../common/connection.hpp"
 
@@ -74,6 +76,13 @@ public:
 			return endpoint_;
 		}
 
+		//! True if the response must be a frame; see util::frame.
+		bool framed() const
+		{
+			this->throw_if_invalid();
+			return parent_->framed(endpoint_);
+		}
+
 		//! The callback; sends a response to the RPC.
 		/*!
 		 *  This function handles sending a response to the node from whence
@@ -83,11 +92,12 @@ public:
 		 *  since.
 		 *
 		 *  \param msg The message to respond with.
+		 *  \param cls The traffic class to queue it in.
 		 */
-		void operator()(const std::string& msg)
+		void operator()(std::string msg, util::traffic_class cls = util::admin)
 		{
 			this->throw_if_invalid();
-			parent_->send_targeted(endpoint_, msg);
+			parent_->send_targeted(endpoint_, std::move(msg), cls);
 		}
 
 	protected:
@@ -123,12 +133,43 @@ public:
 	//! Send a message to all known nodes.
 	void broadcast(const std::string& msg)
 	{
-		for(auto connection : connections_)
-			connection.second->queue_write(msg);
+		broadcast(std::make_shared<const std::string>(msg));
+	}
+
+	//! \overload
+	/*!
+	 *  Every connection queues the same buffer rather than a copy of it.
+	 */
+	void broadcast(const std::shared_ptr<const std::string>& msg,
+			util::traffic_class cls = util::admin)
+	{
+		for(const auto& connection : connections_)
+			connection.second->queue_write(msg, cls);
+	}
+
+	//! Send a message to each of endpoints that's connected.
+	/*!
+	 *  As with broadcast, the connections share msg without copying it, so
+	 *  a message encoded once can go to any number of nodes.
+	 */
+	void broadcast(const std::shared_ptr<const std::string>& msg,
+			const std::vector<uid_type>& endpoints, util::traffic_class cls = util::admin)
+	{
+		for(const uid_type& endpoint : endpoints)
+		{
+			auto it = connections_.find(endpoint);
+			if(it != connections_.end())
+				it->second->queue_write(msg, cls);
+		}
 	}
 
-	//! Send a message to a specific node
-	void send_targeted(const uid_type& endpoint, const std::string& msg)
+	//! Send a message to a specific node; pass an rvalue to avoid copying it.
+	/*!
+	 *  \param cls The traffic class the message is queued in; see
+	 *  util::connection::queue_write.
+	 */
+	void send_targeted(const uid_type& endpoint, std::string msg,
+			util::traffic_class cls = util::admin)
 	{
 		if(!connections_.count(endpoint))
 			throw endpoint_missing(endpoint);
@@ -136,7 +177,17 @@ public:
 		BOOST_LOG_TRIVIAL(trace) << "RPC to " << endpoint << ": |"
 			<< msg << "|";
 
-		connections_[endpoint]->queue_write(msg);
+		connections_[endpoint]->queue_write(std::move(msg), cls);
+	}
+
+	//! \overload Queues msg without copying it.
+	void send_targeted(const uid_type& endpoint, const std::shared_ptr<const std::string>& msg,
+			util::traffic_class cls = util::admin)
+	{
+		if(!connections_.count(endpoint))
+			throw endpoint_missing(endpoint);
+
+		connections_[endpoint]->queue_write(msg, cls);
 	}
 
 	void add_connection(const uid_type& endpoint, typename connection_type::pointer connection)
@@ -153,6 +204,12 @@ public:
 		return connections_.count(endpoint);
 	}
 
+	//! True if messages to endpoint must be frames rather than lines.
+	bool framed(const uid_type& endpoint) const
+	{
+		return connections_.count(endpoint) && connections_.at(endpoint)->framed();
+	}
+
 	//! Checks to see if a connection with connection_id is responsible for the
 	//! connection to endpoint.
 	bool responsible(const uid_type& endpoint,
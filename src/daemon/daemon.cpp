@@ -94,11 +94,39 @@ raft::Controller::TimerLength Daemon::timer(
 		std::get<1>(lengths), std::get<2>(lengths)};
 }
 
+std::unique_ptr<raft::Controller> Daemon::make_group(const DaemonConfigure& config,
+		uint32_t group)
+{
+	//The first group keeps the configured log, so a single group is unchanged
+	std::string log_file = config.raft_log().string();
+	if(group > 0)
+		log_file += "." + std::to_string(group);
+
+	raft::Controller::Options options;
+	options.log.durability = config.raft_durability();
+	options.log.tail_size = config.raft_log_window();
+	options.log.cache_size = config.raft_log_cache();
+	options.log.commit_interval = config.raft_commit_interval();
+	options.snapshot_interval = config.raft_snapshot_interval();
+	options.pipeline_window = config.raft_pipeline_window();
+	options.lease_duration = config.raft_lease();
+	options.pre_vote = config.raft_pre_vote();
+	options.learners = config.learner_list();
+	options.checkpoint_interval = config.raft_checkpoint_interval();
+	options.batch_size = config.raft_batch_size();
+	options.batch_linger = config.raft_batch_linger();
+
+	return std::unique_ptr<raft::Controller>(new raft::Controller(io_, dispatch_,
+				timer(config.raft_timer()), id_, config.node_list(),
+				log_file, options, group));
+}
+
 Daemon::Daemon(DaemonConfigure const& config)
 	:log_(config),
 	io_(),
 	id_(config.id()),
 	mount_path_(config.fuse_mount()),
+	node_info_(config.node_info()),
 	ctx_tick_(io_),
 	fst_tick_(io_),
 	remcon_(io_, config.socket()),
@@ -106,15 +134,15 @@ Daemon::Daemon(DaemonConfigure const& config)
 				std::placeholders::_1, std::placeholders::_2)),
 	dispatch_(pool_),
 	comms_(id_, io_, config.listen(),
-			config.node_info(), pool_),
-	raft_(io_, dispatch_, timer(config.raft_timer()),
-			id_, config.node_list(),
-			config.raft_log().string()),
+			node_info_, pool_, config.rpc_framing()),
+	raft_(io_, id_, config.raft_groups(),
+			std::bind(&Daemon::make_group, this, std::cref(config), std::placeholders::_1),
+			config.raft_balance_interval()),
 	changetx_(config.node_list(),
 			config.persistence_root(),
 			std::bind(&Daemon::changetx_send, this,
 				std::placeholders::_1, std::placeholders::_2)),
-	fsstate_(raft_.client(), changetx_, id_,
+	fsstate_(raft_, changetx_, id_,
 			config.fuse_uid(), config.fuse_gid())
 {
 
@@ -128,7 +156,8 @@ Daemon::Daemon(DaemonConfigure const& config)
 	else
 	{
 
-		//register changetx's handlers
+		//register changetx's handlers; its chunks queue behind everything else
+		dispatch_.set_traffic_class("changetx", util::bulk);
 		changetx_send_ = dispatch_.connect_dispatcher("changetx",
 				[this](const Json::Value& value,
 					typename dispatch_type::Callback cb)
@@ -147,22 +176,26 @@ Daemon::Daemon(DaemonConfigure const& config)
 							<< type;
 				});
 
-		raft_.client().connect_commit_update(
+		raft_.connect_commit_update(
 				std::bind(&change::change_transfer<>::commit_update,
 					&changetx_, std::placeholders::_1));
 
-		raft_.client().connect_commit_rename(
+		raft_.connect_commit_rename(
 				std::bind(&change::change_transfer<>::commit_rename,
 					&changetx_, std::placeholders::_1));
 
-		raft_.client().connect_commit_delete(
+		raft_.connect_commit_delete(
 				std::bind(&change::change_transfer<>::commit_delete,
 					&changetx_, std::placeholders::_1));
 
-		raft_.client().connect_commit_add(
+		raft_.connect_commit_add(
 				std::bind(&change::change_transfer<>::commit_add,
 					&changetx_, std::placeholders::_1));
 
+		raft_.connect_configuration(
+				std::bind(&Daemon::update_membership, this,
+					std::placeholders::_1));
+
 
 		//set up fuselink
 		fuselink::io(&io_);
@@ -196,6 +229,156 @@ Daemon::Daemon(DaemonConfigure const& config)
 					shutdown();
 				});
 
+		//register the leadership transfer command
+		remcon_.connect("transfer", [this](const std::vector<std::string>& args,
+					CTLSession session)
+				{
+					boost::optional<std::string> to;
+					if(!args.empty())
+						to = args.front();
+
+					const bool started = raft_.transfer_leadership(to,
+							[session](bool transferred) mutable
+							{
+								session.write(transferred ? "Leadership transferred.\n"
+										: "Leadership transfer timed out.\n");
+							});
+
+					if(started)
+						session.write("Transferring leadership...\n");
+					else
+						session.write("Can't transfer leadership: not the leader, "
+								"unknown node or transfer already in progress.\n");
+				});
+
+		//register the up-to-date read of a file's version
+		remcon_.connect("read", [this](const std::vector<std::string>& args,
+					CTLSession session)
+				{
+					if(args.size() != 1)
+					{
+						session.write("Usage: read <path>\n");
+						return;
+					}
+
+					const std::string path = args.front();
+					raft_.read(craven::encode_path(path),
+							[session, path](bool confirmed,
+								const boost::optional<std::tuple<std::string, std::string>>& version) mutable
+							{
+								if(!confirmed)
+									session.write("Can't confirm " + path + " is up to date: "
+											"no leader, or leadership changed.\n");
+								else if(version)
+									session.write(path + ": version " + std::get<0>(*version)
+											+ " from " + std::get<1>(*version) + ".\n");
+								else
+									session.write("No such file: " + path + ".\n");
+							});
+				});
+
+		//register the membership commands
+		remcon_.connect("members", [this](const std::vector<std::string>&,
+					CTLSession session)
+				{
+					for(uint32_t group = 0; group < raft_.size(); ++group)
+					{
+						const auto& configuration = raft_.group(group).state().configuration();
+						auto write_nodes = [this, group, &session](const std::string& label,
+								const std::set<std::string>& nodes)
+						{
+							session.write(group_label(group) + label + ":");
+							for(const auto& node : nodes)
+								session.write(" " + node);
+							session.write("\n");
+						};
+
+						write_nodes("voters", configuration.voters());
+						if(configuration.new_voters())
+							write_nodes("joining voters", *configuration.new_voters());
+						write_nodes("learners", configuration.learners());
+					}
+				});
+
+		//Every group changes separately, and only on the node leading it
+		auto change_membership = [this](const std::function<raft::rpc::configuration (
+					const raft::rpc::configuration&)>& change, CTLSession session)
+		{
+			for(uint32_t group = 0; group < raft_.size(); ++group)
+			{
+				raft::Controller& controller = raft_.group(group);
+				const std::string label = group_label(group);
+				const bool started = controller.change_membership(
+						change(controller.state().configuration()),
+						[session, label](bool changed) mutable
+						{
+							session.write(label + (changed ? "Membership changed.\n"
+									: "Membership change abandoned: leadership was lost.\n"));
+						});
+
+				if(started)
+					session.write(label + "Changing membership...\n");
+				else
+					session.write(label + "Can't change membership: not the leader, or a "
+							"change or leadership transfer is already in progress.\n");
+			}
+		};
+
+		remcon_.connect("add", [this, change_membership](const std::vector<std::string>& args,
+					CTLSession session)
+				{
+					if(args.size() < 3 || (args.size() == 4 && args[3] != "learner")
+							|| args.size() > 4)
+					{
+						session.write("Usage: add <id> <host> <port> [learner]\n");
+						return;
+					}
+
+					change_membership([&args](const raft::rpc::configuration& current)
+							{
+								auto voters = current.voters();
+								auto learners = current.learners();
+								auto addresses = current.addresses();
+
+								voters.erase(args[0]);
+								learners.erase(args[0]);
+								if(args.size() == 4)
+									learners.insert(args[0]);
+								else
+									voters.insert(args[0]);
+								addresses[args[0]] = std::make_tuple(args[1], args[2]);
+
+								return raft::rpc::configuration(voters, learners, addresses);
+							}, session);
+				});
+
+		remcon_.connect("remove", [this, change_membership](const std::vector<std::string>& args,
+					CTLSession session)
+				{
+					if(args.size() != 1)
+					{
+						session.write("Usage: remove <id>\n");
+						return;
+					}
+
+					if(!raft_.group(0).state().configuration().members().count(args[0]))
+					{
+						session.write("No such member: " + args[0] + "\n");
+						return;
+					}
+
+					change_membership([&args](const raft::rpc::configuration& current)
+							{
+								auto voters = current.voters();
+								auto learners = current.learners();
+								voters.erase(args[0]);
+								learners.erase(args[0]);
+
+								return raft::rpc::configuration(voters, learners,
+										current.addresses());
+							}, session);
+				});
+
 		//register the who command
 		remcon_.connect("who", [this](const std::vector<std::string>&,
 					CTLSession session)
@@ -260,6 +443,20 @@ int Daemon::exit_code() const
 }
 
 void Daemon::shutdown()
+{
+	const bool transferring = raft_.transfer_leadership(boost::none,
+			[this](bool transferred)
+			{
+				if(!transferred)
+					BOOST_LOG_TRIVIAL(warning) << "Shutting down without handing over raft leadership";
+				unmount();
+			});
+
+	if(!transferring)
+		unmount();
+}
+
+void Daemon::unmount()
 {
 	pid_t child;
 	io_.notify_fork(boost::asio::io_service::fork_prepare);
@@ -356,6 +553,45 @@ void Daemon::start_fst_timer(uint32_t tick_timeout)
 }
 
 
+void Daemon::update_membership(const raft::rpc::configuration& configuration)
+{
+	//Addresses given with the membership replace the configured ones
+	for(const auto& address : configuration.addresses())
+		node_info_[address.first] = address.second;
+
+	//Stay connected to nodes still in any group
+	std::set<std::string> members = configuration.members();
+	for(uint32_t group = 0; group < raft_.size(); ++group)
+	{
+		const auto& current = raft_.group(group).state().configuration().members();
+		members.insert(current.begin(), current.end());
+	}
+	members.erase(id_);
+
+	for(const auto& member : members)
+	{
+		auto it = node_info_.find(member);
+		if(it != node_info_.end())
+			comms_.add_node(member, std::get<0>(it->second), std::get<1>(it->second));
+		else
+			BOOST_LOG_TRIVIAL(warning) << "No address for raft member " << member;
+	}
+
+	for(const auto& node : node_info_)
+		if(!members.count(node.first))
+			comms_.remove_node(node.first);
+
+	changetx_.nodes({members.begin(), members.end()});
+}
+
+std::string Daemon::group_label(uint32_t group) const
+{
+	if(raft_.size() == 1)
+		return std::string();
+
+	return "Group " + std::to_string(group) + ": ";
+}
+
 void Daemon::changetx_send(const std::string& node, const Json::Value& rpc) const
 {
 	changetx_send_(node, "changetx", rpc);
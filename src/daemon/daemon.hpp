@@ -7,6 +7,7 @@
 #include "dispatch.hpp"
 #include "raftrpc.hpp"
 #include "raftctl.hpp"
+#include "raftshards.hpp"
 #include "changetx.hpp"
 #include "fsstate.hpp"
 #include "comms_man.hpp"
@@ -45,6 +46,9 @@ class Daemon
 {
 	//! Ctor helper
 	raft::Controller::TimerLength timer(const std::tuple<uint32_t, uint32_t, uint32_t>& lengths) const;
+
+	//! Ctor helper: makes the controller for a raft group
+	std::unique_ptr<raft::Controller> make_group(const DaemonConfigure& config, uint32_t group);
 public:
 	//! Construct the Daemon
 	//! \param config The configuration for this daemon
@@ -61,6 +65,10 @@ public:
 	int exit_code() const;
 
 	//! Shut the daemon down
+	/*!
+	 *  If this node leads any raft groups it hands over their leadership
+	 *  first, so the others needn't wait out an election timeout.
+	 */
 	void shutdown();
 
 	//! Shut the daemon down without running fusermount
@@ -77,6 +85,16 @@ protected:
 
 	void changetx_send(const std::string& node, const Json::Value& rpc) const;
 
+	//! Runs fusermount if we mounted fuse, then shuts down
+	void unmount();
+
+	//! Connects to the nodes in a new raft membership and drops those that
+	//! have left every group.
+	void update_membership(const raft::rpc::configuration& configuration);
+
+	//! Prefixes messages about a raft group when there's more than one
+	std::string group_label(uint32_t group) const;
+
 	//! The logger
 	logup log_;
 
@@ -85,6 +103,10 @@ protected:
 	std::string id_;
 	boost::optional<boost::filesystem::path> mount_path_;
 
+	//! The addresses of every node we've known, starting with the
+	//! configured ones
+	comms_man::node_map_type node_info_;
+
 	//! Timer for changetx
 	boost::asio::deadline_timer ctx_tick_;
 
@@ -95,7 +117,7 @@ protected:
 	TCPConnectionPool pool_;
 	dispatch_type dispatch_;
 	comms_man comms_;
-	raft::Controller raft_;
+	raft::Shards raft_;
 	change::change_transfer<> changetx_;
 	std::function<void(const std::string&, const std::string&,
 			const Json::Value&)> changetx_send_;
@@ -1,8 +1,12 @@
 #pragma once
 
-#include <unordered_map>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
 
 #include <json_help.hpp>
+#include <frame.hpp>
 
 #include "connection_pool.hpp"
 
@@ -40,9 +44,12 @@ public:
 	public:
 		Callback() = default;
 		Callback(const std::string& module, const std::string& reply,
-				const typename connection_pool_type::Callback& cb)
+				const typename connection_pool_type::Callback& cb, uint32_t group = 0,
+				util::traffic_class cls = util::admin)
 			:module_(module),
 			reply_(reply),
+			group_(group),
+			cls_(cls),
 			wrapped_(cb)
 		{
 		}
@@ -60,16 +67,41 @@ public:
 
 		void operator()(const Json::Value& msg)
 		{
+			if(wrapped_.framed())
+			{
+				wrapped_(util::frame::encode(module_, reply_, group_, util::frame::json,
+							json_help::write(msg)), cls_);
+				return;
+			}
+
 			Json::Value root;
 			root["module"] = module_;
 			root["reply"] = reply_;
+			if(group_ != 0)
+				root["group"] = group_;
 			root["content"] = msg;
 
-			wrapped_(json_help::write(root));
+			wrapped_(json_help::write(root), cls_);
+		}
+
+		//! Reply with a binary payload.
+		/*!
+		 *  \returns False, sending nothing, if the connection isn't framed.
+		 */
+		bool send_binary(const std::string& payload)
+		{
+			if(!wrapped_.framed())
+				return false;
+
+			wrapped_(util::frame::encode(module_, reply_, group_, util::frame::binary,
+						payload), cls_);
+			return true;
 		}
 
 	protected:
 		std::string module_, reply_;
+		uint32_t group_;
+		util::traffic_class cls_;
 		typename connection_pool_type::Callback wrapped_;
 	};
 
@@ -78,7 +110,7 @@ public:
 	TopLevelDispatch(connection_pool_type& pool)
 		:pool_(pool)
 	{
-		register_["dispatch"] = [this](const Json::Value& msg, const
+		register_[std::make_tuple("dispatch", 0u)] = [this](const Json::Value& msg, const
 				Callback& cb)
 		{
 			try
@@ -98,15 +130,22 @@ public:
 	//! Dispatch the RPC encoded in msg.
 	/*!
 	 *  This function deserialises an RPC and dispatches it to the
-	 *  module-specific dispatch requested.
+	 *  module-specific dispatch requested. A message with a group member
+	 *  goes to the module's dispatch for that group.
 	 *
-	 *  \param msg A string containing the JSON to decode -- the dispatch
-	 *  direction is computed from this.
+	 *  \param msg A string containing the JSON to decode, or a frame from a
+	 *  framed connection -- the dispatch direction is computed from this.
 	 *
 	 *  \param cb The callback object for replies.
 	 */
 	void operator()(const std::string& msg, const typename connection_pool_type::Callback& cb)
 	{
+		if(util::frame::is_frame(msg))
+		{
+			dispatch_frame(msg, cb);
+			return;
+		}
+
 		BOOST_LOG_TRIVIAL(trace) << "RPC from: " << cb.endpoint() << ": |"
 			<< msg << "|";
 		Json::Value root;
@@ -116,18 +155,20 @@ public:
 			if(check_message_valid(root))
 			{
 				auto module_id = root["module"].asString();
+				const uint32_t group = root.get("group", 0u).asUInt();
 
-				if(connected(module_id))
+				if(connected(module_id, group))
 				{
-					Callback module_callback(root["reply"].asString(), module_id, cb);
+					const std::string reply = root["reply"].asString();
+					Callback module_callback(reply, module_id, cb, group, traffic_class_of(reply));
 
 					//Call the registered dispatch handler for the module
-					register_[module_id](root["content"], module_callback);
+					register_[std::make_tuple(module_id, group)](root["content"], module_callback);
 				}
 				else
 				{
 					BOOST_LOG_TRIVIAL(warning) << "RPC for unconnected module "
-						<< module_id;
+						<< module_id << " in group " << group;
 					BOOST_LOG_TRIVIAL(warning) << "The registry contains " << register_.size()
 						<< " entries.";
 				}
@@ -163,67 +204,325 @@ public:
 	std::function<void(const std::string&, const std::string&, const Json::Value&)>
 		connect_dispatcher(const std::string& id, Callable&& f)
 	{
-		if(register_.count(id))
-			throw dispatcher_exists(id);
+		return connect_dispatcher(id, 0, std::forward<Callable>(f));
+	}
 
-		register_[id] = f;
+	//! Connect a module-level dispatcher for one raft group.
+	/*!
+	 *  Each group has its own instance of a module, so the same id can be
+	 *  connected once per group. RPCs sent with the returned function go to
+	 *  the module's instance for the same group on the target node; group 0
+	 *  is the ungrouped dispatcher above.
+	 */
+	template <typename Callable>
+	std::function<void(const std::string&, const std::string&, const Json::Value&)>
+		connect_dispatcher(const std::string& id, uint32_t group, Callable&& f)
+	{
+		const auto key = std::make_tuple(id, group);
+		if(register_.count(key))
+			throw dispatcher_exists(group == 0 ? id : id + " in group " + std::to_string(group));
+
+		register_[key] = f;
 		assert(!register_.empty());
-		assert(register_.count(id));
-		BOOST_LOG_TRIVIAL(info) << "Connected RPC handler for module \"" << id << "\"";
+		assert(register_.count(key));
+		BOOST_LOG_TRIVIAL(info) << "Connected RPC handler for module \"" << id
+			<< "\" in group " << group;
 
-		return [this, id](const std::string& node, const std::string& module, const Json::Value& msg)
+		return [this, id, group](const std::string& node, const std::string& module, const Json::Value& msg)
 		{
-			Json::Value root;
-			root["module"] = module;
-			root["reply"] = id;
-			root["content"] = msg;
+			send_serialised(id, node, module, json_help::write(msg), group);
+		};
+	}
 
-			try
-			{
-				//Ignore unconnected
-				if(pool_.exists(node))
-					pool_.send_targeted(node, json_help::write(root));
-			}
-			catch(std::exception& ex)
-			{
-				BOOST_LOG_TRIVIAL(error) << "Error sending marshalled RPC from " << id
-					<< " to " << module << " on " << node << ": " << ex.what();
-			}
-			catch(...)
-			{
-				BOOST_LOG_TRIVIAL(error) << "Unknown error sending marshalled RPC";
-			}
+	//! Connect a module-level dispatcher for binary payloads.
+	/*!
+	 *  Framed connections can carry payloads that aren't JSON; these go to
+	 *  the handler connected here instead of the JSON one. The handler is
+	 *  given the payload and a callback for replies.
+	 *
+	 *  \see send_binary
+	 */
+	template <typename Callable>
+	void connect_binary_dispatcher(const std::string& id, uint32_t group, Callable&& f)
+	{
+		const auto key = std::make_tuple(id, group);
+		if(binary_register_.count(key))
+			throw dispatcher_exists(group == 0 ? id : id + " in group " + std::to_string(group));
 
-		};
+		binary_register_[key] = f;
+		BOOST_LOG_TRIVIAL(info) << "Connected binary RPC handler for module \"" << id
+			<< "\" in group " << group;
+	}
+
+	//! Send an RPC with a binary payload.
+	/*!
+	 *  Only framed connections carry binary payloads, so callers need
+	 *  another way to send the message when this fails.
+	 *
+	 *  \returns False, sending nothing, if the connection to node isn't
+	 *  framed.
+	 */
+	bool send_binary(const std::string& id, const std::string& node,
+			const std::string& module, const std::string& payload, uint32_t group = 0)
+	{
+		if(!pool_.framed(node))
+			return false;
+
+		send(id, node, module, util::frame::encode(module, id, group,
+					util::frame::binary, payload));
+		return true;
 	}
 
-	//! Checks to see if the module id has a handler registered
-	bool connected(const std::string& id) const
+	//! Send an RPC that the module has already serialised.
+	/*!
+	 *  This is for messages built from parts that are serialised once and
+	 *  shared, so that sending one to several nodes doesn't re-encode it.
+	 *
+	 *  \param id The sending module, as passed to connect_dispatcher.
+	 *  \param node The target node.
+	 *  \param module The target module.
+	 *  \param content The message as a single line of JSON.
+	 *  \param group The raft group of the sending and target modules.
+	 */
+	void send_serialised(const std::string& id, const std::string& node,
+			const std::string& module, const std::string& content, uint32_t group = 0)
+	{
+		send(id, node, module, encode(id, module, content, group, pool_.framed(node)));
+	}
+
+	//! An RPC serialised once, to be sent to several nodes.
+	/*!
+	 *  The RPC is encoded at most once for lines and once for frames, and
+	 *  every connection it's sent on shares the encoded buffer.
+	 */
+	class SharedMessage
+	{
+	public:
+		//! Parameters as for send_serialised.
+		SharedMessage(const std::string& id, const std::string& module,
+				std::string content, uint32_t group = 0)
+			:id_(id),
+			module_(module),
+			content_(std::move(content)),
+			group_(group)
+		{}
+
+		//! The sending module.
+		const std::string& id() const
+		{
+			return id_;
+		}
+
+		//! The target module.
+		const std::string& module() const
+		{
+			return module_;
+		}
+
+		//! The RPC as written to a connection, framed or not.
+		std::shared_ptr<const std::string> encoded(bool framed)
+		{
+			auto& msg = framed ? frame_ : line_;
+			if(!msg)
+				msg = std::make_shared<const std::string>(
+						TopLevelDispatch::encode(id_, module_, content_, group_, framed));
+
+			return msg;
+		}
+
+	protected:
+		std::string id_, module_, content_;
+		uint32_t group_;
+		std::shared_ptr<const std::string> line_, frame_;
+	};
+
+	//! Send a shared RPC to a node.
+	void send_shared(const std::string& node, SharedMessage& msg)
+	{
+		try
+		{
+			//Ignore unconnected
+			if(pool_.exists(node))
+				pool_.send_targeted(node, msg.encoded(pool_.framed(node)),
+						traffic_class_of(msg.module()));
+		}
+		catch(std::exception& ex)
+		{
+			BOOST_LOG_TRIVIAL(error) << "Error sending shared RPC from " << msg.id()
+				<< " to " << msg.module() << " on " << node << ": " << ex.what();
+		}
+	}
+
+	//! Send a shared RPC to each of nodes that's connected.
+	void broadcast_shared(const std::vector<std::string>& nodes, SharedMessage& msg)
+	{
+		std::vector<std::string> lines, frames;
+		for(const std::string& node : nodes)
+			(pool_.framed(node) ? frames : lines).push_back(node);
+
+		try
+		{
+			const util::traffic_class cls = traffic_class_of(msg.module());
+			if(!lines.empty())
+				pool_.broadcast(msg.encoded(false), lines, cls);
+			if(!frames.empty())
+				pool_.broadcast(msg.encoded(true), frames, cls);
+		}
+		catch(std::exception& ex)
+		{
+			BOOST_LOG_TRIVIAL(error) << "Error broadcasting RPC from " << msg.id()
+				<< " to " << msg.module() << ": " << ex.what();
+		}
+	}
+
+	//! Sets the traffic class of the messages sent to a module.
+	/*!
+	 *  Messages to the module, and replies to it, are queued in that class
+	 *  on the connection; see util::connection::queue_write. Modules are
+	 *  admin traffic unless they're set otherwise.
+	 */
+	void set_traffic_class(const std::string& module, util::traffic_class cls)
+	{
+		classes_[module] = cls;
+	}
+
+	//! The traffic class of the messages sent to module.
+	util::traffic_class traffic_class_of(const std::string& module) const
+	{
+		auto it = classes_.find(module);
+		return it == classes_.end() ? util::admin : it->second;
+	}
+
+	//! Checks to see if the module id has a handler registered for group
+	bool connected(const std::string& id, uint32_t group = 0) const
 	{
 		//Empty in there to avoid what seems to be a GCC bug.
-		return !register_.empty() && register_.count(id);
+		return !register_.empty() && register_.count(std::make_tuple(id, group));
 	}
 
-	//! Disconnects module id; does nothing if it's not connected.
-	void disconnect(const std::string& id)
+	//! Disconnects module id from group; does nothing if it's not connected.
+	void disconnect(const std::string& id, uint32_t group = 0)
 	{
 		if(id == "dispatch")
 			throw invalid_name();
 
-		if(connected(id))
-			register_.erase(id);
+		if(connected(id, group))
+			register_.erase(std::make_tuple(id, group));
+
+		binary_register_.erase(std::make_tuple(id, group));
 	}
 
 protected:
 	connection_pool_type& pool_;
 
-	std::unordered_map<std::string, std::function<void (const Json::Value&,
+	void send(const std::string& id, const std::string& node,
+			const std::string& module, std::string msg)
+	{
+		try
+		{
+			//Ignore unconnected
+			if(pool_.exists(node))
+				pool_.send_targeted(node, std::move(msg), traffic_class_of(module));
+		}
+		catch(std::exception& ex)
+		{
+			BOOST_LOG_TRIVIAL(error) << "Error sending marshalled RPC from " << id
+				<< " to " << module << " on " << node << ": " << ex.what();
+		}
+		catch(...)
+		{
+			BOOST_LOG_TRIVIAL(error) << "Unknown error sending marshalled RPC";
+		}
+	}
+
+	//! The module handlers by module id and raft group
+	std::map<std::tuple<std::string, uint32_t>, std::function<void (const Json::Value&,
 			Callback)>> register_;
 
+	//! The traffic classes of modules that aren't admin traffic
+	std::map<std::string, util::traffic_class> classes_;
+
+	//! The binary payload handlers by module id and raft group
+	std::map<std::tuple<std::string, uint32_t>, std::function<void (const std::string&,
+			Callback)>> binary_register_;
+
+	//! Dispatch a frame read from a framed connection.
+	void dispatch_frame(const std::string& msg, const typename connection_pool_type::Callback& cb)
+	{
+		util::frame::header hdr;
+		try
+		{
+			hdr = util::frame::decode(msg);
+		}
+		catch(util::frame::bad_frame& ex)
+		{
+			respond_with_error(ex.what(), cb);
+			return;
+		}
+
+		BOOST_LOG_TRIVIAL(trace) << "RPC frame from: " << cb.endpoint() << " for "
+			<< hdr.module << " in group " << hdr.group << ", "
+			<< msg.size() - hdr.payload_offset << " bytes";
+
+		const auto key = std::make_tuple(hdr.module, hdr.group);
+		Callback module_callback(hdr.reply, hdr.module, cb, hdr.group,
+				traffic_class_of(hdr.reply));
+
+		if(hdr.type == util::frame::binary)
+		{
+			if(binary_register_.count(key))
+				binary_register_[key](msg.substr(hdr.payload_offset), module_callback);
+			else
+				BOOST_LOG_TRIVIAL(warning) << "Binary RPC for unconnected module "
+					<< hdr.module << " in group " << hdr.group;
+		}
+		else if(connected(hdr.module, hdr.group))
+		{
+			//Only the content is JSON; the rest of the envelope is the header
+			Json::Value content;
+			Json::Reader reader;
+			if(reader.parse(msg.data() + hdr.payload_offset, msg.data() + msg.size(),
+						content, false))
+				register_[key](content, module_callback);
+			else
+				respond_with_error("JSON parse error in framed RPC: "
+						+ reader.getFormattedErrorMessages(), cb);
+		}
+		else
+			BOOST_LOG_TRIVIAL(warning) << "RPC for unconnected module "
+				<< hdr.module << " in group " << hdr.group;
+	}
+
+	//! Encode content, a single line of JSON, for a connection.
+	static std::string encode(const std::string& id, const std::string& module,
+			const std::string& content, uint32_t group, bool framed)
+	{
+		//Frames carry the content as it is
+		if(framed)
+			return util::frame::encode(module, id, group, util::frame::json, content);
+
+		Json::Value root;
+		root["module"] = module;
+		root["reply"] = id;
+		if(group != 0)
+			root["group"] = group;
+
+		//Splice the content in before the closing brace and newline
+		std::string msg = json_help::write(root);
+		msg.resize(msg.size() - 2);
+		msg.reserve(msg.size() + content.size() + 16);
+		msg += ",\"content\":";
+		msg.append(content, 0, content.find_last_not_of('\n') + 1);
+		msg += "}\n";
+
+		return msg;
+	}
+
 	bool check_message_valid(const Json::Value& msg)
 	{
 		return msg.isMember("module") && msg["module"].isString()
 			&& msg.isMember("reply") && msg["reply"].isString()
+			&& (!msg.isMember("group") || msg["group"].isUInt())
 			&& msg.isMember("content");
 	}
 
@@ -3,6 +3,7 @@
 #include <unordered_map>
 #include <list>
 #include <deque>
+#include <vector>
 #include <type_traits>
 
 #include <boost/filesystem.hpp>
@@ -21,6 +22,10 @@
 #include "raftclient.hpp"
 #include "changetx.hpp"
 
+namespace raft
+{
+	class Shards;
+}
 
 namespace craven
 {
@@ -168,6 +173,9 @@ namespace craven
 			client_.connect_commit_add(std::bind(
 						&basic_state<Client, ChangeTx>::commit_add,
 						this, std::placeholders::_1));
+			client_.connect_restore(std::bind(
+						&basic_state<Client, ChangeTx>::restore_snapshot,
+						this, std::placeholders::_1));
 
 			changetx_.connect_arrival_notifications(std::bind(
 						&basic_state<Client, ChangeTx>::notify_arrival, this,
@@ -200,6 +208,20 @@ namespace craven
 		//! \overload
 		void commit_add(const raft::request::Add& rpc);
 
+		//! Handler for the raft client restoring its versions from a snapshot
+		/*!
+		 *  The snapshot replaces committed history we'll never see as
+		 *  individual commits, so the dcache is reconciled against it: clean
+		 *  and pending files are added, updated or removed to match, and
+		 *  versions we don't hold are requested from the node they came from.
+		 *  Files with local changes are left for the next tick to sync as
+		 *  usual.
+		 *
+		 *  \param versions Every committed key and its (version, from).
+		 */
+		void restore_snapshot(const std::unordered_map<std::string,
+				std::tuple<std::string, std::string>>& versions);
+
 		//! Handler for arrival notifications from the change_transfer instance
 		void notify_arrival(const std::string& key, const std::string& version);
 
@@ -531,7 +553,7 @@ namespace craven
 		}
 	};
 
-	typedef basic_state<raft::Client, change::change_transfer<>> state;
+	typedef basic_state<raft::Shards, change::change_transfer<>> state;
 
 	template <>
 	struct rpc_traits<raft::request::Rename>
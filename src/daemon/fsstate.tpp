@@ -593,6 +593,81 @@ void craven::basic_state<Client, ChangeTx>::commit_add(const raft::request::Add&
 	manage_commit(rpc);
 }
 
+template <typename Client, typename ChangeTx>
+void craven::basic_state<Client, ChangeTx>::restore_snapshot(const std::unordered_map<std::string,
+		std::tuple<std::string, std::string>>& versions)
+{
+	BOOST_LOG_TRIVIAL(info) << "Filesystem restoring " << versions.size() << " keys from a snapshot";
+
+	std::vector<boost::filesystem::path> emptied;
+
+	//Update or remove the committed files we know about
+	for(auto& dir : dcache_)
+	{
+		const boost::filesystem::path parent = dir.first;
+		for(auto it = dir.second.begin(); it != dir.second.end();)
+		{
+			if(it->type != node_info::file
+					|| (it->state != node_info::clean && it->state != node_info::pending))
+			{
+				++it;
+				continue;
+			}
+
+			const std::string key = encode_path((parent / it->name).string());
+			if(versions.count(key) == 0)
+			{
+				it = dir.second.erase(it);
+				emptied.push_back(parent);
+				continue;
+			}
+
+			const std::string& version = std::get<0>(versions.at(key));
+			if(it->version != version)
+			{
+				if(changetx_.exists(key, version))
+				{
+					it->state = node_info::clean;
+					it->previous_version = boost::none;
+				}
+				else
+				{
+					if(it->state == node_info::clean)
+						it->previous_version = it->version;
+					it->state = node_info::pending;
+
+					//The commit that made it is compacted away, so ask for it here
+					changetx_.handle_new_version(std::get<1>(versions.at(key)), key, version,
+							it->previous_version ? *it->previous_version : "");
+				}
+				it->version = version;
+			}
+			++it;
+		}
+	}
+
+	for(const auto& parent : emptied)
+		clean_directories(parent);
+
+	//Add the ones we've never heard of
+	for(const auto& entry : versions)
+	{
+		boost::filesystem::path path = decode_path(entry.first);
+		if(!exists(path))
+		{
+			make_directories(path.parent_path());
+
+			const std::string& version = std::get<0>(entry.second);
+			const bool arrived = changetx_.exists(entry.first, version);
+			dcache_[path.parent_path().string()].push_back(node_info{path.filename().string(),
+					version, arrived});
+
+			if(!arrived)
+				changetx_.handle_new_version(std::get<1>(entry.second), entry.first, version, "");
+		}
+	}
+}
+
 template <typename Client, typename ChangeTx>
 void craven::basic_state<Client, ChangeTx>::notify_arrival(const std::string& key, const std::string& version)
 {
@@ -854,6 +929,15 @@ int craven::basic_state<Client, ChangeTx>::rename_impl(const boost::filesystem::
 
 	node_info& node = get(from);
 
+	//Keys can't move between raft groups; as with a rename across devices,
+	//the caller has to copy instead. A directory's keys are those beneath it.
+	const std::string from_key = node.type == node_info::dir
+		? (from / "_").string() : from.string();
+	const std::string to_key = node.type == node_info::dir
+		? (to / "_").string() : to.string();
+	if(!client_.colocated(encode_path(from_key), encode_path(to_key)))
+		return -EXDEV;
+
 	if(node.type == node_info::file)
 	{
 		//check it's not dead
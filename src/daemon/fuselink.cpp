@@ -17,6 +17,7 @@
 
 #include "raftrequest.hpp"
 #include "raftclient.hpp"
+#include "raftshards.hpp"
 #include "changetx.hpp"
 #include "fsstate.hpp"
 
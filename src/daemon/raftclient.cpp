@@ -18,10 +18,11 @@
 #include "raftclient.hpp"
 
 raft::Client::Handlers::Handlers(const send_request_type& send_request, const append_to_log_type& append_to_log,
-		const leader_type& leader)
+		const leader_type& leader, const confirm_read_type& confirm_read)
 	:send_request_(send_request),
 	append_to_log_(append_to_log),
-	leader_(leader)
+	leader_(leader),
+	confirm_read_(confirm_read)
 {
 }
 
@@ -40,6 +41,16 @@ boost::optional<std::string> raft::Client::Handlers::leader() const
 	return leader_();
 }
 
+void raft::Client::Handlers::confirm_read(const std::function<void (bool)>& f) const
+{
+	confirm_read_(f);
+}
+
+bool raft::Client::Handlers::confirms_reads() const
+{
+	return static_cast<bool>(confirm_read_);
+}
+
 raft::Client::Client(const std::string& id, raft::Client::Handlers& handlers)
 	:id_(id),
 	handlers_(handlers)
@@ -88,13 +99,79 @@ void raft::Client::commit_handler(const Json::Value& root)
 
 bool raft::Client::exists(const std::string& key) const noexcept
 {
-	exists_map(key, version_map_);
+	return exists_map(key, version_map_);
+}
+
+bool raft::Client::colocated(const std::string&, const std::string&) const noexcept
+{
+	return true;
+}
+
+void raft::Client::read(const std::string& key, const read_type& f)
+{
+	if(!handlers_.confirms_reads())
+	{
+		f(false, boost::none);
+		return;
+	}
+
+	handlers_.confirm_read([this, key, f](bool confirmed)
+			{
+				if(confirmed && exists(key))
+					f(true, *version_map_.at(key));
+				else
+					f(confirmed, boost::none);
+			});
 }
 
 std::tuple<std::string, std::string> raft::Client::operator [](const std::string& key) noexcept(false)
 {
 	return *version_map_.at(key);
 }
+
+Json::Value raft::Client::snapshot() const
+{
+	Json::Value root(Json::objectValue);
+	for(const auto& entry : version_map_)
+	{
+		if(!entry.second)
+			continue;
+
+		Json::Value version(Json::arrayValue);
+		version.append(std::get<0>(*entry.second));
+		version.append(std::get<1>(*entry.second));
+		root[entry.first] = version;
+	}
+
+	return root;
+}
+
+void raft::Client::restore(const Json::Value& state)
+{
+	if(!state.isObject())
+		throw std::runtime_error("Bad raft snapshot: not an object");
+
+	version_map_type versions;
+	restore_map_type notify;
+
+	for(auto it = state.begin(); it != state.end(); ++it)
+	{
+		const Json::Value& version = *it;
+		if(!version.isArray() || version.size() != 2)
+			throw std::runtime_error("Bad raft snapshot: bad version for key " + it.key().asString());
+
+		auto value = std::make_tuple(version[0].asString(), version[1].asString());
+		versions[it.key().asString()] = value;
+		notify[it.key().asString()] = value;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "Restoring " << versions.size() << " versions from a raft snapshot";
+
+	version_map_.swap(versions);
+	pending_version_map_.clear();
+
+	restore_(notify);
+}
 void raft::Client::commit_notify(const request::Update& rpc)
 {
 	commit_update_(rpc);
@@ -24,9 +24,10 @@ namespace raft
 			typedef std::function<void (const std::string&, const Json::Value&)> send_request_type;
 			typedef std::function<void (const Json::Value&)> append_to_log_type;
 			typedef std::function<boost::optional<std::string> (void)> leader_type;
+			typedef std::function<void (const std::function<void (bool)>&)> confirm_read_type;
 
 			Handlers(const send_request_type& send_request, const append_to_log_type& append_to_log,
-					const leader_type& leader);
+					const leader_type& leader, const confirm_read_type& confirm_read = nullptr);
 
 			//! For forwarding requests
 			void send_request(const std::string& to, const Json::Value& request) const;
@@ -37,12 +38,24 @@ namespace raft
 			//! For retrieving the current leader
 			boost::optional<std::string> leader() const;
 
+			//! For asking the state machine to call f once the committed
+			//! versions are up to date; see raft::State::read()
+			void confirm_read(const std::function<void (bool)>& f) const;
+
+			//! True if there's a handler for confirm_read()
+			bool confirms_reads() const;
+
 		protected:
 			send_request_type send_request_;
 			append_to_log_type append_to_log_;
 			leader_type leader_;
+			confirm_read_type confirm_read_;
 		};
 
+		//! The callback for read(): true if the read was confirmed, and the
+		//! key's version and requesting instance if it exists.
+		typedef std::function<void (bool, const boost::optional<std::tuple<std::string, std::string>>&)> read_type;
+
 		//! Construct the client interface.
 		/*!
 		 *  \param id The ID of this node; for determining when we're leading.
@@ -117,6 +130,20 @@ namespace raft
 		//! Check that a key exists.
 		bool exists(const std::string& key) const noexcept;
 
+		//! True if key can be renamed to other; one log holds every key, so
+		//! it always can.
+		bool colocated(const std::string& key, const std::string& other) const noexcept;
+
+		//! Read the latest committed version of key without a log write.
+		/*!
+		 *  exists() and operator[] answer from this node's committed versions,
+		 *  which may be behind the leader's. This waits until they include
+		 *  everything committed when it was called, then calls f with the
+		 *  version. If that can't be confirmed -- there's no leader, or it
+		 *  changes -- f is called with false.
+		 */
+		void read(const std::string& key, const read_type& f);
+
 		//! Access the last version for key, throwing if it does not exist.
 		/*!
 		 *  \returns A tuple giving the version information: the first element is the
@@ -124,6 +151,26 @@ namespace raft
 		 */
 		std::tuple<std::string, std::string> operator [](const std::string& key) noexcept(false);
 
+		//! The committed versions as a mapping of key to [version, from].
+		/*!
+		 *  This is the state the Raft log is compacted into: it's everything
+		 *  the committed entries amount to.
+		 */
+		Json::Value snapshot() const;
+
+		//! Replace the committed versions with the content of a snapshot
+		/*!
+		 *  Pending versions are dropped, since the log they were waiting on
+		 *  has been replaced. The restore handlers are notified with the new
+		 *  versions.
+		 *
+		 *  \param state A value previously returned by snapshot()
+		 */
+		void restore(const Json::Value& state);
+
+		//! The committed versions handed to restore handlers: key to (version, from)
+		typedef std::unordered_map<std::string, std::tuple<std::string, std::string>> restore_map_type;
+
 		//! Enum defining if a request is valid
 		enum validity {request_invalid = 0, //!< The request conflicts with the log
 			request_valid, //!< The request does not conflict
@@ -174,6 +221,17 @@ namespace raft
 			return commit_add_.connect(std::forward<Callable>(f));
 		}
 
+		//! Connect a function to be called when a snapshot replaces the versions
+		/*!
+		 *  \param f A callable of function signature void (const
+		 *  restore_map_type& versions)
+		 */
+		template <typename Callable>
+		boost::signals2::connection connect_restore(Callable&& f)
+		{
+			return restore_.connect(std::forward<Callable>(f));
+		}
+
 	protected:
 		std::string id_;
 
@@ -191,6 +249,7 @@ namespace raft
 		boost::signals2::signal<void (const request::Rename&)> commit_rename_;
 		boost::signals2::signal<void (const request::Delete&)> commit_delete_;
 		boost::signals2::signal<void (const request::Add&)> commit_add_;
+		boost::signals2::signal<void (const restore_map_type&)> restore_;
 
 		//! Function to provide ad-hoc polymorphism to rpc commit notification,
 		//! allowing correct notification in a templated function.
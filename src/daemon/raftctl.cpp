@@ -3,6 +3,7 @@
 #include <fstream>
 #include <set>
 #include <vector>
+#include <algorithm>
 
 #include <boost/asio.hpp>
 
@@ -41,17 +42,27 @@ namespace raft
 			return election_(gen_);
 	}
 
+	Controller::Options::Options()
+		:batch_size(256),
+		batch_linger(0)
+	{
+		log.durability = raft::log::durability_batched;
+		pre_vote = true;
+	}
+
 	Controller::Controller(boost::asio::io_service& io, dispatch_type& dispatch, const TimerLength& tl,
 				const std::string& id, const std::vector<std::string>& nodes,
-				const std::string& log_file)
+				const std::string& log_file, const Options& options, uint32_t group)
 		:io_(io),
+		dispatch_(dispatch),
 		tl_(tl),
 		t_(io_),
+		group_(group),
 
 		//Set up the state handlers
 		state_handlers_(
-				[this](const std::string& endpoint, const raft::rpc::append_entries& rpc)
-				{state_rpc_(endpoint, "raftstate", rpc);}, //rpc contextually-converted to Json::Value
+				std::bind(&Controller::send_append_entries, this, std::placeholders::_1,
+					std::placeholders::_2),
 				[this](const std::string& endpoint, const raft::rpc::request_vote& rpc)
 				{state_rpc_(endpoint, "raftstate", rpc);},
 				std::bind(&Controller::async_reset_timer, this, std::placeholders::_1),
@@ -68,31 +79,119 @@ namespace raft
 									BOOST_LOG_TRIVIAL(error) << "Error in raft commit: " << ex.what();
 								}
 							});
-				}
+				},
+				std::bind(&Controller::async_sync, this),
+				[this](const std::string& endpoint, const raft::rpc::install_snapshot& rpc)
+				{state_rpc_(endpoint, "raftstate", rpc);},
+				//Snapshot and restore after the commits already queued
+				[this](uint32_t index)
+				{
+					io_.post([this, index]
+							{
+								state_.snapshot(index, client_.snapshot());
+							});
+				},
+				[this](const Json::Value& state)
+				{
+					io_.post([this, state]
+							{
+								try
+								{
+									client_.restore(state);
+								}
+								catch(const std::exception& ex)
+								{
+									BOOST_LOG_TRIVIAL(error) << "Error restoring raft snapshot: " << ex.what();
+								}
+							});
+				},
+				[this](const std::string& endpoint, const raft::rpc::read_index& rpc)
+				{state_rpc_(endpoint, "raftstate", rpc);},
+				//the steady clock
+				nullptr,
+				[this](const std::string& endpoint, const raft::rpc::timeout_now& rpc)
+				{state_rpc_(endpoint, "raftstate", rpc);},
+				//Connections follow the membership once the state's done with it
+				[this](const raft::rpc::configuration& configuration)
+				{
+					io_.post([this, configuration]
+							{
+								configuration_(configuration);
+							});
+				},
+				std::bind(&Controller::async_notify, this)
 				),
 
 		//Set up the client handlers
 		client_handlers_(
 				[this](const std::string& endpoint, const Json::Value& request)
 				{client_rpc_(endpoint, "raftclient", request);},
-				std::bind(&State::append, &state_, std::placeholders::_1),
+				std::bind(&Controller::propose, this, std::placeholders::_1),
 				//leader. The bind is fine as long as this callback isn't called
 				//until state_ is initialised
-				std::bind(&State::leader, &state_)
+				std::bind(&State::leader, &state_),
+				//Reads go ahead after the commits already queued for the client
+				[this](const std::function<void (bool)>& f)
+				{
+					state_.read([this, f](bool confirmed)
+							{
+								io_.post([f, confirmed]
+										{
+											f(confirmed);
+										});
+							});
+				}
 				),
 
 		//Register the dispatch function for raftstate
-		state_rpc_(dispatch.connect_dispatcher("raftstate", std::bind(&Controller::dispatch_state, this,
+		state_rpc_(dispatch.connect_dispatcher("raftstate", group, std::bind(&Controller::dispatch_state, this,
 						std::placeholders::_1, std::placeholders::_2))),
 
 		//Register the dispatch for raftclient
-		client_rpc_(dispatch.connect_dispatcher("raftclient", std::bind(&Controller::dispatch_client, this,
+		client_rpc_(dispatch.connect_dispatcher("raftclient", group, std::bind(&Controller::dispatch_client, this,
 						std::placeholders::_1))),
 
 		//Set up raft.
-		state_(id, nodes, log_file, state_handlers_),
-		client_(id, client_handlers_)
+		state_(id, nodes, log_file, state_handlers_, options),
+		client_(id, client_handlers_),
+		sync_posted_(false),
+		notify_posted_(false),
+		batch_size_(std::max(1u, options.batch_size)),
+		batch_linger_(options.batch_linger),
+		proposals_posted_(false),
+		proposal_timer_(io_)
 	{
+		//Raft mustn't wait behind file transfers, or followers time out
+		dispatch_.set_traffic_class("raftstate", util::control);
+		dispatch_.set_traffic_class("raftclient", util::control);
+	}
+
+	uint32_t Controller::group() const
+	{
+		return group_;
+	}
+
+	void Controller::send_append_entries(const std::string& endpoint, const rpc::append_entries& rpc)
+	{
+		//Entries are serialised once and shared, so splice them in rather
+		//than converting to Json::Value
+		if(!rpc.entries().empty())
+		{
+			dispatch_.send_serialised("raftstate", endpoint, "raftstate", rpc.serialise(), group_);
+			return;
+		}
+
+		//A heartbeat round sends the same empty RPC to every follower that's
+		//caught up, so encode it once for all of them
+		const auto key = std::make_tuple(rpc.term(), rpc.prev_log_term(), rpc.prev_log_index(),
+				rpc.leader_commit(), rpc.read_seq());
+		if(!heartbeat_ || key != heartbeat_key_)
+		{
+			heartbeat_key_ = key;
+			heartbeat_ = dispatch_type::SharedMessage("raftstate", "raftstate", rpc.serialise(), group_);
+		}
+
+		dispatch_.send_shared(endpoint, *heartbeat_);
 	}
 
 	State& Controller::state()
@@ -113,11 +212,12 @@ namespace raft
 		{
 			rpc::append_entries ae(msg);
 			//Perform the RPC
-			std::tuple<uint32_t, bool> ret = state_.append_entries(ae);
+			std::tuple<uint32_t, bool, uint32_t, uint32_t> ret = state_.append_entries(ae);
 			//Marshal the response
-			rpc::append_entries_response aer(ae, std::get<0>(ret), std::get<1>(ret));
-			//send
-			cb(aer);
+			rpc::append_entries_response aer(ae, std::get<0>(ret), std::get<1>(ret),
+					std::get<2>(ret), std::get<3>(ret));
+			//send once the entries are durable
+			respond(cb, aer);
 		}
 		else if(type == "append_entries_response")
 		{
@@ -125,6 +225,44 @@ namespace raft
 
 			state_.append_entries_response(cb.endpoint(), aer);
 		}
+		else if(type == "install_snapshot")
+		{
+			rpc::install_snapshot is(msg);
+
+			std::tuple<uint32_t, bool, uint32_t> ret = state_.install_snapshot(is);
+			//Marshal the response
+			rpc::install_snapshot_response isr(is, std::get<0>(ret), std::get<1>(ret), std::get<2>(ret));
+			//send once the snapshot is durable
+			respond(cb, isr);
+		}
+		else if(type == "install_snapshot_response")
+		{
+			rpc::install_snapshot_response isr(msg);
+
+			state_.install_snapshot_response(cb.endpoint(), isr);
+		}
+		else if(type == "read_index")
+		{
+			rpc::read_index ri(msg);
+
+			//Nothing's written, so the response needn't wait for a sync
+			state_.read_index(ri, [cb](const rpc::read_index_response& rir) mutable
+					{
+						cb(rir);
+					});
+		}
+		else if(type == "read_index_response")
+		{
+			rpc::read_index_response rir(msg);
+
+			state_.read_index_response(cb.endpoint(), rir);
+		}
+		else if(type == "timeout_now")
+		{
+			rpc::timeout_now tn(msg);
+
+			state_.timeout_now(tn);
+		}
 		else if(type == "request_vote")
 		{
 			rpc::request_vote rv(msg);
@@ -132,8 +270,8 @@ namespace raft
 			std::tuple<uint32_t, bool> ret = state_.request_vote(rv);
 			//Marshal the response
 			rpc::request_vote_response rvr(rv, std::get<0>(ret), std::get<1>(ret));
-			//send
-			cb(rvr);
+			//send once the vote is durable
+			respond(cb, rvr);
 		}
 		else if(type == "request_vote_response")
 		{
@@ -147,6 +285,32 @@ namespace raft
 	}
 
 
+	bool Controller::transfer_leadership(const boost::optional<std::string>& to,
+			const std::function<void (bool)>& done)
+	{
+		//The handover finishes inside the state's handlers, so call done
+		//once they're through
+		return state_.transfer_leadership(to, [this, done](bool transferred)
+				{
+					io_.post([done, transferred]
+							{
+								done(transferred);
+							});
+				});
+	}
+
+	bool Controller::change_membership(const raft::rpc::configuration& target,
+			const std::function<void (bool)>& done)
+	{
+		return state_.change_membership(target, [this, done](bool changed)
+				{
+					io_.post([done, changed]
+							{
+								done(changed);
+							});
+				});
+	}
+
 	Client& Controller::client()
 	{
 		return client_;
@@ -210,4 +374,106 @@ namespace raft
 							});
 				});
 	}
+
+	void Controller::async_sync()
+	{
+		if(sync_posted_)
+			return;
+
+		sync_posted_ = true;
+		//Anything already queued on the io_service joins this batch
+		io_.post([this]()
+				{
+					sync_posted_ = false;
+					try
+					{
+						state_.sync();
+					}
+					catch(const std::exception& ex)
+					{
+						//Without durable writes we can't safely answer anything
+						BOOST_LOG_TRIVIAL(fatal) << "Error syncing raft log: " << ex.what();
+						throw;
+					}
+
+					BOOST_LOG_TRIVIAL(trace) << "Raft log synced; releasing "
+						<< unsynced_responses_.size() << " responses";
+
+					decltype(unsynced_responses_) responses;
+					responses.swap(unsynced_responses_);
+					for(auto& response : responses)
+						std::get<0>(response)(std::get<1>(response));
+				});
+	}
+
+	void Controller::async_notify()
+	{
+		if(notify_posted_)
+			return;
+
+		notify_posted_ = true;
+		//Commits from responses already queued share the one round
+		io_.post([this]()
+				{
+					notify_posted_ = false;
+					state_.notify_commit();
+				});
+	}
+
+	void Controller::propose(const Json::Value& request)
+	{
+		proposals_.push_back(request);
+
+		if(proposals_.size() >= batch_size_)
+			drain_proposals();
+		else if(!proposals_posted_)
+		{
+			proposals_posted_ = true;
+			auto drain = [this]()
+			{
+				proposals_posted_ = false;
+				drain_proposals();
+			};
+
+			if(batch_linger_ == 0)
+				//Requests made in this turn join the batch
+				io_.post(drain);
+			else
+			{
+				proposal_timer_.expires_from_now(boost::posix_time::milliseconds(batch_linger_));
+				proposal_timer_.async_wait([drain](const boost::system::error_code& ec)
+						{
+							if(ec != boost::asio::error::operation_aborted)
+								drain();
+						});
+			}
+		}
+	}
+
+	void Controller::drain_proposals()
+	{
+		if(proposals_.empty())
+			return;
+
+		std::vector<Json::Value> batch;
+		batch.swap(proposals_);
+
+		try
+		{
+			state_.append(batch);
+		}
+		catch(const std::logic_error& ex)
+		{
+			//Leadership changed since they were accepted; the clients retry
+			BOOST_LOG_TRIVIAL(warning) << "Dropping " << batch.size() << " raft requests: " << ex.what();
+		}
+	}
+
+	void Controller::respond(typename dispatch_type::Callback cb, const Json::Value& response)
+	{
+		if(state_.log().durable())
+			cb(response);
+		else
+			unsynced_responses_.emplace_back(cb, response);
+	}
 }
@@ -2,6 +2,8 @@
 
 #include <random>
 
+#include <boost/signals2.hpp>
+
 #include "raftrequest.hpp"
 #include "raftstate.hpp"
 #include "raftclient.hpp"
@@ -40,6 +42,23 @@ namespace raft
 
 		typedef TopLevelDispatch<TCPConnectionPool> dispatch_type;
 
+		//! How the controller batches client requests, with how its state
+		//! replicates and stores the log.
+		struct Options : State::Options
+		{
+			//! As State::Options, but with batched durability and pre-vote;
+			//! up to 256 requests are batched with no lingering.
+			Options();
+
+			//! The most client requests appended to the log in one batch
+			uint32_t batch_size;
+
+			//! The milliseconds to wait for more client requests before
+			//! appending a batch; 0 appends those made in the same io_service
+			//! turn
+			uint32_t batch_linger;
+		};
+
 		//! Construct the controller
 		/*!
 		 *  \param io The process' io_service, used for the raft timers
@@ -47,10 +66,21 @@ namespace raft
 		 *  \param id The ID of this process
 		 *  \param nodes All nodes in the system, not including this one
 		 *  \param log_file The path to the log_file
+		 *  \param options How requests are batched and the log replicated and
+		 *  stored. Batched writes are synced once per io_service turn;
+		 *  responses to RPCs are held until the writes they depend on are
+		 *  durable.
+		 *  \param group The raft group this controller runs when the key
+		 *  space is sharded; its RPCs only reach the same group on other
+		 *  nodes.
 		 */
 		Controller(boost::asio::io_service& io, dispatch_type& dispatch, const TimerLength& tl,
 				const std::string& id, const std::vector<std::string>& nodes,
-				const std::string& log_file);
+				const std::string& log_file, const Options& options = Options(),
+				uint32_t group = 0);
+
+		//! The raft group this controller runs
+		uint32_t group() const;
 
 		//! Retrieve the state
 		State& state();
@@ -60,6 +90,35 @@ namespace raft
 		//! Dispatch manager for the state
 		void dispatch_state(const Json::Value& msg, typename dispatch_type::Callback cb);
 
+		//! Hands raft leadership to another node.
+		/*!
+		 *  See State::transfer_leadership; done is called from the
+		 *  io_service.
+		 *
+		 *  \returns false if the transfer couldn't be started
+		 */
+		bool transfer_leadership(const boost::optional<std::string>& to,
+				const std::function<void (bool)>& done);
+
+		//! Changes the raft membership.
+		/*!
+		 *  See State::change_membership; done is called from the io_service.
+		 *
+		 *  \returns false if the change couldn't be started
+		 */
+		bool change_membership(const raft::rpc::configuration& target,
+				const std::function<void (bool)>& done);
+
+		//! Connect a function to be called when the membership changes
+		/*!
+		 *  \param f A callable of function signature void (const
+		 *  raft::rpc::configuration& configuration)
+		 */
+		template <typename Callable>
+		boost::signals2::connection connect_configuration(Callable&& f)
+		{
+			return configuration_.connect(std::forward<Callable>(f));
+		}
 
 		//! Retrieve the client
 		Client& client();
@@ -72,8 +131,10 @@ namespace raft
 
 	protected:
 		boost::asio::io_service& io_;
+		dispatch_type& dispatch_;
 		TimerLength tl_;
 		boost::asio::deadline_timer t_;
+		const uint32_t group_;
 
 		State::Handlers state_handlers_;
 		Client::Handlers client_handlers_;
@@ -82,10 +143,61 @@ namespace raft
 		std::function<void(const std::string&, const std::string&, const Json::Value&)>
 			state_rpc_, client_rpc_;
 
+		boost::signals2::signal<void (const raft::rpc::configuration&)> configuration_;
+
 		State state_;
 		Client client_;
 
+		//! True if a log sync has been posted and hasn't yet run
+		bool sync_posted_;
+
+		//! True if telling followers of a commit has been posted and hasn't
+		//! yet run
+		bool notify_posted_;
+
+		const uint32_t batch_size_;
+		const uint32_t batch_linger_;
+
+		//! Client requests waiting to be appended to the log together
+		std::vector<Json::Value> proposals_;
+
+		//! True if a drain of the proposals has been posted or timed
+		bool proposals_posted_;
+		boost::asio::deadline_timer proposal_timer_;
+
+		//! RPC responses waiting on the next log sync
+		std::vector<std::tuple<typename dispatch_type::Callback, Json::Value>> unsynced_responses_;
+
+		//! The term, previous log term and index, commit index and heartbeat
+		//! round of the last empty append_entries sent
+		std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t> heartbeat_key_;
+
+		//! The last empty append_entries sent, shared by the followers it's
+		//! sent to
+		boost::optional<typename dispatch_type::SharedMessage> heartbeat_;
+
+		//! Sends append_entries, sharing one encoding of identical heartbeats
+		void send_append_entries(const std::string& endpoint, const rpc::append_entries& rpc);
+
 		void async_reset_timer(State::Handlers::timeout_length length);
+
+		//! Posts a log sync to run after the handlers already queued.
+		void async_sync();
+
+		//! Posts State::notify_commit to run after the handlers already
+		//! queued.
+		void async_notify();
+
+		//! Queues a client request for the log, draining the queue once
+		//! it's full or it's lingered long enough.
+		void propose(const Json::Value& request);
+
+		//! Appends the queued client requests as one batch.
+		void drain_proposals();
+
+		//! Sends a response now if the log is durable, otherwise after the
+		//! next sync.
+		void respond(typename dispatch_type::Callback cb, const Json::Value& response);
 	};
 
 }
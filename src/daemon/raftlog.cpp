@@ -2,17 +2,22 @@
 
 #include <string>
 #include <exception>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <functional>
+#include <thread>
+#include <chrono>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
 
 #include <boost/optional.hpp>
-#include <boost/filesystem/path.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 
+namespace fs = boost::filesystem;
+
 #include <json/json.h>
 #include <json_help.hpp>
 
@@ -33,6 +38,11 @@ raft::log::Loggable::Loggable(const Json::Value& json)
 		throw exceptions::json_bad_type("term", "unsigned int");
 }
 
+raft::log::Loggable::Loggable(record_reader& record)
+	:term_(record.u32())
+{
+}
+
 uint32_t raft::log::Loggable::term() const
 {
 	return term_;
@@ -56,7 +66,9 @@ raft::log::LogEntry::LogEntry()
 	index_(0),
 	spawn_term_(0)
 {
-
+	//Every empty entry shares the one null action
+	static const raft::rpc::payload_ptr empty = std::make_shared<const raft::rpc::payload>(Json::Value{});
+	action_ = empty;
 }
 
 raft::log::LogEntry::LogEntry(uint32_t term, uint32_t index, uint32_t spawn_term,
@@ -64,6 +76,15 @@ raft::log::LogEntry::LogEntry(uint32_t term, uint32_t index, uint32_t spawn_term
 	:Loggable(term),
 	index_(index),
 	spawn_term_(spawn_term),
+	action_(std::make_shared<const raft::rpc::payload>(action))
+{
+}
+
+raft::log::LogEntry::LogEntry(uint32_t term, uint32_t index, uint32_t spawn_term,
+		const raft::rpc::payload_ptr& action)
+	:Loggable(term),
+	index_(index),
+	spawn_term_(spawn_term),
 	action_(action)
 {
 }
@@ -91,7 +112,23 @@ raft::log::LogEntry::LogEntry(const Json::Value& json)
 
 	index_ = json["index"].asUInt();
 	spawn_term_ = json["spawn_term"].asUInt();
-	action_ = json["action"];
+	action_ = std::make_shared<const raft::rpc::payload>(json["action"]);
+}
+
+raft::log::LogEntry::LogEntry(record_reader& record)
+	:Loggable(record),
+	index_(record.u32()),
+	spawn_term_(record.u32())
+{
+	try
+	{
+		//Keep the logged bytes; they're what we'd send anyway
+		action_ = raft::rpc::payload::parse(record.rest());
+	}
+	catch(std::runtime_error&)
+	{
+		throw exceptions::bad_json("Unparseable action in log entry");
+	}
 }
 
 raft::log::LogEntry::operator Json::Value() const
@@ -100,10 +137,17 @@ raft::log::LogEntry::operator Json::Value() const
 	root["type"] = "entry";
 	root["index"] = index_;
 	root["spawn_term"] = spawn_term_;
-	root["action"] = action_;
+	root["action"] = action_->action();
 	return root;
 }
 
+raft::log::record_writer raft::log::LogEntry::record() const
+{
+	record_writer record(entry_record);
+	record.u32(term_).u32(index_).u32(spawn_term_).rest(action_->serialised());
+	return record;
+}
+
 uint32_t raft::log::LogEntry::index() const
 {
 	return index_;
@@ -114,7 +158,12 @@ uint32_t raft::log::LogEntry::spawn_term() const
 	return spawn_term_;
 }
 
-Json::Value raft::log::LogEntry::action() const
+const Json::Value& raft::log::LogEntry::action() const
+{
+	return action_->action();
+}
+
+const raft::rpc::payload_ptr& raft::log::LogEntry::payload() const
 {
 	return action_;
 }
@@ -142,6 +191,11 @@ raft::log::NewTerm::NewTerm(const Json::Value& json)
 
 }
 
+raft::log::NewTerm::NewTerm(record_reader& record)
+	:Loggable(record)
+{
+}
+
 raft::log::NewTerm::operator Json::Value() const
 {
 	auto root = Loggable::operator Json::Value();
@@ -152,6 +206,13 @@ raft::log::NewTerm::operator Json::Value() const
 	return root;
 }
 
+raft::log::record_writer raft::log::NewTerm::record() const
+{
+	record_writer record(term_record);
+	record.u32(term_);
+	return record;
+}
+
 raft::log::Vote::Vote(uint32_t term, const std::string& node)
 	:Loggable(term),
 	node_(node)
@@ -176,6 +237,12 @@ raft::log::Vote::Vote(const Json::Value& json)
 	node_ = json["for"].asString();
 }
 
+raft::log::Vote::Vote(record_reader& record)
+	:Loggable(record),
+	node_(record.str())
+{
+}
+
 raft::log::Vote::operator Json::Value() const
 {
 	Json::Value root = Loggable::operator Json::Value();
@@ -185,6 +252,13 @@ raft::log::Vote::operator Json::Value() const
 	return root;
 }
 
+raft::log::record_writer raft::log::Vote::record() const
+{
+	record_writer record(vote_record);
+	record.u32(term_).str(node_);
+	return record;
+}
+
 std::string raft::log::Vote::node() const
 {
 	return node_;
@@ -215,6 +289,12 @@ raft::log::CommitMarker::CommitMarker(const Json::Value& json)
 	index_ = json["index"].asInt();
 }
 
+raft::log::CommitMarker::CommitMarker(record_reader& record)
+	:Loggable(record),
+	index_(record.u32())
+{
+}
+
 raft::log::CommitMarker::operator Json::Value() const
 {
 	Json::Value root = Loggable::operator Json::Value();
@@ -224,11 +304,68 @@ raft::log::CommitMarker::operator Json::Value() const
 	return root;
 }
 
+raft::log::record_writer raft::log::CommitMarker::record() const
+{
+	record_writer record(commit_record);
+	record.u32(term_).u32(index_);
+	return record;
+}
+
 uint32_t raft::log::CommitMarker::index() const
 {
 	return index_;
 }
 
+raft::log::Snapshot::Snapshot(uint32_t term, uint32_t index, uint32_t spawn_term,
+		const std::string& data)
+	:Loggable(term),
+	index_(index),
+	spawn_term_(spawn_term),
+	data_(data)
+{
+}
+
+raft::log::Snapshot::Snapshot(record_reader& record)
+	:Loggable(record),
+	index_(record.u32()),
+	spawn_term_(record.u32()),
+	data_(record.rest())
+{
+}
+
+raft::log::Snapshot::operator Json::Value() const
+{
+	Json::Value root = Loggable::operator Json::Value();
+	root["type"] = "snapshot";
+	root["index"] = index_;
+	root["spawn_term"] = spawn_term_;
+	root["data"] = json_help::parse(data_);
+
+	return root;
+}
+
+raft::log::record_writer raft::log::Snapshot::record() const
+{
+	record_writer record(snapshot_record);
+	record.u32(term_).u32(index_).u32(spawn_term_).rest(data_);
+	return record;
+}
+
+uint32_t raft::log::Snapshot::index() const
+{
+	return index_;
+}
+
+uint32_t raft::log::Snapshot::spawn_term() const
+{
+	return spawn_term_;
+}
+
+const std::string& raft::log::Snapshot::data() const
+{
+	return data_;
+}
+
 raft::log::exceptions::entry_exists::entry_exists(uint32_t term, uint32_t index)
 	:std::runtime_error(boost::str(boost::format("Entry exists with index %|s| (term: %|s|)") % index % term))
 {
@@ -246,6 +383,12 @@ raft::log::exceptions::entry_missing::entry_missing(uint32_t index)
 {
 }
 
+raft::log::exceptions::entry_compacted::entry_compacted(uint32_t index, uint32_t snapshot_index)
+	:std::runtime_error(boost::str(boost::format("Entry %|s| has been compacted into the snapshot at %|s|")
+				% index % snapshot_index))
+{
+}
+
 raft::log::exceptions::vote_exists::vote_exists(uint32_t term, const std::string& current_vote,
 		const std::string& requested_vote)
 	:std::runtime_error(boost::str(boost::format("Vote already exists for term %s: %s (requested %s)")
@@ -275,30 +418,85 @@ raft::log::exceptions::json_bad_type::json_bad_type(const std::string& member, c
 
 }
 
-raft::Log::Log(const char* file_name, std::function<void(uint32_t)> term_handler)
-	:stream_(file_name, std::ios::in | std::ios::out | std::ios::app),
+Json::Value raft::log::record_json(const std::string& body)
+{
+	record_reader record(body);
+
+	switch(record.type())
+	{
+	case entry_record:
+		return LogEntry(record);
+	case term_record:
+		return NewTerm(record);
+	case vote_record:
+		return Vote(record);
+	case commit_record:
+		return CommitMarker(record);
+	case snapshot_record:
+		return Snapshot(record);
+	default:
+		throw std::runtime_error(boost::str(boost::format("Unknown record type: %s")
+					% static_cast<unsigned>(record.type())));
+	}
+}
+
+std::vector<Json::Value> raft::log::read_records(const fs::path& path)
+{
+	std::vector<Json::Value> records;
+
+	Segments segments(path, raft::Log::default_segment_size);
+	segments.replay([&records](const std::string& body, const record_location&)
+			{
+				records.push_back(record_json(body));
+			});
+
+	return records;
+}
+
+raft::Log::Options::Options()
+	:durability(raft::log::durability_per_entry),
+	segment_size(default_segment_size),
+	tail_size(default_tail_size),
+	cache_size(default_cache_size),
+	commit_interval(default_commit_interval)
+{
+}
+
+raft::Log::Log(const char* file_name, std::function<void(uint32_t)> term_handler,
+		sync_handler_type sync_handler, const Options& options)
+	:segments_(import_json(file_name, options.segment_size), options.segment_size),
+	durability_(options.durability),
+	sync_handler_(sync_handler),
+	dirty_(false),
+	durable_index_(0),
 	//We don't want to call this during recovery
 	new_term_handler_(nullptr),
 	term_(0),
 	last_vote_(boost::none),
-	commit_index_(0)
+	tail_size_(options.tail_size),
+	cache_size_(options.cache_size),
+	commit_index_(0),
+	commit_interval_(options.commit_interval),
+	commit_checkpoint_(0)
 {
 	BOOST_LOG_TRIVIAL(info) << "Recovering log from " << file_name;
 	recover();
+	commit_checkpoint_ = commit_index_;
+	//Whatever survived recovery is on disk
+	durable_index_ = last_index();
 	if(term_handler != nullptr)
 		new_term_handler_ = term_handler;
-	stream_.seekg(0);
-	stream_.seekp(0);
-	stream_.clear();
 }
 
-raft::Log::Log(const std::string& file_name, std::function<void(uint32_t)> term_handler)
-	:Log(file_name.c_str(), term_handler)
+raft::Log::Log(const std::string& file_name, std::function<void(uint32_t)> term_handler,
+		sync_handler_type sync_handler, const Options& options)
+	:Log(file_name.c_str(), term_handler, sync_handler, options)
 {
 }
 
-raft::Log::Log(const boost::filesystem::path& file_name, std::function<void(uint32_t)> term_handler)
-	:Log(file_name.c_str(), term_handler)
+raft::Log::Log(const boost::filesystem::path& file_name, std::function<void(uint32_t)> term_handler,
+		sync_handler_type sync_handler, const Options& options)
+	:Log(file_name.c_str(), term_handler, sync_handler, options)
 {
 }
 
@@ -314,7 +512,7 @@ boost::optional<std::string> raft::Log::last_vote() const noexcept
 
 uint32_t raft::Log::last_index() const noexcept
 {
-	return log_.size();
+	return base_.index() + index_.size();
 }
 
 void raft::Log::write(uint32_t term) noexcept(false)
@@ -326,18 +524,29 @@ void raft::Log::invalidate(uint32_t index) noexcept(false)
 {
 	if(index > last_index())
 		throw raft::log::exceptions::entry_missing(index);
-
+	else if(index <= base_.index())
+		throw raft::log::exceptions::entry_compacted(index, base_.index());
 	else
-		log_.resize(index - 1);
+	{
+		index_.resize(index - base_.index() - 1);
+		while(!tail_.empty() && tail_.back().index() >= index)
+			tail_.pop_back();
+		forget_from(index);
+	}
 
+	durable_index_ = std::min(durable_index_, index - 1);
 }
 
 bool raft::Log::valid(const raft::log::LogEntry entry) const noexcept
 {
+	//Compacted entries are committed, so can't be replaced
+	if(entry.index() <= base_.index())
+		return false;
+
 	return (entry.index() <= last_index()
-			&& entry.term() > (*this)[entry.index()].term())
+			&& entry.term() > entry_info(entry.index()).term)
 			|| (entry.index() == last_index() +1
-					&& entry.spawn_term() >= (*this)[last_index()].term()
+					&& entry.spawn_term() >= entry_info(last_index()).term
 			   );
 }
 
@@ -346,18 +555,59 @@ bool raft::Log::match(uint32_t term, uint32_t index) const noexcept
 	//special case
 	if(term == 0)
 		return index == 0;
+
+	//Compacted entries were committed, so the leader has them too
+	if(index < base_.index())
+		return true;
+
 	BOOST_LOG_TRIVIAL(trace) << "Match: (" << term << ", " << index
 		<<") with ("
-		<< ((index <= log_.size()) ? std::to_string((*this)[index].spawn_term()) : "no term")
-		<< ", " << log_.size() << ")";
+		<< ((index <= last_index()) ? std::to_string(entry_info(index).spawn_term) : "no term")
+		<< ", " << last_index() << ")";
+
+	return (index <= last_index()) && entry_info(index).spawn_term == term;
+}
+
+std::tuple<uint32_t, uint32_t> raft::Log::conflict(uint32_t index) const noexcept(false)
+{
+	const uint32_t term = entry_info(index).spawn_term;
+
+	uint32_t first = index;
+	while(first > base_.index() + 1 && entry_info(first - 1).spawn_term == term)
+		--first;
 
-	return (index <= log_.size()) && (*this)[index].spawn_term() == term;
+	return std::make_tuple(term, first);
+}
+
+uint32_t raft::Log::last_index_in_term(uint32_t term, uint32_t index) const noexcept
+{
+	//Terms never decrease along the log, so stop once we're past term
+	for(uint32_t i = std::min(index, last_index()); i > base_.index(); --i)
+	{
+		const uint32_t entry_term = entry_info(i).term;
+		if(entry_term == term)
+			return i;
+		else if(entry_term < term)
+			break;
+	}
+
+	return 0;
 }
 
 raft::log::LogEntry raft::Log::operator[](uint32_t index) const noexcept(false)
 {
-	//Bounds checking can be done by the vector
-	return log_[index - 1]; //-1 because entries number from 1 and indexes from 0
+	if(index == base_.index())
+		return base_;
+	else if(index < base_.index())
+		throw raft::log::exceptions::entry_compacted(index, base_.index());
+
+	else if(index > last_index())
+		throw raft::log::exceptions::entry_missing(index);
+
+	if(!tail_.empty() && index >= tail_.front().index())
+		return tail_[index - tail_.front().index()];
+
+	return load(index);
 }
 
 uint32_t raft::Log::commit_index() const
@@ -367,41 +617,339 @@ uint32_t raft::Log::commit_index() const
 
 void raft::Log::commit_index(uint32_t index)
 {
-	raft::log::CommitMarker marker{term_, index};
-	write(marker);
+	if(index < commit_index_)
+		throw std::runtime_error("Invalid commit index: can't go backwards");
+
+	commit_index_ = index;
+	if(commit_interval_ == 0 || commit_index_ < commit_checkpoint_ + commit_interval_)
+		return;
+
+	//It goes to disk with the next sync; losing it only costs a little
+	//catching up on restart
+	commit_checkpoint_ = commit_index_;
+	track_segment(segments_.append(raft::log::CommitMarker(term_, commit_index_).record().body()));
+	BOOST_LOG_TRIVIAL(trace) << "Checkpointed commit index " << commit_index_;
+}
+
+void raft::Log::sync()
+{
+	if(!dirty_)
+		return;
+
+	segments_.sync();
+	dirty_ = false;
+	durable_index_ = last_index();
+
+	BOOST_LOG_TRIVIAL(trace) << "Synced log to index " << durable_index_;
+}
+
+bool raft::Log::durable() const noexcept
+{
+	return !dirty_;
+}
+
+uint32_t raft::Log::durable_index() const noexcept
+{
+	return dirty_ ? durable_index_ : last_index();
+}
+
+uint32_t raft::Log::snapshot_index() const noexcept
+{
+	return base_.index();
+}
+
+const boost::optional<raft::log::Snapshot>& raft::Log::snapshot() const noexcept
+{
+	return snapshot_;
+}
+
+void raft::Log::compact(uint32_t index, const std::string& data)
+{
+	if(index <= base_.index())
+		return;
+
+	if(index > commit_index_)
+		throw std::logic_error(boost::str(boost::format(
+						"Can't snapshot uncommitted entry %s (commit index %s)")
+					% index % commit_index_));
+
+	const raft::log::LogEntry last = (*this)[index];
+	apply_snapshot(raft::log::Snapshot(last.term(), index, last.spawn_term(), data), true);
+}
+
+void raft::Log::install(const raft::log::Snapshot& snapshot)
+{
+	if(snapshot.index() <= base_.index())
+		return;
+
+	apply_snapshot(snapshot, snapshot.index() <= last_index()
+			&& match(snapshot.spawn_term(), snapshot.index()));
+}
+
+void raft::Log::apply_snapshot(const raft::log::Snapshot& snapshot, bool keep_suffix)
+{
+	BOOST_LOG_TRIVIAL(info) << "Snapshotting raft log at index " << snapshot.index()
+		<< (keep_suffix ? "" : ", replacing the log");
+
+	//Everything before the snapshot must be on disk before it's discarded
+	segments_.sync();
+	segments_.save_snapshot(snapshot.record().body());
+
+	if(keep_suffix)
+	{
+		index_.erase(index_.begin(), index_.begin() + (snapshot.index() - base_.index()));
+		while(!tail_.empty() && tail_.front().index() <= snapshot.index())
+			tail_.pop_front();
+	}
+	else
+	{
+		index_.clear();
+		tail_.clear();
+	}
+	cache_.clear();
+	cache_index_.clear();
+
+	base_ = raft::log::LogEntry(snapshot.term(), snapshot.index(), snapshot.spawn_term(),
+			Json::Value{});
+	snapshot_ = snapshot;
+	commit_index_ = std::max(commit_index_, snapshot.index());
+
+	//Start a new segment holding the term, vote and commit index so that
+	//older segments can be discarded whole.
+	segments_.roll();
+	track_segment(segments_.append(raft::log::NewTerm(term_).record().body()));
+	if(last_vote_)
+		segments_.append(raft::log::Vote(term_, *last_vote_).record().body());
+	segments_.append(raft::log::CommitMarker(term_, commit_index_).record().body());
+	segments_.sync();
+	commit_checkpoint_ = commit_index_;
+
+	dirty_ = false;
+	durable_index_ = last_index();
+
+	//Discard segments from the front while they only hold compacted entries.
+	//Entries after the snapshot in an older segment keep it, and every later
+	//one, so that replay sees the same sequence of overwrites.
+	uint32_t keep_from = segments_.active();
+	if(keep_suffix)
+	{
+		for(const auto& segment : segment_last_index_)
+		{
+			if(segment.second > snapshot.index())
+			{
+				keep_from = segment.first;
+				break;
+			}
+		}
+	}
+
+	segments_.discard_before(keep_from);
+	segment_last_index_.erase(segment_last_index_.begin(),
+			segment_last_index_.lower_bound(keep_from));
 }
 
 void raft::Log::recover()
 {
-	//seek to start of file
-	stream_.seekg(0, std::ios::beg);
+	auto snapshot_body = segments_.load_snapshot();
+	if(snapshot_body)
+	{
+		raft::log::record_reader record(*snapshot_body);
+		if(record.type() != raft::log::snapshot_record)
+			throw raft::log::exceptions::bad_log("Snapshot has the wrong record type", 0);
 
-	std::string line;
-	unsigned line_count = 0;
-	while(std::getline(stream_, line))
+		snapshot_ = raft::log::Snapshot(record);
+		base_ = raft::log::LogEntry(snapshot_->term(), snapshot_->index(),
+				snapshot_->spawn_term(), Json::Value{});
+		commit_index_ = snapshot_->index();
+
+		BOOST_LOG_TRIVIAL(info) << "Loaded raft snapshot at index " << base_.index();
+	}
+
+	const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	const auto start = std::chrono::steady_clock::now();
+
+	uint32_t record_count = 0;
+	uint64_t bytes = 0;
+	segments_.replay_batches([this, threads, &record_count, &bytes](
+				const std::vector<raft::log::record_view>& records)
+			{
+				//Decoding, mostly parsing the actions, is where the time goes
+				std::vector<raft::log::decoded_record> decoded(records.size());
+				raft::log::parallel_for(records.size(), threads,
+						[&records, &decoded](std::size_t begin, std::size_t end)
+						{
+							for(std::size_t i = begin; i < end; ++i)
+								decoded[i] = decode_record(records[i].data, records[i].size);
+						});
+
+				//but the state has to be built in order
+				for(std::size_t i = 0; i < records.size(); ++i)
+				{
+					recover_record(decoded[i], ++record_count);
+					locate(decoded[i].type, records[i].location);
+					track_segment(records[i].location);
+					bytes += raft::log::Segments::frame_size + records[i].size;
+				}
+			}, threads);
+
+	const double seconds = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+
+	BOOST_LOG_TRIVIAL(info) << "Recovered raft log. Term: " << term_
+		<< " last vote: " << (last_vote_ ? *last_vote_ : "none")
+		<< " index: " << last_index()
+		<< boost::format(" in %.3fs: %s records, %.1f MB/s on %s threads")
+			% seconds % record_count
+			% (seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0) % threads;
+}
+
+raft::log::decoded_record raft::Log::decode_record(const char* data, std::size_t size)
+{
+	raft::log::decoded_record decoded = raft::log::decoded_record();
+
+	try
 	{
-		++line_count;
-		try
+		raft::log::record_reader record(data, size);
+		decoded.type = record.type();
+
+		switch(record.type())
 		{
-			recover_line(json_help::parse(line), line_count);
+		case raft::log::vote_record:
+			decoded.vote = raft::log::Vote(record);
+			break;
+		case raft::log::entry_record:
+			decoded.entry = raft::log::LogEntry(record);
+			break;
+		case raft::log::term_record:
+			decoded.new_term = raft::log::NewTerm(record);
+			break;
+		case raft::log::commit_record:
+			decoded.commit = raft::log::CommitMarker(record);
+			break;
+		default:
+			decoded.error = boost::str(boost::format("Unknown record type: %s")
+						% static_cast<unsigned>(record.type()));
 		}
-		catch(raft::log::exceptions::bad_log& ex)
+	}
+	catch(std::runtime_error& ex)
+	{
+		decoded.error = ex.what();
+	}
+
+	return decoded;
+}
+
+void raft::Log::recover_record(const raft::log::decoded_record& record, uint32_t record_number)
+{
+	//Decoding errors are reported in order, like the rest
+	if(!record.error.empty())
+		throw raft::log::exceptions::bad_log(record.error, record_number);
+
+	try
+	{
+		switch(record.type)
 		{
-			//To ensure we don't wrap it in the next one
-			throw ex;
+		case raft::log::vote_record:
+			handle_state(*record.vote);
+			break;
+		case raft::log::entry_record:
+			{
+				const raft::log::LogEntry& entry = *record.entry;
+				if(entry.index() > base_.index())
+					handle_state(entry);
+				else
+				{
+					//Covered by the snapshot, but still overwrites anything
+					//after it
+					index_.clear();
+					tail_.clear();
+					if(entry.term() > term_)
+						handle_state(static_cast<const raft::log::Loggable&>(entry));
+				}
+			}
+			break;
+		case raft::log::term_record:
+			handle_state(*record.new_term);
+			break;
+		case raft::log::commit_record:
+			{
+				const raft::log::CommitMarker& marker = *record.commit;
+				//Markers from before the snapshot are superseded by it
+				if(marker.index() >= commit_index_ || marker.index() > base_.index())
+					handle_state(marker);
+				else
+					handle_state(static_cast<const raft::log::Loggable&>(marker));
+			}
+			break;
+		default:
+			throw raft::log::exceptions::bad_log(boost::str(boost::format("Unknown record type: %s")
+						% static_cast<unsigned>(record.type)), record_number);
 		}
-		catch(std::runtime_error& ex)
+	}
+	catch(raft::log::exceptions::bad_log& ex)
+	{
+		//To ensure we don't wrap it in the next one
+		throw ex;
+	}
+	catch(std::runtime_error& ex)
+	{
+		throw raft::log::exceptions::bad_log(ex.what(), record_number);
+	}
+}
+
+const fs::path& raft::Log::import_json(const fs::path& path, uint64_t segment_size)
+{
+	const fs::path json_path = path.string() + ".json";
+	const fs::path scratch_path = path.string() + ".import";
+
+	//Finish an import interrupted between its two renames
+	if(!fs::exists(path) && fs::is_directory(scratch_path) && fs::exists(json_path))
+		fs::rename(scratch_path, path);
+
+	if(!fs::is_regular_file(path))
+		return path;
+
+	BOOST_LOG_TRIVIAL(info) << "Importing JSON raft log " << path;
+
+	fs::remove_all(scratch_path);
+
+	{
+		raft::log::Segments scratch(scratch_path, segment_size);
+		//Nothing to replay: this just opens the first segment
+		scratch.replay([](const std::string&, const raft::log::record_location&){});
+
+		std::ifstream stream(path.string());
+		std::string line;
+		uint32_t line_count = 0;
+		while(std::getline(stream, line))
 		{
-			throw raft::log::exceptions::bad_log(ex.what(), line_count);
+			++line_count;
+			try
+			{
+				scratch.append(import_line(json_help::parse(line), line_count).body());
+			}
+			catch(raft::log::exceptions::bad_log& ex)
+			{
+				//To ensure we don't wrap it in the next one
+				throw ex;
+			}
+			catch(std::runtime_error& ex)
+			{
+				throw raft::log::exceptions::bad_log(ex.what(), line_count);
+			}
 		}
+
+		scratch.sync();
+		BOOST_LOG_TRIVIAL(info) << "Imported " << line_count << " records from JSON raft log";
 	}
 
-	BOOST_LOG_TRIVIAL(info) << "Recovered raft log. Term: " << term_
-		<< " last vote: " << (last_vote_ ? *last_vote_ : "none")
-		<< " index: " << log_.size();
+	fs::rename(path, json_path);
+	fs::rename(scratch_path, path);
+
+	return path;
 }
 
-void raft::Log::recover_line(const Json::Value& root, uint32_t line_number)
+raft::log::record_writer raft::Log::import_line(const Json::Value& root, uint32_t line_number)
 {
 	if(!root["type"].isString())
 		throw raft::log::exceptions::json_bad_type("type", "string");
@@ -409,28 +957,15 @@ void raft::Log::recover_line(const Json::Value& root, uint32_t line_number)
 	std::string type = root["type"].asString();
 
 	if(type == "vote")
-	{
-		raft::log::Vote vote(root);
-		handle_state(vote);
-	}
+		return raft::log::Vote(root).record();
 	else if(type == "entry")
-	{
-		raft::log::LogEntry entry(root);
-		handle_state(entry);
-	}
+		return raft::log::LogEntry(root).record();
 	else if(type == "term")
-	{
-		raft::log::NewTerm term(root);
-		handle_state(term);
-	}
+		return raft::log::NewTerm(root).record();
 	else if(type == "commit")
-	{
-		raft::log::CommitMarker marker{root};
-		handle_state(marker);
-	}
+		return raft::log::CommitMarker(root).record();
 	else
 		throw raft::log::exceptions::bad_log("Unknown type: " + type, line_number);
-
 }
 
 void raft::Log::handle_state(const raft::log::LogEntry& entry) noexcept(false)
@@ -438,15 +973,15 @@ void raft::Log::handle_state(const raft::log::LogEntry& entry) noexcept(false)
 	if(entry.index() <= last_index())
 	{
 		//Check the preceeding entry's term for conflict
-		if(entry.index() > 2 && log_[entry.index() - 2].term() > entry.term())
+		if(entry.index() > 2 && entry_info(entry.index() - 1).term > entry.term())
 			throw raft::log::exceptions::term_conflict(entry.term(),
-					log_[entry.index() - 2].term(), entry.index());
+					entry_info(entry.index() - 1).term, entry.index());
 
 		//Clear invalid entries
 		invalidate(entry.index());
 
 		//Add this entry
-		log_.push_back(entry);
+		push_entry(entry);
 		BOOST_LOG_TRIVIAL(info) << "Added a log entry, now on index " << last_index();
 
 		//sanity check the spawn term
@@ -468,7 +1003,7 @@ void raft::Log::handle_state(const raft::log::LogEntry& entry) noexcept(false)
 	}
 	else if(entry.index() == last_index() + 1)
 	{
-		log_.push_back(entry);
+		push_entry(entry);
 		BOOST_LOG_TRIVIAL(info) << "Added a log entry, now on index " << last_index();
 		handle_state(static_cast<const raft::log::Loggable&>(entry));
 	}
@@ -524,14 +1059,127 @@ void raft::Log::handle_state(const raft::log::CommitMarker& marker) noexcept(fal
 	commit_index_ = marker.index();
 }
 
-void raft::Log::write_json(const Json::Value& root)
+void raft::Log::write_record(const raft::log::record_writer& record)
+{
+	const raft::log::record_location location = segments_.append(record.body());
+	locate(static_cast<raft::log::record_type>(record.body()[0]), location);
+	track_segment(location);
+
+	BOOST_LOG_TRIVIAL(trace) << "Wrote record of " << record.body().size() << " bytes to log";
+
+	switch(durability_)
+	{
+	case raft::log::durability_none:
+		segments_.flush();
+		durable_index_ = last_index();
+		break;
+	case raft::log::durability_per_entry:
+		segments_.sync();
+		durable_index_ = last_index();
+		break;
+	case raft::log::durability_batched:
+		if(!sync_handler_)
+		{
+			segments_.sync();
+			durable_index_ = last_index();
+		}
+		else if(!dirty_)
+		{
+			//The first record of the batch schedules the sync
+			dirty_ = true;
+			sync_handler_();
+		}
+		break;
+	}
+}
+
+void raft::Log::track_segment(const raft::log::record_location& location)
+{
+	uint32_t& last = segment_last_index_[location.segment];
+	last = std::max(last, last_index());
+}
+
+void raft::Log::locate(raft::log::record_type type, const raft::log::record_location& location)
+{
+	//An entry record always leaves its entry last in the log
+	if(type == raft::log::entry_record && !index_.empty())
+		index_.back().location = location;
+}
+
+void raft::Log::push_entry(const raft::log::LogEntry& entry)
+{
+	//The location is filled in once the record's been appended
+	index_.push_back(raft::log::entry_location{entry.term(), entry.spawn_term(),
+			raft::log::record_location{0, 0}});
+
+	tail_.push_back(entry);
+	if(tail_.size() > tail_size_)
+		tail_.pop_front();
+}
+
+raft::log::LogEntry raft::Log::load(uint32_t index) const
 {
-	std::string line = json_help::write(root);
+	auto cached = cache_index_.find(index);
+	if(cached != cache_index_.end())
+	{
+		cache_.splice(cache_.begin(), cache_, cached->second);
+		return *cached->second;
+	}
+
+	const raft::log::record_location& location = index_[index - base_.index() - 1].location;
+	const std::string body = segments_.read(location);
+
+	raft::log::record_reader record(body);
+	if(record.type() != raft::log::entry_record)
+		throw std::runtime_error(boost::str(boost::format(
+						"Log index points entry %s at a record of type %s")
+					% index % static_cast<unsigned>(record.type())));
+
+	raft::log::LogEntry entry(record);
+	if(entry.index() != index)
+		throw std::runtime_error(boost::str(boost::format(
+						"Log index points entry %s at entry %s") % index % entry.index()));
+
+	BOOST_LOG_TRIVIAL(trace) << "Read log entry " << index << " from segment " << location.segment;
+
+	if(cache_size_ > 0)
+	{
+		cache_.push_front(entry);
+		cache_index_[index] = cache_.begin();
 
-	stream_ << line;
-	stream_.flush();
+		if(cache_.size() > cache_size_)
+		{
+			cache_index_.erase(cache_.back().index());
+			cache_.pop_back();
+		}
+	}
+
+	return entry;
+}
+
+void raft::Log::forget_from(uint32_t index)
+{
+	for(auto it = cache_.begin(); it != cache_.end();)
+	{
+		if(it->index() >= index)
+		{
+			cache_index_.erase(it->index());
+			it = cache_.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+raft::log::entry_location raft::Log::entry_info(uint32_t index) const
+{
+	if(index == base_.index())
+		return raft::log::entry_location{base_.term(), base_.spawn_term(),
+			raft::log::record_location{0, 0}};
+	else if(index < base_.index())
+		throw raft::log::exceptions::entry_compacted(index, base_.index());
+	else if(index > last_index())
+		throw raft::log::exceptions::entry_missing(index);
 
-	//Remove the newline
-	line.pop_back();
-	BOOST_LOG_TRIVIAL(trace) << "Wrote to log: " << line;
+	return index_[index - base_.index() - 1];
 }
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <map>
+#include <list>
+#include <deque>
 #include <vector>
 #include <fstream>
+#include <unordered_map>
+
+#include "raftsegment.hpp"
+#include "raftrpc.hpp"
 
 namespace raft
 {
@@ -12,6 +19,7 @@ namespace raft
 		public:
 			Loggable(uint32_t term);
 			Loggable(const Json::Value& json);
+			Loggable(record_reader& record);
 
 
 			uint32_t term() const;
@@ -31,18 +39,25 @@ namespace raft
 
 			LogEntry(uint32_t term, uint32_t index, uint32_t spawn_term,
 					const Json::Value& action);
+			LogEntry(uint32_t term, uint32_t index, uint32_t spawn_term,
+					const raft::rpc::payload_ptr& action);
 			LogEntry(const Json::Value& json);
+			LogEntry(record_reader& record);
 
 			operator Json::Value() const;
+			record_writer record() const;
 
 			uint32_t index() const;
 			uint32_t spawn_term() const;
-			Json::Value action() const;
+			const Json::Value& action() const;
+
+			//! The shared action, for sending without copying
+			const raft::rpc::payload_ptr& payload() const;
 
 		protected:
 			uint32_t index_;
 			uint32_t spawn_term_;
-			Json::Value action_;
+			raft::rpc::payload_ptr action_;
 		};
 
 		//! Only difference from Loggable is that this produces more JSON
@@ -54,8 +69,10 @@ namespace raft
 
 			NewTerm(uint32_t term);
 			NewTerm(const Json::Value& json);
+			NewTerm(record_reader& record);
 
 			operator Json::Value() const;
+			record_writer record() const;
 		};
 
 		class Vote : public Loggable
@@ -63,8 +80,10 @@ namespace raft
 		public:
 			Vote(uint32_t term, const std::string& node);
 			Vote(const Json::Value& json);
+			Vote(record_reader& record);
 
 			operator Json::Value() const;
+			record_writer record() const;
 
 			std::string node() const;
 
@@ -78,13 +97,43 @@ namespace raft
 		public:
 			CommitMarker(uint32_t term, uint32_t index);
 			CommitMarker(const Json::Value& json);
+			CommitMarker(record_reader& record);
+
+			operator Json::Value() const;
+			record_writer record() const;
+
+			uint32_t index() const;
+
+		protected:
+			uint32_t index_;
+		};
+
+		//! A snapshot of the applied state, replacing a prefix of the log.
+		/*!
+		 *  The term, index and spawn term are those of the last entry the
+		 *  snapshot includes. The state itself is kept as serialised JSON so it
+		 *  can be sent in chunks without re-encoding.
+		 */
+		class Snapshot : public Loggable
+		{
+		public:
+			Snapshot(uint32_t term, uint32_t index, uint32_t spawn_term,
+					const std::string& data);
+			Snapshot(record_reader& record);
 
 			operator Json::Value() const;
+			record_writer record() const;
 
 			uint32_t index() const;
+			uint32_t spawn_term() const;
+
+			//! The serialised state
+			const std::string& data() const;
 
 		protected:
 			uint32_t index_;
+			uint32_t spawn_term_;
+			std::string data_;
 		};
 
 		namespace exceptions
@@ -109,6 +158,12 @@ namespace raft
 				entry_missing(uint32_t index);
 			};
 
+			//! Exception thrown when an entry has been compacted into a snapshot.
+			struct entry_compacted : std::runtime_error
+			{
+				entry_compacted(uint32_t index, uint32_t snapshot_index);
+			};
+
 			//! Exception thrown when a vote already exists for the current term.
 			struct vote_exists : std::runtime_error
 			{
@@ -137,27 +192,125 @@ namespace raft
 
 			};
 		}
+
+		//! Decode a binary record body into the JSON form of its loggable.
+		/*!
+		 *  This is the inverse of the old JSON log format and is intended for
+		 *  inspection of the log, not for recovery.
+		 */
+		Json::Value record_json(const std::string& body);
+
+		//! Read every record in the log at path, in order, as JSON.
+		std::vector<Json::Value> read_records(const boost::filesystem::path& path);
+
+		//! A record decoded during recovery, ready to be applied in order.
+		/*!
+		 *  Exactly one of the optionals is set, matching type, unless decoding
+		 *  failed; then error says why.
+		 */
+		struct decoded_record
+		{
+			record_type type;
+			boost::optional<LogEntry> entry;
+			boost::optional<NewTerm> new_term;
+			boost::optional<Vote> vote;
+			boost::optional<CommitMarker> commit;
+			std::string error;
+		};
+
+		//! What the log keeps in memory for every entry: enough to check terms
+		//! without loading the entry, and where to load it from.
+		struct entry_location
+		{
+			uint32_t term;
+			uint32_t spawn_term;
+			record_location location;
+		};
 	}
 
 	//! Manages the Raft write-ahead log.
+	/*!
+	 *  The log is stored as a directory of binary segments (see
+	 *  raft::log::Segments). A log in the old newline-delimited JSON format is
+	 *  imported into segments the first time it's opened; the JSON file is kept
+	 *  alongside with a ".json" suffix.
+	 *
+	 *  A prefix of the log can be replaced by a snapshot of the state it
+	 *  produces. Entries up to and including snapshot_index() are then no longer
+	 *  available, except for the last one's term information.
+	 *
+	 *  Only the most recent entries are held in memory. Older ones are read
+	 *  back from their segment on demand, through a small LRU cache so that a
+	 *  lagging follower being caught up doesn't read each entry twice.
+	 */
 	class Log
 	{
 	public:
+		//! The default size after which a log segment is rolled
+		static const uint64_t default_segment_size = 64 * 1024 * 1024;
+
+		//! The default number of recent entries kept in memory
+		static const std::size_t default_tail_size = 4096;
+
+		//! The default number of older entries cached after being read back
+		static const std::size_t default_cache_size = 1024;
+
+		//! The default number of entries the commit index advances by
+		//! between checkpoints
+		static const uint32_t default_commit_interval = 1024;
+
+		//! The handler called when a batched log needs syncing
+		typedef std::function<void()> sync_handler_type;
+
+		//! How the log is stored and cached.
+		struct Options
+		{
+			//! Per-entry durability and the default sizes
+			Options();
+
+			//! How hard to work to make each record durable.
+			raft::log::durability durability;
+
+			//! The size after which a log segment is rolled.
+			uint64_t segment_size;
+
+			//! The number of recent entries kept in memory.
+			std::size_t tail_size;
+
+			//! The number of older entries kept after being read back from
+			//! disk.
+			std::size_t cache_size;
+
+			//! The number of entries the commit index advances by before it's
+			//! checkpointed in the log; zero only records it with snapshots.
+			uint32_t commit_interval;
+		};
+
 		//! Construct the log manager from a provided file.
 		/*!
-		 *  \param file_name The name of the file to use as the Raft log. It will
-		 *  be opened in read/append mode and the state of the Raft log determined
-		 *  from it.
+		 *  \param file_name The name of the segment directory to use as the Raft
+		 *  log. It is created if it doesn't exist and the state of the Raft log
+		 *  determined from it.
 		 *
 		 *  \param term_handler The handler to call when the term count advances.
+		 *
+		 *  \param sync_handler With batched durability, the handler to call the
+		 *  first time a record is buffered after a sync. It should arrange for
+		 *  sync() to be called once the current batch of writes is done. Without
+		 *  a handler, batched writes are synced immediately.
+		 *
+		 *  \param options How the log is stored and cached.
 		 */
-		Log(const char* file_name, std::function<void(uint32_t)> term_handler = nullptr);
+		Log(const char* file_name, std::function<void(uint32_t)> term_handler = nullptr,
+				sync_handler_type sync_handler = nullptr, const Options& options = Options());
 
 		//! \overload
-		Log(const std::string& file_name, std::function<void(uint32_t)> term_handler = nullptr);
+		Log(const std::string& file_name, std::function<void(uint32_t)> term_handler = nullptr,
+				sync_handler_type sync_handler = nullptr, const Options& options = Options());
 
 		//! \overload
-		Log(const boost::filesystem::path& file_name, std::function<void(uint32_t)> term_handler = nullptr);
+		Log(const boost::filesystem::path& file_name, std::function<void(uint32_t)> term_handler = nullptr,
+				sync_handler_type sync_handler = nullptr, const Options& options = Options());
 
 		//! Retrieve the current election term from the log.
 		uint32_t term() const noexcept;
@@ -181,7 +334,7 @@ namespace raft
 		void write(const Log& log) noexcept(false)
 		{
 			handle_state(log);
-			write_json(log);
+			write_record(log.record());
 		}
 
 		//Helper for terms
@@ -207,28 +360,144 @@ namespace raft
 		 */
 		bool match(uint32_t term, uint32_t index) const noexcept;
 
+		//! Where our log conflicts with a leader's at index.
+		/*!
+		 *  Returns the term that match() compares at index and the first index
+		 *  of the run of entries, ending at index, that share it. The run stops
+		 *  at the snapshot. Throws if index is compacted or missing.
+		 */
+		std::tuple<uint32_t, uint32_t> conflict(uint32_t index) const noexcept(false);
+
+		//! The last index, no later than index, of an entry written in term.
+		/*!
+		 *  Returns zero if there's no such entry after the snapshot.
+		 */
+		uint32_t last_index_in_term(uint32_t term, uint32_t index) const noexcept;
+
 		//! Retrieves the log entry at index, throwing if it doesn't exist.
+		/*!
+		 *  At snapshot_index() this returns an entry with the snapshot's term
+		 *  information and no action. Earlier entries throw
+		 *  raft::log::exceptions::entry_compacted.
+		 */
 		raft::log::LogEntry operator[](uint32_t index) const noexcept(false);
 
 		uint32_t commit_index() const;
 
+		//! Advances the commit index.
+		/*!
+		 *  Raft doesn't need the commit index to be durable, so it's only
+		 *  written to the log every commit_interval entries, and then
+		 *  without a sync of its own. After a restart it may be behind,
+		 *  until the leader says otherwise.
+		 */
 		void commit_index(uint32_t index);
 
+		//! Write and fdatasync any records buffered since the last sync.
+		void sync();
+
+		//! True if every record written so far is as durable as the policy
+		//! allows.
+		bool durable() const noexcept;
+
+		//! The index of the last entry covered by the snapshot, or zero.
+		uint32_t snapshot_index() const noexcept;
+
+		//! The current snapshot, if there is one.
+		const boost::optional<raft::log::Snapshot>& snapshot() const noexcept;
+
+		//! Replace the entries up to index with a snapshot of their state.
+		/*!
+		 *  \param index The last entry the snapshot covers. It must be in the
+		 *  log and no later than the commit index.
+		 *  \param data The serialised state after applying entries up to index.
+		 */
+		void compact(uint32_t index, const std::string& data);
+
+		//! Install a snapshot received from the leader.
+		/*!
+		 *  If the log holds the snapshot's last entry, the entries after it are
+		 *  kept; otherwise the whole log is replaced. Snapshots older than the
+		 *  current one are ignored.
+		 */
+		void install(const raft::log::Snapshot& snapshot);
+
+		//! The last log index known to be durable.
+		/*!
+		 *  With batched durability this lags last_index() until the next sync.
+		 */
+		uint32_t durable_index() const noexcept;
+
 	protected:
-		std::fstream stream_;
+		raft::log::Segments segments_;
+
+		const raft::log::durability durability_;
+		sync_handler_type sync_handler_;
+
+		//! True if there are records written since the last sync
+		bool dirty_;
+		uint32_t durable_index_;
 
 		std::function<void(uint32_t)> new_term_handler_;
 
 		uint32_t term_;
 		boost::optional<std::string> last_vote_;
 
-		std::vector<raft::log::LogEntry> log_;
+		//! Every entry after the snapshot; index_[0] has index snapshot_index() + 1
+		std::vector<raft::log::entry_location> index_;
+
+		//! The most recent entries, in full
+		std::deque<raft::log::LogEntry> tail_;
+		const std::size_t tail_size_;
+
+		//! Older entries read back from disk, most recently used first
+		mutable std::list<raft::log::LogEntry> cache_;
+		mutable std::unordered_map<uint32_t, std::list<raft::log::LogEntry>::iterator> cache_index_;
+		const std::size_t cache_size_;
+
+		//! The term information of the snapshot's last entry
+		raft::log::LogEntry base_;
+		boost::optional<raft::log::Snapshot> snapshot_;
+
+		//! The highest entry index written to each segment, used to find
+		//! segments that a snapshot has made redundant
+		std::map<uint32_t, uint32_t> segment_last_index_;
 
 		uint32_t commit_index_;
 
+		const uint32_t commit_interval_;
+
+		//! The commit index last written to the log
+		uint32_t commit_checkpoint_;
+
 		void recover();
 
-		void recover_line(const Json::Value& root, uint32_t line_number);
+		//! Store a snapshot and drop the entries it covers.
+		/*!
+		 *  \param keep_suffix If true, entries after the snapshot are kept;
+		 *  otherwise the log is emptied.
+		 */
+		void apply_snapshot(const raft::log::Snapshot& snapshot, bool keep_suffix);
+
+		//! Decode a record body. This is independent of the log's state, so
+		//! recovery does it in parallel.
+		static raft::log::decoded_record decode_record(const char* data, std::size_t size);
+
+		//! Apply a decoded record to the log's state, in order.
+		void recover_record(const raft::log::decoded_record& record, uint32_t record_number);
+
+		//! Imports a log in the JSON format at path into segments, if there is one.
+		/*!
+		 *  The import is written to a scratch directory and renamed into place, so
+		 *  a crash part way through leaves the JSON log untouched.
+		 *
+		 *  \returns path, for use in the constructor's initialiser list.
+		 */
+		static const boost::filesystem::path& import_json(const boost::filesystem::path& path,
+				uint64_t segment_size);
+
+		//! Converts one line of a JSON log to its binary record.
+		static raft::log::record_writer import_line(const Json::Value& root, uint32_t line_number);
 
 		//! Handles the state change required to add a log entry without writing to
 		//! the log file.
@@ -282,7 +551,26 @@ namespace raft
 		//! \overload
 		void handle_state(const raft::log::CommitMarker& marker) noexcept(false);
 
-		//! Write the given JSON to the end of the log
-		void write_json(const Json::Value& root);
+		//! Write the given record to the end of the log
+		void write_record(const raft::log::record_writer& record);
+
+		//! Note that the segment holding location has entries up to last_index()
+		void track_segment(const raft::log::record_location& location);
+
+		//! Record where a record of the given type has been written, if it's
+		//! an entry
+		void locate(raft::log::record_type type, const raft::log::record_location& location);
+
+		//! Add an entry to the end of the in-memory log
+		void push_entry(const raft::log::LogEntry& entry);
+
+		//! Read an entry from before the tail, through the cache
+		raft::log::LogEntry load(uint32_t index) const;
+
+		//! Drop cached entries from index onwards
+		void forget_from(uint32_t index);
+
+		//! The term and spawn term of an entry, without loading it
+		raft::log::entry_location entry_info(uint32_t index) const;
 	};
 }
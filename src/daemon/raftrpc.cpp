@@ -3,6 +3,8 @@
 #include <exception>
 #include <string>
 #include <vector>
+#include <memory>
+#include <algorithm>
 #include <json/json.h>
 #include "../common/json_help.hpp"
 
@@ -12,6 +14,38 @@ namespace raft
 {
 	namespace rpc
 	{
+		payload::payload(const Json::Value& action)
+			:serialised_(json_help::write(action)),
+			action_(action)
+		{
+			//Remove the newline
+			serialised_.pop_back();
+		}
+
+		payload::payload(const std::string& serialised, const Json::Value& action)
+			:serialised_(serialised),
+			action_(action)
+		{
+		}
+
+		payload_ptr payload::parse(const std::string& serialised)
+		{
+			Json::Value action;
+			if(!json_help::parse(serialised, action))
+				throw std::runtime_error("Unparseable action: " + serialised);
+
+			return payload_ptr(new payload(serialised, action));
+		}
+
+		const Json::Value& payload::action() const
+		{
+			return action_;
+		}
+
+		const std::string& payload::serialised() const
+		{
+			return serialised_;
+		}
 
 		template <typename T>
 		T append_entries::checked_from_json(const Json::Value& root, const std::string& key) const
@@ -21,13 +55,15 @@ namespace raft
 
 		append_entries::append_entries(uint32_t term, const std::string& leader_id,
 				uint32_t prev_log_term, uint32_t prev_log_index, const
-				std::vector<std::tuple<uint32_t, Json::Value>>& entries, uint32_t leader_commit)
-			:term_(term),
+				std::vector<entry_type>& entries, uint32_t leader_commit,
+				uint32_t read_seq)
+			:version_(protocol_version),
+			term_(term),
 			leader_id_(leader_id),
 			prev_log_(std::make_tuple(prev_log_term, prev_log_index)),
 			entries_(entries),
-			leader_commit_(leader_commit)
-
+			leader_commit_(leader_commit),
+			read_seq_(read_seq)
 		{
 
 		}
@@ -39,6 +75,8 @@ namespace raft
 			if(!(type == "append_entries"))
 				throw std::runtime_error("RPC not append_entries");
 
+			version_ = root.isMember("version") ? checked_from_json<uint32_t>(root, "version") : 1;
+
 			term_ = checked_from_json<uint32_t>(root, "term");
 
 			leader_id_ = checked_from_json<std::string>(root, "leader_id");
@@ -47,15 +85,19 @@ namespace raft
 					checked_from_json<uint32_t>(root, "prev_log_term"),
 					checked_from_json<uint32_t>(root, "prev_log_index"));
 
-			entries_ = checked_from_json<std::vector<std::tuple<uint32_t, Json::Value>>>(root, "entries");
+			for(const auto& entry : checked_from_json<std::vector<std::tuple<uint32_t, Json::Value>>>(root, "entries"))
+				entries_.emplace_back(std::get<0>(entry),
+						std::make_shared<const payload>(std::get<1>(entry)));
 
 			leader_commit_ = checked_from_json<uint32_t>(root, "leader_commit");
+			read_seq_ = root.isMember("read_seq") ? checked_from_json<uint32_t>(root, "read_seq") : 0;
 		}
 
 		append_entries::operator Json::Value() const
 		{
 			Json::Value root;
 			root["type"] = "append_entries";
+			root["version"] = version_;
 			root["term"] = term_;
 			root["leader_id"] = leader_id_;
 			root["prev_log_term"] = prev_log_term();
@@ -67,15 +109,53 @@ namespace raft
 			{
 				entries[i].resize(2);
 				entries[i][0] = std::get<0>(entries_[i]);
-				entries[i][1] = std::get<1>(entries_[i]);
+				entries[i][1] = std::get<1>(entries_[i])->action();
 			}
 
 			root["entries"] = entries;
 			root["leader_commit"] = leader_commit_;
+			root["read_seq"] = read_seq_;
 
 			return root;
 		}
 
+		std::string append_entries::serialise() const
+		{
+			Json::Value root;
+			root["type"] = "append_entries";
+			root["version"] = version_;
+			root["term"] = term_;
+			root["leader_id"] = leader_id_;
+			root["prev_log_term"] = prev_log_term();
+			root["prev_log_index"] = prev_log_index();
+			root["leader_commit"] = leader_commit_;
+			root["read_seq"] = read_seq_;
+
+			//Drop the closing brace and newline to append the entries
+			std::string line = json_help::write(root);
+			line.resize(line.size() - 2);
+
+			std::size_t size = line.size() + 16;
+			for(const auto& entry : entries_)
+				size += std::get<1>(entry)->serialised().size() + 16;
+			line.reserve(size);
+
+			line += ",\"entries\":[";
+			for(unsigned int i = 0; i < entries_.size(); ++i)
+			{
+				if(i > 0)
+					line += ',';
+				line += '[';
+				line += std::to_string(std::get<0>(entries_[i]));
+				line += ',';
+				line += std::get<1>(entries_[i])->serialised();
+				line += ']';
+			}
+			line += "]}\n";
+
+			return line;
+		}
+
 		uint32_t append_entries::term() const
 		{
 			return term_;
@@ -86,6 +166,11 @@ namespace raft
 			return leader_id_;
 		}
 
+		uint32_t append_entries::version() const
+		{
+			return version_;
+		}
+
 		std::tuple<uint32_t, uint32_t> append_entries::prev_log() const
 		{
 			return prev_log_;
@@ -101,7 +186,7 @@ namespace raft
 			return std::get<0>(prev_log_);
 		}
 
-		std::vector<std::tuple<uint32_t, Json::Value>> append_entries::entries() const
+		const std::vector<append_entries::entry_type>& append_entries::entries() const
 		{
 			return entries_;
 		}
@@ -111,21 +196,33 @@ namespace raft
 			return leader_commit_;
 		}
 
+		uint32_t append_entries::read_seq() const
+		{
+			return read_seq_;
+		}
+
 		template <typename T>
 		T append_entries_response::checked_from_json(const Json::Value& root, const std::string& key) const
 		{
 			return json_help::checked_from_json<T>(root, key, "Bad json for append_entries RPC response:");
 		}
 
-		append_entries_response::append_entries_response(const append_entries& request, uint32_t term, bool success)
-			:request_(request),
+		append_entries_response::append_entries_response(const append_entries& request, uint32_t term,
+				bool success, uint32_t conflict_index, uint32_t conflict_term)
+			:version_(std::min(request.version(), protocol_version)),
 			term_(term),
-			success_(success)
+			success_(success),
+			prev_log_index_(request.prev_log_index()),
+			match_index_(success ? request.prev_log_index() + request.entries().size() : 0),
+			conflict_index_(success ? 0 : conflict_index),
+			conflict_term_(success ? 0 : conflict_term),
+			read_seq_(request.read_seq())
 		{
+			if(version_ < 2)
+				request_ = std::make_shared<const append_entries>(request);
 		}
 
 		append_entries_response::append_entries_response(const Json::Value& root)
-			:request_(root["request"])
 		{
 			std::string type = checked_from_json<std::string>(root, "type");
 
@@ -134,6 +231,29 @@ namespace raft
 
 			term_ = checked_from_json<uint32_t>(root, "term");
 			success_ = checked_from_json<bool>(root, "success");
+
+			if(root.isMember("request"))
+			{
+				//Version 1: work it out from the echoed request
+				append_entries request(root["request"]);
+				version_ = 1;
+				prev_log_index_ = request.prev_log_index();
+				match_index_ = success_ ? prev_log_index_ + request.entries().size() : 0;
+				conflict_index_ = 0;
+				conflict_term_ = 0;
+				read_seq_ = request.read_seq();
+			}
+			else
+			{
+				version_ = checked_from_json<uint32_t>(root, "version");
+				prev_log_index_ = checked_from_json<uint32_t>(root, "prev_log_index");
+				match_index_ = checked_from_json<uint32_t>(root, "match_index");
+				conflict_index_ = checked_from_json<uint32_t>(root, "conflict_index");
+				//Absent from responses that only carry an index hint
+				conflict_term_ = root.isMember("conflict_term") ?
+					checked_from_json<uint32_t>(root, "conflict_term") : 0;
+				read_seq_ = root.isMember("read_seq") ? checked_from_json<uint32_t>(root, "read_seq") : 0;
+			}
 		}
 
 		append_entries_response::operator Json::Value() const
@@ -143,14 +263,50 @@ namespace raft
 			root["type"] = "append_entries_response";
 			root["term"] = term_;
 			root["success"] = success_;
-			root["request"] = request_;
+
+			if(request_)
+				root["request"] = *request_;
+			else
+			{
+				root["version"] = version_;
+				root["prev_log_index"] = prev_log_index_;
+				root["match_index"] = match_index_;
+				root["conflict_index"] = conflict_index_;
+				root["conflict_term"] = conflict_term_;
+				root["read_seq"] = read_seq_;
+			}
 
 			return root;
 		}
 
-		append_entries append_entries_response::request() const
+		uint32_t append_entries_response::version() const
 		{
-			return request_;
+			return version_;
+		}
+
+		uint32_t append_entries_response::prev_log_index() const
+		{
+			return prev_log_index_;
+		}
+
+		uint32_t append_entries_response::match_index() const
+		{
+			return match_index_;
+		}
+
+		uint32_t append_entries_response::conflict_index() const
+		{
+			return conflict_index_;
+		}
+
+		uint32_t append_entries_response::conflict_term() const
+		{
+			return conflict_term_;
+		}
+
+		uint32_t append_entries_response::read_seq() const
+		{
+			return read_seq_;
 		}
 
 		uint32_t append_entries_response::term() const
@@ -171,10 +327,12 @@ namespace raft
 
 
 		request_vote::request_vote(uint32_t term, const std::string& candidate_id, uint32_t last_log_term,
-				uint32_t last_log_index)
+				uint32_t last_log_index, bool transfer, bool pre_vote)
 			:term_(term),
 			candidate_id_(candidate_id),
-			last_log_(std::make_tuple(last_log_term, last_log_index))
+			last_log_(std::make_tuple(last_log_term, last_log_index)),
+			transfer_(transfer),
+			pre_vote_(pre_vote)
 		{
 		}
 
@@ -192,6 +350,9 @@ namespace raft
 			last_log_ = std::make_tuple(
 					checked_from_json<uint32_t>(root, "last_log_term"),
 					checked_from_json<uint32_t>(root, "last_log_index"));
+
+			transfer_ = root.isMember("transfer") ? checked_from_json<bool>(root, "transfer") : false;
+			pre_vote_ = root.isMember("pre_vote") ? checked_from_json<bool>(root, "pre_vote") : false;
 		}
 
 		request_vote::operator Json::Value() const
@@ -204,6 +365,10 @@ namespace raft
 
 			root["last_log_term"] = last_log_term();
 			root["last_log_index"] = last_log_index();
+			if(transfer_)
+				root["transfer"] = true;
+			if(pre_vote_)
+				root["pre_vote"] = true;
 
 			return root;
 		}
@@ -233,6 +398,16 @@ namespace raft
 			return std::get<0>(last_log_);
 		}
 
+		bool request_vote::transfer() const
+		{
+			return transfer_;
+		}
+
+		bool request_vote::pre_vote() const
+		{
+			return pre_vote_;
+		}
+
 		template <typename T>
 		T request_vote_response::checked_from_json(const Json::Value& root, const std::string& key) const
 		{
@@ -286,5 +461,492 @@ namespace raft
 		{
 			return vote_granted_;
 		}
+	
+		configuration::configuration(const std::set<std::string>& voters,
+				const std::set<std::string>& learners, const address_map& addresses)
+			:voters_(voters),
+			learners_(learners),
+			addresses_(addresses)
+		{
+		}
+
+		//! Reads an array of node IDs
+		static std::set<std::string> node_set(const Json::Value& root, const std::string& key)
+		{
+			const Json::Value& nodes = root[key];
+			if(!nodes.isArray())
+				throw std::runtime_error("Bad json for configuration: " + key + " isn't an array");
+
+			std::set<std::string> ret;
+			for(const auto& node : nodes)
+				ret.insert(node.asString());
+
+			return ret;
+		}
+
+		static Json::Value node_array(const std::set<std::string>& nodes)
+		{
+			Json::Value ret(Json::arrayValue);
+			for(const auto& node : nodes)
+				ret.append(node);
+
+			return ret;
+		}
+
+		configuration::configuration(const Json::Value& root)
+		{
+			if(!is_configuration(root))
+				throw std::runtime_error("Action not configuration");
+
+			voters_ = node_set(root, "voters");
+			if(root.isMember("new_voters"))
+				new_voters_ = node_set(root, "new_voters");
+			if(root.isMember("learners"))
+				learners_ = node_set(root, "learners");
+
+			const Json::Value& addresses = root["addresses"];
+			for(auto it = addresses.begin(); it != addresses.end(); ++it)
+				addresses_[it.key().asString()] = std::make_tuple(
+						json_help::checked_from_json<std::string>(*it, "host", "Bad json for configuration:"),
+						json_help::checked_from_json<std::string>(*it, "port", "Bad json for configuration:"));
+		}
+
+		configuration::operator Json::Value() const
+		{
+			Json::Value root;
+			root["type"] = "configuration";
+			root["voters"] = node_array(voters_);
+			if(new_voters_)
+				root["new_voters"] = node_array(*new_voters_);
+			root["learners"] = node_array(learners_);
+
+			root["addresses"] = Json::Value(Json::objectValue);
+			for(const auto& address : addresses_)
+			{
+				Json::Value& node = root["addresses"][address.first];
+				node["host"] = std::get<0>(address.second);
+				node["port"] = std::get<1>(address.second);
+			}
+
+			return root;
+		}
+
+		bool configuration::is_configuration(const Json::Value& action)
+		{
+			return action.isObject() && action.get("type", "").asString() == "configuration";
+		}
+
+		const std::set<std::string>& configuration::voters() const
+		{
+			return voters_;
+		}
+
+		const boost::optional<std::set<std::string>>& configuration::new_voters() const
+		{
+			return new_voters_;
+		}
+
+		const std::set<std::string>& configuration::learners() const
+		{
+			return learners_;
+		}
+
+		const configuration::address_map& configuration::addresses() const
+		{
+			return addresses_;
+		}
+
+		bool configuration::joint() const
+		{
+			return static_cast<bool>(new_voters_);
+		}
+
+		configuration configuration::transition(const configuration& target) const
+		{
+			//Old voters keep voting until the change is done, so they needn't
+			//be kept on as learners
+			configuration ret(voters_, target.learners_, addresses_);
+			ret.new_voters_ = target.voters_;
+			for(const auto& node : target.voters_)
+				ret.learners_.erase(node);
+
+			for(const auto& address : target.addresses_)
+				ret.addresses_[address.first] = address.second;
+
+			return ret;
+		}
+
+		configuration configuration::target() const
+		{
+			if(!new_voters_)
+				return *this;
+
+			configuration ret(*new_voters_, learners_);
+			for(const auto& node : ret.members())
+				if(addresses_.count(node))
+					ret.addresses_[node] = addresses_.at(node);
+
+			return ret;
+		}
+
+		std::set<std::string> configuration::members() const
+		{
+			std::set<std::string> ret(voters_);
+			if(new_voters_)
+				ret.insert(new_voters_->begin(), new_voters_->end());
+			ret.insert(learners_.begin(), learners_.end());
+
+			return ret;
+		}
+
+		bool configuration::voting(const std::string& node) const
+		{
+			return voters_.count(node) || (new_voters_ && new_voters_->count(node));
+		}
+
+		//! True if agreed holds a majority of voters
+		static bool majority(const std::set<std::string>& voters, const std::set<std::string>& agreed)
+		{
+			std::size_t count = 0;
+			for(const auto& node : voters)
+				if(agreed.count(node))
+					++count;
+
+			return count >= voters.size() / 2 + 1;
+		}
+
+		bool configuration::quorum(const std::set<std::string>& agreed) const
+		{
+			return majority(voters_, agreed) && (!new_voters_ || majority(*new_voters_, agreed));
+		}
+
+		bool configuration::operator==(const configuration& other) const
+		{
+			return voters_ == other.voters_ && new_voters_ == other.new_voters_
+				&& learners_ == other.learners_ && addresses_ == other.addresses_;
+		}
+
+		bool configuration::operator!=(const configuration& other) const
+		{
+			return !(*this == other);
+		}
+
+		template <typename T>
+		T install_snapshot::checked_from_json(const Json::Value& root, const std::string& key) const
+		{
+			return json_help::checked_from_json<T>(root, key, "Bad json for install_snapshot RPC:");
+		}
+
+		install_snapshot::install_snapshot(uint32_t term, const std::string& leader_id,
+				uint32_t last_included_term, uint32_t last_included_index,
+				uint32_t offset, const std::string& data, bool done,
+				const boost::optional<configuration>& membership)
+			:term_(term),
+			leader_id_(leader_id),
+			last_included_(std::make_tuple(last_included_term, last_included_index)),
+			offset_(offset),
+			data_(data),
+			done_(done),
+			membership_(membership)
+		{
+		}
+
+		install_snapshot::install_snapshot(const Json::Value& root)
+		{
+			std::string type = checked_from_json<std::string>(root, "type");
+
+			if(!(type == "install_snapshot"))
+				throw std::runtime_error("RPC not install_snapshot");
+
+			term_ = checked_from_json<uint32_t>(root, "term");
+
+			leader_id_ = checked_from_json<std::string>(root, "leader_id");
+
+			last_included_ = std::make_tuple(
+					checked_from_json<uint32_t>(root, "last_included_term"),
+					checked_from_json<uint32_t>(root, "last_included_index"));
+
+			offset_ = checked_from_json<uint32_t>(root, "offset");
+			data_ = checked_from_json<std::string>(root, "data");
+			done_ = checked_from_json<bool>(root, "done");
+
+			if(root.isMember("membership"))
+				membership_ = configuration(root["membership"]);
+		}
+
+		install_snapshot::operator Json::Value() const
+		{
+			Json::Value root;
+			root["type"] = "install_snapshot";
+			root["term"] = term_;
+			root["leader_id"] = leader_id_;
+			root["last_included_term"] = last_included_term();
+			root["last_included_index"] = last_included_index();
+			root["offset"] = offset_;
+			root["data"] = data_;
+			root["done"] = done_;
+			if(membership_)
+				root["membership"] = static_cast<Json::Value>(*membership_);
+
+			return root;
+		}
+
+		uint32_t install_snapshot::term() const
+		{
+			return term_;
+		}
+
+		std::string install_snapshot::leader_id() const
+		{
+			return leader_id_;
+		}
+
+		uint32_t install_snapshot::last_included_index() const
+		{
+			return std::get<1>(last_included_);
+		}
+
+		uint32_t install_snapshot::last_included_term() const
+		{
+			return std::get<0>(last_included_);
+		}
+
+		uint32_t install_snapshot::offset() const
+		{
+			return offset_;
+		}
+
+		std::string install_snapshot::data() const
+		{
+			return data_;
+		}
+
+		bool install_snapshot::done() const
+		{
+			return done_;
+		}
+
+		const boost::optional<configuration>& install_snapshot::membership() const
+		{
+			return membership_;
+		}
+
+		template <typename T>
+		T install_snapshot_response::checked_from_json(const Json::Value& root, const std::string& key) const
+		{
+			return json_help::checked_from_json<T>(root, key, "Bad json for install_snapshot RPC response:");
+		}
+
+		install_snapshot_response::install_snapshot_response(const install_snapshot& request,
+				uint32_t term, bool success, uint32_t offset)
+			:term_(term),
+			success_(success),
+			last_included_index_(request.last_included_index()),
+			offset_(offset),
+			done_(request.done())
+		{
+		}
+
+		install_snapshot_response::install_snapshot_response(const Json::Value& root)
+		{
+			std::string type = checked_from_json<std::string>(root, "type");
+
+			if(!(type == "install_snapshot_response"))
+				throw std::runtime_error("RPC not install_snapshot_response");
+
+			term_ = checked_from_json<uint32_t>(root, "term");
+			success_ = checked_from_json<bool>(root, "success");
+			last_included_index_ = checked_from_json<uint32_t>(root, "last_included_index");
+			offset_ = checked_from_json<uint32_t>(root, "offset");
+			done_ = checked_from_json<bool>(root, "done");
+		}
+
+		install_snapshot_response::operator Json::Value() const
+		{
+			Json::Value root;
+
+			root["type"] = "install_snapshot_response";
+			root["term"] = term_;
+			root["success"] = success_;
+			root["last_included_index"] = last_included_index_;
+			root["offset"] = offset_;
+			root["done"] = done_;
+
+			return root;
+		}
+
+		uint32_t install_snapshot_response::term() const
+		{
+			return term_;
+		}
+
+		bool install_snapshot_response::success() const
+		{
+			return success_;
+		}
+
+		uint32_t install_snapshot_response::last_included_index() const
+		{
+			return last_included_index_;
+		}
+
+		uint32_t install_snapshot_response::offset() const
+		{
+			return offset_;
+		}
+
+		bool install_snapshot_response::done() const
+		{
+			return done_;
+		}
+
+		template <typename T>
+		T read_index::checked_from_json(const Json::Value& root, const std::string& key) const
+		{
+			return json_help::checked_from_json<T>(root, key, "Bad json for read_index RPC:");
+		}
+
+		read_index::read_index(uint32_t term, uint32_t id)
+			:term_(term),
+			id_(id)
+		{
+		}
+
+		read_index::read_index(const Json::Value& root)
+		{
+			std::string type = checked_from_json<std::string>(root, "type");
+
+			if(!(type == "read_index"))
+				throw std::runtime_error("RPC not read_index");
+
+			term_ = checked_from_json<uint32_t>(root, "term");
+			id_ = checked_from_json<uint32_t>(root, "id");
+		}
+
+		read_index::operator Json::Value() const
+		{
+			Json::Value root;
+
+			root["type"] = "read_index";
+			root["term"] = term_;
+			root["id"] = id_;
+
+			return root;
+		}
+
+		uint32_t read_index::term() const
+		{
+			return term_;
+		}
+
+		uint32_t read_index::id() const
+		{
+			return id_;
+		}
+
+		template <typename T>
+		T read_index_response::checked_from_json(const Json::Value& root, const std::string& key) const
+		{
+			return json_help::checked_from_json<T>(root, key, "Bad json for read_index RPC response:");
+		}
+
+		read_index_response::read_index_response(const read_index& request, uint32_t term,
+				bool success, uint32_t index)
+			:term_(term),
+			id_(request.id()),
+			success_(success),
+			index_(index)
+		{
+		}
+
+		read_index_response::read_index_response(const Json::Value& root)
+		{
+			std::string type = checked_from_json<std::string>(root, "type");
+
+			if(!(type == "read_index_response"))
+				throw std::runtime_error("RPC not read_index_response");
+
+			term_ = checked_from_json<uint32_t>(root, "term");
+			id_ = checked_from_json<uint32_t>(root, "id");
+			success_ = checked_from_json<bool>(root, "success");
+			index_ = checked_from_json<uint32_t>(root, "index");
+		}
+
+		read_index_response::operator Json::Value() const
+		{
+			Json::Value root;
+
+			root["type"] = "read_index_response";
+			root["term"] = term_;
+			root["id"] = id_;
+			root["success"] = success_;
+			root["index"] = index_;
+
+			return root;
+		}
+
+		uint32_t read_index_response::term() const
+		{
+			return term_;
+		}
+
+		uint32_t read_index_response::id() const
+		{
+			return id_;
+		}
+
+		bool read_index_response::success() const
+		{
+			return success_;
+		}
+
+		uint32_t read_index_response::index() const
+		{
+			return index_;
+		}
+
+		template <typename T>
+		T timeout_now::checked_from_json(const Json::Value& root, const std::string& key) const
+		{
+			return json_help::checked_from_json<T>(root, key, "Bad json for timeout_now RPC:");
+		}
+
+		timeout_now::timeout_now(uint32_t term, const std::string& leader_id)
+			:term_(term),
+			leader_id_(leader_id)
+		{
+		}
+
+		timeout_now::timeout_now(const Json::Value& root)
+		{
+			std::string type = checked_from_json<std::string>(root, "type");
+
+			if(!(type == "timeout_now"))
+				throw std::runtime_error("RPC not timeout_now");
+
+			term_ = checked_from_json<uint32_t>(root, "term");
+			leader_id_ = checked_from_json<std::string>(root, "leader_id");
+		}
+
+		timeout_now::operator Json::Value() const
+		{
+			Json::Value root;
+
+			root["type"] = "timeout_now";
+			root["term"] = term_;
+			root["leader_id"] = leader_id_;
+
+			return root;
+		}
+
+		uint32_t timeout_now::term() const
+		{
+			return term_;
+		}
+
+		std::string timeout_now::leader_id() const
+		{
+			return leader_id_;
+		}
 	}
 }
@@ -1,77 +1,207 @@
 #pragma once
 
+#include <memory>
+#include <set>
+#include <map>
+
+#include <boost/optional.hpp>
+
 #include "../common/json_help.hpp"
 
 namespace raft
 {
 	namespace rpc
 	{
+		//! A log entry's action, shared and never modified once made.
+		/*!
+		 *  The action is serialised once, when the payload is made. The same
+		 *  bytes are written to the log and spliced into every append_entries
+		 *  that carries the entry, so copying an entry or sending it to several
+		 *  followers doesn't copy or re-encode the action.
+		 */
+		class payload
+		{
+		public:
+			explicit payload(const Json::Value& action);
+
+			//! Make a payload from an action's serialised form, throwing
+			//! std::runtime_error if it doesn't parse.
+			static std::shared_ptr<const payload> parse(const std::string& serialised);
+
+			const Json::Value& action() const;
+
+			//! The action as compact JSON, without a trailing newline
+			const std::string& serialised() const;
+
+		protected:
+			payload(const std::string& serialised, const Json::Value& action);
+
+			std::string serialised_;
+			Json::Value action_;
+		};
+
+		typedef std::shared_ptr<const payload> payload_ptr;
+
+		//! The version of the replication RPCs this node speaks.
+		/*!
+		 *  Version 1 append_entries responses echo the whole request; from
+		 *  version 2 they're compact. Followers answer in the version of the
+		 *  request, so nodes can be upgraded in any order.
+		 */
+		const uint32_t protocol_version = 2;
 
 		class append_entries
 		{
 		public:
+			//! An entry's spawn term and its action
+			typedef std::tuple<uint32_t, payload_ptr> entry_type;
+
+			/*!
+			 *  \param read_seq The leader's heartbeat round when this was
+			 *  sent; followers echo it so reads can be confirmed.
+			 */
 			append_entries(uint32_t term, const std::string& leader_id,
 					uint32_t prev_log_term, uint32_t prev_log_index, const
-					std::vector<std::tuple<uint32_t, Json::Value>>& entries, uint32_t leader_commit);
+					std::vector<entry_type>& entries, uint32_t leader_commit,
+					uint32_t read_seq = 0);
+
+			//! \overload Makes a payload for each action.
+			template <typename Action = Json::Value>
+			append_entries(uint32_t term, const std::string& leader_id,
+					uint32_t prev_log_term, uint32_t prev_log_index, const
+					std::vector<std::tuple<uint32_t, Action>>& entries, uint32_t leader_commit,
+					uint32_t read_seq = 0)
+				:append_entries(term, leader_id, prev_log_term, prev_log_index,
+						std::vector<entry_type>(), leader_commit, read_seq)
+			{
+				entries_.reserve(entries.size());
+				for(const auto& entry : entries)
+					entries_.emplace_back(std::get<0>(entry),
+							std::make_shared<const payload>(std::get<1>(entry)));
+			}
 
 			append_entries(const Json::Value& root);
 
 			operator Json::Value() const;
 
+			//! The RPC as a line of compact JSON, the same as writing
+			//! operator Json::Value() but splicing in each entry's serialised
+			//! action rather than re-encoding it.
+			std::string serialise() const;
+
 			uint32_t term() const;
 			std::string leader_id() const;
 
+			//! The protocol version of the leader; 1 if it didn't say
+			uint32_t version() const;
+
 			std::tuple<uint32_t, uint32_t> prev_log() const;
 			uint32_t prev_log_index() const;
 			uint32_t prev_log_term() const;
 
-			std::vector<std::tuple<uint32_t, Json::Value>> entries() const;
+			const std::vector<entry_type>& entries() const;
 
 			uint32_t leader_commit() const;
 
+			//! The leader's heartbeat round; zero if it didn't say
+			uint32_t read_seq() const;
+
 		private:
 			//Private so its definition can be in the cpp
 			template <typename T>
 			T checked_from_json(const Json::Value& root, const std::string& key) const;
 
 		protected:
+			uint32_t version_;
 			uint32_t term_;
 			std::string leader_id_;
 
 			//! Stores the term and index of prev log, in that order.
 			std::tuple<uint32_t, uint32_t> prev_log_;
-			std::vector<std::tuple<uint32_t, Json::Value>> entries_;
+			std::vector<entry_type> entries_;
 			uint32_t leader_commit_;
+			uint32_t read_seq_;
 
 		};
 
+		//! Response to append_entries.
+		/*!
+		 *  Rather than echoing the request, this carries what the leader needs
+		 *  from it: the index it was checked at and, on success, how far the
+		 *  logs now match. Responses to version 1 requests are sent in the old
+		 *  form, echoing the request, and old responses are understood.
+		 */
 		class append_entries_response
 		{
 		public:
-			append_entries_response(const append_entries& request, uint32_t term, bool success);
+			/*!
+			 *  \param conflict_index On failure, the earliest index at which
+			 *  the follower's log may differ from the leader's, or zero if
+			 *  that isn't known.
+			 *  \param conflict_term On failure, the term of the follower's
+			 *  entry at prev_log_index, or zero if it has no entry there;
+			 *  conflict_index is then the first index it holds in that term.
+			 */
+			append_entries_response(const append_entries& request, uint32_t term,
+					bool success, uint32_t conflict_index = 0, uint32_t conflict_term = 0);
 			append_entries_response(const Json::Value& root);
 
 			operator Json::Value() const;
 
-			append_entries request() const;
 			uint32_t term() const;
 			bool success() const;
 
+			//! The protocol version the response was sent with
+			uint32_t version() const;
+
+			//! The prev_log_index of the request
+			uint32_t prev_log_index() const;
+
+			//! On success, the last index at which the logs match
+			uint32_t match_index() const;
+
+			//! On failure, a hint for where the logs diverge; zero if none
+			uint32_t conflict_index() const;
+
+			//! On failure, the term of the follower's conflicting entry; zero
+			//! if none
+			uint32_t conflict_term() const;
+
+			//! The read_seq of the request
+			uint32_t read_seq() const;
+
 		private:
 			template <typename T>
 			T checked_from_json(const Json::Value& root, const std::string& key) const;
 
 		protected:
-			append_entries request_;
+			uint32_t version_;
 			uint32_t term_;
 			bool success_;
+			uint32_t prev_log_index_;
+			uint32_t match_index_;
+			uint32_t conflict_index_;
+			uint32_t conflict_term_;
+			uint32_t read_seq_;
+
+			//! The request, to echo to leaders using version 1
+			std::shared_ptr<const append_entries> request_;
 		};
 
 		class request_vote
 		{
 		public:
+			/*!
+			 *  \param transfer True if the candidate is campaigning because the
+			 *  leader handed over to it; voters then don't wait out the leader's
+			 *  lease.
+			 *  \param pre_vote True if this only asks whether the candidate
+			 *  could win an election for term; voters neither take up the term
+			 *  nor record a vote.
+			 */
 			request_vote(uint32_t term, const std::string& candidate_id, uint32_t
-					last_log_term, uint32_t last_log_index);
+					last_log_term, uint32_t last_log_index, bool transfer = false,
+					bool pre_vote = false);
 
 			request_vote(const Json::Value& root);
 
@@ -83,6 +213,13 @@ namespace raft
 			uint32_t last_log_index() const;
 			uint32_t last_log_term() const;
 
+			//! True if the leader handed over to the candidate; false if it
+			//! didn't say
+			bool transfer() const;
+
+			//! True if this is a pre-vote; false if it didn't say
+			bool pre_vote() const;
+
 		private:
 			//Private so its definition can be in the cpp
 			template <typename T>
@@ -94,6 +231,8 @@ namespace raft
 
 			//! Stores the term and index, in that order
 			std::tuple<uint32_t, uint32_t> last_log_;
+			bool transfer_;
+			bool pre_vote_;
 		};
 
 		class request_vote_response
@@ -117,5 +256,240 @@ namespace raft
 			uint32_t term_;
 			bool vote_granted_;
 		};
+	
+		//! A cluster membership, carried as the action of a log entry.
+		/*!
+		 *  While the membership changes the configuration is joint: elections
+		 *  and commits need a majority of the old voters and of the new.
+		 *  Learners follow the log without voting. Members' addresses go with
+		 *  it, so nodes can reach members they weren't configured with.
+		 */
+		class configuration
+		{
+		public:
+			//! Each member's host and port, in that order
+			typedef std::map<std::string, std::tuple<std::string, std::string>> address_map;
+
+			configuration() = default;
+			configuration(const std::set<std::string>& voters, const std::set<std::string>& learners,
+					const address_map& addresses = address_map());
+			configuration(const Json::Value& root);
+
+			operator Json::Value() const;
+
+			//! True if the action of a log entry is a configuration
+			static bool is_configuration(const Json::Value& action);
+
+			const std::set<std::string>& voters() const;
+
+			//! The voters being moved to, if the configuration is joint
+			const boost::optional<std::set<std::string>>& new_voters() const;
+
+			const std::set<std::string>& learners() const;
+			const address_map& addresses() const;
+
+			bool joint() const;
+
+			//! The joint configuration moving from this one to target.
+			/*!
+			 *  Old voters leaving keep voting until the change is done;
+			 *  learners come and go at once.
+			 */
+			configuration transition(const configuration& target) const;
+
+			//! The configuration a joint one is moving to
+			configuration target() const;
+
+			//! Every voter, new voter and learner
+			std::set<std::string> members() const;
+
+			//! True if node counts towards a majority
+			bool voting(const std::string& node) const;
+
+			//! True if agreed holds a majority of the voters, and of the new
+			//! voters if the configuration is joint.
+			bool quorum(const std::set<std::string>& agreed) const;
+
+			bool operator==(const configuration& other) const;
+			bool operator!=(const configuration& other) const;
+
+		protected:
+			std::set<std::string> voters_;
+			boost::optional<std::set<std::string>> new_voters_;
+			std::set<std::string> learners_;
+			address_map addresses_;
+		};
+
+		//! InstallSnapshot RPC: carries one chunk of the leader's snapshot.
+		/*!
+		 *  The snapshot's serialised state is split into chunks of at most a
+		 *  configured size. Chunks are sent in order; the follower assembles them
+		 *  and installs the snapshot once the chunk marked done arrives.
+		 */
+		class install_snapshot
+		{
+		public:
+			/*!
+			 *  \param membership The configuration as of the snapshot, sent
+			 *  with the last chunk
+			 */
+			install_snapshot(uint32_t term, const std::string& leader_id,
+					uint32_t last_included_term, uint32_t last_included_index,
+					uint32_t offset, const std::string& data, bool done,
+					const boost::optional<configuration>& membership = boost::none);
+
+			install_snapshot(const Json::Value& root);
+
+			operator Json::Value() const;
+
+			uint32_t term() const;
+			std::string leader_id() const;
+
+			uint32_t last_included_index() const;
+			uint32_t last_included_term() const;
+
+			//! The byte offset of this chunk in the serialised snapshot
+			uint32_t offset() const;
+			std::string data() const;
+
+			//! True if this is the last chunk
+			bool done() const;
+
+			//! The configuration as of the snapshot, if it was sent
+			const boost::optional<configuration>& membership() const;
+
+		private:
+			template <typename T>
+			T checked_from_json(const Json::Value& root, const std::string& key) const;
+
+		protected:
+			uint32_t term_;
+			std::string leader_id_;
+
+			//! Stores the term and index of the last included entry, in that order.
+			std::tuple<uint32_t, uint32_t> last_included_;
+			uint32_t offset_;
+			std::string data_;
+			bool done_;
+			boost::optional<configuration> membership_;
+		};
+
+		//! Response to install_snapshot.
+		/*!
+		 *  Unlike the other responses this doesn't echo the request, to avoid
+		 *  sending the chunk back. offset is the next byte the follower expects.
+		 */
+		class install_snapshot_response
+		{
+		public:
+			install_snapshot_response(const install_snapshot& request, uint32_t term,
+					bool success, uint32_t offset);
+			install_snapshot_response(const Json::Value& root);
+
+			operator Json::Value() const;
+
+			uint32_t term() const;
+			bool success() const;
+			uint32_t last_included_index() const;
+			uint32_t offset() const;
+			bool done() const;
+
+		private:
+			template <typename T>
+			T checked_from_json(const Json::Value& root, const std::string& key) const;
+
+		protected:
+			uint32_t term_;
+			bool success_;
+			uint32_t last_included_index_;
+			uint32_t offset_;
+			bool done_;
+		};
+
+		//! ReadIndex RPC: a follower asking the leader for a read index.
+		/*!
+		 *  The leader answers once it has confirmed it's still leading, with
+		 *  its commit index at that point. Once the follower has applied that
+		 *  far, its state is as recent as any read of the leader's would be.
+		 */
+		class read_index
+		{
+		public:
+			/*!
+			 *  \param id Identifies the read to the follower; echoed in the
+			 *  response.
+			 */
+			read_index(uint32_t term, uint32_t id);
+			read_index(const Json::Value& root);
+
+			operator Json::Value() const;
+
+			uint32_t term() const;
+			uint32_t id() const;
+
+		private:
+			template <typename T>
+			T checked_from_json(const Json::Value& root, const std::string& key) const;
+
+		protected:
+			uint32_t term_;
+			uint32_t id_;
+		};
+
+		//! Response to read_index.
+		class read_index_response
+		{
+		public:
+			/*!
+			 *  \param success True if leadership was confirmed
+			 *  \param index The commit index the follower must apply up to
+			 */
+			read_index_response(const read_index& request, uint32_t term,
+					bool success, uint32_t index);
+			read_index_response(const Json::Value& root);
+
+			operator Json::Value() const;
+
+			uint32_t term() const;
+			uint32_t id() const;
+			bool success() const;
+			uint32_t index() const;
+
+		private:
+			template <typename T>
+			T checked_from_json(const Json::Value& root, const std::string& key) const;
+
+		protected:
+			uint32_t term_;
+			uint32_t id_;
+			bool success_;
+			uint32_t index_;
+		};
+
+		//! TimeoutNow RPC: the leader handing leadership to a follower.
+		/*!
+		 *  Sent once the follower's log matches the leader's; the follower
+		 *  starts an election at once rather than waiting for its timeout.
+		 *  There's no response; the follower's vote requests are the answer.
+		 */
+		class timeout_now
+		{
+		public:
+			timeout_now(uint32_t term, const std::string& leader_id);
+			timeout_now(const Json::Value& root);
+
+			operator Json::Value() const;
+
+			uint32_t term() const;
+			std::string leader_id() const;
+
+		private:
+			template <typename T>
+			T checked_from_json(const Json::Value& root, const std::string& key) const;
+
+		protected:
+			uint32_t term_;
+			std::string leader_id_;
+		};
 	}
 }
@@ -0,0 +1,725 @@
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+
+#include <thread>
+#include <exception>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <boost/crc.hpp>
+#include <boost/format.hpp>
+#include <boost/optional.hpp>
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
+
+#include "raftsegment.hpp"
+
+namespace
+{
+	const char segment_magic[] = {'C', 'R', 'V', 'N', 'L', 'O', 'G', '1'};
+
+	void put_u32(std::string& out, uint32_t value)
+	{
+		for(unsigned i = 0; i < 4; ++i)
+			out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+	}
+
+	uint32_t get_u32(const char* data)
+	{
+		uint32_t value = 0;
+		for(unsigned i = 0; i < 4; ++i)
+			value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+		return value;
+	}
+
+	//! A read-only mapping of a whole file, unmapped on destruction.
+	class mapped_file
+	{
+	public:
+		mapped_file(const fs::path& path, std::size_t size)
+			:data_(nullptr),
+			size_(size)
+		{
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if(fd == -1)
+				throw raft::log::exceptions::log_io("Unable to open log segment " + path.string(), errno);
+
+			void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			int err = errno;
+			//The mapping outlives the descriptor
+			::close(fd);
+
+			if(data == MAP_FAILED)
+				throw raft::log::exceptions::log_io("Unable to map log segment " + path.string(), err);
+
+			data_ = static_cast<const char*>(data);
+			//Replay reads front to back
+			::madvise(const_cast<char*>(data_), size_, MADV_SEQUENTIAL);
+		}
+
+		~mapped_file()
+		{
+			::munmap(const_cast<char*>(data_), size_);
+		}
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		const char* data() const
+		{
+			return data_;
+		}
+
+	protected:
+		const char* data_;
+		std::size_t size_;
+	};
+
+	//! Chunks smaller than this aren't worth a thread
+	const std::size_t min_parallel_chunk = 256;
+
+	//! fsync a directory, so the entries made in it survive a crash.
+	void sync_directory(const fs::path& dir)
+	{
+		int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if(dir_fd == -1)
+			throw raft::log::exceptions::log_io("Unable to open directory " + dir.string(), errno);
+
+		int result = ::fsync(dir_fd);
+		int err = errno;
+		::close(dir_fd);
+
+		if(result == -1)
+			throw raft::log::exceptions::log_io("fsync of directory " + dir.string() + " failed", err);
+	}
+}
+
+namespace raft
+{
+	namespace log
+	{
+		void parallel_for(std::size_t count, unsigned threads,
+				const std::function<void (std::size_t, std::size_t)>& f)
+		{
+			std::size_t chunk = std::max(min_parallel_chunk,
+					(count + std::max(threads, 1u) - 1) / std::max(threads, 1u));
+
+			if(count <= chunk)
+			{
+				f(0, count);
+				return;
+			}
+
+			std::vector<std::thread> workers;
+			std::vector<std::exception_ptr> errors((count + chunk - 1) / chunk);
+
+			for(std::size_t begin = 0, i = 0; begin < count; begin += chunk, ++i)
+			{
+				const std::size_t end = std::min(count, begin + chunk);
+				workers.emplace_back([&f, &errors, begin, end, i]()
+						{
+							try
+							{
+								f(begin, end);
+							}
+							catch(...)
+							{
+								errors[i] = std::current_exception();
+							}
+						});
+			}
+
+			for(std::thread& worker : workers)
+				worker.join();
+
+			for(const std::exception_ptr& error : errors)
+				if(error)
+					std::rethrow_exception(error);
+		}
+
+		void replace_file(const fs::path& path, const std::string& data)
+		{
+			const fs::path scratch = path.string() + ".tmp";
+
+			int fd = ::open(scratch.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(fd == -1)
+				throw exceptions::log_io("Unable to open " + scratch.string(), errno);
+
+			const char* remaining = data.data();
+			std::size_t size = data.size();
+			while(size > 0)
+			{
+				ssize_t written = ::write(fd, remaining, size);
+				if(written < 0)
+				{
+					if(errno == EINTR)
+						continue;
+					int err = errno;
+					::close(fd);
+					throw exceptions::log_io("Write to " + scratch.string() + " failed", err);
+				}
+
+				remaining += written;
+				size -= written;
+			}
+
+			if(::fdatasync(fd) == -1)
+			{
+				int err = errno;
+				::close(fd);
+				throw exceptions::log_io("fdatasync of " + scratch.string() + " failed", err);
+			}
+			::close(fd);
+
+			fs::rename(scratch, path);
+			::sync_directory(path.has_parent_path() ? path.parent_path() : fs::path("."));
+		}
+
+		record_writer::record_writer(record_type type)
+		{
+			body_.push_back(static_cast<char>(type));
+		}
+
+		record_writer& record_writer::u32(uint32_t value)
+		{
+			put_u32(body_, value);
+			return *this;
+		}
+
+		record_writer& record_writer::str(const std::string& value)
+		{
+			put_u32(body_, value.size());
+			body_ += value;
+			return *this;
+		}
+
+		record_writer& record_writer::rest(const std::string& value)
+		{
+			body_ += value;
+			return *this;
+		}
+
+		const std::string& record_writer::body() const
+		{
+			return body_;
+		}
+
+		record_reader::record_reader(const char* data, std::size_t size)
+			:data_(data),
+			size_(size),
+			pos_(1)
+		{
+			//The type byte must be present
+			if(size_ == 0)
+				throw std::runtime_error("Empty log record");
+		}
+
+		record_reader::record_reader(const std::string& body)
+			:record_reader(body.data(), body.size())
+		{
+		}
+
+		record_type record_reader::type() const
+		{
+			return static_cast<record_type>(data_[0]);
+		}
+
+		uint32_t record_reader::u32()
+		{
+			require(4);
+			uint32_t value = get_u32(data_ + pos_);
+			pos_ += 4;
+			return value;
+		}
+
+		std::string record_reader::str()
+		{
+			uint32_t length = u32();
+			require(length);
+			std::string value(data_ + pos_, length);
+			pos_ += length;
+			return value;
+		}
+
+		std::string record_reader::rest()
+		{
+			std::string value(data_ + pos_, size_ - pos_);
+			pos_ = size_;
+			return value;
+		}
+
+		void record_reader::require(std::size_t count) const
+		{
+			if(size_ - pos_ < count)
+				throw std::runtime_error(boost::str(boost::format(
+								"Truncated log record: wanted %s bytes at %s, have %s")
+							% count % pos_ % (size_ - pos_)));
+		}
+
+		exceptions::log_io::log_io(const std::string& what, int err)
+			:std::runtime_error(what + ": " + std::strerror(err))
+		{
+		}
+
+		exceptions::corrupt_record::corrupt_record(const std::string& segment, uint64_t offset,
+				const std::string& what)
+			:std::runtime_error(boost::str(boost::format(
+							"Corrupt record in log segment %s at offset %s: %s")
+						% segment % offset % what))
+		{
+		}
+
+		const uint64_t Segments::header_size = sizeof(segment_magic);
+		const uint64_t Segments::frame_size = 8;
+
+		Segments::Segments(const fs::path& dir, uint64_t segment_size)
+			:dir_(dir),
+			segment_size_(segment_size),
+			fd_(-1),
+			active_(0),
+			active_size_(0),
+			failed_(false),
+			read_fd_(-1),
+			read_segment_(0)
+		{
+			if(fs::exists(dir_) && !fs::is_directory(dir_))
+				throw std::logic_error("Raft log " + dir_.string() + " is not a directory");
+
+			fs::create_directories(dir_);
+		}
+
+		Segments::~Segments()
+		{
+			if(fd_ != -1)
+			{
+				try
+				{
+					flush();
+				}
+				catch(const std::exception& ex)
+				{
+					BOOST_LOG_TRIVIAL(error) << "Lost buffered log records on close: " << ex.what();
+				}
+				::close(fd_);
+			}
+
+			if(read_fd_ != -1)
+				::close(read_fd_);
+		}
+
+		void Segments::replay(const replay_type& f)
+		{
+			replay_batches([&f](const std::vector<record_view>& records)
+					{
+						for(const record_view& record : records)
+							f(std::string(record.data, record.size), record.location);
+					}, 1);
+		}
+
+		void Segments::replay_batches(const batch_replay_type& f, unsigned threads)
+		{
+			const std::vector<uint32_t> all = segments();
+
+			for(auto it = all.begin(); it != all.end(); ++it)
+			{
+				const bool last = (it + 1 == all.end());
+				const fs::path path = segment_path(*it);
+				const uint64_t size = fs::file_size(path);
+
+				//A crash while creating the segment can leave a short header
+				if(size < header_size)
+				{
+					if(!last)
+						throw exceptions::corrupt_record(path.string(), 0, "bad segment header");
+
+					BOOST_LOG_TRIVIAL(warning) << "Rewriting incomplete header of log segment " << path;
+					fs::remove(path);
+					open_active(*it, true);
+					return;
+				}
+
+				uint64_t truncate_at = size;
+				{
+					const mapped_file mapped(path, size);
+					const char* data = mapped.data();
+
+					if(!std::equal(segment_magic, segment_magic + header_size, data))
+						throw exceptions::corrupt_record(path.string(), 0, "bad segment header");
+
+					//Finding the frames is serial, but only hops between lengths
+					std::vector<record_view> records;
+					std::string problem;
+					uint64_t offset = header_size;
+					while(offset < size)
+					{
+						const uint64_t remaining = size - offset;
+						if(remaining < frame_size)
+						{
+							problem = "torn frame";
+							break;
+						}
+
+						const uint32_t length = get_u32(data + offset);
+						if(remaining - frame_size < length)
+						{
+							problem = "torn record";
+							break;
+						}
+
+						records.push_back(record_view{data + offset + frame_size, length,
+								record_location{*it, offset}});
+						offset += frame_size + length;
+					}
+
+					//Checksumming is the expensive part, so spread it out
+					std::vector<char> valid(records.size(), 1);
+					parallel_for(records.size(), threads,
+							[&records, &valid](std::size_t begin, std::size_t end)
+							{
+								for(std::size_t i = begin; i < end; ++i)
+								{
+									const record_view& record = records[i];
+									valid[i] = checksum(record.data, record.size)
+										== get_u32(record.data - frame_size + 4);
+								}
+							});
+
+					auto bad = std::find(valid.begin(), valid.end(), 0);
+					if(bad != valid.end())
+					{
+						const std::size_t first_bad = bad - valid.begin();
+						offset = records[first_bad].location.offset;
+						problem = "checksum mismatch";
+						records.resize(first_bad);
+					}
+
+					if(!problem.empty())
+					{
+						if(!last)
+							throw exceptions::corrupt_record(path.string(), offset, problem);
+
+						BOOST_LOG_TRIVIAL(warning) << "Truncating log segment " << path
+							<< " at offset " << offset << ": " << problem;
+						truncate_at = offset;
+					}
+
+					f(records);
+				}
+
+				if(truncate_at != size)
+					fs::resize_file(path, truncate_at);
+			}
+
+			if(all.empty())
+				open_active(1, true);
+			else
+				open_active(all.back(), false);
+		}
+
+		record_location Segments::append(const std::string& body)
+		{
+			if(fd_ == -1)
+				throw std::logic_error("Raft log segments appended to before replay");
+
+			check_usable();
+
+			if(active_size_ > header_size && active_size_ + frame_size + body.size() > segment_size_)
+				roll();
+
+			record_location location{active_, active_size_};
+
+			put_u32(buffer_, body.size());
+			put_u32(buffer_, checksum(body.data(), body.size()));
+			buffer_ += body;
+			active_size_ += frame_size + body.size();
+
+			return location;
+		}
+
+		std::string Segments::read(const record_location& location) const
+		{
+			const uint64_t written = active_size_ - buffer_.size();
+			const fs::path path = segment_path(location.segment);
+
+			const char* frame;
+			char frame_buffer[8];
+			std::string body;
+
+			if(location.segment == active_ && location.offset >= written)
+			{
+				const uint64_t at = location.offset - written;
+				if(buffer_.size() - at < frame_size)
+					throw exceptions::corrupt_record(path.string(), location.offset, "read past buffer");
+
+				frame = buffer_.data() + at;
+				const uint32_t length = get_u32(frame);
+				if(buffer_.size() - at - frame_size < length)
+					throw exceptions::corrupt_record(path.string(), location.offset, "read past buffer");
+
+				body.assign(frame + frame_size, length);
+			}
+			else
+			{
+				if(read_fd_ == -1 || read_segment_ != location.segment)
+				{
+					if(read_fd_ != -1)
+						::close(read_fd_);
+
+					read_fd_ = ::open(path.c_str(), O_RDONLY);
+					if(read_fd_ == -1)
+						throw exceptions::log_io("Unable to open log segment " + path.string(), errno);
+					read_segment_ = location.segment;
+				}
+
+				if(read_at(frame_buffer, frame_size, location.offset) != frame_size)
+					throw exceptions::corrupt_record(path.string(), location.offset, "torn frame");
+
+				frame = frame_buffer;
+				body.resize(get_u32(frame));
+				if(read_at(&body[0], body.size(), location.offset + frame_size) != body.size())
+					throw exceptions::corrupt_record(path.string(), location.offset, "torn record");
+			}
+
+			if(checksum(body.data(), body.size()) != get_u32(frame + 4))
+				throw exceptions::corrupt_record(path.string(), location.offset, "checksum mismatch");
+
+			return body;
+		}
+
+		void Segments::flush()
+		{
+			if(!buffer_.empty())
+			{
+				check_usable();
+
+				//active_size_ already counts the buffer
+				write_all(buffer_.data(), buffer_.size());
+				buffer_.clear();
+			}
+		}
+
+		void Segments::sync()
+		{
+			flush();
+
+			if(fd_ != -1)
+			{
+				check_usable();
+
+				if(::fdatasync(fd_) == -1)
+				{
+					//The kernel may have dropped the dirty pages, so a retry
+					//could succeed without them reaching the disk
+					failed_ = true;
+					throw exceptions::log_io("fdatasync of log segment failed", errno);
+				}
+			}
+		}
+
+		bool Segments::buffered() const
+		{
+			return !buffer_.empty();
+		}
+
+		bool Segments::failed() const
+		{
+			return failed_;
+		}
+
+		uint32_t Segments::active() const
+		{
+			return active_;
+		}
+
+		void Segments::discard_before(uint32_t segment)
+		{
+			for(uint32_t existing : segments())
+			{
+				if(existing >= segment || existing == active_)
+					break;
+
+				BOOST_LOG_TRIVIAL(info) << "Discarding compacted log segment " << existing;
+				if(read_fd_ != -1 && read_segment_ == existing)
+				{
+					::close(read_fd_);
+					read_fd_ = -1;
+				}
+				fs::remove(segment_path(existing));
+			}
+		}
+
+		void Segments::save_snapshot(const std::string& body)
+		{
+			std::string frame;
+			put_u32(frame, body.size());
+			put_u32(frame, checksum(body.data(), body.size()));
+			frame += body;
+
+			replace_file(snapshot_path(), frame);
+		}
+
+		boost::optional<std::string> Segments::load_snapshot() const
+		{
+			if(!fs::exists(snapshot_path()))
+				return boost::none;
+
+			std::ifstream in(snapshot_path().string(), std::ios::binary);
+			const std::string data{std::istreambuf_iterator<char>(in),
+				std::istreambuf_iterator<char>()};
+
+			if(data.size() < frame_size
+					|| data.size() - frame_size != get_u32(data.data()))
+				throw exceptions::corrupt_record(snapshot_path().string(), 0, "bad snapshot length");
+
+			if(checksum(data.data() + frame_size, data.size() - frame_size) != get_u32(data.data() + 4))
+				throw exceptions::corrupt_record(snapshot_path().string(), 0, "checksum mismatch");
+
+			return data.substr(frame_size);
+		}
+
+		fs::path Segments::directory() const
+		{
+			return dir_;
+		}
+
+		fs::path Segments::segment_path(uint32_t segment) const
+		{
+			return dir_ / boost::str(boost::format("%010u.seg") % segment);
+		}
+
+		fs::path Segments::snapshot_path() const
+		{
+			return dir_ / "snapshot";
+		}
+
+		std::vector<uint32_t> Segments::segments() const
+		{
+			std::vector<uint32_t> found;
+
+			fs::directory_iterator end;
+			for(fs::directory_iterator it(dir_); it != end; ++it)
+			{
+				const fs::path name = it->path().filename();
+				if(name.extension() == ".seg" && fs::is_regular_file(it->status()))
+				{
+					try
+					{
+						found.push_back(std::stoul(name.stem().string()));
+					}
+					catch(const std::logic_error&)
+					{
+						BOOST_LOG_TRIVIAL(warning) << "Ignoring unexpected file in log directory: " << name;
+					}
+				}
+			}
+
+			std::sort(found.begin(), found.end());
+			return found;
+		}
+
+		uint32_t Segments::checksum(const char* data, std::size_t size)
+		{
+			boost::crc_32_type crc;
+			crc.process_bytes(data, size);
+			return crc.checksum();
+		}
+
+		void Segments::open_active(uint32_t segment, bool create)
+		{
+			if(fd_ != -1)
+				::close(fd_);
+
+			fd_ = -1;
+			const fs::path path = segment_path(segment);
+
+			fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+			if(fd_ == -1)
+				throw exceptions::log_io("Unable to open log segment " + path.string(), errno);
+
+			active_ = segment;
+
+			if(create)
+			{
+				write_all(segment_magic, header_size);
+				active_size_ = header_size;
+				//Make sure the new segment's directory entry survives a crash
+				sync_directory();
+			}
+			else
+				active_size_ = fs::file_size(path);
+		}
+
+		void Segments::roll()
+		{
+			BOOST_LOG_TRIVIAL(info) << "Rolling raft log to segment " << active_ + 1;
+			//Records in the old segment must be durable before any in the new one
+			sync();
+			open_active(active_ + 1, true);
+		}
+
+		void Segments::write_all(const char* data, std::size_t size)
+		{
+			while(size > 0)
+			{
+				ssize_t written = ::write(fd_, data, size);
+				if(written < 0)
+				{
+					if(errno == EINTR)
+						continue;
+					failed_ = true;
+					throw exceptions::log_io("Write to log segment failed", errno);
+				}
+
+				data += written;
+				size -= written;
+			}
+		}
+
+		void Segments::check_usable() const
+		{
+			if(failed_)
+				throw exceptions::log_io("Raft log segment " + segment_path(active_).string()
+						+ " failed earlier", EIO);
+		}
+
+		std::size_t Segments::read_at(char* data, std::size_t size, uint64_t offset) const
+		{
+			std::size_t done = 0;
+			while(done < size)
+			{
+				ssize_t result = ::pread(read_fd_, data + done, size - done, offset + done);
+				if(result < 0)
+				{
+					if(errno == EINTR)
+						continue;
+					throw exceptions::log_io("Read from log segment failed", errno);
+				}
+				if(result == 0)
+					break;
+
+				done += result;
+			}
+
+			return done;
+		}
+
+		void Segments::sync_directory() const
+		{
+			::sync_directory(dir_);
+		}
+	}
+}
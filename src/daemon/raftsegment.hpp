@@ -0,0 +1,290 @@
+#pragma once
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+
+namespace raft
+{
+	namespace log
+	{
+		//! The kinds of record stored in the binary Raft log.
+		enum record_type : uint8_t
+		{
+			entry_record = 1, //!< A raft::log::LogEntry
+			term_record = 2, //!< A raft::log::NewTerm
+			vote_record = 3, //!< A raft::log::Vote
+			commit_record = 4, //!< A raft::log::CommitMarker
+			snapshot_record = 5 //!< A raft::log::Snapshot
+		};
+
+		//! How hard the log works to make records durable.
+		enum durability
+		{
+			durability_none, //!< Records are written but never explicitly synced
+			durability_batched, //!< Records are buffered and synced as a group
+			durability_per_entry //!< Every record is written and synced on its own
+		};
+
+		//! The position of a record in the segmented log.
+		struct record_location
+		{
+			//! The sequence number of the segment holding the record
+			uint32_t segment;
+
+			//! The byte offset of the record's frame within its segment
+			uint64_t offset;
+		};
+
+		//! A record body within a mapped segment, and where it came from.
+		struct record_view
+		{
+			const char* data;
+			std::size_t size;
+			record_location location;
+		};
+
+		//! Run f over [0, count) split into contiguous chunks on up to threads
+		//! threads.
+		/*!
+		 *  f is called with the bounds of each chunk. Small counts run on the
+		 *  calling thread. The first exception thrown by f is rethrown once
+		 *  every chunk is done.
+		 */
+		void parallel_for(std::size_t count, unsigned threads,
+				const std::function<void (std::size_t, std::size_t)>& f);
+
+		//! Builds the body of a binary log record.
+		/*!
+		 *  Integers are stored little-endian; strings are stored as a 32-bit
+		 *  length followed by their bytes.
+		 */
+		class record_writer
+		{
+		public:
+			explicit record_writer(record_type type);
+
+			record_writer& u32(uint32_t value);
+			record_writer& str(const std::string& value);
+
+			//! Appends value without a length prefix; it runs to the end of the
+			//! record.
+			record_writer& rest(const std::string& value);
+
+			const std::string& body() const;
+
+		protected:
+			std::string body_;
+		};
+
+		//! Reads back a record body built by record_writer, throwing if it's too
+		//! short.
+		class record_reader
+		{
+		public:
+			record_reader(const char* data, std::size_t size);
+			explicit record_reader(const std::string& body);
+
+			record_type type() const;
+
+			uint32_t u32();
+			std::string str();
+			std::string rest();
+
+		protected:
+			const char* data_;
+			std::size_t size_;
+			std::size_t pos_;
+
+			void require(std::size_t count) const;
+		};
+
+		namespace exceptions
+		{
+			//! Exception thrown when the operating system fails a log operation
+			struct log_io : std::runtime_error
+			{
+				log_io(const std::string& what, int err);
+			};
+
+			//! Exception thrown when a record fails its checksum or framing away
+			//! from the tail of the log.
+			struct corrupt_record : std::runtime_error
+			{
+				corrupt_record(const std::string& segment, uint64_t offset, const std::string& what);
+			};
+		}
+
+		//! Atomically and durably replace the file at path with data.
+		/*!
+		 *  data is written to a scratch file beside path and synced, then the
+		 *  scratch file is renamed over path and the directory synced, so after
+		 *  a crash path holds either all of the old contents or all of the new.
+		 *
+		 *  Throws exceptions::log_io if any step fails.
+		 */
+		void replace_file(const boost::filesystem::path& path, const std::string& data);
+
+		//! Manages a directory of append-only segment files.
+		/*!
+		 *  Each segment starts with a short magic header followed by framed
+		 *  records: a 32-bit body length, a CRC-32 of the body and then the body
+		 *  itself. Segments are rolled once they grow past the requested size and
+		 *  are named by their sequence number so that a directory listing gives
+		 *  their order.
+		 *
+		 *  Appends are buffered in memory: nothing reaches the file until flush()
+		 *  or sync() is called, so a group of records costs one write.
+		 *
+		 *  Once a write or sync of the active segment fails, what reached the
+		 *  disk is unknown, so every later append, flush or sync throws
+		 *  exceptions::log_io rather than build on it.
+		 */
+		class Segments
+		{
+		public:
+			//! The callback used to replay the log: the record body and its location.
+			typedef std::function<void (const std::string&, const record_location&)> replay_type;
+
+			//! The callback used to replay the log a segment at a time.
+			/*!
+			 *  The views point into the mapped segment and are only valid for
+			 *  the duration of the call.
+			 */
+			typedef std::function<void (const std::vector<record_view>&)> batch_replay_type;
+
+			//! Open (creating if needed) the segment directory dir.
+			/*!
+			 *  \param dir The directory holding the segments
+			 *  \param segment_size The size after which the active segment is rolled
+			 */
+			Segments(const boost::filesystem::path& dir, uint64_t segment_size);
+
+			~Segments();
+
+			Segments(const Segments&) = delete;
+			Segments& operator=(const Segments&) = delete;
+
+			//! Replay each record in order, then open the last segment for appends.
+			/*!
+			 *  A torn or corrupt record at the very end of the last segment is the
+			 *  signature of a crash mid-write: it is truncated with a warning.
+			 *  Corruption anywhere else throws exceptions::corrupt_record.
+			 */
+			void replay(const replay_type& f);
+
+			//! Replay the records of each segment in a batch.
+			/*!
+			 *  Each segment is memory-mapped and split on its frames, then the
+			 *  checksums are verified on up to threads threads. Torn and corrupt
+			 *  records are handled as they are by replay(const replay_type&).
+			 */
+			void replay_batches(const batch_replay_type& f, unsigned threads);
+
+			//! Frame and buffer a record body, returning where it will be written.
+			record_location append(const std::string& body);
+
+			//! Read back the body of the record at location.
+			/*!
+			 *  Records still buffered are read from the buffer. Throws
+			 *  exceptions::corrupt_record if the record fails its checksum.
+			 */
+			std::string read(const record_location& location) const;
+
+			//! Write any buffered records to the active segment in one write.
+			void flush();
+
+			//! Flush, then fdatasync the active segment.
+			void sync();
+
+			//! True if there are buffered records that haven't been written.
+			bool buffered() const;
+
+			//! True once a write or sync has failed; see the class description.
+			bool failed() const;
+
+			//! Sync the active segment and start appending to a new one.
+			void roll();
+
+			//! The sequence number of the segment being appended to.
+			uint32_t active() const;
+
+			//! Delete every segment before the given one.
+			/*!
+			 *  The active segment is never deleted.
+			 */
+			void discard_before(uint32_t segment);
+
+			//! Atomically replace the snapshot stored alongside the segments.
+			/*!
+			 *  The snapshot is framed like a record and written to a scratch file
+			 *  that's synced and renamed into place.
+			 */
+			void save_snapshot(const std::string& body);
+
+			//! Read back the body of the stored snapshot, if there is one.
+			/*!
+			 *  Throws exceptions::corrupt_record if it fails its checksum.
+			 */
+			boost::optional<std::string> load_snapshot() const;
+
+			//! The segment directory
+			boost::filesystem::path directory() const;
+
+			//! The path to the segment with the given sequence number
+			boost::filesystem::path segment_path(uint32_t segment) const;
+
+			//! The path to the stored snapshot
+			boost::filesystem::path snapshot_path() const;
+
+			//! The sequence numbers of the segments on disk, in order.
+			std::vector<uint32_t> segments() const;
+
+			//! The number of bytes in a segment header
+			static const uint64_t header_size;
+
+			//! The number of bytes preceding each record body
+			static const uint64_t frame_size;
+
+			//! Compute the record checksum of size bytes at data
+			static uint32_t checksum(const char* data, std::size_t size);
+
+		protected:
+			boost::filesystem::path dir_;
+			const uint64_t segment_size_;
+
+			//! The active segment's file descriptor, or -1 before replay
+			int fd_;
+			uint32_t active_;
+
+			//! The size of the active segment, including buffered records
+			uint64_t active_size_;
+
+			//! Framed records not yet written to the active segment
+			std::string buffer_;
+
+			//! Set when a write or sync fails
+			bool failed_;
+
+			//! A descriptor for random reads and the segment it's open on
+			mutable int read_fd_;
+			mutable uint32_t read_segment_;
+
+			void open_active(uint32_t segment, bool create);
+
+			//! Write to the active segment, marking the log failed on error.
+			void write_all(const char* data, std::size_t size);
+
+			//! Throw if the log has failed.
+			void check_usable() const;
+
+			//! pread into data from the read descriptor, returning the bytes
+			//! read; short only at the end of the file.
+			std::size_t read_at(char* data, std::size_t size, uint64_t offset) const;
+			void sync_directory() const;
+		};
+	}
+}
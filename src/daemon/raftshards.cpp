@@ -0,0 +1,256 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <functional>
+
+#include <boost/asio.hpp>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <boost/optional.hpp>
+#include <boost/filesystem.hpp>
+
+#include <json/json.h>
+#include <json_help.hpp>
+
+#include "raftrpc.hpp"
+#include "raftrequest.hpp"
+#include "raftclient.hpp"
+#include "raftstate.hpp"
+#include "dispatch.hpp"
+#include "raftctl.hpp"
+
+#include "raftshards.hpp"
+
+namespace raft
+{
+	constexpr Client::validity Shards::request_invalid;
+	constexpr Client::validity Shards::request_valid;
+	constexpr Client::validity Shards::request_done;
+
+	Shards::Shards(boost::asio::io_service& io, const std::string& id, uint32_t groups,
+			const factory_type& make_group, uint32_t balance_interval)
+		:io_(io),
+		id_(id),
+		balance_interval_(balance_interval),
+		balance_timer_(io_)
+	{
+		if(groups == 0)
+			throw std::logic_error("Need at least one raft group");
+
+		for(uint32_t index = 0; index < groups; ++index)
+		{
+			groups_.push_back(make_group(index));
+			Client& client = groups_.back()->client();
+
+			client.connect_commit_update([this](const request::Update& rpc) {commit_update_(rpc);});
+			client.connect_commit_rename([this](const request::Rename& rpc) {commit_rename_(rpc);});
+			client.connect_commit_delete([this](const request::Delete& rpc) {commit_delete_(rpc);});
+			client.connect_commit_add([this](const request::Add& rpc) {commit_add_(rpc);});
+			client.connect_restore(std::bind(&Shards::restore, this, index, std::placeholders::_1));
+		}
+
+		//With one group there's nothing to spread
+		if(balance_interval_ > 0 && groups_.size() > 1)
+			start_balance_timer();
+	}
+
+	uint32_t Shards::size() const
+	{
+		return groups_.size();
+	}
+
+	Controller& Shards::group(uint32_t index)
+	{
+		return *groups_.at(index);
+	}
+
+	const Controller& Shards::group(uint32_t index) const
+	{
+		return *groups_.at(index);
+	}
+
+	uint32_t Shards::group_of(const std::string& key) const
+	{
+		if(groups_.size() == 1)
+			return 0;
+
+		//FNV-1a, since every node has to agree on the hash
+		uint32_t hash = 2166136261u;
+		for(const char c : prefix(key))
+		{
+			hash ^= static_cast<unsigned char>(c);
+			hash *= 16777619u;
+		}
+
+		return hash % groups_.size();
+	}
+
+	std::string Shards::prefix(const std::string& key)
+	{
+		//The encoded path separator
+		static const std::string separator = "%2f";
+
+		const std::size_t start = key.compare(0, separator.size(), separator) == 0
+			? separator.size() : 0;
+		const std::size_t end = key.find(separator, start);
+
+		if(end == std::string::npos)
+			return std::string();
+
+		return key.substr(0, end);
+	}
+
+	bool Shards::colocated(const std::string& key, const std::string& other) const
+	{
+		return group_of(key) == group_of(other);
+	}
+
+	boost::optional<std::string> Shards::preferred_leader(uint32_t index) const
+	{
+		const std::set<std::string>& voters = group(index).state().configuration().voters();
+		if(voters.empty())
+			return boost::none;
+
+		//Voters are ordered, so every node agrees
+		return *std::next(voters.begin(), index % voters.size());
+	}
+
+	void Shards::balance()
+	{
+		for(uint32_t index = 0; index < groups_.size(); ++index)
+		{
+			Controller& controller = group(index);
+			if(controller.state().state() != State::leader_state)
+				continue;
+
+			const boost::optional<std::string> preferred = preferred_leader(index);
+			if(!preferred || *preferred == id_)
+				continue;
+
+			//Writes stall while a transfer's going, so don't start one that
+			//couldn't finish promptly
+			if(!controller.state().caught_up(*preferred))
+			{
+				BOOST_LOG_TRIVIAL(trace) << "Not balancing raft group " << index << ": "
+					<< *preferred << " isn't caught up";
+				continue;
+			}
+
+			//This does nothing while a transfer or membership change is going on
+			const bool started = controller.transfer_leadership(preferred,
+					[index, preferred](bool transferred)
+					{
+						if(transferred)
+							BOOST_LOG_TRIVIAL(info) << "Handed leadership of raft group " << index
+								<< " to " << *preferred;
+						else
+							BOOST_LOG_TRIVIAL(info) << "Couldn't hand leadership of raft group "
+								<< index << " to " << *preferred;
+					});
+
+			if(started)
+				BOOST_LOG_TRIVIAL(info) << "Balancing raft leaders: handing group " << index
+					<< " to " << *preferred;
+		}
+	}
+
+	bool Shards::transfer_leadership(const boost::optional<std::string>& to,
+			const std::function<void (bool)>& done)
+	{
+		//The transfers still going, and whether they've all succeeded
+		auto outstanding = std::make_shared<std::tuple<uint32_t, bool>>(0, true);
+
+		for(auto& controller : groups_)
+		{
+			//done is posted, so none finish before they've all been started
+			const bool started = controller->transfer_leadership(to,
+					[outstanding, done](bool transferred)
+					{
+						std::get<1>(*outstanding) = std::get<1>(*outstanding) && transferred;
+						if(--std::get<0>(*outstanding) == 0)
+							done(std::get<1>(*outstanding));
+					});
+
+			if(started)
+				++std::get<0>(*outstanding);
+		}
+
+		return std::get<0>(*outstanding) > 0;
+	}
+
+	void Shards::request(const request::Rename& request)
+	{
+		if(colocated(request.key(), request.new_key()))
+			client_of(request.key()).request(request);
+		else
+			BOOST_LOG_TRIVIAL(warning) << "Dropping rename between raft groups: " << request;
+	}
+
+	Client::validity Shards::valid(const request::Rename& request) const noexcept
+	{
+		if(!colocated(request.key(), request.new_key()))
+			return request_invalid;
+
+		return client_of(request.key()).valid(request);
+	}
+
+	bool Shards::exists(const std::string& key) const noexcept
+	{
+		return client_of(key).exists(key);
+	}
+
+	void Shards::read(const std::string& key, const Client::read_type& f)
+	{
+		client_of(key).read(key, f);
+	}
+
+	std::tuple<std::string, std::string> Shards::operator [](const std::string& key) noexcept(false)
+	{
+		return client_of(key)[key];
+	}
+
+	Client& Shards::client_of(const std::string& key)
+	{
+		return groups_[group_of(key)]->client();
+	}
+
+	const Client& Shards::client_of(const std::string& key) const
+	{
+		return groups_[group_of(key)]->client();
+	}
+
+	void Shards::restore(uint32_t index, const Client::restore_map_type& versions)
+	{
+		Client::restore_map_type all(versions);
+		for(uint32_t other = 0; other < groups_.size(); ++other)
+		{
+			if(other == index)
+				continue;
+
+			const Json::Value snapshot = groups_[other]->client().snapshot();
+			for(auto it = snapshot.begin(); it != snapshot.end(); ++it)
+				all[it.key().asString()] = std::make_tuple((*it)[0].asString(), (*it)[1].asString());
+		}
+
+		restore_(all);
+	}
+
+	void Shards::start_balance_timer()
+	{
+		balance_timer_.expires_from_now(boost::posix_time::milliseconds(balance_interval_));
+		balance_timer_.async_wait([this](const boost::system::error_code& ec)
+				{
+					if(!ec)
+						balance();
+					else if(ec != boost::asio::error::operation_aborted)
+						BOOST_LOG_TRIVIAL(error) << "Timer for raft balancing failed: "
+							<< ec.message();
+
+					if(ec != boost::asio::error::operation_aborted)
+						start_balance_timer();
+				});
+	}
+}
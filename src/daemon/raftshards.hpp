@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <functional>
+
+#include <boost/asio.hpp>
+#include <boost/optional.hpp>
+#include <boost/signals2.hpp>
+
+#include "dispatch.hpp"
+#include "raftrequest.hpp"
+#include "raftstate.hpp"
+#include "raftclient.hpp"
+#include "raftctl.hpp"
+
+namespace raft
+{
+	//! Shards the key space across several raft groups.
+	/*!
+	 *  Each group is a raft::Controller with its own log, leader and
+	 *  dispatch group, so writes to keys in different groups are replicated
+	 *  independently. Keys are paths as encoded by craven::encode_path; a
+	 *  key belongs to the group its top-level directory hashes to, and
+	 *  files in the root directory share a group. Renames within a
+	 *  top-level directory stay in one group; those that would move a key
+	 *  to another group are refused, like a rename across devices.
+	 *
+	 *  This presents the raft::Client interface, routing each request to the
+	 *  group that owns its key.
+	 */
+	class Shards
+	{
+	public:
+		//! Makes the controller for a group
+		typedef std::function<std::unique_ptr<Controller> (uint32_t group)> factory_type;
+
+		//! Construct the groups
+		/*!
+		 *  \param io The process' io_service, used for the balancing timer
+		 *  \param id The ID of this node
+		 *  \param groups The number of raft groups; every node must agree
+		 *  \param make_group Called for each group, in order, to make its
+		 *  controller
+		 *  \param balance_interval The milliseconds between checks that this
+		 *  node only leads the groups it's preferred for; 0 disables them,
+		 *  as does having a single group.
+		 */
+		Shards(boost::asio::io_service& io, const std::string& id, uint32_t groups,
+				const factory_type& make_group, uint32_t balance_interval = 0);
+
+		Shards(const Shards&) = delete;
+		Shards& operator=(const Shards&) = delete;
+
+		//! The number of groups
+		uint32_t size() const;
+
+		//! Retrieve a group's controller
+		Controller& group(uint32_t index);
+		//! \overload
+		const Controller& group(uint32_t index) const;
+
+		//! The group that owns key
+		uint32_t group_of(const std::string& key) const;
+
+		//! The part of key that decides its group: its top-level directory,
+		//! or the empty string for files in the root directory.
+		static std::string prefix(const std::string& key);
+
+		//! True if both keys belong to the same group, so one can be renamed
+		//! to the other
+		bool colocated(const std::string& key, const std::string& other) const;
+
+		//! The node that should lead group, given its voters
+		boost::optional<std::string> preferred_leader(uint32_t group) const;
+
+		//! Hands the leadership of every group this node leads that another
+		//! node is preferred for to that node, if it's caught up.
+		void balance();
+
+		//! Hands over the leadership of every group this node leads.
+		/*!
+		 *  See Controller::transfer_leadership; done is called with true
+		 *  once every transfer has finished, or false if any failed.
+		 *
+		 *  \returns false if no transfer could be started
+		 */
+		bool transfer_leadership(const boost::optional<std::string>& to,
+				const std::function<void (bool)>& done);
+
+		//! Make a request of the group owning its key; see Client::request.
+		template <typename Derived>
+		void request(const Derived& request)
+		{
+			client_of(request.key()).request(request);
+		}
+
+		//! \overload
+		/*!
+		 *  Renames between groups are dropped.
+		 */
+		void request(const request::Rename& request);
+
+		//! Checks if a request is valid; see Client::valid.
+		template <typename Derived>
+		Client::validity valid(const Derived& request) const noexcept
+		{
+			return client_of(request.key()).valid(request);
+		}
+
+		//! \overload
+		/*!
+		 *  Renames between groups are never valid.
+		 */
+		Client::validity valid(const request::Rename& request) const noexcept;
+
+		static constexpr Client::validity request_invalid = Client::request_invalid;
+		static constexpr Client::validity request_valid = Client::request_valid;
+		static constexpr Client::validity request_done = Client::request_done;
+
+		//! Check that a key exists.
+		bool exists(const std::string& key) const noexcept;
+
+		//! Read the latest committed version of key; see Client::read.
+		void read(const std::string& key, const Client::read_type& f);
+
+		//! Access the last version for key, throwing if it does not exist.
+		std::tuple<std::string, std::string> operator [](const std::string& key) noexcept(false);
+
+		//! Connect a function to be called on commit of a new Update in any
+		//! group
+		template <typename Callable>
+		boost::signals2::connection connect_commit_update(Callable&& f)
+		{
+			return commit_update_.connect(std::forward<Callable>(f));
+		}
+
+		//! Connect a function to be called on commit of a new Rename in any
+		//! group
+		template <typename Callable>
+		boost::signals2::connection connect_commit_rename(Callable&& f)
+		{
+			return commit_rename_.connect(std::forward<Callable>(f));
+		}
+
+		//! Connect a function to be called on commit of a new Delete in any
+		//! group
+		template <typename Callable>
+		boost::signals2::connection connect_commit_delete(Callable&& f)
+		{
+			return commit_delete_.connect(std::forward<Callable>(f));
+		}
+
+		//! Connect a function to be called on commit of a new Add in any
+		//! group
+		template <typename Callable>
+		boost::signals2::connection connect_commit_add(Callable&& f)
+		{
+			return commit_add_.connect(std::forward<Callable>(f));
+		}
+
+		//! Connect a function to be called when a snapshot replaces a group's
+		//! versions
+		/*!
+		 *  The map passed holds every group's committed versions, not just
+		 *  those restored, so it can replace them all.
+		 *
+		 *  \param f A callable of function signature void (const
+		 *  Client::restore_map_type& versions)
+		 */
+		template <typename Callable>
+		boost::signals2::connection connect_restore(Callable&& f)
+		{
+			return restore_.connect(std::forward<Callable>(f));
+		}
+
+		//! Connect a function to be called when any group's membership
+		//! changes
+		template <typename Callable>
+		void connect_configuration(Callable&& f)
+		{
+			for(auto& group : groups_)
+				group->connect_configuration(f);
+		}
+
+	protected:
+		boost::asio::io_service& io_;
+		std::string id_;
+		std::vector<std::unique_ptr<Controller>> groups_;
+
+		const uint32_t balance_interval_;
+		boost::asio::deadline_timer balance_timer_;
+
+		boost::signals2::signal<void (const request::Update&)> commit_update_;
+		boost::signals2::signal<void (const request::Rename&)> commit_rename_;
+		boost::signals2::signal<void (const request::Delete&)> commit_delete_;
+		boost::signals2::signal<void (const request::Add&)> commit_add_;
+		boost::signals2::signal<void (const Client::restore_map_type&)> restore_;
+
+		Client& client_of(const std::string& key);
+		const Client& client_of(const std::string& key) const;
+
+		//! Passes on a group's restore with the other groups' versions added
+		void restore(uint32_t group, const Client::restore_map_type& versions);
+
+		void start_balance_timer();
+	};
+}
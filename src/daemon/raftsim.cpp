@@ -0,0 +1,388 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <json/json.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+
+#include "raftrpc.hpp"
+#include "raftstate.hpp"
+#include "raftsim.hpp"
+
+namespace fs = boost::filesystem;
+
+raft::Simulation::Options::Options()
+	:min_latency(std::chrono::milliseconds(1)),
+	max_latency(std::chrono::milliseconds(5)),
+	loss(0),
+	heartbeat(std::chrono::milliseconds(50)),
+	min_election(std::chrono::milliseconds(150)),
+	max_election(std::chrono::milliseconds(300)),
+	seed(1),
+	pre_vote(true)
+{
+}
+
+double raft::Simulation::Stats::commits_per_second() const
+{
+	const double seconds = std::chrono::duration<double>(elapsed).count();
+	return seconds > 0 ? committed / seconds : 0;
+}
+
+raft::Simulation::duration raft::Simulation::Stats::latency_percentile(double p) const
+{
+	if(latencies.empty())
+		return duration::zero();
+
+	std::vector<duration> sorted(latencies);
+	std::sort(sorted.begin(), sorted.end());
+
+	const std::size_t index = std::min(sorted.size() - 1,
+			static_cast<std::size_t>(p * sorted.size()));
+	return sorted[index];
+}
+
+bool raft::Simulation::Event::operator<(const Event& other) const
+{
+	//priority_queue puts the greatest first
+	if(at != other.at)
+		return at > other.at;
+
+	return seq > other.seq;
+}
+
+raft::Simulation::Simulation(const std::vector<std::string>& ids, const Options& options)
+	:options_(options),
+	gen_(options.seed),
+	scratch_(fs::temp_directory_path() / fs::unique_path("raftsim-%%%%-%%%%-%%%%")),
+	now_(),
+	next_seq_(0),
+	next_proposal_(0),
+	stats_start_(now_),
+	leader_term_(0)
+{
+	fs::create_directories(scratch_);
+
+	for(const std::string& id : ids)
+	{
+		std::vector<std::string> others;
+		std::copy_if(ids.begin(), ids.end(), std::back_inserter(others),
+				[&id](const std::string& other) {return other != id;});
+
+		//The state keeps a reference to its handlers, so they go first
+		Node& node = nodes_[id];
+		node.id = id;
+		node.timer_generation = 0;
+		node.group = 0;
+		node.handlers.reset(new State::Handlers(make_handlers(id)));
+		State::Options options;
+		options.log.durability = raft::log::durability_none;
+		options.pre_vote = options_.pre_vote;
+		node.state.reset(new State(id, others, (scratch_ / id).string(), *node.handlers,
+					options));
+	}
+}
+
+raft::Simulation::~Simulation()
+{
+	//Close the logs before removing them
+	nodes_.clear();
+
+	boost::system::error_code ec;
+	fs::remove_all(scratch_, ec);
+}
+
+raft::Simulation::time_point raft::Simulation::now() const
+{
+	return now_;
+}
+
+void raft::Simulation::run(duration length)
+{
+	run_until([]() {return false;}, length);
+}
+
+bool raft::Simulation::run_until(const std::function<bool ()>& f, duration length)
+{
+	const time_point end = now_ + length;
+	while(!events_.empty() && events_.top().at <= end)
+	{
+		step();
+		if(f())
+			return true;
+	}
+
+	if(!leader())
+		stats_.downtime += end - now_;
+	now_ = end;
+	stats_.elapsed = now_ - stats_start_;
+
+	return f();
+}
+
+void raft::Simulation::load(duration length, uint32_t proposals_per_second)
+{
+	if(proposals_per_second > 0)
+	{
+		const duration interval = std::chrono::duration_cast<duration>(
+				std::chrono::seconds(1)) / proposals_per_second;
+		for(duration at = duration::zero(); at < length; at += interval)
+			schedule(at, [this]() {propose();});
+	}
+
+	run(length);
+}
+
+bool raft::Simulation::propose()
+{
+	++stats_.proposed;
+
+	boost::optional<std::string> id = leader();
+	if(!id)
+		return false;
+
+	const int64_t proposal = next_proposal_++;
+	try
+	{
+		node(*id).append(std::vector<Json::Value>{Json::Value(static_cast<Json::Int64>(proposal))});
+	}
+	catch(const std::logic_error&)
+	{
+		//Handing over leadership
+		return false;
+	}
+
+	++stats_.accepted;
+	pending_[proposal] = now_;
+	return true;
+}
+
+void raft::Simulation::partition(const std::vector<std::vector<std::string>>& groups)
+{
+	uint32_t group = 0;
+	for(auto& node : nodes_)
+		node.second.group = ++group;
+
+	for(const auto& members : groups)
+	{
+		++group;
+		for(const std::string& id : members)
+			nodes_.at(id).group = group;
+	}
+}
+
+void raft::Simulation::heal()
+{
+	for(auto& node : nodes_)
+		node.second.group = 0;
+}
+
+void raft::Simulation::loss(double chance)
+{
+	options_.loss = chance;
+}
+
+boost::optional<std::string> raft::Simulation::leader() const
+{
+	boost::optional<std::string> ret;
+	uint32_t term = 0;
+	for(const auto& node : nodes_)
+	{
+		const State& state = *node.second.state;
+		if(state.state() != State::leader_state || (ret && state.term() <= term))
+			continue;
+
+		//A leader cut off from a majority can't commit anything
+		const uint32_t group = node.second.group;
+		const auto reachable = std::count_if(nodes_.begin(), nodes_.end(),
+				[group](const std::pair<const std::string, Node>& other)
+				{
+					return other.second.group == group;
+				});
+
+		if(static_cast<std::size_t>(reachable) * 2 > nodes_.size())
+		{
+			ret = node.first;
+			term = state.term();
+		}
+	}
+
+	return ret;
+}
+
+raft::State& raft::Simulation::node(const std::string& id)
+{
+	return *nodes_.at(id).state;
+}
+
+const raft::Simulation::Stats& raft::Simulation::stats() const
+{
+	return stats_;
+}
+
+void raft::Simulation::reset_stats()
+{
+	stats_ = Stats();
+	stats_start_ = now_;
+	pending_.clear();
+}
+
+raft::State::Handlers raft::Simulation::make_handlers(const std::string& id)
+{
+	return State::Handlers(
+			[this, id](const std::string& to, const raft::rpc::append_entries& rpc)
+			{
+				send(id, to, [this, id, to, rpc](State& state)
+						{
+							auto ret = state.append_entries(rpc);
+							raft::rpc::append_entries_response response(rpc, std::get<0>(ret),
+									std::get<1>(ret), std::get<2>(ret), std::get<3>(ret));
+							send(to, id, [to, response](State& leader)
+									{
+										leader.append_entries_response(to, response);
+									});
+						});
+			},
+			[this, id](const std::string& to, const raft::rpc::request_vote& rpc)
+			{
+				send(id, to, [this, id, to, rpc](State& state)
+						{
+							auto ret = state.request_vote(rpc);
+							raft::rpc::request_vote_response response(rpc, std::get<0>(ret),
+									std::get<1>(ret));
+							send(to, id, [to, response](State& candidate)
+									{
+										candidate.request_vote_response(to, response);
+									});
+						});
+			},
+			[this, id](State::Handlers::timeout_length length)
+			{
+				set_timer(id, length);
+			},
+			std::bind(&Simulation::applied, this, std::placeholders::_1),
+			//Logs aren't synced and snapshots aren't taken
+			nullptr, nullptr, nullptr, nullptr,
+			[this, id](const std::string& to, const raft::rpc::read_index& rpc)
+			{
+				send(id, to, [this, id, to, rpc](State& state)
+						{
+							state.read_index(rpc, [this, id, to](const raft::rpc::read_index_response& response)
+									{
+										send(to, id, [to, response](State& follower)
+												{
+													follower.read_index_response(to, response);
+												});
+									});
+						});
+			},
+			[this]()
+			{
+				return now_;
+			},
+			[this, id](const std::string& to, const raft::rpc::timeout_now& rpc)
+			{
+				send(id, to, [rpc](State& state)
+						{
+							state.timeout_now(rpc);
+						});
+			},
+			nullptr,
+			//Commits from the same event share a notification, as in Controller
+			[this, id]()
+			{
+				schedule(duration::zero(), [this, id]()
+						{
+							node(id).notify_commit();
+						});
+			});
+}
+
+void raft::Simulation::schedule(duration delay, const std::function<void ()>& f)
+{
+	events_.push(Event{now_ + delay, next_seq_++, f});
+}
+
+void raft::Simulation::send(const std::string& from, const std::string& to,
+		const std::function<void (State&)>& f)
+{
+	if(!nodes_.count(to) || nodes_.at(from).group != nodes_.at(to).group)
+		return;
+
+	if(options_.loss > 0 && std::uniform_real_distribution<double>()(gen_) < options_.loss)
+		return;
+
+	schedule(between(options_.min_latency, options_.max_latency), [this, from, to, f]()
+			{
+				//Messages in flight when the network splits are lost too
+				if(nodes_.at(from).group == nodes_.at(to).group)
+					f(node(to));
+			});
+}
+
+void raft::Simulation::set_timer(const std::string& id, State::Handlers::timeout_length length)
+{
+	Node& node = nodes_.at(id);
+	const uint64_t generation = ++node.timer_generation;
+
+	const duration delay = length == State::Handlers::leader_timeout ? options_.heartbeat
+		: between(options_.min_election, options_.max_election);
+
+	schedule(delay, [this, id, generation]()
+			{
+				Node& node = nodes_.at(id);
+				if(node.timer_generation == generation)
+					node.state->timeout();
+			});
+}
+
+void raft::Simulation::applied(const Json::Value& action)
+{
+	if(!action.isIntegral())
+		return;
+
+	//The first node to apply a proposal shows it's committed
+	auto it = pending_.find(action.asInt64());
+	if(it == pending_.end())
+		return;
+
+	stats_.latencies.push_back(now_ - it->second);
+	++stats_.committed;
+	pending_.erase(it);
+}
+
+void raft::Simulation::step()
+{
+	Event event = events_.top();
+	events_.pop();
+
+	if(!leader())
+		stats_.downtime += event.at - now_;
+	now_ = event.at;
+
+	event.run();
+
+	boost::optional<std::string> current = leader();
+	if(current && node(*current).term() != leader_term_)
+	{
+		leader_term_ = node(*current).term();
+		BOOST_LOG_TRIVIAL(debug) << "Simulated node " << *current << " leads term " << leader_term_;
+		++stats_.elections;
+	}
+	stats_.elapsed = now_ - stats_start_;
+}
+
+raft::Simulation::duration raft::Simulation::between(duration min, duration max)
+{
+	if(max <= min)
+		return min;
+
+	std::uniform_int_distribution<duration::rep> dist(min.count(), max.count());
+	return duration(dist(gen_));
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <functional>
+
+#include <boost/filesystem.hpp>
+
+#include "raftstate.hpp"
+
+namespace raft
+{
+	//! Runs several raft::State instances in one process over a simulated
+	//! network, in virtual time.
+	/*!
+	 *  Every RPC, timeout and client proposal is an event on a single queue
+	 *  ordered by virtual time, and every random choice comes from one
+	 *  seeded generator, so a run with the same seed and faults always plays
+	 *  out the same way. Nothing waits on the wall clock, so minutes of
+	 *  cluster time take a fraction of a second.
+	 *
+	 *  Messages are delayed by a uniformly distributed latency, may be lost,
+	 *  and are only delivered within a partition. Logs are written to a
+	 *  scratch directory without syncing, which is removed on destruction.
+	 */
+	class Simulation
+	{
+	public:
+		typedef std::chrono::steady_clock::duration duration;
+		typedef std::chrono::steady_clock::time_point time_point;
+
+		//! The simulated network and timers
+		struct Options
+		{
+			//! 1--5ms latency, no loss, 50ms heartbeats and 150--300ms
+			//! election timeouts, with pre-vote
+			Options();
+
+			//! The fastest and slowest a message is delivered
+			duration min_latency, max_latency;
+
+			//! The chance each message is lost
+			double loss;
+
+			//! The interval between a leader's heartbeats
+			duration heartbeat;
+
+			//! The range election timeouts are drawn from
+			duration min_election, max_election;
+
+			uint32_t seed;
+			bool pre_vote;
+		};
+
+		//! What's been measured since the simulation started, or since the
+		//! last reset_stats()
+		struct Stats
+		{
+			//! Virtual time covered
+			duration elapsed{};
+
+			//! Proposals made, and those that found a leader to take them
+			uint64_t proposed = 0;
+			uint64_t accepted = 0;
+
+			//! Proposals applied on any node
+			uint64_t committed = 0;
+
+			//! From each accepted proposal to its first application, in the
+			//! order they were applied
+			std::vector<duration> latencies;
+
+			//! The time with no leader
+			duration downtime{};
+
+			//! The number of terms in which a leader was elected
+			uint32_t elections = 0;
+
+			//! Committed proposals per second of virtual time
+			double commits_per_second() const;
+
+			//! The commit latency at or below which the fraction p of
+			//! latencies fall, or zero if nothing was committed
+			duration latency_percentile(double p) const;
+		};
+
+		//! Creates the cluster; every node starts as a follower.
+		Simulation(const std::vector<std::string>& ids, const Options& options = Options());
+		~Simulation();
+
+		Simulation(const Simulation&) = delete;
+		Simulation& operator=(const Simulation&) = delete;
+
+		//! The virtual time now
+		time_point now() const;
+
+		//! Runs events until the virtual time reaches now() + length.
+		void run(duration length);
+
+		//! Runs events until f returns true or length has passed.
+		/*!
+		 *  \returns the value of f when it stopped
+		 */
+		bool run_until(const std::function<bool ()>& f, duration length);
+
+		//! Makes proposals at a steady rate while running for length.
+		/*!
+		 *  Each goes to the current leader, if there is one; otherwise it's
+		 *  counted as proposed but not accepted.
+		 */
+		void load(duration length, uint32_t proposals_per_second);
+
+		//! Proposes one entry to the leader now.
+		/*!
+		 *  \returns false if there's no leader to take it
+		 */
+		bool propose();
+
+		//! Splits the network; nodes only hear from those in their group.
+		//! Nodes not named are put in a group of their own.
+		void partition(const std::vector<std::vector<std::string>>& groups);
+
+		//! Rejoins the network
+		void heal();
+
+		//! Changes the chance each message is lost
+		void loss(double chance);
+
+		//! The node leading with the highest term that can reach a majority
+		//! of the cluster, if any
+		boost::optional<std::string> leader() const;
+
+		State& node(const std::string& id);
+
+		const Stats& stats() const;
+
+		//! Starts measuring afresh, say once an initial election is over.
+		void reset_stats();
+
+	protected:
+		struct Event
+		{
+			time_point at;
+			uint64_t seq;
+			std::function<void ()> run;
+
+			//! Earliest first, then in the order they were scheduled
+			bool operator<(const Event& other) const;
+		};
+
+		struct Node
+		{
+			std::string id;
+			std::unique_ptr<State::Handlers> handlers;
+			std::unique_ptr<State> state;
+
+			//! Bumped to cancel the pending timeout when a new one's set
+			uint64_t timer_generation;
+
+			//! The network partition the node's in
+			uint32_t group;
+		};
+
+		Options options_;
+		std::mt19937 gen_;
+		boost::filesystem::path scratch_;
+
+		time_point now_;
+		uint64_t next_seq_;
+		std::priority_queue<Event> events_;
+
+		std::map<std::string, Node> nodes_;
+
+		//! Accepted proposals not yet applied, by their id
+		std::map<int64_t, time_point> pending_;
+		int64_t next_proposal_;
+
+		Stats stats_;
+		time_point stats_start_;
+
+		//! The term of the last leader seen
+		uint32_t leader_term_;
+
+		State::Handlers make_handlers(const std::string& id);
+
+		void schedule(duration delay, const std::function<void ()>& f);
+
+		//! Delivers f to the node to after a latency, unless the message is
+		//! lost or the nodes are partitioned.
+		void send(const std::string& from, const std::string& to,
+				const std::function<void (State&)>& f);
+
+		void set_timer(const std::string& id, State::Handlers::timeout_length length);
+
+		void applied(const Json::Value& action);
+
+		//! Runs the next event, accounting for the time with no leader
+		void step();
+
+		duration between(duration min, duration max);
+	};
+}
@@ -1,6 +1,7 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <algorithm>
 #include <functional>
 #include <fstream>
 
@@ -15,13 +16,28 @@
 #include "raftrpc.hpp"
 #include "raftstate.hpp"
 
+namespace fs = boost::filesystem;
+
 raft::State::Handlers::Handlers(const append_entries_type& append_entries,
 		const request_vote_type& request_vote, const timeout_type& request_timeout,
-		const commit_type& commit)
+		const commit_type& commit, const sync_type& request_sync,
+		const install_snapshot_type& install_snapshot, const snapshot_type& request_snapshot,
+		const restore_type& restore, const read_index_type& read_index,
+		const clock_type& now, const timeout_now_type& timeout_now,
+		const configure_type& configure, const notify_type& request_notify)
 	:append_entries_(append_entries),
 	request_vote_(request_vote),
 	request_timeout_(request_timeout),
-	commit_(commit)
+	commit_(commit),
+	request_sync_(request_sync),
+	install_snapshot_(install_snapshot),
+	request_snapshot_(request_snapshot),
+	restore_(restore),
+	read_index_(read_index),
+	now_(now),
+	timeout_now_(timeout_now),
+	configure_(configure),
+	request_notify_(request_notify)
 {
 }
 
@@ -45,34 +61,192 @@ void raft::State::Handlers::commit(const Json::Value& value)
 	commit_(value);
 }
 
+void raft::State::Handlers::request_sync()
+{
+	request_sync_();
+}
+
+bool raft::State::Handlers::syncs() const
+{
+	return static_cast<bool>(request_sync_);
+}
+
+void raft::State::Handlers::install_snapshot(const std::string& endpoint, const raft::rpc::install_snapshot& rpc)
+{
+	install_snapshot_(endpoint, rpc);
+}
+
+void raft::State::Handlers::request_snapshot(uint32_t index)
+{
+	request_snapshot_(index);
+}
+
+void raft::State::Handlers::restore(const Json::Value& state)
+{
+	restore_(state);
+}
+
+bool raft::State::Handlers::snapshots() const
+{
+	return install_snapshot_ && request_snapshot_ && restore_;
+}
+
+void raft::State::Handlers::read_index(const std::string& endpoint, const raft::rpc::read_index& rpc)
+{
+	read_index_(endpoint, rpc);
+}
+
+bool raft::State::Handlers::forwards_reads() const
+{
+	return static_cast<bool>(read_index_);
+}
+
+std::chrono::steady_clock::time_point raft::State::Handlers::now() const
+{
+	return now_ ? now_() : std::chrono::steady_clock::now();
+}
+
+void raft::State::Handlers::timeout_now(const std::string& endpoint, const raft::rpc::timeout_now& rpc)
+{
+	timeout_now_(endpoint, rpc);
+}
+
+bool raft::State::Handlers::transfers() const
+{
+	return static_cast<bool>(timeout_now_);
+}
+
+void raft::State::Handlers::configure(const raft::rpc::configuration& configuration)
+{
+	if(configure_)
+		configure_(configuration);
+}
+
+void raft::State::Handlers::request_notify()
+{
+	request_notify_();
+}
+
+bool raft::State::Handlers::notifies() const
+{
+	return static_cast<bool>(request_notify_);
+}
+
+const uint32_t raft::State::transfer_rounds;
+
+raft::State::Options::Options()
+	:transfer_limit(50),
+	snapshot_interval(0),
+	snapshot_chunk_size(64 * 1024),
+	pipeline_window(8),
+	lease_duration(0),
+	pre_vote(false),
+	checkpoint_interval(0)
+{
+}
+
 raft::State::State(const std::string& id, const std::vector<std::string>& nodes,
-		const std::string& log_file, State::Handlers& handlers,
-		uint32_t transfer_limit)
-	:transfer_limit_(transfer_limit),
+		const std::string& log_file, State::Handlers& handlers, const Options& options)
+	:transfer_limit_(std::max(1u, options.transfer_limit)),
+	pipeline_window_(std::max(1u, options.pipeline_window)),
+	snapshot_interval_(options.snapshot_interval),
+	checkpoint_interval_(options.checkpoint_interval),
+	snapshot_chunk_size_(options.snapshot_chunk_size),
+	lease_duration_(options.lease_duration),
+	pre_vote_(options.pre_vote),
 	id_(id),
 	nodes_(nodes),
-	log_(log_file, std::bind(&raft::State::term_update, this, std::placeholders::_1)),
+	base_configuration_index_(0),
+	membership_file_(log_file + ".members"),
+	log_(log_file, std::bind(&raft::State::term_update, this, std::placeholders::_1),
+			//Without a handler to batch with, the log syncs as it goes
+			handlers.syncs() ? std::bind(&Handlers::request_sync, &handlers)
+				: raft::Log::sync_handler_type(),
+			options.log),
 	state_(follower_state),
 	handlers_(handlers),
-	last_applied_(0)
+	last_applied_(0),
+	snapshot_requested_(false),
+	checkpoint_requested_(false),
+	checkpoint_index_(0),
+	checkpoint_file_(log_file + ".applied"),
+	incoming_snapshot_index_(0),
+	next_read_id_(0),
+	pre_voting_(false),
+	read_seq_(0),
+	transfer_rounds_(0)
 {
+	//Until the membership's been changed, it's as we were configured
+	std::set<std::string> voters(nodes.begin(), nodes.end());
+	voters.insert(id_);
+	for(const auto& learner : options.learners)
+		voters.erase(learner);
+	base_configuration_ = raft::rpc::configuration(voters,
+			{options.learners.begin(), options.learners.end()});
+
+	if(fs::exists(membership_file_))
+	{
+		std::ifstream in(membership_file_);
+		std::string line;
+		std::getline(in, line);
+		Json::Value root = json_help::parse(line);
+		base_configuration_index_ = json_help::checked_from_json<uint32_t>(root, "index",
+				"Bad raft membership file:");
+		base_configuration_ = raft::rpc::configuration(root["configuration"]);
+	}
+
+	//Configurations appended since the base are in force even before
+	//they're committed
+	for(uint32_t index = std::max(log_.snapshot_index(), base_configuration_index_) + 1;
+			index <= log_.last_index(); ++index)
+		record_configuration(index, log_[index].action());
+	update_configuration();
+
 	transition_follower();
+
+	if(log_.snapshot())
+	{
+		//Entries up to the snapshot are gone, so the state must come from it
+		if(handlers_.snapshots())
+			handlers_.restore(json_help::parse(log_.snapshot()->data()));
+		else
+			BOOST_LOG_TRIVIAL(error) << "Raft log has a snapshot but there's no handler to restore it";
+
+		last_applied_ = log_.snapshot_index();
+	}
+
+	restore_checkpoint();
+
 	commit_available();
 }
 
 void raft::State::timeout()
 {
-	if(follower_state == state_ || candidate_state == state_)
+	if(!voting(id_))
+		//Learners never stand; just wait for a leader
+		handlers_.request_timeout(State::Handlers::election_timeout);
+	else if(follower_state == state_ || candidate_state == state_)
 	{
-		BOOST_LOG_TRIVIAL(trace) << "Broadcasting candidacy for new election term.";
-		//update the term
-		log_.write(log_.term() + 1);
-		//Perform the transition (which will also ask for the timeout)
-		transition_candidate();
+		if(pre_vote_)
+			start_pre_vote();
+		else
+			start_election();
 	}
 	else
 	{
 		heartbeat();
+
+		if(transfer_target_)
+		{
+			if(--transfer_rounds_ == 0)
+			{
+				BOOST_LOG_TRIVIAL(warning) << "Abandoning leadership transfer to " << *transfer_target_;
+				end_transfer(false);
+			}
+			else
+				check_transfer();
+		}
+
 		handlers_.request_timeout(State::Handlers::leader_timeout);
 	}
 }
@@ -82,51 +256,19 @@ raft::State::Status raft::State::state() const
 	return state_;
 }
 
-std::tuple<uint32_t, bool> raft::State::append_entries(const raft::rpc::append_entries& rpc)
+std::tuple<uint32_t, bool, uint32_t, uint32_t> raft::State::append_entries(const raft::rpc::append_entries& rpc)
 {
 	//Stale
 	if(rpc.term() < log_.term())
 	{
 		BOOST_LOG_TRIVIAL(warning) << "Received stale append_entries request from " << rpc.leader_id();
-		return std::make_tuple(log_.term(), false);
+		return std::make_tuple(log_.term(), false, 0, 0);
 	}
 
-	//We need to become a follower -- our term <= their term
-	if(candidate_state == state_)
-	{
-		BOOST_LOG_TRIVIAL(info) << "Stepped down as candidate for term " << rpc.term()
-			<< " deferring to " << rpc.leader_id() << ".";
-
-		transition_follower();
-		//No term update -- leave that for the follower handling.
-
-	} // no else because we need to deal with this as a follower
-
-	//If later term, step down. Otherwise, log a warning (and step down).
-	if(leader_state == state_)
-	{
-		//Shouldn't happen
-		if(rpc.term() == log_.term())
-			BOOST_LOG_TRIVIAL(error) << "Two leaders for term " << rpc.term() << ": "
-				<< id_ << " and " << rpc.leader_id();
-
-		transition_follower();
-	}
+	follow(rpc.term(), rpc.leader_id());
 
 	if(follower_state == state_)
 	{
-		//Reset the timeout
-		handlers_.request_timeout(State::Handlers::election_timeout);
-
-		if(rpc.term() > log_.term())
-		{
-			raft::log::NewTerm nt(rpc.term());
-			log_.write(nt);
-		}
-
-		if(!leader_)
-			leader_ = rpc.leader_id();
-
 		//We've found the last consistent point in our log, so get adding.
 		if(log_.match(rpc.prev_log_term(), rpc.prev_log_index()))
 		{
@@ -134,16 +276,32 @@ std::tuple<uint32_t, bool> raft::State::append_entries(const raft::rpc::append_e
 			{
 				for(unsigned int i = 0; i < rpc.entries().size(); ++i)
 				{
-					std::tuple<uint32_t, Json::Value> entry = rpc.entries()[i];
+					//Indexes start from one after prev_log_index
+					const uint32_t index = i + 1 + rpc.prev_log_index();
+
+					//Anything in our snapshot is already committed
+					if(index <= log_.snapshot_index())
+						continue;
 
-					raft::log::LogEntry log_entry(log_.term(),
-							//Indexes start from one after prev_log_index
-							i + 1 + rpc.prev_log_index(),
+					const auto& entry = rpc.entries()[i];
+
+					//An entry we already have is the same one resent; rewriting
+					//it would drop those after it
+					if(index <= log_.last_index() && log_.match(std::get<0>(entry), index))
+						continue;
+
+					//Configurations past a conflict are going with the entries
+					if(index <= log_.last_index())
+						truncate_configurations(index);
+
+					raft::log::LogEntry log_entry(log_.term(), index,
 							std::get<0>(entry),
 							std::get<1>(entry));
 
 					log_.write(log_entry);
+					record_configuration(index, log_entry.action());
 				}
+				update_configuration();
 				BOOST_LOG_TRIVIAL(trace) << "Added " << rpc.entries().size() << " log entries from "
 					<< rpc.leader_id() << ".";
 			}
@@ -160,12 +318,22 @@ std::tuple<uint32_t, bool> raft::State::append_entries(const raft::rpc::append_e
 			}
 
 			//Success!
-			return std::make_tuple(log_.term(), true);
+			return std::make_tuple(log_.term(), true, 0, 0);
+		}
+		else if(rpc.prev_log_index() > log_.last_index())
+		{
+			BOOST_LOG_TRIVIAL(trace) << "No match in log: it ends at " << log_.last_index();
+			//If we're behind, there's no point the leader trying past our end
+			return std::make_tuple(log_.term(), false, log_.last_index() + 1, 0);
 		}
 		else
 		{
-			BOOST_LOG_TRIVIAL(trace) << "No match in log.";
-			return std::make_tuple(log_.term(), false);
+			//The whole run of our entries in the conflicting term is suspect,
+			//so let the leader skip back over it in one go
+			auto conflict = log_.conflict(rpc.prev_log_index());
+			BOOST_LOG_TRIVIAL(trace) << "No match in log: term " << std::get<0>(conflict)
+				<< " from index " << std::get<1>(conflict);
+			return std::make_tuple(log_.term(), false, std::get<1>(conflict), std::get<0>(conflict));
 		}
 	}
 
@@ -173,45 +341,277 @@ std::tuple<uint32_t, bool> raft::State::append_entries(const raft::rpc::append_e
 	throw std::runtime_error("Invalid logic path in append_entries receive");
 }
 
+std::tuple<uint32_t, bool, uint32_t> raft::State::install_snapshot(const raft::rpc::install_snapshot& rpc)
+{
+	//Stale
+	if(rpc.term() < log_.term())
+	{
+		BOOST_LOG_TRIVIAL(warning) << "Received stale install_snapshot request from " << rpc.leader_id();
+		return std::make_tuple(log_.term(), false, 0);
+	}
+
+	follow(rpc.term(), rpc.leader_id());
+
+	//A new snapshot restarts the transfer
+	if(rpc.offset() == 0)
+	{
+		incoming_snapshot_index_ = rpc.last_included_index();
+		incoming_snapshot_.clear();
+	}
+
+	if(rpc.last_included_index() != incoming_snapshot_index_
+			|| rpc.offset() != incoming_snapshot_.size())
+	{
+		BOOST_LOG_TRIVIAL(trace) << "Out of order snapshot chunk from " << rpc.leader_id()
+			<< " at offset " << rpc.offset();
+		//Ask for the chunk we want, or a restart if it's a different snapshot
+		return std::make_tuple(log_.term(), false,
+				rpc.last_included_index() == incoming_snapshot_index_ ? incoming_snapshot_.size() : 0);
+	}
+
+	incoming_snapshot_ += rpc.data();
+	const uint32_t received = incoming_snapshot_.size();
+
+	if(rpc.done())
+	{
+		//If we've already applied past it, the snapshot has nothing to offer
+		if(rpc.last_included_index() > last_applied_)
+		{
+			BOOST_LOG_TRIVIAL(info) << "Installing snapshot from " << rpc.leader_id()
+				<< " at index " << rpc.last_included_index();
+
+			Json::Value state = json_help::parse(incoming_snapshot_);
+
+			//Older leaders don't send the membership, so fall back on our own
+			rebase_configuration(rpc.last_included_index(), rpc.membership() ? *rpc.membership()
+					: configuration_at(rpc.last_included_index()));
+
+			log_.install(raft::log::Snapshot(log_.term(), rpc.last_included_index(),
+						rpc.last_included_term(), incoming_snapshot_));
+
+			//Refusing it would only have the leader send it again
+			if(handlers_.snapshots())
+				handlers_.restore(state);
+			else
+				BOOST_LOG_TRIVIAL(error) << "Installed snapshot at index " << rpc.last_included_index()
+					<< " without restoring it: nothing here handles snapshots";
+			last_applied_ = rpc.last_included_index();
+
+			//Unless the snapshot matched our log, it's been discarded
+			truncate_configurations(log_.last_index() + 1);
+			update_configuration();
+
+			//Any entries kept after the snapshot might be committed
+			commit_available();
+		}
+
+		incoming_snapshot_index_ = 0;
+		incoming_snapshot_.clear();
+	}
+
+	return std::make_tuple(log_.term(), true, received);
+}
+
+void raft::State::install_snapshot_response(const std::string& from,
+		const raft::rpc::install_snapshot_response& rpc)
+{
+	if(rpc.term() == log_.term())
+	{
+		if(leader_state == state_ && snapshot_transfers_.count(from))
+		{
+			auto& transfer = snapshot_transfers_[from];
+
+			if(rpc.last_included_index() != std::get<0>(transfer))
+			{
+				//A response to an old snapshot: start again with this one
+				BOOST_LOG_TRIVIAL(trace) << "Restarting snapshot transfer to " << from;
+				std::get<1>(transfer) = 0;
+				send_snapshot(from);
+			}
+			else if(rpc.success() && rpc.done())
+			{
+				const uint32_t index = rpc.last_included_index();
+				BOOST_LOG_TRIVIAL(info) << "Node " << from << " installed snapshot at index " << index;
+
+				snapshot_transfers_.erase(from);
+				client_index_[from] = Progress{index + 1, index, false, {},
+					client_index_[from].read_seq, client_index_[from].commit_sent};
+
+				check_commit();
+
+				//We might have committed our own removal
+				if(leader_state != state_)
+					return;
+
+				if(client_index_[from].next_index <= log_.last_index())
+					heartbeat(from);
+			}
+			else
+			{
+				//Send the chunk they asked for
+				std::get<1>(transfer) = rpc.offset();
+				send_snapshot(from);
+			}
+		}
+		else
+			BOOST_LOG_TRIVIAL(trace) << "Ignoring install_snapshot response from " << from;
+	}
+	else if(rpc.term() > log_.term())
+		//a new term has started
+	{
+		//and the new term handler will sort the rest
+		log_.write(rpc.term());
+	}
+	//else ignore it; it's stale
+}
+
+void raft::State::read(const read_type& f)
+{
+	if(leader_state == state_)
+		confirm_read([this, f](bool confirmed, uint32_t index)
+				{
+					if(confirmed)
+						apply_read(index, f);
+					else
+						f(false);
+				});
+	else if(follower_state == state_ && leader_ && handlers_.forwards_reads())
+	{
+		const uint32_t id = ++next_read_id_;
+		forwarded_reads_[id] = f;
+
+		BOOST_LOG_TRIVIAL(trace) << "Asking " << *leader_ << " for read index " << id;
+		handlers_.read_index(*leader_, raft::rpc::read_index(log_.term(), id));
+	}
+	else
+	{
+		BOOST_LOG_TRIVIAL(trace) << "Can't confirm read: no leader";
+		f(false);
+	}
+}
+
+void raft::State::read_index(const raft::rpc::read_index& rpc,
+		const std::function<void (const raft::rpc::read_index_response&)>& respond)
+{
+	//It's from another term's follower, so can't be for us
+	if(rpc.term() != log_.term())
+	{
+		BOOST_LOG_TRIVIAL(warning) << "Received read_index from term " << rpc.term();
+		respond(raft::rpc::read_index_response(rpc, log_.term(), false, 0));
+		return;
+	}
+
+	confirm_read([this, rpc, respond](bool confirmed, uint32_t index)
+			{
+				respond(raft::rpc::read_index_response(rpc, log_.term(), confirmed, index));
+			});
+}
+
+void raft::State::read_index_response(const std::string& from,
+		const raft::rpc::read_index_response& rpc)
+{
+	auto it = forwarded_reads_.find(rpc.id());
+	if(it == forwarded_reads_.end())
+	{
+		BOOST_LOG_TRIVIAL(trace) << "Ignoring read_index response " << rpc.id() << " from " << from;
+		return;
+	}
+
+	read_type f = it->second;
+	forwarded_reads_.erase(it);
+
+	if(rpc.success() && rpc.term() == log_.term())
+		apply_read(rpc.index(), f);
+	else
+		f(false);
+}
+
 void raft::State::append_entries_response(const std::string& from,
 		const raft::rpc::append_entries_response& rpc)
 {
 	if(rpc.term() == log_.term())
 	{
-		if(leader_state == state_)
+		//Nodes removed from the membership are no longer tracked
+		if(leader_state == state_ && client_index_.count(from))
 		{
+			Progress& progress = client_index_[from];
+			const uint32_t prev_index = rpc.prev_log_index();
+
+			//Any answer in our term shows we were leading when it was sent
+			progress.read_seq = std::max(progress.read_seq, rpc.read_seq());
+
 			if(rpc.success())
 			{
-				uint32_t last_index = rpc.request().prev_log_index() + rpc.request().entries().size();
-				BOOST_LOG_TRIVIAL(trace) << "Successfully added " << rpc.request().entries().size()
+				uint32_t last_index = rpc.match_index();
+				BOOST_LOG_TRIVIAL(trace) << "Successfully added " << last_index - prev_index
 					<< " entries to the log of node " << from;
 
 				//We know last_index is the oldest replicated on the other
-				//machine, so the next to send to them is last_index + 1.
-				BOOST_LOG_TRIVIAL(trace) << "Updating info for node " << from << " to: (" <<
-					last_index + 1 << ", " << last_index << ", false)";
-				client_index_[from] = std::make_tuple(last_index + 1, last_index, false);
+				//machine. Responses to earlier batches can arrive after later
+				//ones have been sent, so never move backwards.
+				progress.match_index = std::max(progress.match_index, last_index);
+				progress.next_index = std::max(progress.next_index, last_index + 1);
+				progress.probing = false;
+				while(!progress.in_flight.empty() && progress.in_flight.front() <= last_index)
+					progress.in_flight.pop_front();
+
+				BOOST_LOG_TRIVIAL(trace) << "Updating info for node " << from << " to: ("
+					<< progress.next_index << ", " << progress.match_index << ", "
+					<< progress.in_flight.size() << " in flight)";
 
 				check_commit();
 
-				//If there are remaining entries, pass them on.
-				if(std::get<0>(client_index_[from]) < log_.last_index())
+				//We might have committed our own removal
+				if(leader_state != state_)
+					return;
+
+				//If there are remaining entries and room in the window, pass
+				//them on.
+				if(progress.next_index <= log_.last_index()
+						&& progress.in_flight.size() < pipeline_window_)
 				{
 					BOOST_LOG_TRIVIAL(trace) << "Responding to succesful append_entries with the remaining log entries.";
 					heartbeat(from);
 				}
+
+				if(transfer_target_ && *transfer_target_ == from)
+					check_transfer();
 			}
-			else
+			//Rejections of batches sent before we rewound, or of entries we
+			//know it has, are stale
+			else if(prev_index > progress.match_index
+					&& !(progress.probing && prev_index + 1 != progress.next_index))
 			{
-				//Decrement next_index_
-				--std::get<0>(client_index_[from]);
-				//ensure we're still in match-hunt mode
-				std::get<2>(client_index_[from]) = true;
+				//Everything sent after the rejected entry is lost too, so
+				//step back from it, as far as the hint says, and go back to
+				//match-hunt mode
+				BOOST_LOG_TRIVIAL(trace) << "Node " << from << " rejected entries after "
+					<< prev_index << " (hint: " << rpc.conflict_index() << " in term "
+					<< rpc.conflict_term() << "); rewinding from " << progress.next_index;
+				progress.next_index = prev_index;
+				if(rpc.conflict_index() > 0)
+					progress.next_index = std::min(progress.next_index, rpc.conflict_index());
+
+				//If we've entries in the node's conflicting term, the logs may
+				//agree up to our last one; otherwise skip its whole run
+				if(rpc.conflict_term() > 0)
+				{
+					const uint32_t last_in_term = log_.last_index_in_term(rpc.conflict_term(), prev_index);
+					if(last_in_term > 0)
+						progress.next_index = std::min(prev_index, last_in_term + 1);
+				}
+				progress.next_index = std::max(progress.next_index, progress.match_index + 1);
+				progress.probing = true;
+				progress.in_flight.clear();
 				heartbeat(from);
 			}
+			else
+				BOOST_LOG_TRIVIAL(trace) << "Ignoring stale append_entries rejection from " << from;
+
+			check_reads();
 		}
 		else
-			BOOST_LOG_TRIVIAL(trace) << "Ignoring append_entries response because we're not leading";
+			BOOST_LOG_TRIVIAL(trace) << "Ignoring append_entries response from " << from;
 	}
 	else if(rpc.term() > log_.term())
 		//a new term has started
@@ -232,6 +632,36 @@ std::tuple<uint32_t, bool> raft::State::request_vote(const raft::rpc::request_vo
 		return std::make_tuple(log_.term(), false);
 	}
 
+	if(!voting(id_))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "Ignoring vote request from " << rpc.candidate_id()
+			<< " because we're a learner";
+		return std::make_tuple(log_.term(), false);
+	}
+
+	if(rpc.pre_vote())
+	{
+		//Until our own timeout fires, the leader's alive as far as we know,
+		//so we wouldn't vote anyone in to replace it
+		const bool have_leader = leader_state == state_ || (follower_state == state_ && leader_);
+		const bool grant = rpc.term() > log_.term() && !have_leader && up_to_date(rpc);
+
+		BOOST_LOG_TRIVIAL(trace) << (grant ? "Granting" : "Refusing") << " pre-vote to "
+			<< rpc.candidate_id() << " for term " << rpc.term();
+		return std::make_tuple(log_.term(), grant);
+	}
+
+	//The leader's lease relies on us not electing anyone else until it's
+	//run out, so ignore the candidate without taking up its term. A leader
+	//handing over gives up its lease.
+	if(lease_duration_.count() > 0 && !rpc.transfer() && follower_state == state_ && leader_
+			&& handlers_.now() < last_heard_ + lease_duration_)
+	{
+		BOOST_LOG_TRIVIAL(info) << "Refusing vote for " << rpc.candidate_id()
+			<< " while the lease of " << *leader_ << " may be running";
+		return std::make_tuple(log_.term(), false);
+	}
+
 	//If it's later, we need to vote
 	if(rpc.term() > log_.term())
 	{
@@ -260,20 +690,7 @@ std::tuple<uint32_t, bool> raft::State::request_vote(const raft::rpc::request_vo
 	else //no vote; we're a leader or candidate in the current term
 		return std::make_tuple(log_.term(), false);
 
-	bool vote = false;
-
-	//check if they're eligable for a vote: their log is at least as up-to-date as
-	//ours
-	if(log_.last_index() != 0)
-	{
-		const uint32_t last_term = log_[log_.last_index()].term();
-		if(last_term < rpc.last_log_term())
-			vote = true;
-		if(last_term == rpc.last_log_term())
-			vote = rpc.last_log_index() >= log_.last_index();
-	}
-	else
-		vote = true;
+	const bool vote = up_to_date(rpc);
 
 	if(vote)
 	{
@@ -288,7 +705,23 @@ std::tuple<uint32_t, bool> raft::State::request_vote(const raft::rpc::request_vo
 void raft::State::request_vote_response(const std::string& from,
 		const raft::rpc::request_vote_response& rpc)
 {
-	if(rpc.term() == log_.term())
+	if(rpc.request().pre_vote())
+	{
+		//Nodes that granted it are behind the term we asked about
+		if(rpc.term() > log_.term())
+			log_.write(rpc.term());
+		else if(pre_voting_ && rpc.request().term() == log_.term() + 1 && rpc.vote_granted())
+		{
+			BOOST_LOG_TRIVIAL(trace) << "Received a pre-vote from " << from
+				<< " for term " << rpc.request().term();
+			if(voting(from))
+				pre_votes_.insert(from);
+
+			if(configuration_.quorum(pre_votes_))
+				start_election();
+		}
+	}
+	else if(rpc.term() == log_.term())
 	{
 		if(candidate_state == state_)
 		{
@@ -296,10 +729,11 @@ void raft::State::request_vote_response(const std::string& from,
 			{
 				BOOST_LOG_TRIVIAL(trace) << "Received a vote from " << from
 					<< " for term " << log_.term();
-				votes_.insert(from);
+				if(voting(from))
+					votes_.insert(from);
 			}
 
-			if(votes_.size() >= calculate_majority())
+			if(configuration_.quorum(votes_))
 			{
 				BOOST_LOG_TRIVIAL(info) << "Received a majority of votes, becoming leader for term: "
 					<< log_.term();
@@ -315,6 +749,61 @@ void raft::State::request_vote_response(const std::string& from,
 	} //else ignore it; it's stale
 }
 
+bool raft::State::transfer_leadership(const boost::optional<std::string>& to, const transfer_type& done)
+{
+	if(leader_state != state_ || transfer_target_ || membership_done_ || configuration_.joint()
+			|| !handlers_.transfers())
+		return false;
+
+	std::string target;
+	if(to)
+	{
+		if(std::find(nodes_.begin(), nodes_.end(), *to) == nodes_.end() || !voting(*to))
+			return false;
+		target = *to;
+	}
+	else
+	{
+		//The most up-to-date voter needs the fewest entries
+		boost::optional<std::string> best;
+		for(const std::string& node : nodes_)
+			if(voting(node) && (!best || client_index_[node].match_index > client_index_[*best].match_index))
+				best = node;
+
+		if(!best)
+			return false;
+		target = *best;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "Transferring leadership for term " << log_.term() << " to " << target;
+
+	//The target's election doesn't wait for the lease to run out, so reads
+	//have to be confirmed by a round of heartbeats until the transfer's over
+	read_seq_sent_.clear();
+	lease_expiry_ = std::chrono::steady_clock::time_point();
+
+	transfer_target_ = target;
+	transfer_rounds_ = transfer_rounds;
+	transfer_done_ = done;
+	check_transfer();
+	return true;
+}
+
+void raft::State::timeout_now(const raft::rpc::timeout_now& rpc)
+{
+	if(rpc.term() == log_.term() && follower_state == state_ && voting(id_)
+			&& leader_ && *leader_ == rpc.leader_id())
+	{
+		BOOST_LOG_TRIVIAL(info) << rpc.leader_id() << " handed over leadership; starting an election for term "
+			<< log_.term() + 1;
+		log_.write(log_.term() + 1);
+		transition_candidate(true);
+	}
+	else
+		BOOST_LOG_TRIVIAL(trace) << "Ignoring timeout_now from " << rpc.leader_id()
+			<< " for term " << rpc.term();
+}
+
 std::string raft::State::id() const
 {
 	return id_;
@@ -341,26 +830,121 @@ const raft::Log& raft::State::log() const
 }
 
 void raft::State::append(const Json::Value& root)
+{
+	//The target couldn't catch up if the log kept growing
+	if(transfer_target_)
+		throw std::logic_error("This node (" + id_ + ") is handing leadership to "
+				+ *transfer_target_ + ".");
+
+	write_entry(root);
+}
+
+void raft::State::write_entry(const Json::Value& root)
 {
 	if(static_cast<bool>(leader_) && *leader_ == id_)
 	{
 		raft::log::LogEntry entry(log_.term(), log_.last_index() + 1, log_.term(), root);
 		log_.write(entry);
+
+		//Configurations are in force as soon as they're in the log
+		if(raft::rpc::configuration::is_configuration(root))
+		{
+			record_configuration(entry.index(), root);
+			update_configuration();
+		}
 	}
 	else
 		throw std::logic_error("This node (" + id_ + ") is not the leader: "
 				+ (leader_ ? *leader_ : "no leader") + ".");
 }
 
+void raft::State::append(const std::vector<Json::Value>& batch)
+{
+	if(batch.empty())
+		return;
+
+	for(const auto& root : batch)
+		append(root);
+
+	BOOST_LOG_TRIVIAL(trace) << "Appended a batch of " << batch.size() << " entries";
+
+	//With no other voters, durable entries are already committed
+	if(configuration_.quorum({id_}) && log_.durable())
+		check_commit();
+
+	//Nodes still being probed or sent a snapshot wait for their answer
+	for(const std::string& node : nodes_)
+	{
+		const Progress& progress = client_index_[node];
+		if(!progress.probing && !snapshot_transfers_.count(node)
+				&& progress.next_index <= log_.last_index()
+				&& progress.in_flight.size() < pipeline_window_)
+			heartbeat(node);
+	}
+}
+
+void raft::State::snapshot(uint32_t index, const Json::Value& state)
+{
+	snapshot_requested_ = false;
+
+	if(checkpoint_requested_)
+	{
+		checkpoint_requested_ = false;
+		if(index > std::max(log_.snapshot_index(), checkpoint_index_) && index <= last_applied_)
+			write_checkpoint(index, state);
+	}
+	else if(index > log_.snapshot_index() && index <= last_applied_)
+	{
+		rebase_configuration(index, configuration_at(index));
+		log_.compact(index, json_help::write(state));
+	}
+}
+
+void raft::State::sync()
+{
+	log_.sync();
+
+	//Our own entries may now count towards a majority
+	if(leader_state == state_)
+		check_commit();
+}
+
 void raft::State::commit_available()
 {
 	for(; last_applied_ < log_.commit_index() && last_applied_ < log_.last_index();
 			++last_applied_)
 	{
-		//Ignore Raft-livelock--avoidance nops
-		if(log_[last_applied_ + 1].action() != Json::Value{})
-			handlers_.commit(log_[last_applied_ + 1].action());
+		//Ignore Raft-livelock--avoidance nops and configurations, which
+		//are raft's own
+		const Json::Value& action = log_[last_applied_ + 1].action();
+		if(action != Json::Value{} && !raft::rpc::configuration::is_configuration(action))
+			handlers_.commit(action);
+	}
+
+	if(snapshot_interval_ > 0 && !snapshot_requested_ && handlers_.snapshots()
+			&& last_applied_ - log_.snapshot_index() >= snapshot_interval_)
+	{
+		BOOST_LOG_TRIVIAL(info) << "Requesting a raft snapshot at index " << last_applied_;
+		snapshot_requested_ = true;
+		handlers_.request_snapshot(last_applied_);
 	}
+	else if(checkpoint_interval_ > 0 && !snapshot_requested_ && handlers_.snapshots()
+			&& last_applied_ - std::max(log_.snapshot_index(), checkpoint_index_) >= checkpoint_interval_)
+	{
+		BOOST_LOG_TRIVIAL(debug) << "Requesting a checkpoint of the applied state at index " << last_applied_;
+		snapshot_requested_ = true;
+		checkpoint_requested_ = true;
+		handlers_.request_snapshot(last_applied_);
+	}
+
+	while(!applying_reads_.empty() && applying_reads_.begin()->first <= last_applied_)
+	{
+		read_type f = applying_reads_.begin()->second;
+		applying_reads_.erase(applying_reads_.begin());
+		f(true);
+	}
+
+	advance_configuration();
 }
 
 void raft::State::term_update(uint32_t term)
@@ -373,21 +957,20 @@ void raft::State::term_update(uint32_t term)
 
 void raft::State::check_commit()
 {
+	const uint32_t old_commit = log_.commit_index();
 	uint32_t nop_index = 0;
 	uint32_t trial_index = log_.commit_index() + 1;
 	while(trial_index <= log_.last_index())
 	{
 		if(log_[trial_index].term() == log_.term())
 		{
-			uint32_t number_have = 1;
-			for(const std::pair<std::string, std::tuple<uint32_t, uint32_t, bool>> client
-					: client_index_)
-			{
-				if(std::get<1>(std::get<1>(client)) >= trial_index)
-					++number_have;
-			}
+			//We only count ourselves once the entry is safely on disk
+			const uint32_t agreed = quorum_value([this](const std::string& node)
+					{
+						return node == id_ ? log_.durable_index() : client_index_[node].match_index;
+					});
 
-			if(number_have >= calculate_majority())
+			if(agreed >= trial_index)
 				log_.commit_index(trial_index++);
 			else
 				break;
@@ -397,101 +980,299 @@ void raft::State::check_commit()
 	}
 	//if nop_index > 0 and no entries this term, issue nop
 	if(nop_index > 0 && log_[log_.last_index()].term() != log_.term())
-		append(Json::Value{});
+		write_entry(Json::Value{});
+
+	//Followers shouldn't have to wait for the next heartbeat to apply it
+	if(log_.commit_index() > old_commit && handlers_.notifies())
+		handlers_.request_notify();
 
 	commit_available();
+	check_reads();
+}
+
+void raft::State::notify_commit()
+{
+	if(leader_state != state_)
+		return;
+
+	for(const std::string& node : nodes_)
+	{
+		//Snapshot transfers go at their own pace
+		if(client_index_[node].commit_sent < log_.commit_index() && !snapshot_transfers_.count(node))
+			heartbeat(node);
+	}
 }
 
 void raft::State::heartbeat()
 {
+	//Start a new round, so answers show we were leading from now
+	++read_seq_;
+	if(lease_duration_.count() > 0)
+		read_seq_sent_.emplace_back(read_seq_, handlers_.now());
+
 	for(const std::string& node : nodes_)
 		heartbeat(node);
 }
 
 void raft::State::heartbeat(const std::string& node)
 {
-	if(std::get<0>(client_index_[node]) == log_.last_index() + 1)
-	{
-		BOOST_LOG_TRIVIAL(trace) << "Empty heartbeat to " << node;
-		//send an empty heartbeat
-		std::tuple<uint32_t, uint32_t> entry_info(0, 0);
+	Progress& progress = client_index_[node];
 
-		if(log_.last_index() > 0)
+	//Entries the node needs have been compacted away
+	if(snapshot_transfers_.count(node)
+			|| (log_.snapshot_index() > 0 && progress.next_index <= log_.snapshot_index()))
+		send_snapshot(node);
+	else if(progress.next_index == 0 || progress.next_index > log_.last_index() + 1)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "Information for follower " << node
+			<< " is nonsensical: last index: " << log_.last_index()
+			<< ", term: " << log_.term() << ", follower index: " << progress.next_index
+			<< ", follower match index: " << progress.match_index;
+		progress = Progress{log_.last_index() + 1, 0, true, {}, progress.read_seq,
+			progress.commit_sent};
+	}
+	else if(progress.probing || progress.next_index > log_.last_index()
+			|| progress.in_flight.size() >= pipeline_window_)
+	{
+		BOOST_LOG_TRIVIAL(trace) << "Empty heartbeat to " << node << " at index " << progress.next_index;
+		//Up to date, still finding the match_index or waiting for the window
+		//to drain: either way check the node has everything before next_index
+		send_entries(node, progress.next_index, progress.next_index - 1);
+	}
+	else
+	{
+		//Keep sending batches without waiting for them to be acknowledged
+		while(progress.next_index <= log_.last_index() && progress.in_flight.size() < pipeline_window_)
 		{
-			auto last_entry = log_[log_.last_index()];
-			entry_info = std::make_tuple(last_entry.term(), last_entry.index());
+			const uint32_t to = std::min(log_.last_index(), progress.next_index + transfer_limit_ - 1);
+
+			BOOST_LOG_TRIVIAL(trace) << "Update to " << node
+				<< ", adding logs: " << progress.next_index << "--" << to;
+
+			send_entries(node, progress.next_index, to);
+			progress.in_flight.push_back(to);
+			progress.next_index = to + 1;
 		}
+	}
+}
 
-		raft::rpc::append_entries msg(log_.term(), id_,
-				std::get<0>(entry_info), std::get<1>(entry_info),
-				{}, log_.commit_index());
+void raft::State::send_entries(const std::string& node, uint32_t from, uint32_t to)
+{
+	std::vector<raft::rpc::append_entries::entry_type> entries;
+	if(to >= from)
+		entries.reserve(to - from + 1);
 
-		//send the message
-		handlers_.append_entries(node, msg);
+	for(uint32_t i = from; i <= to; ++i)
+	{
+		//Shares the entry's payload rather than copying its action
+		const auto entry = log_[i];
+		entries.emplace_back(entry.term(), entry.payload());
 	}
-	else if(std::get<2>(client_index_[node]))
+
+	std::tuple<uint32_t, uint32_t> prev_log{0, 0};
+	if(from > 1)
 	{
-		BOOST_LOG_TRIVIAL(trace) << "Finding match_index for " << node;
-		//Still trying to work out the match_index
-		uint32_t next_index = std::get<0>(client_index_[node]);
-		if(next_index > log_.last_index())
-		{
-			BOOST_LOG_TRIVIAL(warning) << "Information for follower " << node
-				<< " is nonsensical: last index: " << log_.last_index()
-				<< ", term: " << log_.term() << ", follower index: " << next_index
-				<< ", follower match index: " << std::get<1>(client_index_[node]);
-			client_index_[node] = std::make_tuple(log_.last_index() + 1, 0, true);
-		}
-		else
-		{
-			std::tuple<uint32_t, uint32_t> prev_log{0, 0};
-			if(next_index > 1)
-			{
-				auto entry = log_[next_index - 1];
-				prev_log = std::make_tuple(entry.term(), entry.index());
-			}
+		auto entry = log_[from - 1];
+		prev_log = std::make_tuple(entry.term(), entry.index());
+	}
 
-			raft::rpc::append_entries msg(log_.term(), id_,
-					std::get<0>(prev_log), std::get<1>(prev_log),
-					{}, log_.commit_index());
-			handlers_.append_entries(node, msg);
+	raft::rpc::append_entries msg(log_.term(), id_,
+			std::get<0>(prev_log), std::get<1>(prev_log),
+			entries, log_.commit_index(), read_seq_);
 
-		}
+	client_index_[node].commit_sent = log_.commit_index();
+	handlers_.append_entries(node, msg);
+}
+
+void raft::State::send_snapshot(const std::string& node)
+{
+	if(!log_.snapshot() || !handlers_.snapshots())
+	{
+		BOOST_LOG_TRIVIAL(error) << "Node " << node << " needs a snapshot that can't be sent";
+		return;
 	}
-	else //plain old update
+
+	const raft::log::Snapshot& snapshot = *log_.snapshot();
+	const std::string& data = snapshot.data();
+
+	auto& transfer = snapshot_transfers_[node];
+	//Restart if we've taken a new snapshot since the transfer started
+	if(std::get<0>(transfer) != snapshot.index() || std::get<1>(transfer) > data.size())
+		transfer = std::make_tuple(snapshot.index(), 0);
+
+	const uint32_t offset = std::get<1>(transfer);
+	uint32_t end = std::min<std::size_t>(offset + snapshot_chunk_size_, data.size());
+
+	//Don't split a UTF-8 sequence between chunks: each has to be a valid
+	//JSON string.
+	while(end < data.size() && end > offset + 1
+			&& (static_cast<unsigned char>(data[end]) & 0xc0) == 0x80)
+		--end;
+
+	BOOST_LOG_TRIVIAL(trace) << "Sending snapshot " << snapshot.index() << " to " << node
+		<< ", bytes " << offset << "--" << end << " of " << data.size();
+
+	//The membership goes with the last chunk, for the follower to start from
+	const bool done = end == data.size();
+	raft::rpc::install_snapshot msg(log_.term(), id_,
+			snapshot.spawn_term(), snapshot.index(),
+			offset, data.substr(offset, end - offset), done,
+			done ? boost::make_optional(configuration_at(snapshot.index())) : boost::none);
+
+	handlers_.install_snapshot(node, msg);
+}
+
+void raft::State::confirm_read(const std::function<void (bool, uint32_t)>& confirmed)
+{
+	if(leader_state != state_)
+	{
+		confirmed(false, 0);
+		return;
+	}
+
+	//No one else can have been elected while the lease runs, unless we've
+	//asked them to stand
+	if(lease_duration_.count() > 0 && !transfer_target_ && commit_current()
+			&& handlers_.now() < lease_expiry_)
 	{
-		std::vector<std::tuple<uint32_t, Json::Value>> entries;
-		const uint32_t from_log = std::get<0>(client_index_[node]);
-		const uint32_t to_log = (log_.last_index() - from_log) > transfer_limit_
-			? from_log + transfer_limit_
-			: log_.last_index();
+		confirmed(true, log_.commit_index());
+		return;
+	}
 
-		entries.reserve(to_log - from_log);
+	//Wait for a majority to answer the next round
+	pending_reads_.push_back(PendingRead{read_seq_ + 1, confirmed});
+	heartbeat();
+	check_reads();
+}
 
-		BOOST_LOG_TRIVIAL(trace) << "Update to " << node
-			<< ", adding logs: " << from_log << "--" << to_log;
+void raft::State::apply_read(uint32_t index, const read_type& f)
+{
+	if(last_applied_ >= index)
+		f(true);
+	else
+		applying_reads_.emplace(index, f);
+}
 
-		if(from_log > 0)
-		{
-			for(unsigned int i = from_log; i <= to_log; ++i)
-				entries.push_back(std::make_tuple(log_[i].term(), log_[i].action()));
+void raft::State::check_reads()
+{
+	if(leader_state != state_)
+		return;
 
-			std::tuple<uint32_t, uint32_t> prev_log{0, 0};
-			if(from_log > 1)
+	//The latest round answered by a majority, counting ourselves
+	const uint32_t majority_seq = quorum_value([this](const std::string& node)
 			{
-				auto entry = log_[from_log - 1];
-				prev_log = std::make_tuple(entry.term(), entry.index());
-			}
+				return node == id_ ? read_seq_ : client_index_[node].read_seq;
+			});
+
+	//The lease runs from when that round was sent
+	while(!read_seq_sent_.empty() && std::get<0>(read_seq_sent_.front()) <= majority_seq)
+	{
+		if(std::get<0>(read_seq_sent_.front()) == majority_seq && !transfer_target_)
+			lease_expiry_ = std::max(lease_expiry_, std::get<1>(read_seq_sent_.front()) + lease_duration_);
+		read_seq_sent_.pop_front();
+	}
+
+	if(!commit_current())
+		return;
+
+	while(!pending_reads_.empty() && pending_reads_.front().read_seq <= majority_seq)
+	{
+		auto confirmed = pending_reads_.front().confirmed;
+		pending_reads_.pop_front();
+		confirmed(true, log_.commit_index());
+	}
+}
+
+bool raft::State::commit_current() const
+{
+	//Every committed entry is in our log, so if all of it is committed we
+	//know about them; otherwise we don't until we've committed in our term.
+	return log_.commit_index() == log_.last_index()
+		|| log_[log_.commit_index()].term() == log_.term();
+}
+
+void raft::State::abandon_reads()
+{
+	read_seq_sent_.clear();
+	lease_expiry_ = std::chrono::steady_clock::time_point();
+
+	decltype(pending_reads_) pending;
+	pending.swap(pending_reads_);
+	for(const auto& read : pending)
+		read.confirmed(false, 0);
+
+	decltype(forwarded_reads_) forwarded;
+	forwarded.swap(forwarded_reads_);
+	for(const auto& read : forwarded)
+		read.second(false);
+}
 
-			raft::rpc::append_entries msg(log_.term(), id_,
-					std::get<0>(prev_log), std::get<1>(prev_log),
-					entries, log_.commit_index());
+void raft::State::check_transfer()
+{
+	const std::string& target = *transfer_target_;
+	const Progress& progress = client_index_[target];
+
+	if(progress.match_index == log_.last_index())
+	{
+		BOOST_LOG_TRIVIAL(trace) << target << " is up to date; sending timeout_now";
+		handlers_.timeout_now(target, raft::rpc::timeout_now(log_.term(), id_));
+	}
+	else if(!progress.probing && !snapshot_transfers_.count(target)
+			&& progress.next_index <= log_.last_index()
+			&& progress.in_flight.size() < pipeline_window_)
+		heartbeat(target);
+}
+
+void raft::State::end_transfer(bool transferred)
+{
+	transfer_target_ = boost::none;
+
+	transfer_type done;
+	done.swap(transfer_done_);
+	if(done)
+		done(transferred);
+}
+
+void raft::State::follow(uint32_t term, const std::string& leader_id)
+{
+	//We need to become a follower -- our term <= their term
+	if(candidate_state == state_)
+	{
+		BOOST_LOG_TRIVIAL(info) << "Stepped down as candidate for term " << term
+			<< " deferring to " << leader_id << ".";
+
+		transition_follower();
+		//No term update -- leave that for the follower handling.
+
+	} // no else because we need to deal with this as a follower
+
+	//If later term, step down. Otherwise, log a warning (and step down).
+	if(leader_state == state_)
+	{
+		//Shouldn't happen
+		if(term == log_.term())
+			BOOST_LOG_TRIVIAL(error) << "Two leaders for term " << term << ": "
+				<< id_ << " and " << leader_id;
+
+		transition_follower();
+	}
+
+	if(follower_state == state_)
+	{
+		//Reset the timeout
+		handlers_.request_timeout(State::Handlers::election_timeout);
 
-			handlers_.append_entries(node, msg);
+		if(term > log_.term())
+		{
+			raft::log::NewTerm nt(term);
+			log_.write(nt);
 		}
-		else //reset the numbers
-			client_index_[node] = std::make_tuple(log_.last_index() + 1, 0, true);
 
+		if(!leader_)
+			leader_ = leader_id;
+
+		pre_voting_ = false;
+		last_heard_ = handlers_.now();
 	}
 }
 
@@ -499,13 +1280,29 @@ void raft::State::transition_follower()
 {
 	state_ = follower_state;
 	leader_ = boost::none;
+	pre_voting_ = false;
+	abandon_reads();
+
+	if(membership_done_)
+	{
+		BOOST_LOG_TRIVIAL(info) << "Lost leadership during a membership change";
+		end_membership(false);
+	}
+
+	if(transfer_target_)
+	{
+		BOOST_LOG_TRIVIAL(info) << "Handed over leadership to " << *transfer_target_;
+		end_transfer(true);
+	}
 	handlers_.request_timeout(Handlers::election_timeout);
 }
 
-void raft::State::transition_candidate()
+void raft::State::transition_candidate(bool transfer)
 {
 	state_ = candidate_state;
 	votes_.clear();
+	pre_voting_ = false;
+	abandon_reads();
 
 	//vote for yourself
 	votes_.insert(id_);
@@ -513,38 +1310,334 @@ void raft::State::transition_candidate()
 	//Make a note of that
 	log_.write(raft::log::Vote(log_.term(), id_));
 
-	//Send off vote requests.
+	//Send off vote requests; learners don't get a say
 	for(const std::string& node : nodes_)
 	{
+		if(!voting(node))
+			continue;
+
 		std::tuple<uint32_t, uint32_t> last_log(0, 0);
 		if(log_.last_index() > 0)
 			last_log = std::make_tuple(log_[log_.last_index()].term(), log_.last_index());
 
 		raft::rpc::request_vote msg(log_.term(), id_,
-				std::get<0>(last_log), std::get<1>(last_log));
+				std::get<0>(last_log), std::get<1>(last_log), transfer);
 
 		handlers_.request_vote(node, msg);
 	}
 	handlers_.request_timeout(Handlers::election_timeout);
+
+	//The only voter
+	if(configuration_.quorum(votes_))
+		transition_leader();
 }
 
 void raft::State::transition_leader()
 {
 	state_ = leader_state;
+	pre_voting_ = false;
 	client_index_.clear();
+	snapshot_transfers_.clear();
 	leader_ = id_;
 
 	//Initialise the index
 	for(const std::string& node : nodes_)
-		client_index_[node] = std::make_tuple(log_.last_index() + 1, 0, true);
+		client_index_[node] = Progress{log_.last_index() + 1, 0, true, {}, 0, 0};
 
 	heartbeat();
 	handlers_.request_timeout(Handlers::leader_timeout);
+
+	//Finish any change our predecessor left half done
+	advance_configuration();
+}
+
+void raft::State::start_pre_vote()
+{
+	BOOST_LOG_TRIVIAL(trace) << "Asking if we could win an election for term " << log_.term() + 1;
+
+	//Our leader's gone quiet, so we'd let others replace it
+	if(follower_state == state_)
+		leader_ = boost::none;
+
+	pre_voting_ = true;
+	pre_votes_.clear();
+	pre_votes_.insert(id_);
+
+	if(configuration_.quorum(pre_votes_))
+	{
+		start_election();
+		return;
+	}
+
+	std::tuple<uint32_t, uint32_t> last_log(0, 0);
+	if(log_.last_index() > 0)
+		last_log = std::make_tuple(log_[log_.last_index()].term(), log_.last_index());
+
+	raft::rpc::request_vote msg(log_.term() + 1, id_,
+			std::get<0>(last_log), std::get<1>(last_log), false, true);
+
+	for(const std::string& node : nodes_)
+		if(voting(node))
+			handlers_.request_vote(node, msg);
+
+	handlers_.request_timeout(Handlers::election_timeout);
+}
+
+void raft::State::start_election()
+{
+	BOOST_LOG_TRIVIAL(trace) << "Broadcasting candidacy for new election term.";
+	//update the term
+	log_.write(log_.term() + 1);
+	//Perform the transition (which will also ask for the timeout)
+	transition_candidate();
 }
 
-uint32_t raft::State::calculate_majority()
+bool raft::State::up_to_date(const raft::rpc::request_vote& rpc) const
 {
-	//nodes_.size() + 1 because we're not stored in nodes
-	return ((nodes_.size() + 1) / 2) + 1;
-	//( ... / 2) +1 because integer division floors & we'd like the majority
+	//check if they're eligable for a vote: their log is at least as up-to-date as
+	//ours
+	if(log_.last_index() == 0)
+		return true;
+
+	const uint32_t last_term = log_[log_.last_index()].term();
+	if(last_term == rpc.last_log_term())
+		return rpc.last_log_index() >= log_.last_index();
+
+	return last_term < rpc.last_log_term();
+}
+
+bool raft::State::voting(const std::string& node) const
+{
+	return configuration_.voting(node);
+}
+
+uint32_t raft::State::quorum_value(const std::function<uint32_t (const std::string&)>& value) const
+{
+	auto majority_value = [&value](const std::set<std::string>& voters) -> uint32_t
+	{
+		if(voters.empty())
+			return 0;
+
+		std::vector<uint32_t> values;
+		for(const std::string& voter : voters)
+			values.push_back(value(voter));
+		std::sort(values.begin(), values.end(), std::greater<uint32_t>());
+		//A majority have reached the middle value
+		return values[values.size() / 2];
+	};
+
+	uint32_t agreed = majority_value(configuration_.voters());
+	if(configuration_.new_voters())
+		agreed = std::min(agreed, majority_value(*configuration_.new_voters()));
+
+	return agreed;
+}
+
+void raft::State::record_configuration(uint32_t index, const Json::Value& action)
+{
+	if(raft::rpc::configuration::is_configuration(action))
+		configurations_[index] = raft::rpc::configuration(action);
+}
+
+void raft::State::truncate_configurations(uint32_t index)
+{
+	configurations_.erase(configurations_.lower_bound(index), configurations_.end());
+}
+
+void raft::State::update_configuration()
+{
+	const raft::rpc::configuration& latest = configurations_.empty()
+		? base_configuration_ : configurations_.rbegin()->second;
+
+	if(latest == configuration_)
+		return;
+
+	configuration_ = latest;
+	BOOST_LOG_TRIVIAL(info) << "Raft membership is now: " << json_help::write(configuration_);
+
+	//Keep the order we had, so the ones that stay are contacted as before
+	std::set<std::string> members = configuration_.members();
+	members.erase(id_);
+	std::vector<std::string> nodes;
+	for(const std::string& node : nodes_)
+		if(members.erase(node))
+			nodes.push_back(node);
+	nodes.insert(nodes.end(), members.begin(), members.end());
+	nodes_.swap(nodes);
+
+	if(leader_state == state_)
+	{
+		//Newcomers start out being probed, like everyone after an election
+		for(const std::string& node : nodes_)
+			if(!client_index_.count(node))
+				client_index_[node] = Progress{log_.last_index() + 1, 0, true, {}, 0, 0};
+
+		for(auto it = client_index_.begin(); it != client_index_.end();)
+		{
+			if(std::find(nodes_.begin(), nodes_.end(), it->first) == nodes_.end())
+			{
+				snapshot_transfers_.erase(it->first);
+				it = client_index_.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+
+	handlers_.configure(configuration_);
+}
+
+uint32_t raft::State::configuration_index() const
+{
+	return configurations_.empty() ? base_configuration_index_ : configurations_.rbegin()->first;
+}
+
+raft::rpc::configuration raft::State::configuration_at(uint32_t index) const
+{
+	auto it = configurations_.upper_bound(index);
+	if(it == configurations_.begin())
+		return base_configuration_;
+
+	return std::prev(it)->second;
+}
+
+void raft::State::rebase_configuration(uint32_t index, const raft::rpc::configuration& configuration)
+{
+	configurations_.erase(configurations_.begin(), configurations_.upper_bound(index));
+
+	if(configuration == base_configuration_)
+		return;
+
+	base_configuration_ = configuration;
+	base_configuration_index_ = index;
+
+	Json::Value root;
+	root["index"] = index;
+	root["configuration"] = base_configuration_;
+
+	//It must be on disk before the log entries it replaces are compacted away
+	raft::log::replace_file(membership_file_, json_help::write(root) + '\n');
+}
+
+bool raft::State::change_membership(const raft::rpc::configuration& target, const membership_type& done)
+{
+	//One change at a time, each starting from a committed configuration
+	if(leader_state != state_ || transfer_target_ || membership_done_ || configuration_.joint()
+			|| configuration_index() > log_.commit_index() || target.voters().empty())
+		return false;
+
+	BOOST_LOG_TRIVIAL(info) << "Changing raft membership to: " << json_help::write(target);
+
+	//Even without a handler, note that a change is under way
+	membership_done_ = done ? done : [](bool) {};
+	append(std::vector<Json::Value>{configuration_.transition(target)});
+	return true;
+}
+
+const raft::rpc::configuration& raft::State::configuration() const
+{
+	return configuration_;
+}
+
+bool raft::State::caught_up(const std::string& node) const
+{
+	if(leader_state != state_ || !voting(node) || snapshot_transfers_.count(node))
+		return false;
+
+	auto it = client_index_.find(node);
+	if(it == client_index_.end())
+		return false;
+
+	const Progress& progress = it->second;
+	return !progress.probing && progress.next_index > log_.last_index()
+		&& progress.read_seq + 1 >= read_seq_;
+}
+
+void raft::State::advance_configuration()
+{
+	if(leader_state != state_ || configuration_index() > log_.commit_index())
+		return;
+
+	if(configuration_.joint())
+	{
+		//Both majorities have the joint configuration, so the new one can
+		//take over
+		BOOST_LOG_TRIVIAL(info) << "Joint raft membership committed; moving to the new one";
+		append(std::vector<Json::Value>{configuration_.target()});
+		return;
+	}
+
+	if(membership_done_)
+	{
+		BOOST_LOG_TRIVIAL(info) << "Raft membership change committed";
+		end_membership(true);
+	}
+
+	//Leading a cluster we're not a voter in
+	if(!voting(id_))
+	{
+		BOOST_LOG_TRIVIAL(info) << "No longer a raft voter; stepping down";
+		transition_follower();
+	}
+}
+
+void raft::State::end_membership(bool changed)
+{
+	membership_type done;
+	done.swap(membership_done_);
+	if(done)
+		done(changed);
+}
+
+void raft::State::restore_checkpoint()
+{
+	if(!fs::exists(checkpoint_file_) || !handlers_.snapshots())
+		return;
+
+	std::ifstream in(checkpoint_file_);
+	std::string line;
+	std::getline(in, line);
+
+	//It's only an optimisation: without it the log is replayed
+	Json::Value root;
+	uint32_t index;
+	try
+	{
+		root = json_help::parse(line);
+		index = json_help::checked_from_json<uint32_t>(root, "index",
+				"Bad raft checkpoint file:");
+		if(!root.isMember("state"))
+			throw std::runtime_error("Bad raft checkpoint file: no state");
+	}
+	catch(const std::exception& ex)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "Ignoring unreadable raft checkpoint " << checkpoint_file_
+			<< ": " << ex.what();
+		return;
+	}
+
+	//A later snapshot supersedes it; entries it covers must still be here
+	if(index <= log_.snapshot_index() || index > log_.last_index())
+		return;
+
+	BOOST_LOG_TRIVIAL(info) << "Restoring the applied state checkpointed at index " << index;
+	handlers_.restore(root["state"]);
+	last_applied_ = index;
+	checkpoint_index_ = index;
+
+	//Those entries were committed, even if the commit index wasn't kept
+	if(log_.commit_index() < index)
+		log_.commit_index(index);
+}
+
+void raft::State::write_checkpoint(uint32_t index, const Json::Value& state)
+{
+	Json::Value root;
+	root["index"] = index;
+	root["state"] = state;
+
+	raft::log::replace_file(checkpoint_file_, json_help::write(root) + '\n');
+
+	checkpoint_index_ = index;
+	BOOST_LOG_TRIVIAL(debug) << "Checkpointed the applied state at index " << index;
 }
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <deque>
+#include <set>
 #include <unordered_map>
+#include <map>
+#include <chrono>
 
 #include "raftlog.hpp"
 
@@ -25,11 +29,28 @@ namespace raft
 			typedef std::function<void (const std::string&, const raft::rpc::request_vote&)> request_vote_type;
 			typedef std::function<void (timeout_length)> timeout_type;
 			typedef std::function<void (const Json::Value&)> commit_type;
+			typedef std::function<void ()> sync_type;
+			typedef std::function<void (const std::string&, const raft::rpc::install_snapshot&)> install_snapshot_type;
+			typedef std::function<void (uint32_t)> snapshot_type;
+			typedef std::function<void (const Json::Value&)> restore_type;
+			typedef std::function<void (const std::string&, const raft::rpc::read_index&)> read_index_type;
+			typedef std::function<std::chrono::steady_clock::time_point ()> clock_type;
+			typedef std::function<void (const std::string&, const raft::rpc::timeout_now&)> timeout_now_type;
+			typedef std::function<void (const raft::rpc::configuration&)> configure_type;
+			typedef std::function<void ()> notify_type;
 
 			Handlers() = default;
 			Handlers(const append_entries_type& append_entries, const
 					request_vote_type& request_vote, const timeout_type& request_timeout,
-					const commit_type& commit);
+					const commit_type& commit, const sync_type& request_sync = nullptr,
+					const install_snapshot_type& install_snapshot = nullptr,
+					const snapshot_type& request_snapshot = nullptr,
+					const restore_type& restore = nullptr,
+					const read_index_type& read_index = nullptr,
+					const clock_type& now = nullptr,
+					const timeout_now_type& timeout_now = nullptr,
+					const configure_type& configure = nullptr,
+					const notify_type& request_notify = nullptr);
 
 			void append_entries(const std::string& endpoint, const raft::rpc::append_entries& rpc);
 
@@ -38,11 +59,136 @@ namespace raft
 			void request_timeout(timeout_length length);
 
 			void commit(const Json::Value& value);
+
+			//! Asks for State::sync() to be called once the current batch of
+			//! log writes is done.
+			void request_sync();
+
+			//! True if there's a handler for request_sync()
+			bool syncs() const;
+
+			void install_snapshot(const std::string& endpoint, const raft::rpc::install_snapshot& rpc);
+
+			//! Asks for State::snapshot() to be called with the state as it
+			//! stands once every entry up to index has been committed.
+			void request_snapshot(uint32_t index);
+
+			//! Replaces the committed state with a snapshot's.
+			void restore(const Json::Value& state);
+
+			//! True if snapshots can be taken and restored
+			bool snapshots() const;
+
+			//! Asks the leader to confirm a read for a follower.
+			void read_index(const std::string& endpoint, const raft::rpc::read_index& rpc);
+
+			//! True if there's a handler for read_index()
+			bool forwards_reads() const;
+
+			//! The time, for leader leases; the steady clock if there's no
+			//! handler.
+			std::chrono::steady_clock::time_point now() const;
+
+			//! Tells a follower to start an election now; leadership can't be
+			//! transferred without a handler.
+			void timeout_now(const std::string& endpoint, const raft::rpc::timeout_now& rpc);
+
+			//! True if there's a handler for timeout_now()
+			bool transfers() const;
+
+			//! Passes on the membership when it changes, if there's a
+			//! handler.
+			void configure(const raft::rpc::configuration& configuration);
+
+			//! Asks for State::notify_commit() to be called once the current
+			//! batch of work is done.
+			void request_notify();
+
+			//! True if there's a handler for request_notify()
+			bool notifies() const;
 		protected:
 			append_entries_type append_entries_;
 			request_vote_type request_vote_;
 			timeout_type request_timeout_;
 			commit_type commit_;
+			sync_type request_sync_;
+			install_snapshot_type install_snapshot_;
+			snapshot_type request_snapshot_;
+			restore_type restore_;
+			read_index_type read_index_;
+			clock_type now_;
+			timeout_now_type timeout_now_;
+			configure_type configure_;
+			notify_type request_notify_;
+		};
+
+		//! Called once a read may go ahead, with false if it can't be
+		//! confirmed.
+		typedef std::function<void (bool)> read_type;
+
+		//! Called once a leadership transfer is over, with true if we've
+		//! stepped down.
+		typedef std::function<void (bool)> transfer_type;
+
+		//! Called once a membership change is over, with true if it was
+		//! made.
+		typedef std::function<void (bool)> membership_type;
+
+		//! The number of leader timeouts a leadership transfer is given
+		//! before it's abandoned.
+		static const uint32_t transfer_rounds = 10;
+
+		//! How the node replicates and stores the log.
+		struct Options
+		{
+			//! The defaults: a transfer limit of 50 entries, per-entry
+			//! durability, no snapshots or checkpoints, 64KiB snapshot chunks,
+			//! a pipeline window of 8 and no lease or pre-vote
+			Options();
+
+			//! How the log is stored and cached. With batched durability and
+			//! a request_sync handler, sync() must be called to make writes
+			//! durable.
+			raft::Log::Options log;
+
+			//! The maximum number of logs to transfer in one RPC
+			uint32_t transfer_limit;
+
+			//! The number of applied entries after which a snapshot is
+			//! requested and the log compacted; zero never snapshots.
+			uint32_t snapshot_interval;
+
+			//! The maximum number of bytes of snapshot to send in one
+			//! install_snapshot RPC
+			uint32_t snapshot_chunk_size;
+
+			//! The maximum number of append_entries carrying entries that may
+			//! be unacknowledged at each follower
+			uint32_t pipeline_window;
+
+			//! The length of the leader lease in milliseconds; zero confirms
+			//! every read with a heartbeat. It must be less than the shortest
+			//! election timeout, less any clock drift.
+			uint32_t lease_duration;
+
+			//! If true, a node whose election timeout fires first asks
+			//! whether it could win an election, and only takes up a new term
+			//! once a majority say it could. Nodes that have heard from a
+			//! leader since their last timeout say it couldn't, so a node
+			//! rejoining after a partition doesn't depose a working leader.
+			bool pre_vote;
+
+			//! The nodes, possibly including this one, that are sent the log
+			//! but don't vote and aren't counted towards a majority. A learner
+			//! never stands for election.
+			std::vector<std::string> learners;
+
+			//! The number of applied entries after which the applied state is
+			//! requested, as for a snapshot, and kept alongside the log with a
+			//! ".applied" suffix without compacting it. On restart it's
+			//! restored and only later entries are applied; zero never
+			//! checkpoints.
+			uint32_t checkpoint_interval;
 		};
 
 		//! Constructor for the raft::State instance.
@@ -54,12 +200,14 @@ namespace raft
 		 *  to communicate with others (possibly over the network -- that detail is
 		 *  hidden from this class). The callback additionally provide neat type
 		 *  erasure, allowing untemplated testing.
-		 *  \param transfer_limit The maximum number of logs to transfer in one
-		 *  RPC
+		 *  \param options How the node replicates and stores the log.
+		 *
+		 *  nodes, the learners and this node make up the membership until one
+		 *  is found in the log, or kept alongside it with a ".members" suffix.
 		 */
 		State(const std::string& id, const std::vector<std::string>& nodes,
 				const std::string& log_file, Handlers& handlers,
-				uint32_t transfer_limit=50);
+				const Options& options = Options());
 
 		//! Handler called on timeout.
 		/*!
@@ -81,14 +229,59 @@ namespace raft
 		 *
 		 *  \returns A tuple: the first element is the term of this node, the second
 		 *  element is true if this node has an entry that matches prev_log_* -- i.e.
-		 *  the logs are consistent up to that index.
+		 *  the logs are consistent up to that index. If not, the third is the
+		 *  earliest index at which our log may differ from the leader's and the
+		 *  fourth is the term of our entry at prev_log_index, or zero if we
+		 *  don't have one.
 		 */
-		std::tuple<uint32_t, bool> append_entries(const raft::rpc::append_entries& rpc);
+		std::tuple<uint32_t, bool, uint32_t, uint32_t> append_entries(const raft::rpc::append_entries& rpc);
 
 		//! The response handler for append_entries
 		void append_entries_response(const std::string& from,
 				const raft::rpc::append_entries_response& rpc);
 
+		//! InstallSnapshot RPC
+		/*!
+		 *  This function is used to signify to the raft::State instance that a
+		 *  chunk of the leader's snapshot has arrived.
+		 *
+		 *  \returns A tuple: the term of this node, true if the chunk was
+		 *  accepted and the offset of the next chunk this node expects.
+		 */
+		std::tuple<uint32_t, bool, uint32_t> install_snapshot(const raft::rpc::install_snapshot& rpc);
+
+		//! The response handler for install_snapshot
+		void install_snapshot_response(const std::string& from,
+				const raft::rpc::install_snapshot_response& rpc);
+
+		//! Calls f once a linearizable read may be served from the committed
+		//! state.
+		/*!
+		 *  Rather than writing to the log, the leader notes that the read
+		 *  is waiting and sends a round of heartbeats; once a majority have
+		 *  answered one it knows it was still leading, and its commit index
+		 *  then is the read index. While a leader lease is held, the
+		 *  heartbeats are skipped. A follower asks the leader for the read
+		 *  index with a read_index RPC.
+		 *
+		 *  Either way, f is called with true once every entry up to the read
+		 *  index has been passed to the commit handler. It's called with
+		 *  false if there's no leader, or leadership changes first.
+		 */
+		void read(const read_type& f);
+
+		//! ReadIndex RPC
+		/*!
+		 *  Confirms a follower's read as read() does, then calls respond with
+		 *  the response.
+		 */
+		void read_index(const raft::rpc::read_index& rpc,
+				const std::function<void (const raft::rpc::read_index_response&)>& respond);
+
+		//! The response handler for read_index
+		void read_index_response(const std::string& from,
+				const raft::rpc::read_index_response& rpc);
+
 		//! RequestVote RPC
 		/*!
 		 *  This function is used to signify to the raft::State instance that a
@@ -106,6 +299,51 @@ namespace raft
 		void request_vote_response(const std::string& from,
 				const raft::rpc::request_vote_response& rpc);
 
+		//! Hands leadership to another node.
+		/*!
+		 *  New entries are refused while the target is brought up to date;
+		 *  once its log matches ours it's sent a timeout_now RPC so it starts
+		 *  an election straight away, and wins it before the others' timeouts
+		 *  run out. done is called with true once we've stepped down, or false
+		 *  if that hasn't happened after transfer_rounds leader timeouts.
+		 *
+		 *  \param to The node to hand over to; if none, the follower with the
+		 *  most of our log.
+		 *  \returns false, without calling done, if we're not leading, there's
+		 *  no such node, or a transfer or membership change is in progress.
+		 */
+		bool transfer_leadership(const boost::optional<std::string>& to, const transfer_type& done);
+
+		//! TimeoutNow RPC
+		/*!
+		 *  Starts an election at once if the RPC is from our leader.
+		 */
+		void timeout_now(const raft::rpc::timeout_now& rpc);
+
+		//! Changes the membership of the cluster.
+		/*!
+		 *  A joint configuration, needing majorities of both the old and
+		 *  new voters, is appended to the log; once it's committed the new
+		 *  configuration is appended. Each node uses the latest configuration
+		 *  in its log, committed or not. Once the new configuration is
+		 *  committed done is called with true, and a leader that's no longer
+		 *  a voter steps down. It's called with false if leadership is lost
+		 *  first.
+		 *
+		 *  \returns false, without calling done, if we're not leading, a
+		 *  change or leadership transfer is in progress, or target has no
+		 *  voters.
+		 */
+		bool change_membership(const raft::rpc::configuration& target, const membership_type& done);
+
+		//! The membership in force: the latest in the log
+		const raft::rpc::configuration& configuration() const;
+
+		//! True if node could take over leadership promptly: we're leading,
+		//! and it votes, has answered this round of heartbeats or the last
+		//! and lacks only the entries in flight to it.
+		bool caught_up(const std::string& node) const;
+
 		std::string id() const;
 
 		std::vector<std::string> nodes() const;
@@ -122,14 +360,117 @@ namespace raft
 
 		const Log& log() const;
 
+		//! Appends an entry to the log.
+		/*!
+		 *  Throws std::logic_error if we're not leading, or are handing over
+		 *  leadership.
+		 */
 		void append(const Json::Value& root);
 
+		//! Appends a batch of entries, then sends them straight on.
+		/*!
+		 *  Followers whose logs match ours are sent the new entries now,
+		 *  rather than at the next heartbeat, so a batch costs one round of
+		 *  append_entries. Throws std::logic_error if we're not leading, or
+		 *  are handing over leadership.
+		 */
+		void append(const std::vector<Json::Value>& batch);
+
+		//! Makes the log's buffered writes durable.
+		/*!
+		 *  Responses to RPCs that wrote to the log must not be sent before this
+		 *  has been called. A leader's own entries only count towards a
+		 *  majority once they're durable, so this may advance the commit index.
+		 */
+		void sync();
+
+		//! Tells followers the commit index has advanced.
+		/*!
+		 *  Followers not yet sent the current commit index are sent
+		 *  append_entries now rather than at the next heartbeat. Requested
+		 *  through Handlers::request_notify as the commit index advances, so
+		 *  several advances share one round; without a handler followers
+		 *  hear of commits with the next heartbeat or entries.
+		 */
+		void notify_commit();
+
+		//! Compacts the log with a snapshot requested through the handlers.
+		/*!
+		 *  If a checkpoint of the applied state was asked for instead, it's
+		 *  written alongside the log and the log's left as it is.
+		 *
+		 *  \param index The index passed to Handlers::request_snapshot
+		 *  \param state The committed state after applying entries up to index
+		 */
+		void snapshot(uint32_t index, const Json::Value& state);
+
 	protected:
+		//! What a leader knows about a follower's log.
+		/*!
+		 *  Once the logs are known to match, batches of entries are sent
+		 *  without waiting for each to be acknowledged: next_index runs ahead
+		 *  of match_index by up to the pipeline window's worth of batches.
+		 */
+		struct Progress
+		{
+			//! The next entry to send
+			uint32_t next_index;
+
+			//! The last entry known to be replicated
+			uint32_t match_index;
+
+			//! True while searching for the point where the logs match; then
+			//! only empty probes are sent.
+			bool probing;
+
+			//! The last index of each unacknowledged batch, oldest first
+			std::deque<uint32_t> in_flight;
+
+			//! The latest heartbeat round the node has answered
+			uint32_t read_seq;
+
+			//! The commit index last sent to the node
+			uint32_t commit_sent;
+		};
+
+		//! A read waiting for a heartbeat round to be answered by a majority;
+		//! called with the read index, or false if leadership is lost.
+		struct PendingRead
+		{
+			uint32_t read_seq;
+			std::function<void (bool, uint32_t)> confirmed;
+		};
+
 		const uint32_t transfer_limit_;
+		const uint32_t pipeline_window_;
+		const uint32_t snapshot_interval_;
+		const uint32_t checkpoint_interval_;
+		const uint32_t snapshot_chunk_size_;
+		const std::chrono::milliseconds lease_duration_;
+		const bool pre_vote_;
 		const std::string id_;
+
+		//! Every other member
 		std::vector<std::string> nodes_;
 		boost::optional<std::string> leader_;
 
+		//! The membership in force
+		raft::rpc::configuration configuration_;
+
+		//! The membership as of base_configuration_index_, before any
+		//! configurations left in the log
+		raft::rpc::configuration base_configuration_;
+		uint32_t base_configuration_index_;
+
+		//! The configurations in the log after the base, by index
+		std::map<uint32_t, raft::rpc::configuration> configurations_;
+
+		//! Where the base configuration is kept once it's been changed
+		const std::string membership_file_;
+
+		//! Called once the membership change in progress is over
+		membership_type membership_done_;
+
 		Log log_;
 
 		Status state_;
@@ -139,13 +480,73 @@ namespace raft
 		//volatile state on all servers
 		uint32_t last_applied_;
 
+		//! True while a requested snapshot hasn't been taken
+		bool snapshot_requested_;
+
+		//! True if the snapshot requested is only a checkpoint
+		bool checkpoint_requested_;
+
+		//! The index of the last applied state checkpointed
+		uint32_t checkpoint_index_;
+
+		//! Where the applied state is checkpointed
+		const std::string checkpoint_file_;
+
+		//! Confirmed reads waiting for entries up to their read index to be
+		//! applied
+		std::multimap<uint32_t, read_type> applying_reads_;
+
+		//volatile state on followers
+
+		//! The last included index of the snapshot being received
+		uint32_t incoming_snapshot_index_;
+
+		//! The chunks of the snapshot being received so far
+		std::string incoming_snapshot_;
+
+		//! When we last heard from the leader; votes aren't granted for a
+		//! lease's length afterwards
+		std::chrono::steady_clock::time_point last_heard_;
+
+		//! Reads sent to the leader to confirm, by their ID
+		std::unordered_map<uint32_t, read_type> forwarded_reads_;
+		uint32_t next_read_id_;
+
 		//volatile state on candidates
 		std::set<std::string> votes_;
 
+		//! True while asking whether we could win the next term's election
+		bool pre_voting_;
+
+		//! The nodes that say we could
+		std::set<std::string> pre_votes_;
+
 		//volatile state on leaders
 
-		//! A map to each node's next_index and match_index
-		std::unordered_map<std::string, std::tuple<uint32_t, uint32_t, bool>> client_index_;
+		//! A map to each node's replication progress
+		std::unordered_map<std::string, Progress> client_index_;
+
+		//! Snapshots being sent to lagging nodes: the snapshot index and the
+		//! offset of the next chunk.
+		std::unordered_map<std::string, std::tuple<uint32_t, uint32_t>> snapshot_transfers_;
+
+		//! The current heartbeat round; each append_entries carries it
+		uint32_t read_seq_;
+
+		//! Reads waiting on a heartbeat round, in order of round
+		std::deque<PendingRead> pending_reads_;
+
+		//! When recent heartbeat rounds were sent, for the lease
+		std::deque<std::tuple<uint32_t, std::chrono::steady_clock::time_point>> read_seq_sent_;
+
+		//! The leader lease runs until this
+		std::chrono::steady_clock::time_point lease_expiry_;
+
+		//! The node leadership is being handed to, the leader timeouts left
+		//! before giving up and the handler to call when it's over
+		boost::optional<std::string> transfer_target_;
+		uint32_t transfer_rounds_;
+		transfer_type transfer_done_;
 
 		//! Helper function to apply all committed log entries
 		void commit_available();
@@ -160,23 +561,123 @@ namespace raft
 		 */
 		void check_commit();
 
+		//! Writes an entry to the log as leader, even during a transfer, as
+		//! the nop that commits earlier terms' entries has to be.
+		void write_entry(const Json::Value& root);
+
 		//! Performs a global heartbeat: up-to-date nodes are sent empty
 		//! append_requests while others are sent the next batch of entries.
 		void heartbeat();
 
 		//! Performs a heartbeat at a single node.
+		/*!
+		 *  A node whose log matches ours is sent batches of entries until it
+		 *  has them all or the pipeline window is full. Otherwise it's sent an
+		 *  empty append_entries checking its log up to next_index.
+		 */
 		void heartbeat(const std::string& node);
 
+		//! Sends the entries [from, to] to node; to < from sends none.
+		void send_entries(const std::string& node, uint32_t from, uint32_t to);
+
+		//! Sends the next chunk of the snapshot to a node that's too far behind
+		//! for the log.
+		void send_snapshot(const std::string& node);
+
+		//! Confirms we're still leading, calling confirmed with the read
+		//! index once we know.
+		void confirm_read(const std::function<void (bool, uint32_t)>& confirmed);
+
+		//! Calls f once entries up to index have been applied
+		void apply_read(uint32_t index, const read_type& f);
+
+		//! Confirms the pending reads whose heartbeat round a majority have
+		//! answered, extending the lease.
+		void check_reads();
+
+		//! True if every committed entry is known to be committed: reads
+		//! can't be served by a new leader until it is.
+		bool commit_current() const;
+
+		//! Fails the reads waiting on leadership.
+		void abandon_reads();
+
+		//! Sends timeout_now to the transfer target if its log matches
+		//! ours, otherwise sends it the entries it's missing.
+		void check_transfer();
+
+		//! Ends a leadership transfer, calling its handler.
+		void end_transfer(bool transferred);
+
+		//! Handles the stepping down and term update common to RPCs from a
+		//! leader.
+		void follow(uint32_t term, const std::string& leader_id);
+
 		//! Handles transition to follower
 		void transition_follower();
 
 		//! Handles transition to candidate
-		void transition_candidate();
+		/*!
+		 *  \param transfer True if the leader handed over to us, so voters
+		 *  needn't wait out its lease.
+		 */
+		void transition_candidate(bool transfer = false);
 
 		//! Handles transition to leader
 		void transition_leader();
 
-		//! Calculates the number of nodes required for a majority
-		uint32_t calculate_majority();
+		//! Asks the other nodes whether we could win an election for the
+		//! next term, without taking it up.
+		void start_pre_vote();
+
+		//! Takes up the next term and campaigns for it
+		void start_election();
+
+		//! True if the candidate's log is at least as up-to-date as ours
+		bool up_to_date(const raft::rpc::request_vote& rpc) const;
+
+		//! True if node votes and counts towards a majority
+		bool voting(const std::string& node) const;
+
+		//! The highest value a majority of voters have reached, of both old
+		//! and new voters if the configuration is joint.
+		uint32_t quorum_value(const std::function<uint32_t (const std::string&)>& value) const;
+
+		//! Notes a configuration appended to the log at index, doing nothing
+		//! if action isn't one.
+		void record_configuration(uint32_t index, const Json::Value& action);
+
+		//! Forgets the configurations from index on, as the log is about to
+		//! be truncated there.
+		void truncate_configurations(uint32_t index);
+
+		//! Makes the membership the latest in the log, telling the handlers
+		//! if it's changed.
+		void update_configuration();
+
+		//! The index of the configuration in force
+		uint32_t configuration_index() const;
+
+		//! The configuration in force once the log reached index
+		raft::rpc::configuration configuration_at(uint32_t index) const;
+
+		//! Replaces the configurations up to index, which are about to leave
+		//! the log, with the one in force there, keeping it alongside the
+		//! log.
+		void rebase_configuration(uint32_t index, const raft::rpc::configuration& configuration);
+
+		//! Moves a membership change on once its latest configuration has
+		//! been committed.
+		void advance_configuration();
+
+		//! Ends a membership change, calling its handler.
+		void end_membership(bool changed);
+
+		//! Restores the applied state from the checkpoint, if there's one
+		//! later than the snapshot.
+		void restore_checkpoint();
+
+		//! Writes the applied state as of index to the checkpoint file.
+		void write_checkpoint(uint32_t index, const Json::Value& state);
 	};
 }
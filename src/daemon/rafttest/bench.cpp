@@ -0,0 +1,119 @@
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include <json/json.h>
+
+#include "../raftrpc.hpp"
+#include "../raftstate.hpp"
+#include "../raftsim.hpp"
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+static double ms(raft::Simulation::duration d)
+{
+	return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static void report(const std::string& phase, const raft::Simulation::Stats& stats)
+{
+	std::cout << std::fixed << std::setprecision(2)
+		<< phase << ":\n"
+		<< "  proposed " << stats.proposed << ", accepted " << stats.accepted
+		<< ", committed " << stats.committed << "\n"
+		<< "  commits/s " << stats.commits_per_second() << "\n"
+		<< "  latency p50 " << ms(stats.latency_percentile(0.5)) << "ms"
+		<< ", p90 " << ms(stats.latency_percentile(0.9)) << "ms"
+		<< ", p99 " << ms(stats.latency_percentile(0.99)) << "ms\n"
+		<< "  elections " << stats.elections
+		<< ", downtime " << ms(stats.downtime) << "ms\n";
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t nodes, rate, length, min_latency, max_latency;
+	raft::Simulation::Options options;
+
+	po::options_description desc("Benchmarks raft::State on a simulated network");
+	desc.add_options()
+		("help", "Print this help message")
+		("nodes", po::value<uint32_t>(&nodes)->default_value(5), "The number of nodes in the cluster")
+		("rate", po::value<uint32_t>(&rate)->default_value(1000), "Proposals per second")
+		("length", po::value<uint32_t>(&length)->default_value(30), "Seconds of virtual time each phase runs for")
+		("min-latency", po::value<uint32_t>(&min_latency)->default_value(1), "The fastest a message is delivered, in ms")
+		("max-latency", po::value<uint32_t>(&max_latency)->default_value(5), "The slowest a message is delivered, in ms")
+		("loss", po::value<double>(&options.loss)->default_value(0.01), "The chance each message is lost")
+		("seed", po::value<uint32_t>(&options.seed)->default_value(1), "Seeds the simulation")
+		("no-pre-vote", "Disable the pre-vote phase");
+
+	po::variables_map vm;
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	}
+	catch(const po::error& ex)
+	{
+		std::cerr << ex.what() << "\n" << desc;
+		return 1;
+	}
+
+	if(vm.count("help") || nodes == 0)
+	{
+		std::cout << desc;
+		return 0;
+	}
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	options.min_latency = milliseconds(min_latency);
+	options.max_latency = milliseconds(max_latency);
+	options.pre_vote = !vm.count("no-pre-vote");
+
+	std::vector<std::string> ids;
+	for(uint32_t i = 0; i < nodes; ++i)
+		ids.push_back("node" + std::to_string(i));
+
+	raft::Simulation sim(ids, options);
+	sim.run_until([&sim]() {return static_cast<bool>(sim.leader());}, seconds(60));
+	report("Initial election", sim.stats());
+
+	sim.reset_stats();
+	sim.load(seconds(length), rate);
+	report("Steady state", sim.stats());
+
+	//Cut the leader off with a minority, so the rest have to elect another
+	sim.reset_stats();
+	if(sim.leader())
+	{
+		const std::string old_leader = *sim.leader();
+		std::vector<std::string> minority{old_leader}, majority;
+		for(const std::string& id : ids)
+			if(id != old_leader)
+				(minority.size() < (nodes - 1) / 2 ? minority : majority).push_back(id);
+
+		sim.partition({minority, majority});
+	}
+	sim.load(seconds(length), rate);
+	report("Leader partitioned", sim.stats());
+
+	sim.reset_stats();
+	sim.heal();
+	sim.load(seconds(length), rate);
+	report("Healed", sim.stats());
+
+	return 0;
+}
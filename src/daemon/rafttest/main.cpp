@@ -139,7 +139,7 @@ void Control::attempt_connection(const std::string& endpoint)
 					if(!pool_.exists(endpoint))
 					{
 						BOOST_LOG_TRIVIAL(info) << "Connected to: " << endpoint;
-						conn->queue_write(id_ + '\n');
+						conn->queue_write(id_ + '\n', util::control);
 						pool_.add_connection(endpoint, conn);
 					}
 				}
@@ -28,9 +28,17 @@ struct connection_mock
 		:open_(true)
 	{}
 
-	void queue_write(const std::string& msg)
+	void queue_write(const std::string& msg, util::traffic_class cls = util::admin)
 	{
 		write_queue_.push_back(msg);
+		classes_.push_back(cls);
+	}
+
+	void queue_write(const std::shared_ptr<const std::string>& msg,
+			util::traffic_class cls = util::admin)
+	{
+		queue_write(*msg, cls);
+		shared_.push_back(msg);
 	}
 
 	template <typename Callable>
@@ -64,6 +72,8 @@ struct connection_mock
 	std::function<void(const std::string&)> read_handler_;
 	std::function<void(const std::string&)> close_handler_;
 	std::vector<std::string> write_queue_;
+	std::vector<std::shared_ptr<const std::string>> shared_;
+	std::vector<util::traffic_class> classes_;
 	bool open_;
 };
 
@@ -124,6 +134,7 @@ BOOST_AUTO_TEST_CASE(dispatch_callback_to_read_handler)
 	BOOST_REQUIRE_EQUAL(cm2->write_queue_.size(), 0);
 
 	BOOST_REQUIRE_EQUAL(cm->write_queue_[0], "Fnord foo bar");
+	BOOST_CHECK_EQUAL(cm->classes_[0], util::admin);
 }
 
 BOOST_AUTO_TEST_CASE(broadcast_writes_to_all)
@@ -151,6 +162,32 @@ BOOST_AUTO_TEST_CASE(broadcast_writes_to_all)
 	BOOST_REQUIRE_EQUAL(cm2->write_queue_[0], "Test message please ignore\n");
 }
 
+BOOST_AUTO_TEST_CASE(broadcast_shares_one_buffer)
+{
+	dispatch_mock dm;
+	auto cm = std::make_shared<connection_mock>();
+	auto cm2 = std::make_shared<connection_mock>();
+	auto cm3 = std::make_shared<connection_mock>();
+
+	connection_pool_type sut(dm.get_function(), {{"1", cm}, {"2", cm2}, {"3", cm3}});
+
+	auto msg = std::make_shared<const std::string>("Test message please ignore\n");
+	sut.broadcast(msg, {"1", "3", "4"});
+
+	BOOST_REQUIRE_EQUAL(cm->shared_.size(), 1);
+	BOOST_REQUIRE_EQUAL(cm2->shared_.size(), 0);
+	BOOST_REQUIRE_EQUAL(cm3->shared_.size(), 1);
+
+	//Queued without copies
+	BOOST_CHECK_EQUAL(cm->shared_[0], msg);
+	BOOST_CHECK_EQUAL(cm3->shared_[0], msg);
+
+	sut.broadcast(msg);
+	BOOST_REQUIRE_EQUAL(cm2->shared_.size(), 1);
+	BOOST_CHECK_EQUAL(cm2->shared_[0], msg);
+	BOOST_CHECK_EQUAL(cm2->classes_[0], util::admin);
+}
+
 BOOST_AUTO_TEST_CASE(targeted_does_not_broadcast)
 {
 	dispatch_mock dm;
@@ -168,6 +205,12 @@ BOOST_AUTO_TEST_CASE(targeted_does_not_broadcast)
 	BOOST_REQUIRE_EQUAL(cm2->write_queue_.size(), 0);
 
 	BOOST_REQUIRE_EQUAL(cm->write_queue_[0], "Hello from the system under test\n");
+
+	sut.send_targeted(cm_uid, "Bulk from the system under test\n", util::bulk);
+	BOOST_REQUIRE_EQUAL(cm->classes_.size(), 2);
+	//Unclassified traffic mustn't jump ahead of raft
+	BOOST_CHECK_EQUAL(cm->classes_[0], util::admin);
+	BOOST_CHECK_EQUAL(cm->classes_[1], util::bulk);
 }
 
 BOOST_AUTO_TEST_CASE(targeted_on_non_existant_throws)
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <tuple>
+#include <set>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -27,12 +28,15 @@ BOOST_GLOBAL_FIXTURE(disable_logging)
 struct callback_details
 {
 	callback_details()
-		:valid_(false)
+		:valid_(false),
+		framed_(false)
 	{}
 
 	bool valid_;
+	bool framed_;
 	std::string endpoint_;
 	std::vector<std::string> msgs_;
+	std::vector<util::traffic_class> classes_;
 };
 
 struct connection_pool_mock
@@ -73,10 +77,18 @@ struct connection_pool_mock
 			return details_->endpoint_;
 		}
 
-		void operator()(const std::string& msg)
+		bool framed() const
+		{
+			throw_if_invalid();
+
+			return details_->framed_;
+		}
+
+		void operator()(const std::string& msg, util::traffic_class cls = util::control)
 		{
 			throw_if_invalid();
 			details_->msgs_.push_back(msg);
+			details_->classes_.push_back(cls);
 		}
 
 
@@ -90,17 +102,41 @@ struct connection_pool_mock
 		callback_details* details_;
 	};
 
-	void send_targeted(const std::string& to, const std::string& msg)
+	void send_targeted(const std::string& to, const std::string& msg,
+			util::traffic_class cls = util::control)
 	{
 		send_targeted_args_.push_back(std::make_tuple(to, msg));
+		classes_.push_back(cls);
 	};
 
+	void send_targeted(const std::string& to, const std::shared_ptr<const std::string>& msg,
+			util::traffic_class cls = util::control)
+	{
+		send_targeted(to, *msg, cls);
+		shared_.push_back(msg);
+	}
+
+	void broadcast(const std::shared_ptr<const std::string>& msg, const std::vector<std::string>& to,
+			util::traffic_class cls = util::control)
+	{
+		for(const std::string& node : to)
+			send_targeted(node, msg, cls);
+	}
+
 	bool exists(const std::string& node) const
 	{
 		return true;
 	}
 
+	bool framed(const std::string& node) const
+	{
+		return framed_.count(node);
+	}
+
 	std::vector<std::tuple<std::string, std::string>> send_targeted_args_;
+	std::set<std::string> framed_;
+	std::vector<std::shared_ptr<const std::string>> shared_;
+	std::vector<util::traffic_class> classes_;
 };
 
 typedef  TopLevelDispatch<connection_pool_mock> dispatch_type;
@@ -190,6 +226,97 @@ BOOST_AUTO_TEST_CASE(callbacks_pass_through)
 	BOOST_REQUIRE_EQUAL(actual_root, expected_root);
 }
 
+BOOST_AUTO_TEST_CASE(serialised_messages_spliced)
+{
+	Module m1;
+
+	connection_pool_mock cpm;
+	dispatch_type sut(cpm);
+
+	sut.connect_dispatcher("m1", m1.handler());
+	sut.send_serialised("m1", "thud", "m2", "{\"Hail!\":\"Eris\"}\n");
+
+	BOOST_REQUIRE_EQUAL(cpm.send_targeted_args_.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(cpm.send_targeted_args_[0]), "thud");
+
+	const std::string& msg = std::get<1>(cpm.send_targeted_args_[0]);
+	BOOST_CHECK_EQUAL(msg.find('\n'), msg.size() - 1);
+
+	Json::Value expected_root;
+	expected_root["module"] = "m2";
+	expected_root["reply"] = "m1";
+	expected_root["content"]["Hail!"] = "Eris";
+
+	Json::Value actual_root;
+	Json::Reader r;
+	BOOST_REQUIRE(r.parse(msg, actual_root));
+
+	BOOST_REQUIRE_EQUAL(actual_root, expected_root);
+}
+
+BOOST_AUTO_TEST_CASE(grouped_dispatch_targets_group)
+{
+	Module m0;
+	Module m1;
+
+	connection_pool_mock cpm;
+	dispatch_type sut(cpm);
+
+	sut.connect_dispatcher("m", m0.handler());
+	sut.connect_dispatcher("m", 1, m1.handler());
+
+	callback_details cbd;
+	connection_pool_mock::Callback cb(cbd);
+
+	sut(R"({"module":"m","reply":"m","group":1,"content":"foobar"})", cb);
+	BOOST_REQUIRE_EQUAL(m0.calls_.size(), 0);
+	BOOST_REQUIRE_EQUAL(m1.calls_.size(), 1);
+
+	sut(R"({"module":"m","reply":"m","content":"foobar"})", cb);
+	BOOST_REQUIRE_EQUAL(m0.calls_.size(), 1);
+	BOOST_REQUIRE_EQUAL(m1.calls_.size(), 1);
+
+	//Replies go back to the same group
+	std::get<1>(m1.calls_[0])(Json::Value("fnord"));
+	BOOST_REQUIRE_EQUAL(cbd.msgs_.size(), 1);
+
+	Json::Value actual_root;
+	Json::Reader r;
+	BOOST_REQUIRE(r.parse(cbd.msgs_[0], actual_root));
+	BOOST_CHECK_EQUAL(actual_root["group"].asUInt(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(grouped_sends_tagged_with_group)
+{
+	Module m1;
+
+	connection_pool_mock cpm;
+	dispatch_type sut(cpm);
+
+	auto send = sut.connect_dispatcher("m1", 2, m1.handler());
+	send("thud", "m2", Json::Value("Hail Eris!"));
+	sut.send_serialised("m1", "thud", "m2", "\"Hail Eris!\"\n", 2);
+
+	BOOST_REQUIRE_EQUAL(cpm.send_targeted_args_.size(), 2);
+	for(const auto& args : cpm.send_targeted_args_)
+	{
+		Json::Value expected_root;
+		expected_root["module"] = "m2";
+		expected_root["reply"] = "m1";
+		expected_root["group"] = 2;
+		expected_root["content"] = "Hail Eris!";
+
+		Json::Value actual_root;
+		Json::Reader r;
+		BOOST_REQUIRE(r.parse(std::get<1>(args), actual_root));
+		BOOST_CHECK_EQUAL(actual_root, expected_root);
+	}
+
+	//The same module can connect once per group
+	BOOST_CHECK_NO_THROW(sut.connect_dispatcher("m1", m1.handler()));
+	BOOST_CHECK_THROW(sut.connect_dispatcher("m1", 2, m1.handler()), dispatch_type::dispatcher_exists);
+}
+
 BOOST_AUTO_TEST_CASE(dispatch_to_unknown_silent)
 {
 	Module m1;
@@ -289,3 +416,180 @@ BOOST_AUTO_TEST_CASE(bad_json_bad_format)
 	BOOST_REQUIRE(root["content"].isMember("error"));
 
 }
+
+//Strip the length prefix, as a framed connection does
+static std::string unprefix(const std::string& frame)
+{
+	BOOST_REQUIRE_GE(frame.size(), util::frame::length_size);
+	return frame.substr(util::frame::length_size);
+}
+
+BOOST_AUTO_TEST_CASE(frames_dispatched_to_group)
+{
+	Module m0;
+	Module m1;
+
+	connection_pool_mock cpm;
+	dispatch_type sut(cpm);
+
+	sut.connect_dispatcher("m", m0.handler());
+	sut.connect_dispatcher("m", 1, m1.handler());
+
+	callback_details cbd;
+	cbd.framed_ = true;
+	connection_pool_mock::Callback cb(cbd);
+
+	sut(unprefix(util::frame::encode("m", "thud", 1, util::frame::json, R"({"Hail!":"Eris"})")), cb);
+	BOOST_REQUIRE_EQUAL(m0.calls_.size(), 0);
+	BOOST_REQUIRE_EQUAL(m1.calls_.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(m1.calls_[0]), R"({"Hail!":"Eris"})");
+
+	//Replies to frames are frames, to the reply module in the same group
+	std::get<1>(m1.calls_[0])(Json::Value("fnord"));
+	BOOST_REQUIRE_EQUAL(cbd.msgs_.size(), 1);
+
+	const std::string reply = unprefix(cbd.msgs_[0]);
+	auto hdr = util::frame::decode(reply);
+	BOOST_CHECK_EQUAL(hdr.module, "thud");
+	BOOST_CHECK_EQUAL(hdr.reply, "m");
+	BOOST_CHECK_EQUAL(hdr.group, 1);
+	BOOST_CHECK_EQUAL(json_help::parse(reply.substr(hdr.payload_offset)).asString(), "fnord");
+}
+
+BOOST_AUTO_TEST_CASE(framed_nodes_sent_frames)
+{
+	Module m1;
+
+	connection_pool_mock cpm;
+	cpm.framed_.insert("thud");
+	dispatch_type sut(cpm);
+
+	auto send = sut.connect_dispatcher("m1", 2, m1.handler());
+	send("thud", "m2", Json::Value("Hail Eris!"));
+	send("fnord", "m2", Json::Value("Hail Eris!"));
+
+	BOOST_REQUIRE_EQUAL(cpm.send_targeted_args_.size(), 2);
+
+	const std::string frame = std::get<1>(cpm.send_targeted_args_[0]);
+	BOOST_CHECK_EQUAL(frame.size() - util::frame::length_size,
+			util::frame::buffer()(frame.data(), frame.size()).at(0).size());
+
+	auto hdr = util::frame::decode(unprefix(frame));
+	BOOST_CHECK_EQUAL(hdr.type, util::frame::json);
+	BOOST_CHECK_EQUAL(hdr.module, "m2");
+	BOOST_CHECK_EQUAL(hdr.reply, "m1");
+	BOOST_CHECK_EQUAL(hdr.group, 2);
+
+	//Unframed nodes still get lines
+	BOOST_CHECK(!util::frame::is_frame(std::get<1>(cpm.send_targeted_args_[1])));
+	BOOST_CHECK_EQUAL(json_help::parse(std::get<1>(cpm.send_targeted_args_[1]))["group"].asUInt(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(binary_payloads_only_to_framed_nodes)
+{
+	connection_pool_mock cpm;
+	cpm.framed_.insert("thud");
+	dispatch_type sut(cpm);
+
+	std::vector<std::string> payloads;
+	sut.connect_binary_dispatcher("m1", 0,
+			[&payloads](const std::string& payload, const dispatch_type::Callback&)
+			{
+				payloads.push_back(payload);
+			});
+
+	const std::string payload("\0\n\xff", 3);
+	BOOST_CHECK(sut.send_binary("m1", "thud", "m1", payload));
+	BOOST_CHECK(!sut.send_binary("m1", "fnord", "m1", payload));
+	BOOST_REQUIRE_EQUAL(cpm.send_targeted_args_.size(), 1);
+
+	callback_details cbd;
+	cbd.framed_ = true;
+	connection_pool_mock::Callback cb(cbd);
+
+	sut(unprefix(std::get<1>(cpm.send_targeted_args_[0])), cb);
+	BOOST_REQUIRE_EQUAL(payloads.size(), 1);
+	BOOST_CHECK_EQUAL(payloads[0], payload);
+}
+
+BOOST_AUTO_TEST_CASE(bad_frame_error_response)
+{
+	connection_pool_mock cpm;
+	dispatch_type sut(cpm);
+
+	callback_details cbd;
+	connection_pool_mock::Callback cb(cbd);
+
+	std::string frame = unprefix(util::frame::encode("m1", "m1", 0, util::frame::json, "{}"));
+	frame.resize(8);
+	sut(frame, cb);
+
+	BOOST_REQUIRE_EQUAL(cbd.msgs_.size(), 1);
+	BOOST_CHECK(json_help::parse(cbd.msgs_[0])["content"].isMember("error"));
+}
+
+BOOST_AUTO_TEST_CASE(shared_messages_encoded_once_per_format)
+{
+	connection_pool_mock cpm;
+	cpm.framed_.insert("thud");
+	cpm.framed_.insert("foo");
+	dispatch_type sut(cpm);
+
+	dispatch_type::SharedMessage msg("m1", "m2", "{\"Hail!\":\"Eris\"}\n", 2);
+	sut.broadcast_shared({"fnord", "thud", "foo", "bar"}, msg);
+	sut.send_shared("fnord", msg);
+
+	BOOST_REQUIRE_EQUAL(cpm.shared_.size(), 5);
+
+	std::set<std::shared_ptr<const std::string>> buffers(cpm.shared_.begin(), cpm.shared_.end());
+	BOOST_CHECK_EQUAL(buffers.size(), 2);
+
+	for(const auto& args : cpm.send_targeted_args_)
+	{
+		const std::string& node = std::get<0>(args);
+		const std::string& sent = std::get<1>(args);
+
+		BOOST_CHECK_EQUAL(util::frame::is_frame(unprefix(sent)), cpm.framed_.count(node) == 1);
+		if(!cpm.framed_.count(node))
+		{
+			Json::Value expected_root;
+			expected_root["module"] = "m2";
+			expected_root["reply"] = "m1";
+			expected_root["group"] = 2;
+			expected_root["content"]["Hail!"] = "Eris";
+
+			BOOST_CHECK_EQUAL(json_help::parse(sent), expected_root);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(traffic_class_by_target_module)
+{
+	Module m1;
+
+	connection_pool_mock cpm;
+	dispatch_type sut(cpm);
+	sut.set_traffic_class("m1", util::control);
+	sut.set_traffic_class("m2", util::bulk);
+
+	auto send = sut.connect_dispatcher("m1", m1.handler());
+	send("thud", "m2", Json::Value("Hail Eris!"));
+	send("thud", "m1", Json::Value("Hail Eris!"));
+	send("thud", "m3", Json::Value("Hail Eris!"));
+
+	BOOST_REQUIRE_EQUAL(cpm.classes_.size(), 3);
+	BOOST_CHECK_EQUAL(cpm.classes_[0], util::bulk);
+	BOOST_CHECK_EQUAL(cpm.classes_[1], util::control);
+	BOOST_CHECK_EQUAL(cpm.classes_[2], util::admin);
+
+	//Replies take the class of the module they go to
+	callback_details cbd;
+	connection_pool_mock::Callback cb(cbd);
+	sut(R"({"module":"m1","reply":"m2","content":"foobar"})", cb);
+
+	BOOST_REQUIRE_EQUAL(m1.calls_.size(), 1);
+	std::get<1>(m1.calls_[0])(Json::Value("fnord"));
+
+	BOOST_REQUIRE_EQUAL(cbd.classes_.size(), 1);
+	BOOST_CHECK_EQUAL(cbd.classes_[0], util::bulk);
+}
@@ -67,8 +67,21 @@ struct client_mock
 		return commit_add_.connect(std::forward<Callable>(f));
 	}
 
+	template <typename Callable>
+	boost::signals2::connection connect_restore(Callable&& f)
+	{
+		++restore_connections_;
+		return restore_.connect(std::forward<Callable>(f));
+	}
+
 	bool exists(const std::string& key) const noexcept;
 
+	bool colocated(const std::string& key, const std::string& other) const noexcept
+	{
+		colocated_args_.emplace_back(key, other);
+		return colocated_;
+	}
+
 	std::tuple<std::string, std::string> operator[] (const std::string& key)
 		noexcept(false);
 
@@ -83,6 +96,13 @@ struct client_mock
 	uint32_t commit_delete_connections_;
 	boost::signals2::signal <void (const raft::request::Add&)> commit_add_;
 	uint32_t commit_add_connections_;
+	boost::signals2::signal <void (const std::unordered_map<std::string,
+			std::tuple<std::string, std::string>>&)> restore_;
+	uint32_t restore_connections_;
+
+	//! What colocated returns; false stands in for keys in different raft groups
+	bool colocated_;
+	mutable std::vector<std::tuple<std::string, std::string>> colocated_args_;
 };
 
 struct changetx_mock
@@ -155,6 +175,27 @@ struct changetx_mock
 
 	std::vector<std::tuple<std::string, scratch>> move_args_;
 
+	scratch open(const std::string& key, const std::string& version)
+	{
+		return scratch(key, version, craven::decode_path(key));
+	}
+
+	void kill(const scratch& scratch_info)
+	{
+		kill_args_.push_back(scratch_info);
+	}
+
+	std::vector<scratch> kill_args_;
+
+	void handle_new_version(const std::string& from, const std::string& key,
+			const std::string& new_version, const std::string& old_version) noexcept
+	{
+		new_version_args_.emplace_back(from, key, new_version, old_version);
+	}
+
+	std::vector<std::tuple<std::string, std::string, std::string, std::string>>
+		new_version_args_;
+
 
 	boost::signals2::signal<void (const std::string&, const std::string&)> notify_arrival_;
 	uint32_t connections_;
@@ -200,7 +241,9 @@ client_mock::client_mock()
 	:commit_update_connections_(0),
 	commit_rename_connections_(0),
 	commit_delete_connections_(0),
-	commit_add_connections_(0)
+	commit_add_connections_(0),
+	restore_connections_(0),
+	colocated_(true)
 {
 }
 
@@ -271,6 +314,7 @@ BOOST_FIXTURE_TEST_CASE(handlers_installed, test_fixture)
 	BOOST_CHECK_EQUAL(client_.commit_rename_connections_, 1);
 	BOOST_CHECK_EQUAL(client_.commit_delete_connections_, 1);
 	BOOST_CHECK_EQUAL(client_.commit_add_connections_, 1);
+	BOOST_CHECK_EQUAL(client_.restore_connections_, 1);
 
 	BOOST_CHECK_EQUAL(changetx_.connections_, 1);
 }
@@ -618,6 +662,46 @@ BOOST_FIXTURE_TEST_CASE(rename_key_does_not_exist_acts_like_add, test_fixture)
 				"a4e3e1394621ec2301076e39c6e5585bb1d665dc");
 }
 
+BOOST_FIXTURE_TEST_CASE(rename_between_groups_refused, test_fixture)
+{
+	changetx_.existing_entries_ = {
+		{"%2ffoo%2fbar",
+				"a4e3e1394621ec2301076e39c6e5585bb1d665dc"}
+		};
+
+	State sut(client_, changetx_);
+
+	sut.commit_add(raft::request::Add("eris", "%2ffoo%2fbar",
+				"a4e3e1394621ec2301076e39c6e5585bb1d665dc"));
+
+	client_.colocated_ = false;
+	BOOST_CHECK_EQUAL(sut.rename("/foo/bar", "/baz"), -EXDEV);
+	BOOST_CHECK_EQUAL(sut.rename("/foo", "/thud"), -EXDEV);
+
+	//A directory stands for the keys beneath it
+	BOOST_REQUIRE_EQUAL(client_.colocated_args_.size(), 2);
+	BOOST_CHECK_EQUAL(std::get<0>(client_.colocated_args_[0]), "%2ffoo%2fbar");
+	BOOST_CHECK_EQUAL(std::get<1>(client_.colocated_args_[0]), "%2fbaz");
+	BOOST_CHECK_EQUAL(std::get<0>(client_.colocated_args_[1]), "%2ffoo%2f_");
+	BOOST_CHECK_EQUAL(std::get<1>(client_.colocated_args_[1]), "%2fthud%2f_");
+
+	//Nothing was asked of raft, and the file stays put
+	BOOST_CHECK(client_.requests_.empty());
+	BOOST_REQUIRE_EQUAL(sut.dcache_.count("/foo"), 1);
+	BOOST_REQUIRE_EQUAL(sut.dcache_["/foo"].size(), 2);
+	BOOST_CHECK(boost::range::find_if(sut.dcache_["/foo"],
+			[](const State::node_info& info)
+			{
+				return info.name == "bar";
+			}) != sut.dcache_["/foo"].end());
+
+	BOOST_CHECK(sut.sync_cache_.empty());
+
+	//Within a group the same rename goes ahead, to be synced later
+	client_.colocated_ = true;
+	BOOST_CHECK_EQUAL(sut.rename("/foo/bar", "/baz"), 0);
+	BOOST_CHECK_EQUAL(sut.sync_cache_.count("/baz"), 1);
+}
 
 BOOST_FIXTURE_TEST_CASE(update_normal_executes, test_fixture)
 {
@@ -1036,3 +1120,67 @@ BOOST_FIXTURE_TEST_CASE(delete_tombstone_clean_and_remove_from_sync_cache, test_
 	BOOST_REQUIRE_EQUAL(sut.dcache_.count("/foo/bar"), 0);
 }
 
+
+BOOST_FIXTURE_TEST_CASE(restore_reconciles_clean_nodes, test_fixture)
+{
+	changetx_.existing_entries_ = {
+		{"%2ffoo%2fbar", "a4e3e1394621ec2301076e39c6e5585bb1d665dc"},
+		{"%2fgone%2fbaz", "a4e3e1394621ec2301076e39c6e5585bb1d665dc"},
+		{"%2fnew%2ffnord", "5898511673f223c4adb65ddce23981a2d87dec5c"}
+		};
+
+	State sut(client_, changetx_);
+
+	sut.commit_add(raft::request::Add("eris", "%2ffoo%2fbar",
+				"a4e3e1394621ec2301076e39c6e5585bb1d665dc"));
+	sut.commit_add(raft::request::Add("eris", "%2fgone%2fbaz",
+				"a4e3e1394621ec2301076e39c6e5585bb1d665dc"));
+
+	client_.restore_({
+			{"%2ffoo%2fbar", std::make_tuple("c0ffee", "eris")},
+			{"%2fnew%2ffnord", std::make_tuple("5898511673f223c4adb65ddce23981a2d87dec5c", "eris")},
+			{"%2fnew%2fkallisti", std::make_tuple("deadbeef", "discordia")}
+			});
+
+	//Keys missing from the snapshot are removed with their directories
+	BOOST_CHECK_EQUAL(sut.dcache_.count("/gone"), 0);
+
+	//Keys with new versions are pending until they arrive
+	BOOST_REQUIRE_EQUAL(sut.dcache_.count("/foo"), 1);
+	auto node_it = boost::range::find_if(sut.dcache_["/foo"],
+			[](const State::node_info& info)
+			{
+				return info.name == "bar";
+			});
+	BOOST_REQUIRE(node_it != sut.dcache_["/foo"].end());
+	BOOST_CHECK_EQUAL(node_it->state, State::node_info::pending);
+	BOOST_CHECK_EQUAL(node_it->version, "c0ffee");
+	BOOST_REQUIRE(node_it->previous_version);
+	BOOST_CHECK_EQUAL(*node_it->previous_version, "a4e3e1394621ec2301076e39c6e5585bb1d665dc");
+
+	//New keys are added
+	BOOST_REQUIRE_EQUAL(sut.dcache_.count("/new"), 1);
+	node_it = boost::range::find_if(sut.dcache_["/new"],
+			[](const State::node_info& info)
+			{
+				return info.name == "fnord";
+			});
+	BOOST_REQUIRE(node_it != sut.dcache_["/new"].end());
+	BOOST_CHECK_EQUAL(node_it->state, State::node_info::clean);
+
+	node_it = boost::range::find_if(sut.dcache_["/new"],
+			[](const State::node_info& info)
+			{
+				return info.name == "kallisti";
+			});
+	BOOST_REQUIRE(node_it != sut.dcache_["/new"].end());
+	BOOST_CHECK_EQUAL(node_it->state, State::node_info::pending);
+
+	//Only the versions we don't hold are fetched, from where they came from
+	auto requests = changetx_.new_version_args_;
+	std::sort(requests.begin(), requests.end());
+	BOOST_REQUIRE_EQUAL(requests.size(), 2);
+	BOOST_CHECK(requests[0] == std::make_tuple("discordia", "%2fnew%2fkallisti", "deadbeef", ""));
+	BOOST_CHECK(requests[1] == std::make_tuple("eris", "%2ffoo%2fbar", "c0ffee",
+				"a4e3e1394621ec2301076e39c6e5585bb1d665dc"));
+}
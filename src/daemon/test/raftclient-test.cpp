@@ -581,3 +581,131 @@ BOOST_FIXTURE_TEST_CASE(leader_rename_new_key_exists_different_version_ignored,
 	BOOST_REQUIRE_EQUAL(send_request_args_.size(), 0);
 	BOOST_REQUIRE_EQUAL(append_to_log_args_.size(), 0);
 }
+
+BOOST_FIXTURE_TEST_CASE(snapshot_restores_committed_versions, test_fixture)
+{
+	raft::Client source("eris", handler_);
+
+	source.commit_handler(raft::request::Add("eris", "fnord", "foo"));
+	source.commit_handler(raft::request::Add("eris", "thud", "bar"));
+	source.commit_handler(raft::request::Delete("eris", "thud", "bar"));
+
+	raft::Client sut("discordia", handler_);
+	sut.commit_handler(raft::request::Add("eris", "thud", "baz"));
+
+	raft::Client::restore_map_type restored;
+	sut.connect_restore([&restored](const raft::Client::restore_map_type& versions)
+			{
+				restored = versions;
+			});
+
+	//Through JSON, as it'd be stored
+	sut.restore(json_help::parse(json_help::write(source.snapshot())));
+
+	BOOST_REQUIRE(sut.exists("fnord"));
+	BOOST_CHECK_EQUAL(std::get<0>(sut["fnord"]), "foo");
+	BOOST_CHECK_EQUAL(std::get<1>(sut["fnord"]), "eris");
+	BOOST_CHECK(!sut.exists("thud"));
+
+	BOOST_REQUIRE_EQUAL(restored.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(restored["fnord"]), "foo");
+
+	BOOST_REQUIRE_THROW(sut.restore(Json::Value("fnord")), std::runtime_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(read_waits_for_confirmation, test_fixture)
+{
+	std::vector<std::function<void (bool)>> confirmations;
+	raft::Client::Handlers handlers(
+			[](const std::string&, const Json::Value&) {},
+			[](const Json::Value&) {},
+			[this]() {return leader_;},
+			[&confirmations](const std::function<void (bool)>& f)
+			{
+				confirmations.push_back(f);
+			});
+	raft::Client sut("eris", handlers);
+
+	std::vector<std::tuple<bool, boost::optional<std::tuple<std::string, std::string>>>> reads;
+	auto read = [&reads](bool confirmed, const boost::optional<std::tuple<std::string, std::string>>& version)
+	{
+		reads.push_back(std::make_tuple(confirmed, version));
+	};
+
+	sut.read("fnord", read);
+	sut.read("fnord", read);
+	BOOST_REQUIRE_EQUAL(confirmations.size(), 2);
+	BOOST_CHECK(reads.empty());
+
+	//The answer reflects what's committed by the time it's confirmed
+	sut.commit_handler(raft::request::Add("foo", "fnord", "bar"));
+	confirmations[0](true);
+	confirmations[1](false);
+
+	BOOST_REQUIRE_EQUAL(reads.size(), 2);
+	BOOST_CHECK(std::get<0>(reads[0]));
+	BOOST_REQUIRE(std::get<1>(reads[0]));
+	BOOST_CHECK_EQUAL(std::get<0>(*std::get<1>(reads[0])), "bar");
+	BOOST_CHECK(!std::get<0>(reads[1]));
+
+	//Without a way to confirm reads, none are
+	raft::Client unconfirmed("eris", handler_);
+	unconfirmed.read("fnord", read);
+	BOOST_REQUIRE_EQUAL(reads.size(), 3);
+	BOOST_CHECK(!std::get<0>(reads[2]));
+}
+
+BOOST_FIXTURE_TEST_CASE(checkpoint_restores_untransferred_versions, test_fixture)
+{
+	auto log_file = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	raft::State::Options options;
+	options.checkpoint_interval = 1;
+
+	{
+		raft::Client client("eris", handler_);
+		std::vector<uint32_t> snapshots;
+		raft::State::Handlers handlers(
+				[](const std::string&, const raft::rpc::append_entries&) {},
+				[](const std::string&, const raft::rpc::request_vote&) {},
+				[](raft::State::Handlers::timeout_length) {},
+				[&client](const Json::Value& value) {client.commit_handler(value);},
+				nullptr,
+				[](const std::string&, const raft::rpc::install_snapshot&) {},
+				[&snapshots](uint32_t index) {snapshots.push_back(index);},
+				[&client](const Json::Value& state) {client.restore(state);});
+		raft::State state("eris", {"discordia"}, log_file.string(), handlers, options);
+
+		//Committed, but the restart comes before the content is fetched
+		state.append_entries(raft::rpc::append_entries(1, "discordia", 0, 0,
+					std::vector<std::tuple<uint32_t, Json::Value>>{
+						std::make_tuple(1u, raft::request::Add("discordia", "fnord", "kallisti"))}, 1));
+		BOOST_REQUIRE_EQUAL(snapshots.size(), 1);
+		state.snapshot(snapshots[0], client.snapshot());
+	}
+
+	raft::Client sut("eris", handler_);
+	raft::Client::restore_map_type restored;
+	sut.connect_restore([&restored](const raft::Client::restore_map_type& versions)
+			{
+				restored = versions;
+			});
+	raft::State::Handlers handlers(
+			[](const std::string&, const raft::rpc::append_entries&) {},
+			[](const std::string&, const raft::rpc::request_vote&) {},
+			[](raft::State::Handlers::timeout_length) {},
+			[&sut](const Json::Value& value) {sut.commit_handler(value);},
+			nullptr,
+			[](const std::string&, const raft::rpc::install_snapshot&) {},
+			[](uint32_t) {},
+			[&sut](const Json::Value& state) {sut.restore(state);});
+	raft::State state("eris", {"discordia"}, log_file.string(), handlers, options);
+
+	//The restore handlers learn the version, so the filesystem fetches it
+	BOOST_REQUIRE_EQUAL(restored.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(restored["fnord"]), "kallisti");
+	BOOST_CHECK_EQUAL(std::get<1>(restored["fnord"]), "discordia");
+
+	boost::filesystem::remove_all(log_file);
+	for(const auto suffix : {".json", ".members", ".applied"})
+		boost::filesystem::remove(log_file.string() + suffix);
+}
@@ -53,7 +53,9 @@ test_fixture::test_fixture()
 
 test_fixture::~test_fixture()
 {
-	fs::remove(tmp_log_);
+	fs::remove_all(tmp_log_);
+	fs::remove(tmp_log_.string() + ".json");
+	fs::remove_all(tmp_log_.string() + ".import");
 }
 
 void test_fixture::write_simple() const
@@ -178,56 +180,42 @@ BOOST_FIXTURE_TEST_CASE(log_entries_append, test_fixture)
 		sut.write(raft::log::Vote(3, "eris"));
 	}
 
-	std::ifstream log(tmp_log().string());
+	auto records = raft::log::read_records(tmp_log());
+	BOOST_REQUIRE_EQUAL(records.size(), 6);
 
-	std::string line;
-	Json::Value root;
-	Json::Reader r;
-
-	std::getline(log, line);
-	r.parse(line, root);
+	Json::Value root = records[0];
 	BOOST_REQUIRE_EQUAL(root["term"].asInt(), 1);
 	BOOST_REQUIRE_EQUAL(root["type"].asString(), "vote");
 	BOOST_REQUIRE_EQUAL(root["for"].asString(), "endpoint1");
 
-	std::getline(log, line);
-	r.parse(line, root);
+	root = records[1];
 	BOOST_REQUIRE_EQUAL(root["term"].asInt(), 1);
 	BOOST_REQUIRE_EQUAL(root["type"].asString(), "entry");
 	BOOST_REQUIRE_EQUAL(root["index"].asInt(), 1);
 	BOOST_REQUIRE_EQUAL(root["action"].asString(), "thud");
 
-	std::getline(log, line);
-	r.parse(line, root);
+	root = records[2];
 	BOOST_REQUIRE_EQUAL(root["term"].asInt(), 1);
 	BOOST_REQUIRE_EQUAL(root["type"].asString(), "entry");
 	BOOST_REQUIRE_EQUAL(root["index"].asInt(), 2);
 	BOOST_REQUIRE_EQUAL(root["action"].asString(), "thud");
 
-	std::getline(log, line);
-	r.parse(line, root);
+	root = records[3];
 	BOOST_REQUIRE_EQUAL(root["term"].asInt(), 2);
 	BOOST_REQUIRE_EQUAL(root["type"].asString(), "entry");
 	BOOST_REQUIRE_EQUAL(root["index"].asInt(), 3);
 	BOOST_REQUIRE_EQUAL(root["action"].asString(), "fnord");
 
-	std::getline(log, line);
-	r.parse(line, root);
+	root = records[4];
 	BOOST_REQUIRE_EQUAL(root["term"].asInt(), 2);
 	BOOST_REQUIRE_EQUAL(root["type"].asString(), "entry");
 	BOOST_REQUIRE_EQUAL(root["index"].asInt(), 4);
 	BOOST_REQUIRE_EQUAL(root["action"].asString(), "thud");
 
-	std::getline(log, line);
-	r.parse(line, root);
+	root = records[5];
 	BOOST_REQUIRE_EQUAL(root["term"].asInt(), 3);
 	BOOST_REQUIRE_EQUAL(root["type"].asString(), "vote");
 	BOOST_REQUIRE_EQUAL(root["for"].asString(), "eris");
-
-	std::getline(log, line);
-
-	BOOST_REQUIRE_EQUAL(line, "");
-	BOOST_REQUIRE(log.eof());
 }
 
 BOOST_FIXTURE_TEST_CASE(log_entries_appended_recoverable, test_fixture)
@@ -421,14 +409,11 @@ BOOST_FIXTURE_TEST_CASE(explicit_term_written, test_fixture)
 		sut.write(term);
 	}
 
-	std::ifstream log(tmp_log().string());
-	std::string line;
-	//Ignore the first three lines
-	for(unsigned int i =0; i < 3; ++i)
-		BOOST_REQUIRE(std::getline(log, line));
+	auto records = raft::log::read_records(tmp_log());
+	//Ignore the first three records
+	BOOST_REQUIRE_EQUAL(records.size(), 4);
 
-	BOOST_REQUIRE(std::getline(log, line));
-	auto root = json_help::parse(line);
+	auto root = records[3];
 	BOOST_REQUIRE_EQUAL(root["term"].asInt(), 3);
 	BOOST_REQUIRE_EQUAL(root["type"].asString(), "term");
 }
@@ -451,4 +436,277 @@ BOOST_FIXTURE_TEST_CASE(stale_explicit_term_fails, test_fixture)
 	BOOST_REQUIRE_THROW(sut.write(term), std::runtime_error);
 }
 
+BOOST_FIXTURE_TEST_CASE(json_log_imported_to_segments, test_fixture)
+{
+	write_simple();
+
+	{
+		raft::Log sut(tmp_log().string());
+		BOOST_CHECK_EQUAL(sut.last_index(), 2);
+	}
+
+	BOOST_REQUIRE(fs::is_directory(tmp_log()));
+	BOOST_REQUIRE(fs::is_regular_file(tmp_log().string() + ".json"));
+
+	//Reopening must not import a second time
+	raft::Log sut(tmp_log().string());
+	BOOST_CHECK_EQUAL(sut.term(), 1);
+	BOOST_CHECK_EQUAL(sut.last_vote().get(), "endpoint1");
+	BOOST_CHECK_EQUAL(sut.last_index(), 2);
+	BOOST_CHECK_EQUAL(sut[2].action().asString(), "thud");
+	BOOST_CHECK_EQUAL(raft::log::read_records(tmp_log()).size(), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(bad_json_log_reports_line, test_fixture)
+{
+	{
+		std::ofstream of(tmp_log().string());
+		of << R"({"term":1,"type":"vote","for":"endpoint1"})" << "\n"
+			<< R"({"term":1,"type":"fnord"})" << std::endl;
+	}
+
+	BOOST_REQUIRE_THROW(raft::Log sut(tmp_log().string()), raft::log::exceptions::bad_log);
+	//The JSON log is left where it was
+	BOOST_REQUIRE(fs::is_regular_file(tmp_log()));
+}
+
+BOOST_FIXTURE_TEST_CASE(complex_actions_survive_binary_round_trip, test_fixture)
+{
+	auto action = json_help::parse(R"({"type":"rename","key":"a\nb","new_key":"c","from":"eris","version":"1"})");
+
+	{
+		raft::Log sut(tmp_log().string());
+		sut.write(raft::log::LogEntry(1, 1, 1, action));
+		sut.write(raft::log::LogEntry(1, 2, 1, Json::Value{}));
+		sut.commit_index(1);
+	}
+
+	raft::Log sut(tmp_log().string());
+	BOOST_CHECK_EQUAL(sut.last_index(), 2);
+	BOOST_CHECK(sut[1].action() == action);
+	BOOST_CHECK(sut[2].action() == Json::Value{});
+}
+
+BOOST_FIXTURE_TEST_CASE(commit_index_only_written_at_checkpoints, test_fixture)
+{
+	raft::Log::Options options;
+	options.commit_interval = 4;
+
+	{
+		raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+
+		sut.write(raft::log::NewTerm(1));
+		for(uint32_t i = 1; i <= 10; ++i)
+		{
+			sut.write(raft::log::LogEntry(1, i, 1, Json::Value(i)));
+			sut.commit_index(i);
+			BOOST_CHECK_EQUAL(sut.commit_index(), i);
+		}
+
+		BOOST_REQUIRE_THROW(sut.commit_index(9), std::runtime_error);
+	}
+
+	//Ten commits cost two records rather than ten
+	unsigned commits = 0;
+	for(const auto& record : raft::log::read_records(tmp_log()))
+		if(record["type"].asString() == "commit")
+			++commits;
+	BOOST_CHECK_EQUAL(commits, 2);
+
+	//and a restart resumes from the last checkpoint
+	raft::Log sut(tmp_log().string());
+	BOOST_CHECK_EQUAL(sut.last_index(), 10);
+	BOOST_CHECK_EQUAL(sut.commit_index(), 8);
+}
+
+BOOST_FIXTURE_TEST_CASE(batched_writes_wait_for_sync, test_fixture)
+{
+	unsigned sync_requests = 0;
+	raft::Log::Options options;
+	options.durability = raft::log::durability_batched;
+
+	{
+		raft::Log sut(tmp_log().string(), nullptr,
+				[&sync_requests]()
+				{
+					++sync_requests;
+				}, options);
+
+		sut.write(raft::log::LogEntry(1, 1, 1, Json::Value("hail")));
+		sut.write(raft::log::LogEntry(1, 2, 1, Json::Value("eris")));
+
+		BOOST_CHECK_EQUAL(sync_requests, 1);
+		BOOST_CHECK(!sut.durable());
+		BOOST_CHECK_EQUAL(sut.last_index(), 2);
+		BOOST_CHECK_EQUAL(sut.durable_index(), 0);
+		BOOST_CHECK(raft::log::read_records(tmp_log()).empty());
+
+		sut.sync();
+
+		BOOST_CHECK(sut.durable());
+		BOOST_CHECK_EQUAL(sut.durable_index(), 2);
+		BOOST_CHECK_EQUAL(raft::log::read_records(tmp_log()).size(), 2);
+
+		sut.write(raft::log::LogEntry(1, 3, 1, Json::Value("fnord")));
+		BOOST_CHECK_EQUAL(sync_requests, 2);
+	}
 
+	//Anything still buffered is written on close
+	raft::Log sut(tmp_log().string());
+	BOOST_CHECK_EQUAL(sut.last_index(), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(unbatched_writes_are_durable, test_fixture)
+{
+	raft::Log::Options options;
+	options.durability = raft::log::durability_none;
+	raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+
+	sut.write(raft::log::LogEntry(1, 1, 1, Json::Value("hail")));
+
+	BOOST_CHECK(sut.durable());
+	BOOST_CHECK_EQUAL(sut.durable_index(), 1);
+	BOOST_CHECK_EQUAL(raft::log::read_records(tmp_log()).size(), 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(compacted_log_recovers_from_snapshot, test_fixture)
+{
+	//Small segments so compaction has some to discard
+	raft::Log::Options options;
+	options.segment_size = 256;
+
+	{
+		raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+
+		sut.write(raft::log::NewTerm(2));
+		for(int i = 1; i <= 10; ++i)
+			sut.write(raft::log::LogEntry(2, i, i < 5 ? 1 : 2, Json::Value(i)));
+
+		sut.commit_index(8);
+		sut.compact(6, R"({"hail":"eris"})");
+
+		BOOST_CHECK_EQUAL(sut.snapshot_index(), 6);
+		BOOST_CHECK_EQUAL(sut.last_index(), 10);
+		BOOST_CHECK_EQUAL(sut[6].spawn_term(), 2);
+		BOOST_CHECK(sut[7].action() == Json::Value(7));
+		BOOST_REQUIRE_THROW(sut[5], raft::log::exceptions::entry_compacted);
+		BOOST_CHECK(sut.match(1, 3));
+	}
+
+	raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+	BOOST_CHECK_EQUAL(sut.term(), 2);
+	BOOST_CHECK_EQUAL(sut.snapshot_index(), 6);
+	BOOST_CHECK_EQUAL(sut.last_index(), 10);
+	BOOST_CHECK_EQUAL(sut.commit_index(), 8);
+	BOOST_REQUIRE(sut.snapshot());
+	BOOST_CHECK_EQUAL(sut.snapshot()->data(), R"({"hail":"eris"})");
+	BOOST_CHECK(sut[10].action() == Json::Value(10));
+
+	//Compaction never goes past the commit index
+	BOOST_REQUIRE_THROW(sut.compact(9, "{}"), std::logic_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(installed_snapshot_replaces_conflicting_log, test_fixture)
+{
+	{
+		raft::Log sut(tmp_log().string());
+		sut.write(raft::log::NewTerm(1));
+		sut.write(raft::log::LogEntry(1, 1, 1, Json::Value("hail")));
+		sut.write(raft::log::LogEntry(1, 2, 1, Json::Value("eris")));
+
+		sut.write(raft::log::NewTerm(3));
+		sut.install(raft::log::Snapshot(3, 4, 2, "{}"));
+
+		BOOST_CHECK_EQUAL(sut.snapshot_index(), 4);
+		BOOST_CHECK_EQUAL(sut.last_index(), 4);
+		BOOST_CHECK_EQUAL(sut.commit_index(), 4);
+		BOOST_CHECK(sut.match(2, 4));
+	}
+
+	raft::Log sut(tmp_log().string());
+	BOOST_CHECK_EQUAL(sut.term(), 3);
+	BOOST_CHECK_EQUAL(sut.last_index(), 4);
+	BOOST_CHECK_EQUAL(sut[4].spawn_term(), 2);
+
+	//Appends continue after the snapshot
+	sut.write(raft::log::LogEntry(3, 5, 3, Json::Value("fnord")));
+	BOOST_CHECK_EQUAL(sut.last_index(), 5);
+}
+
+BOOST_FIXTURE_TEST_CASE(entries_outside_tail_read_from_disk, test_fixture)
+{
+	//Two entries in memory, two cached
+	raft::Log::Options options;
+	options.durability = raft::log::durability_batched;
+	options.tail_size = 2;
+	options.cache_size = 2;
+	raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+
+	for(int i = 1; i <= 10; ++i)
+		sut.write(raft::log::LogEntry(1, i, 1, Json::Value(i)));
+
+	for(int i = 1; i <= 10; ++i)
+		BOOST_CHECK(sut[i].action() == Json::Value(i));
+
+	BOOST_CHECK(sut.match(1, 3));
+	BOOST_CHECK(!sut.match(2, 3));
+
+	//Overwriting an old entry replaces what's read back
+	sut.write(raft::log::LogEntry(2, 4, 2, Json::Value("hail")));
+	BOOST_CHECK_EQUAL(sut.last_index(), 4);
+	BOOST_CHECK(sut[3].action() == Json::Value(3));
+	BOOST_CHECK(sut[4].action() == Json::Value("hail"));
+	BOOST_CHECK(sut.match(2, 4));
+	BOOST_REQUIRE_THROW(sut[5], raft::log::exceptions::entry_missing);
+
+	sut.write(raft::log::LogEntry(2, 5, 2, Json::Value("eris")));
+	sut.write(raft::log::LogEntry(2, 6, 2, Json::Value("fnord")));
+	BOOST_CHECK(sut[4].action() == Json::Value("hail"));
+}
+
+BOOST_FIXTURE_TEST_CASE(recovered_entries_read_from_disk, test_fixture)
+{
+	{
+		raft::Log sut(tmp_log().string());
+		for(int i = 1; i <= 10; ++i)
+			sut.write(raft::log::LogEntry(1, i, 1, Json::Value(i)));
+		sut.write(raft::log::LogEntry(1, 5, 1, Json::Value("hail")));
+	}
+
+	raft::Log::Options options;
+	options.tail_size = 1;
+	options.cache_size = 0;
+	raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+	BOOST_REQUIRE_EQUAL(sut.last_index(), 5);
+	for(int i = 1; i < 5; ++i)
+		BOOST_CHECK(sut[i].action() == Json::Value(i));
+	BOOST_CHECK(sut[5].action() == Json::Value("hail"));
+}
+
+BOOST_FIXTURE_TEST_CASE(large_log_recovered_in_order, test_fixture)
+{
+	//Enough records to be decoded on several threads, across segments
+	raft::Log::Options options;
+	options.durability = raft::log::durability_batched;
+	options.segment_size = 16 * 1024;
+
+	{
+		raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+		for(int i = 1; i <= 2000; ++i)
+		{
+			if(i % 500 == 0)
+				sut.write(raft::log::NewTerm(i / 500 + 1));
+			sut.write(raft::log::LogEntry(i / 500 + 1, i, 1, Json::Value(i)));
+		}
+		sut.write(raft::log::LogEntry(5, 1500, 5, Json::Value("hail")));
+		sut.sync();
+	}
+
+	raft::Log sut(tmp_log().string(), nullptr, nullptr, options);
+	BOOST_CHECK_EQUAL(sut.term(), 5);
+	BOOST_REQUIRE_EQUAL(sut.last_index(), 1500);
+	for(int i = 1; i < 1500; ++i)
+		BOOST_CHECK(sut[i].action() == Json::Value(i));
+	BOOST_CHECK(sut[1500].action() == Json::Value("hail"));
+	BOOST_CHECK_EQUAL(sut[1500].term(), 5);
+}
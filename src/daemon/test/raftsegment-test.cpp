@@ -0,0 +1,463 @@
+#define BOOST_TEST_MODULE "Raft log segment tests"
+#include <boost/test/unit_test.hpp>
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include <csignal>
+
+#include <sys/resource.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+
+namespace fs = boost::filesystem;
+
+#include "../raftsegment.hpp"
+
+struct disable_logging
+{
+	disable_logging()
+	{
+		boost::log::core::get()->set_logging_enabled(false);
+	}
+};
+
+BOOST_GLOBAL_FIXTURE(disable_logging)
+
+class test_fixture
+{
+public:
+	test_fixture();
+	~test_fixture();
+
+	fs::path tmp_dir() const;
+
+	//! Replays the segments in tmp_dir, returning the bodies read.
+	std::vector<std::string> replay(uint64_t segment_size = 1024) const;
+
+protected:
+	fs::path tmp_dir_;
+};
+
+test_fixture::test_fixture()
+	:tmp_dir_(fs::temp_directory_path() / fs::unique_path())
+{
+}
+
+test_fixture::~test_fixture()
+{
+	fs::remove_all(tmp_dir_);
+}
+
+fs::path test_fixture::tmp_dir() const
+{
+	return tmp_dir_;
+}
+
+std::vector<std::string> test_fixture::replay(uint64_t segment_size) const
+{
+	std::vector<std::string> bodies;
+	raft::log::Segments sut(tmp_dir(), segment_size);
+	sut.replay([&bodies](const std::string& body, const raft::log::record_location&)
+			{
+				bodies.push_back(body);
+			});
+
+	return bodies;
+}
+
+BOOST_AUTO_TEST_CASE(record_round_trip)
+{
+	raft::log::record_writer writer(raft::log::vote_record);
+	writer.u32(42).str("eris").rest("fnord");
+
+	raft::log::record_reader reader(writer.body());
+	BOOST_CHECK_EQUAL(reader.type(), raft::log::vote_record);
+	BOOST_CHECK_EQUAL(reader.u32(), 42);
+	BOOST_CHECK_EQUAL(reader.str(), "eris");
+	BOOST_CHECK_EQUAL(reader.rest(), "fnord");
+}
+
+BOOST_AUTO_TEST_CASE(short_record_throws)
+{
+	raft::log::record_writer writer(raft::log::commit_record);
+	writer.str("eris");
+
+	std::string body = writer.body();
+	body.pop_back();
+
+	raft::log::record_reader reader(body);
+	BOOST_REQUIRE_THROW(reader.str(), std::runtime_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(empty_directory_replays_nothing, test_fixture)
+{
+	BOOST_CHECK(replay().empty());
+	BOOST_CHECK(fs::is_directory(tmp_dir()));
+}
+
+BOOST_FIXTURE_TEST_CASE(appended_records_replay_in_order, test_fixture)
+{
+	{
+		raft::log::Segments sut(tmp_dir(), 1024);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+
+		sut.append("hail");
+		sut.append("eris");
+		sut.append(std::string("\0\n\xff", 3));
+	}
+
+	auto bodies = replay();
+	BOOST_REQUIRE_EQUAL(bodies.size(), 3);
+	BOOST_CHECK_EQUAL(bodies[0], "hail");
+	BOOST_CHECK_EQUAL(bodies[1], "eris");
+	BOOST_CHECK_EQUAL(bodies[2], std::string("\0\n\xff", 3));
+}
+
+BOOST_FIXTURE_TEST_CASE(segments_roll_at_size, test_fixture)
+{
+	std::vector<raft::log::record_location> locations;
+	{
+		raft::log::Segments sut(tmp_dir(), 64);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+
+		for(unsigned i = 0; i < 10; ++i)
+			locations.push_back(sut.append(std::string(20, 'a' + i)));
+
+		BOOST_CHECK(sut.segments().size() > 1);
+	}
+
+	BOOST_CHECK_EQUAL(locations.front().segment, 1);
+	BOOST_CHECK(locations.back().segment > 1);
+
+	std::vector<raft::log::record_location> replayed;
+	raft::log::Segments sut(tmp_dir(), 64);
+	sut.replay([&replayed](const std::string& body, const raft::log::record_location& location)
+			{
+				BOOST_CHECK_EQUAL(body.size(), 20);
+				replayed.push_back(location);
+			});
+
+	BOOST_REQUIRE_EQUAL(replayed.size(), locations.size());
+	for(unsigned i = 0; i < replayed.size(); ++i)
+	{
+		BOOST_CHECK_EQUAL(replayed[i].segment, locations[i].segment);
+		BOOST_CHECK_EQUAL(replayed[i].offset, locations[i].offset);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(torn_tail_truncated, test_fixture)
+{
+	fs::path segment;
+	{
+		raft::log::Segments sut(tmp_dir(), 1024);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+
+		sut.append("hail");
+		sut.append("eris");
+		segment = sut.segment_path(1);
+	}
+
+	//Simulate a crash part way through the last record
+	fs::resize_file(segment, fs::file_size(segment) - 2);
+
+	auto bodies = replay();
+	BOOST_REQUIRE_EQUAL(bodies.size(), 1);
+	BOOST_CHECK_EQUAL(bodies[0], "hail");
+
+	//Appends continue from the truncation point
+	{
+		raft::log::Segments sut(tmp_dir(), 1024);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+		sut.append("discordia");
+	}
+
+	bodies = replay();
+	BOOST_REQUIRE_EQUAL(bodies.size(), 2);
+	BOOST_CHECK_EQUAL(bodies[1], "discordia");
+}
+
+BOOST_FIXTURE_TEST_CASE(corrupt_tail_checksum_truncated, test_fixture)
+{
+	fs::path segment;
+	{
+		raft::log::Segments sut(tmp_dir(), 1024);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+
+		sut.append("hail");
+		sut.append("eris");
+		segment = sut.segment_path(1);
+	}
+
+	{
+		std::fstream file(segment.string(), std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(-1, std::ios::end);
+		file.put('X');
+	}
+
+	auto bodies = replay();
+	BOOST_REQUIRE_EQUAL(bodies.size(), 1);
+	BOOST_CHECK_EQUAL(bodies[0], "hail");
+}
+
+BOOST_FIXTURE_TEST_CASE(corruption_before_last_segment_throws, test_fixture)
+{
+	fs::path segment;
+	{
+		raft::log::Segments sut(tmp_dir(), 32);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+
+		for(unsigned i = 0; i < 4; ++i)
+			sut.append(std::string(16, 'a' + i));
+		segment = sut.segment_path(1);
+	}
+
+	{
+		std::fstream file(segment.string(), std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(-1, std::ios::end);
+		file.put('X');
+	}
+
+	BOOST_REQUIRE_THROW(replay(32), raft::log::exceptions::corrupt_record);
+}
+
+BOOST_FIXTURE_TEST_CASE(appends_buffered_until_flush, test_fixture)
+{
+	raft::log::Segments sut(tmp_dir(), 1024);
+	sut.replay([](const std::string&, const raft::log::record_location&){});
+
+	const auto segment = sut.segment_path(1);
+	const auto empty_size = fs::file_size(segment);
+
+	sut.append("hail");
+	sut.append("eris");
+	BOOST_CHECK(sut.buffered());
+	BOOST_CHECK_EQUAL(fs::file_size(segment), empty_size);
+
+	sut.sync();
+	BOOST_CHECK(!sut.buffered());
+	BOOST_CHECK_EQUAL(fs::file_size(segment),
+			empty_size + 2 * raft::log::Segments::frame_size + 8);
+
+	auto location = sut.append("fnord");
+	BOOST_CHECK_EQUAL(location.offset, fs::file_size(segment));
+}
+
+BOOST_FIXTURE_TEST_CASE(failed_write_stops_appends, test_fixture)
+{
+	raft::log::Segments sut(tmp_dir(), 1024);
+	sut.replay([](const std::string&, const raft::log::record_location&){});
+
+	const auto segment = sut.segment_path(1);
+	const auto empty_size = fs::file_size(segment);
+	const auto location = sut.append(std::string(64, 'x'));
+
+	//Let the write get part way, failing with EFBIG rather than SIGXFSZ
+	rlimit old_limit;
+	::getrlimit(RLIMIT_FSIZE, &old_limit);
+	auto old_handler = std::signal(SIGXFSZ, SIG_IGN);
+	rlimit limit = old_limit;
+	limit.rlim_cur = empty_size + 16;
+	::setrlimit(RLIMIT_FSIZE, &limit);
+
+	BOOST_CHECK_THROW(sut.flush(), raft::log::exceptions::log_io);
+
+	::setrlimit(RLIMIT_FSIZE, &old_limit);
+	std::signal(SIGXFSZ, old_handler);
+
+	BOOST_CHECK(sut.failed());
+	BOOST_CHECK_EQUAL(sut.read(location), std::string(64, 'x'));
+	BOOST_CHECK_THROW(sut.append("fnord"), raft::log::exceptions::log_io);
+	BOOST_CHECK_THROW(sut.flush(), raft::log::exceptions::log_io);
+	BOOST_CHECK_THROW(sut.sync(), raft::log::exceptions::log_io);
+}
+
+BOOST_FIXTURE_TEST_CASE(snapshot_round_trip, test_fixture)
+{
+	raft::log::Segments sut(tmp_dir(), 1024);
+	sut.replay([](const std::string&, const raft::log::record_location&){});
+
+	BOOST_CHECK(!sut.load_snapshot());
+
+	sut.save_snapshot("hail eris");
+	sut.save_snapshot(std::string("\0fnord", 6));
+
+	auto snapshot = sut.load_snapshot();
+	BOOST_REQUIRE(snapshot);
+	BOOST_CHECK_EQUAL(*snapshot, std::string("\0fnord", 6));
+
+	//The snapshot isn't mistaken for a segment
+	BOOST_CHECK_EQUAL(sut.segments().size(), 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(replace_file_swaps_contents, test_fixture)
+{
+	fs::create_directories(tmp_dir());
+	const fs::path path = tmp_dir() / "members";
+
+	raft::log::replace_file(path, "hail\n");
+	raft::log::replace_file(path, "eris\n");
+
+	std::ifstream in(path.string());
+	const std::string contents{std::istreambuf_iterator<char>(in),
+		std::istreambuf_iterator<char>()};
+	BOOST_CHECK_EQUAL(contents, "eris\n");
+
+	//Nothing's left aside
+	BOOST_CHECK(!fs::exists(path.string() + ".tmp"));
+}
+
+BOOST_FIXTURE_TEST_CASE(corrupt_snapshot_throws, test_fixture)
+{
+	raft::log::Segments sut(tmp_dir(), 1024);
+	sut.replay([](const std::string&, const raft::log::record_location&){});
+	sut.save_snapshot("hail eris");
+
+	{
+		std::fstream file(sut.snapshot_path().string(), std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(-1, std::ios::end);
+		file.put('X');
+	}
+
+	BOOST_REQUIRE_THROW(sut.load_snapshot(), raft::log::exceptions::corrupt_record);
+}
+
+BOOST_FIXTURE_TEST_CASE(discard_before_keeps_later_segments, test_fixture)
+{
+	{
+		raft::log::Segments sut(tmp_dir(), 64);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+
+		for(unsigned i = 0; i < 6; ++i)
+			sut.append(std::string(20, 'a' + i));
+
+		BOOST_REQUIRE(sut.active() > 2);
+
+		sut.roll();
+		const uint32_t active = sut.active();
+		sut.discard_before(active);
+
+		BOOST_REQUIRE_EQUAL(sut.segments().size(), 1);
+		BOOST_CHECK_EQUAL(sut.segments()[0], active);
+
+		//The active segment is never discarded
+		sut.discard_before(active + 1);
+		BOOST_CHECK_EQUAL(sut.segments().size(), 1);
+	}
+
+	BOOST_CHECK(replay(64).empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(records_read_back_by_location, test_fixture)
+{
+	raft::log::Segments sut(tmp_dir(), 64);
+	sut.replay([](const std::string&, const raft::log::record_location&){});
+
+	std::vector<raft::log::record_location> locations;
+	for(unsigned i = 0; i < 6; ++i)
+		locations.push_back(sut.append(std::string(20, 'a' + i)));
+
+	//The last records are still buffered
+	BOOST_REQUIRE(sut.buffered());
+	for(unsigned i = 0; i < locations.size(); ++i)
+		BOOST_CHECK_EQUAL(sut.read(locations[i]), std::string(20, 'a' + i));
+
+	sut.sync();
+	BOOST_CHECK_EQUAL(sut.read(locations.back()), std::string(20, 'f'));
+	BOOST_CHECK_EQUAL(sut.read(locations.front()), std::string(20, 'a'));
+}
+
+BOOST_FIXTURE_TEST_CASE(corrupt_record_read_throws, test_fixture)
+{
+	raft::log::Segments sut(tmp_dir(), 1024);
+	sut.replay([](const std::string&, const raft::log::record_location&){});
+
+	auto location = sut.append("hail");
+	sut.sync();
+
+	{
+		std::fstream file(sut.segment_path(1).string(), std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(-1, std::ios::end);
+		file.put('X');
+	}
+
+	BOOST_REQUIRE_THROW(sut.read(location), raft::log::exceptions::corrupt_record);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_for_covers_every_index)
+{
+	for(std::size_t count : {0, 1, 255, 256, 257, 10000})
+	{
+		std::vector<unsigned> seen(count, 0);
+		raft::log::parallel_for(count, 4, [&seen](std::size_t begin, std::size_t end)
+				{
+					for(std::size_t i = begin; i < end; ++i)
+						++seen[i];
+				});
+
+		BOOST_CHECK(std::all_of(seen.begin(), seen.end(), [](unsigned n){return n == 1;}));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(parallel_for_rethrows)
+{
+	BOOST_REQUIRE_THROW(raft::log::parallel_for(10000, 4, [](std::size_t begin, std::size_t)
+				{
+					if(begin > 0)
+						throw std::runtime_error("fnord");
+				}), std::runtime_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(batched_replay_matches_replay, test_fixture)
+{
+	std::vector<raft::log::record_location> expected;
+	{
+		raft::log::Segments sut(tmp_dir(), 4096);
+		sut.replay([](const std::string&, const raft::log::record_location&){});
+
+		for(unsigned i = 0; i < 1000; ++i)
+			expected.push_back(sut.append(std::string(i % 40, 'a' + i % 26)));
+
+		BOOST_REQUIRE(sut.segments().size() > 1);
+	}
+
+	std::vector<std::string> bodies;
+	std::vector<raft::log::record_location> locations;
+	{
+		raft::log::Segments sut(tmp_dir(), 4096);
+		sut.replay_batches([&bodies, &locations](const std::vector<raft::log::record_view>& records)
+				{
+					for(const auto& record : records)
+					{
+						bodies.emplace_back(record.data, record.size);
+						locations.push_back(record.location);
+					}
+				}, 4);
+
+		//Appends continue after a batched replay
+		sut.append("discordia");
+	}
+
+	BOOST_REQUIRE_EQUAL(locations.size(), expected.size());
+	for(unsigned i = 0; i < locations.size(); ++i)
+	{
+		BOOST_CHECK_EQUAL(bodies[i], std::string(i % 40, 'a' + i % 26));
+		BOOST_CHECK_EQUAL(locations[i].segment, expected[i].segment);
+		BOOST_CHECK_EQUAL(locations[i].offset, expected[i].offset);
+	}
+
+	auto replayed = replay(4096);
+	BOOST_REQUIRE_EQUAL(replayed.size(), expected.size() + 1);
+	BOOST_CHECK_EQUAL(replayed.back(), "discordia");
+}
@@ -0,0 +1,341 @@
+#define BOOST_TEST_MODULE "Raft shards test"
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <boost/optional.hpp>
+#include <boost/filesystem.hpp>
+
+#include <json/json.h>
+#include "../../common/json_help.hpp"
+
+#include "../connection_pool.hpp"
+#include "../dispatch.hpp"
+#include "../raftrpc.hpp"
+#include "../raftstate.hpp"
+#include "../raftrequest.hpp"
+#include "../raftclient.hpp"
+#include "../raftctl.hpp"
+#include "../raftshards.hpp"
+
+namespace fs = boost::filesystem;
+
+struct disable_logging
+{
+	disable_logging()
+	{
+		boost::log::core::get()->set_logging_enabled(false);
+	}
+};
+
+BOOST_GLOBAL_FIXTURE(disable_logging)
+
+class test_fixture
+{
+public:
+	test_fixture();
+	~test_fixture();
+
+	//! Shards for eris, with foo and bar as the other voters. Nothing is
+	//! connected, so RPCs go nowhere and the tests drive each group's state.
+	std::unique_ptr<raft::Shards> make_shards(uint32_t groups, uint32_t balance_interval = 0);
+
+	//! Make a group's state leader for term 1
+	static void lead(raft::Controller& controller);
+
+	//! Have node answer the leader's heartbeats, catching up with its log
+	static void answer(raft::Controller& controller, const std::string& node);
+
+	//! Run the io_service for a while
+	void run_for(uint32_t milliseconds);
+
+	//! The first key in a top-level directory of its own that's in group
+	static std::string key_in(const raft::Shards& shards, uint32_t group);
+
+	boost::asio::io_service io_;
+	TCPConnectionPool pool_;
+	fs::path tmp_dir_;
+
+	//Each set of shards registers its groups with its own dispatch
+	std::vector<std::unique_ptr<raft::Controller::dispatch_type>> dispatch_;
+};
+
+test_fixture::test_fixture()
+	:pool_([](const std::string&, const TCPConnectionPool::Callback&) {}),
+	tmp_dir_(fs::temp_directory_path() / fs::unique_path())
+{
+	fs::create_directories(tmp_dir_);
+}
+
+test_fixture::~test_fixture()
+{
+	fs::remove_all(tmp_dir_);
+}
+
+std::unique_ptr<raft::Shards> test_fixture::make_shards(uint32_t groups, uint32_t balance_interval)
+{
+	dispatch_.emplace_back(new raft::Controller::dispatch_type(pool_));
+	raft::Controller::dispatch_type& dispatch = *dispatch_.back();
+	const fs::path dir = tmp_dir_ / std::to_string(dispatch_.size());
+	fs::create_directories(dir);
+
+	raft::Controller::Options options;
+	options.log.durability = raft::log::durability_none;
+	options.pre_vote = false;
+
+	return std::unique_ptr<raft::Shards>(new raft::Shards(io_, "eris", groups,
+				[this, &dispatch, dir, options](uint32_t group)
+				{
+					//Long timeouts, so only the tests change the states
+					return std::unique_ptr<raft::Controller>(new raft::Controller(io_, dispatch,
+								raft::Controller::TimerLength(0, 60000, 60000, 0), "eris",
+								{"foo", "bar"}, (dir / std::to_string(group)).string(), options,
+								group));
+				}, balance_interval));
+}
+
+void test_fixture::lead(raft::Controller& controller)
+{
+	raft::State& state = controller.state();
+	state.timeout();
+
+	const raft::rpc::request_vote request(1, "eris", 0, 0);
+	state.request_vote_response("foo", raft::rpc::request_vote_response(request, 1, true));
+	state.request_vote_response("bar", raft::rpc::request_vote_response(request, 1, true));
+	BOOST_REQUIRE_EQUAL(state.state(), raft::State::leader_state);
+}
+
+void test_fixture::answer(raft::Controller& controller, const std::string& node)
+{
+	//The election's round of heartbeats
+	const raft::rpc::append_entries heartbeat(1, "eris", 0, 0,
+			std::vector<raft::rpc::append_entries::entry_type>{}, 0, 1);
+	controller.state().append_entries_response(node,
+			raft::rpc::append_entries_response(heartbeat, 1, true));
+}
+
+void test_fixture::run_for(uint32_t milliseconds)
+{
+	boost::asio::deadline_timer stop(io_);
+	stop.expires_from_now(boost::posix_time::milliseconds(milliseconds));
+	stop.async_wait([this](const boost::system::error_code&) {io_.stop();});
+	io_.run();
+	io_.reset();
+}
+
+std::string test_fixture::key_in(const raft::Shards& shards, uint32_t group)
+{
+	for(uint32_t dir = 0; dir < 1000; ++dir)
+	{
+		const std::string key = "%2fdir" + std::to_string(dir) + "%2ffnord";
+		if(shards.group_of(key) == group)
+			return key;
+	}
+
+	BOOST_FAIL("No key found in group " << group);
+	return std::string();
+}
+
+BOOST_AUTO_TEST_CASE(prefix_is_top_level_directory)
+{
+	//Files in the root directory share the empty prefix
+	BOOST_CHECK_EQUAL(raft::Shards::prefix("%2ffnord"), "");
+	BOOST_CHECK_EQUAL(raft::Shards::prefix("%2f"), "");
+	BOOST_CHECK_EQUAL(raft::Shards::prefix("fnord"), "");
+
+	BOOST_CHECK_EQUAL(raft::Shards::prefix("%2fhail%2feris"), "%2fhail");
+	BOOST_CHECK_EQUAL(raft::Shards::prefix("%2fhail%2feris%2ffnord"), "%2fhail");
+	BOOST_CHECK_EQUAL(raft::Shards::prefix("%2fhail%2f_"), "%2fhail");
+	BOOST_CHECK_EQUAL(raft::Shards::prefix("hail%2feris"), "hail");
+}
+
+BOOST_FIXTURE_TEST_CASE(group_of_is_deterministic, test_fixture)
+{
+	auto sut = make_shards(4);
+	auto other = make_shards(4);
+
+	const std::vector<std::string> keys{"%2ffnord", "%2fhail%2feris",
+		"%2fhail%2feris%2ffnord", "%2fkallisti%2fdiscordia", "%2f"};
+	for(const std::string& key : keys)
+	{
+		BOOST_CHECK_LT(sut->group_of(key), 4);
+		BOOST_CHECK_EQUAL(sut->group_of(key), sut->group_of(key));
+		BOOST_CHECK_EQUAL(sut->group_of(key), other->group_of(key));
+	}
+
+	//Every node has to agree, so it's FNV-1a rather than std::hash; the
+	//root directory's empty prefix hashes to the offset basis
+	BOOST_CHECK_EQUAL(sut->group_of("%2ffnord"), 2166136261u % 4);
+	BOOST_CHECK_EQUAL(sut->group_of("%2ffnord"), sut->group_of("%2fkallisti"));
+
+	BOOST_CHECK_EQUAL(sut->group_of("%2fhail%2feris"),
+			sut->group_of("%2fhail%2fdiscordia%2ffnord"));
+
+	//With one group everything's in it
+	auto single = make_shards(1);
+	for(const std::string& key : keys)
+		BOOST_CHECK_EQUAL(single->group_of(key), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(colocated_by_top_level_directory, test_fixture)
+{
+	auto sut = make_shards(2);
+
+	BOOST_CHECK(sut->colocated("%2ffnord", "%2fkallisti"));
+	BOOST_CHECK(sut->colocated("%2fhail%2feris", "%2fhail%2fdiscordia%2ffnord"));
+
+	const std::string first = key_in(*sut, 0);
+	const std::string second = key_in(*sut, 1);
+	BOOST_CHECK(!sut->colocated(first, second));
+	BOOST_CHECK(!sut->colocated(second, first));
+
+	//Renames between groups are never valid
+	BOOST_CHECK_EQUAL(sut->valid(raft::request::Rename("eris", first, second, "fnord")),
+			raft::Shards::request_invalid);
+}
+
+BOOST_FIXTURE_TEST_CASE(preferred_leader_spreads_groups, test_fixture)
+{
+	auto sut = make_shards(4);
+
+	//Voters are taken in order, wrapping round
+	BOOST_REQUIRE(sut->preferred_leader(0));
+	BOOST_CHECK_EQUAL(*sut->preferred_leader(0), "bar");
+	BOOST_REQUIRE(sut->preferred_leader(1));
+	BOOST_CHECK_EQUAL(*sut->preferred_leader(1), "eris");
+	BOOST_REQUIRE(sut->preferred_leader(2));
+	BOOST_CHECK_EQUAL(*sut->preferred_leader(2), "foo");
+	BOOST_REQUIRE(sut->preferred_leader(3));
+	BOOST_CHECK_EQUAL(*sut->preferred_leader(3), "bar");
+
+	//The same on every node
+	auto other = make_shards(4);
+	for(uint32_t group = 0; group < 4; ++group)
+		BOOST_CHECK(sut->preferred_leader(group) == other->preferred_leader(group));
+}
+
+BOOST_FIXTURE_TEST_CASE(balance_only_to_caught_up_voters, test_fixture)
+{
+	auto sut = make_shards(2);
+	lead(sut->group(0));
+	lead(sut->group(1));
+	BOOST_REQUIRE_EQUAL(*sut->preferred_leader(0), "bar");
+	BOOST_REQUIRE_EQUAL(*sut->preferred_leader(1), "eris");
+
+	//bar hasn't answered, so group 0 keeps taking writes
+	sut->balance();
+	sut->group(0).state().append(Json::Value("hail"));
+
+	answer(sut->group(0), "bar");
+	BOOST_REQUIRE(sut->group(0).state().caught_up("bar"));
+	sut->balance();
+	BOOST_CHECK_THROW(sut->group(0).state().append(Json::Value("eris")), std::logic_error);
+
+	//eris is already preferred for group 1
+	sut->group(1).state().append(Json::Value("hail"));
+}
+
+BOOST_FIXTURE_TEST_CASE(balance_timer_needs_several_groups, test_fixture)
+{
+	auto single = make_shards(1, 1);
+	lead(single->group(0));
+	answer(single->group(0), "bar");
+	BOOST_REQUIRE_EQUAL(*single->preferred_leader(0), "bar");
+
+	auto sharded = make_shards(2, 1);
+	lead(sharded->group(0));
+	answer(sharded->group(0), "bar");
+
+	run_for(20);
+
+	//Only the sharded group 0 was handed over
+	single->group(0).state().append(Json::Value("hail"));
+	BOOST_CHECK_THROW(sharded->group(0).state().append(Json::Value("hail")), std::logic_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer_done_once_after_all_groups, test_fixture)
+{
+	auto sut = make_shards(2);
+	std::vector<bool> done;
+	auto record = [&done](bool transferred) {done.push_back(transferred);};
+
+	//Nothing's led, so there's nothing to hand over
+	BOOST_CHECK(!sut->transfer_leadership(std::string("foo"), record));
+	io_.poll();
+	BOOST_CHECK(done.empty());
+
+	lead(sut->group(0));
+	lead(sut->group(1));
+	BOOST_REQUIRE(sut->transfer_leadership(std::string("foo"), record));
+
+	//foo's election for group 0 ends that transfer, but not group 1's
+	sut->group(0).state().request_vote(raft::rpc::request_vote(2, "foo", 1, 1, true));
+	BOOST_CHECK_EQUAL(sut->group(0).state().state(), raft::State::follower_state);
+	io_.poll();
+	BOOST_CHECK(done.empty());
+
+	sut->group(1).state().request_vote(raft::rpc::request_vote(2, "foo", 1, 1, true));
+	io_.poll();
+	BOOST_REQUIRE_EQUAL(done.size(), 1);
+	BOOST_CHECK(done[0]);
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer_fails_if_any_group_fails, test_fixture)
+{
+	auto sut = make_shards(2);
+	std::vector<bool> done;
+
+	lead(sut->group(0));
+	lead(sut->group(1));
+	BOOST_REQUIRE(sut->transfer_leadership(std::string("foo"),
+				[&done](bool transferred) {done.push_back(transferred);}));
+
+	sut->group(0).state().request_vote(raft::rpc::request_vote(2, "foo", 1, 1, true));
+
+	//Group 1's transfer is abandoned after enough leader timeouts
+	for(uint32_t round = 0; round < raft::State::transfer_rounds; ++round)
+		sut->group(1).state().timeout();
+	BOOST_CHECK_EQUAL(sut->group(1).state().state(), raft::State::leader_state);
+
+	io_.poll();
+	BOOST_REQUIRE_EQUAL(done.size(), 1);
+	BOOST_CHECK(!done[0]);
+}
+
+BOOST_FIXTURE_TEST_CASE(restore_merges_other_groups, test_fixture)
+{
+	auto sut = make_shards(2);
+	const std::string first = key_in(*sut, 0);
+	const std::string second = key_in(*sut, 1);
+
+	sut->group(0).client().commit_handler(raft::request::Add("foo", first, "hail"));
+	sut->group(1).client().commit_handler(raft::request::Add("bar", second, "eris"));
+
+	std::vector<raft::Client::restore_map_type> restored;
+	sut->connect_restore([&restored](const raft::Client::restore_map_type& versions)
+			{
+				restored.push_back(versions);
+			});
+
+	//Group 0 restores a snapshot with a newer version of its key
+	Json::Value snapshot = sut->group(0).client().snapshot();
+	snapshot[first][0] = "fnord";
+	sut->group(0).client().restore(snapshot);
+
+	BOOST_REQUIRE_EQUAL(restored.size(), 1);
+	BOOST_REQUIRE_EQUAL(restored[0].size(), 2);
+	BOOST_CHECK_EQUAL(std::get<0>(restored[0].at(first)), "fnord");
+	BOOST_CHECK_EQUAL(std::get<1>(restored[0].at(first)), "foo");
+
+	//Group 1's versions come along, so the whole map can be replaced
+	BOOST_CHECK_EQUAL(std::get<0>(restored[0].at(second)), "eris");
+	BOOST_CHECK_EQUAL(std::get<1>(restored[0].at(second)), "bar");
+}
@@ -0,0 +1,132 @@
+#define BOOST_TEST_MODULE "Raft simulation"
+#include <boost/test/unit_test.hpp>
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include <json/json.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+
+#include "../raftrpc.hpp"
+#include "../raftstate.hpp"
+#include "../raftsim.hpp"
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+struct disable_logging
+{
+	disable_logging()
+	{
+		boost::log::core::get()->set_logging_enabled(false);
+	}
+};
+
+BOOST_GLOBAL_FIXTURE(disable_logging)
+
+static const std::vector<std::string> nodes{"eris", "foo", "bar", "baz", "qux"};
+
+BOOST_AUTO_TEST_CASE(elects_a_leader)
+{
+	raft::Simulation sut(nodes);
+
+	BOOST_REQUIRE(sut.run_until([&sut]() {return static_cast<bool>(sut.leader());}, seconds(5)));
+	BOOST_CHECK_EQUAL(sut.stats().elections, 1);
+
+	//The first election can't finish before a timeout
+	BOOST_CHECK(sut.stats().downtime >= milliseconds(150));
+}
+
+BOOST_AUTO_TEST_CASE(commits_under_load)
+{
+	raft::Simulation sut(nodes);
+	sut.run(seconds(2));
+	sut.reset_stats();
+
+	sut.load(seconds(5), 200);
+	sut.run(seconds(1));
+
+	const auto& stats = sut.stats();
+	BOOST_CHECK_EQUAL(stats.proposed, 1000);
+	BOOST_CHECK_EQUAL(stats.accepted, 1000);
+	BOOST_CHECK_EQUAL(stats.committed, 1000);
+	BOOST_CHECK_CLOSE(stats.commits_per_second(), 1000 / 6.0, 1);
+	BOOST_CHECK_EQUAL(stats.elections, 0);
+	BOOST_CHECK(stats.downtime == milliseconds(0));
+
+	//A round trip each way, at most
+	BOOST_CHECK(stats.latency_percentile(0.5) >= milliseconds(2));
+	BOOST_CHECK(stats.latency_percentile(0.99) <= milliseconds(10));
+}
+
+BOOST_AUTO_TEST_CASE(runs_are_repeatable)
+{
+	auto run = [](uint32_t seed)
+	{
+		raft::Simulation::Options options;
+		options.seed = seed;
+		options.loss = 0.05;
+
+		raft::Simulation sut(nodes, options);
+		sut.load(seconds(10), 100);
+		return std::make_tuple(sut.stats().committed, sut.stats().latencies, sut.leader());
+	};
+
+	BOOST_CHECK(run(7) == run(7));
+}
+
+BOOST_AUTO_TEST_CASE(minority_partition_loses_leadership)
+{
+	raft::Simulation sut(nodes);
+	sut.run(seconds(2));
+	BOOST_REQUIRE(sut.leader());
+	const std::string old_leader = *sut.leader();
+
+	//Cut the leader off with one follower
+	std::vector<std::string> minority{old_leader}, majority;
+	for(const auto& node : nodes)
+		if(node != old_leader)
+			(minority.size() < 2 ? minority : majority).push_back(node);
+
+	sut.partition({minority, majority});
+	sut.reset_stats();
+	sut.load(seconds(5), 100);
+
+	//The majority elects its own leader and carries on committing
+	BOOST_REQUIRE(sut.leader());
+	BOOST_CHECK(*sut.leader() != old_leader);
+	BOOST_CHECK(sut.stats().elections >= 1);
+	BOOST_CHECK(sut.stats().committed > 0);
+
+	//and the old leader follows it once the network's healed
+	sut.heal();
+	sut.run(seconds(2));
+	BOOST_CHECK_EQUAL(sut.node(old_leader).state(), raft::State::follower_state);
+	BOOST_CHECK(sut.node(old_leader).log().commit_index()
+			== sut.node(*sut.leader()).log().commit_index());
+}
+
+BOOST_AUTO_TEST_CASE(commits_through_message_loss)
+{
+	raft::Simulation::Options options;
+	options.loss = 0.2;
+
+	raft::Simulation sut(nodes, options);
+	sut.run(seconds(5));
+	sut.reset_stats();
+
+	sut.load(seconds(10), 50);
+	sut.run(seconds(5));
+
+	//Lost appends are resent with the next heartbeat
+	BOOST_CHECK(sut.stats().accepted > 0);
+	BOOST_CHECK(sut.stats().committed >= sut.stats().accepted * 9 / 10);
+}
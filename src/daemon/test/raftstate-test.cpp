@@ -8,6 +8,7 @@
 #include <set>
 #include <functional>
 #include <fstream>
+#include <chrono>
 
 #include <json/json.h>
 
@@ -48,6 +49,15 @@ public:
 
 	raft::State::Handlers& handler();
 
+	//! Handlers that batch log writes, counting the sync requests
+	raft::State::Handlers& syncing_handler();
+
+	//! Handlers that support snapshots, recording the snapshot calls
+	raft::State::Handlers& snapshot_handler();
+
+	//! Handlers that defer commit notifications, counting the requests
+	raft::State::Handlers& notifying_handler();
+
 	std::vector<std::tuple<std::string, raft::rpc::append_entries>>
 		append_entries_args_;
 
@@ -58,16 +68,87 @@ public:
 
 	std::vector<Json::Value> commit_args_;
 
+	unsigned sync_requests_;
+
+	unsigned notify_requests_;
+
+	std::vector<std::tuple<std::string, raft::rpc::install_snapshot>>
+		install_snapshot_args_;
+
+	std::vector<uint32_t> request_snapshot_args_;
+
+	std::vector<Json::Value> restore_args_;
+
+	std::vector<std::tuple<std::string, raft::rpc::read_index>> read_index_args_;
+
+	std::vector<std::tuple<std::string, raft::rpc::timeout_now>> timeout_now_args_;
+
+	//! The time given to raft::State
+	std::chrono::steady_clock::time_point now_;
+
 protected:
 	fs::path tmp_log_;
 	bool handler_called_;
 	raft::State::Handlers handler_;
+	raft::State::Handlers syncing_handler_;
+	raft::State::Handlers snapshot_handler_;
+	raft::State::Handlers notifying_handler_;
+
+	raft::State::Handlers make_handlers(bool syncing, bool snapshotting = false,
+			bool notifying = false);
 };
 
 test_fixture::test_fixture()
-	:tmp_log_(fs::temp_directory_path() / fs::unique_path()),
+	:sync_requests_(0),
+	notify_requests_(0),
+	tmp_log_(fs::temp_directory_path() / fs::unique_path()),
 	handler_called_(false),
-	handler_(raft::State::Handlers(
+	handler_(make_handlers(false)),
+	syncing_handler_(make_handlers(true)),
+	snapshot_handler_(make_handlers(false, true)),
+	notifying_handler_(make_handlers(false, false, true))
+{
+
+}
+
+raft::State::Handlers test_fixture::make_handlers(bool syncing, bool snapshotting,
+		bool notifying)
+{
+	raft::State::Handlers::sync_type sync = nullptr;
+	if(syncing)
+		sync = [this]()
+		{
+			++sync_requests_;
+		};
+
+	raft::State::Handlers::install_snapshot_type install_snapshot = nullptr;
+	raft::State::Handlers::snapshot_type request_snapshot = nullptr;
+	raft::State::Handlers::restore_type restore = nullptr;
+	if(snapshotting)
+	{
+		install_snapshot = [this](const std::string& to, const raft::rpc::install_snapshot& rpc)
+		{
+			handler_called_ = true;
+			install_snapshot_args_.push_back(std::make_tuple(to, rpc));
+		};
+		request_snapshot = [this](uint32_t index)
+		{
+			request_snapshot_args_.push_back(index);
+		};
+		restore = [this](const Json::Value& state)
+		{
+			restore_args_.push_back(state);
+		};
+	}
+
+	raft::State::Handlers::notify_type request_notify = nullptr;
+	if(notifying)
+		request_notify = [this]()
+		{
+			++notify_requests_;
+		};
+
+	return raft::State::Handlers(
 			[this](const std::string& to, const raft::rpc::append_entries& rpc)
 			{
 				handler_called_ = true;
@@ -87,14 +168,29 @@ test_fixture::test_fixture()
 			{
 				handler_called_ = true;
 				commit_args_.push_back(value);
-			}))
-{
-
+			},
+			sync, install_snapshot, request_snapshot, restore,
+			[this](const std::string& to, const raft::rpc::read_index& rpc)
+			{
+				read_index_args_.push_back(std::make_tuple(to, rpc));
+			},
+			[this]()
+			{
+				return now_;
+			},
+			[this](const std::string& to, const raft::rpc::timeout_now& rpc)
+			{
+				timeout_now_args_.push_back(std::make_tuple(to, rpc));
+			},
+			nullptr, request_notify);
 }
 
 test_fixture::~test_fixture()
 {
-	fs::remove(tmp_log_);
+	fs::remove_all(tmp_log_);
+	fs::remove(tmp_log_.string() + ".json");
+	fs::remove(tmp_log_.string() + ".members");
+	fs::remove(tmp_log_.string() + ".applied");
 }
 
 fs::path test_fixture::tmp_log() const
@@ -112,6 +208,21 @@ raft::State::Handlers& test_fixture::handler()
 	return handler_;
 }
 
+raft::State::Handlers& test_fixture::syncing_handler()
+{
+	return syncing_handler_;
+}
+
+raft::State::Handlers& test_fixture::snapshot_handler()
+{
+	return snapshot_handler_;
+}
+
+raft::State::Handlers& test_fixture::notifying_handler()
+{
+	return notifying_handler_;
+}
+
 void test_fixture::write_for_stale() const
 {
 	std::ofstream of(tmp_log().string());
@@ -239,16 +350,8 @@ BOOST_FIXTURE_TEST_CASE(append_entries_with_incorrect_prev_log_term_with_new_ind
 		BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
 	}
 
-	std::ifstream log(tmp_log().string());
-	//ignore the first three lines
-	std::string line;
-	for(unsigned int i = 0; i < 3; ++i)
-		BOOST_REQUIRE(std::getline(log, line));
-
-	BOOST_REQUIRE(!std::getline(log, line));
-	BOOST_REQUIRE_EQUAL(line, "");
-	//Check there's nothing else
-	BOOST_REQUIRE(log.eof());
+	//The first three records are from setup; check there's nothing else
+	BOOST_REQUIRE_EQUAL(raft::log::read_records(tmp_log()).size(), 3);
 }
 
 BOOST_FIXTURE_TEST_CASE(append_entries_with_incorrect_prev_log_index_late, test_fixture)
@@ -295,16 +398,8 @@ BOOST_FIXTURE_TEST_CASE(append_entries_with_incorrect_prev_log_index_late_with_n
 		BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
 	}
 
-	std::ifstream log(tmp_log().string());
-	//ignore the first three lines
-	std::string line;
-	for(unsigned int i = 0; i < 3; ++i)
-		BOOST_REQUIRE(std::getline(log, line));
-
-	BOOST_REQUIRE(!std::getline(log, line));
-	BOOST_REQUIRE_EQUAL(line, "");
-	//Check there's nothing else
-	BOOST_REQUIRE(log.eof());
+	//The first three records are from setup; check there's nothing else
+	BOOST_REQUIRE_EQUAL(raft::log::read_records(tmp_log()).size(), 3);
 }
 
 BOOST_FIXTURE_TEST_CASE(append_entries_with_correct_prev_log, test_fixture)
@@ -329,16 +424,9 @@ BOOST_FIXTURE_TEST_CASE(append_entries_with_correct_prev_log, test_fixture)
 		BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
 	}
 
-	std::ifstream log(tmp_log().string());
-	//ignore the first four lines
-	std::string line;
-	for(unsigned int i = 0; i < 4; ++i)
-		BOOST_REQUIRE(std::getline(log, line));
-
-	BOOST_REQUIRE(!std::getline(log, line));
-	BOOST_REQUIRE_EQUAL(line, "");
-	//Check there's nothing else
-	BOOST_REQUIRE(log.eof());
+	//The first three records are from setup; the commit index isn't
+	//checkpointed yet, so check there's nothing else
+	BOOST_REQUIRE_EQUAL(raft::log::read_records(tmp_log()).size(), 3);
 }
 
 BOOST_FIXTURE_TEST_CASE(append_entries_with_correct_prev_log_requests_new_timeout, test_fixture)
@@ -389,14 +477,10 @@ BOOST_FIXTURE_TEST_CASE(append_entries_with_correct_prev_log_appends_entries, te
 		BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
 	}
 
-	std::ifstream log(tmp_log().string());
-	//ignore the first three lines
-	std::string line;
-	for(unsigned int i = 0; i < 3; ++i)
-		BOOST_REQUIRE(std::getline(log, line));
-
-	BOOST_REQUIRE(std::getline(log, line));
-	auto log_entry = json_help::parse(line);
+	auto records = raft::log::read_records(tmp_log());
+	//ignore the first three records
+	BOOST_REQUIRE(records.size() > 3);
+	auto log_entry = records[3];
 
 	BOOST_REQUIRE_EQUAL(log_entry["term"].asInt(), 2);
 	BOOST_REQUIRE_EQUAL(log_entry["type"].asString(), "entry");
@@ -800,9 +884,18 @@ BOOST_FIXTURE_TEST_CASE(leader_heartbeat_response_arrives_does_nothing_if_up_to_
 
 	raft::rpc::append_entries_response aer(std::get<1>(*bar_append), 3, true);
 
+	//bar's log matches, so it's only sent the nop for our new term
 	append_entries_args_.clear();
 	sut.append_entries_response("bar", aer);
 
+	BOOST_REQUIRE_EQUAL(append_entries_args_.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(append_entries_args_[0]), "bar");
+	BOOST_CHECK_EQUAL(std::get<1>(append_entries_args_[0]).entries().size(), 1);
+
+	raft::rpc::append_entries_response nop_aer(std::get<1>(append_entries_args_[0]), 3, true);
+	append_entries_args_.clear();
+	sut.append_entries_response("bar", nop_aer);
+
 	BOOST_CHECK_EQUAL(append_entries_args_.size(), 0);
 }
 
@@ -891,3 +984,1418 @@ BOOST_FIXTURE_TEST_CASE(leader_heartbeat_response_fallback_to_follower_on_newer_
 	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
 	BOOST_CHECK(!sut.leader());
 }
+
+BOOST_FIXTURE_TEST_CASE(batched_appends_request_one_sync, test_fixture)
+{
+	raft::State::Options options;
+	options.log.durability = raft::log::durability_batched;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), syncing_handler(),
+			options);
+
+	raft::rpc::append_entries ae(1, "foo", 0, 0,
+			{
+				std::make_tuple(1, Json::Value("hail")),
+				std::make_tuple(1, Json::Value("eris")),
+				std::make_tuple(1, Json::Value("fnord")),
+			}, 0);
+
+	auto ret = sut.append_entries(ae);
+	BOOST_REQUIRE(std::get<1>(ret));
+
+	//A new term and three entries, but only one sync
+	BOOST_CHECK_EQUAL(sync_requests_, 1);
+	BOOST_CHECK(!sut.log().durable());
+	BOOST_CHECK_EQUAL(sut.log().durable_index(), 0);
+	BOOST_CHECK_EQUAL(raft::log::read_records(tmp_log()).size(), 0);
+
+	sut.sync();
+
+	BOOST_CHECK(sut.log().durable());
+	BOOST_CHECK_EQUAL(sut.log().durable_index(), 3);
+	BOOST_CHECK_EQUAL(raft::log::read_records(tmp_log()).size(), 4);
+
+	//The next batch asks again
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 1, 3,
+				{std::make_tuple(1, Json::Value("hail"))}, 0));
+	BOOST_CHECK_EQUAL(sync_requests_, 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(leader_counts_itself_once_durable, test_fixture)
+{
+	write_for_stale();
+
+	raft::State::Options options;
+	options.log.durability = raft::log::durability_batched;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), syncing_handler(),
+			options);
+
+	sut.timeout();
+
+	auto bar_request = std::find_if(request_vote_args_.begin(), request_vote_args_.end(),
+			[](const std::tuple<std::string, raft::rpc::request_vote>& a) -> bool
+			{
+				return std::get<0>(a) == "bar";
+			});
+
+	sut.request_vote_response("bar", raft::rpc::request_vote_response(std::get<1>(*bar_request), 3, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	auto bar_append = [this]()
+	{
+		return std::get<1>(*std::find_if(append_entries_args_.rbegin(), append_entries_args_.rend(),
+				[](const std::tuple<std::string, raft::rpc::append_entries>& a) -> bool
+				{
+					return std::get<0>(a) == "bar";
+				}));
+	};
+
+	//Matching the heartbeat makes the leader add a nop for its new term
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(bar_append(), 3, true));
+	BOOST_REQUIRE_EQUAL(sut.log().last_index(), 3);
+
+	//The nop goes straight to bar, who acknowledges it
+	BOOST_REQUIRE_EQUAL(bar_append().entries().size(), 1);
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(bar_append(), 3, true));
+
+	//bar alone isn't a majority while our copy isn't durable
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 0);
+	BOOST_CHECK(commit_args_.empty());
+
+	sut.sync();
+
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 3);
+	BOOST_CHECK_EQUAL(commit_args_.size(), 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(followers_sent_shared_entry_payloads, test_fixture)
+{
+	write_for_stale();
+
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	sut.timeout();
+	for(const auto& request : request_vote_args_)
+		sut.request_vote_response(std::get<0>(request),
+				raft::rpc::request_vote_response(std::get<1>(request), 3, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	auto last_append = [this](const std::string& node)
+	{
+		return std::get<1>(*std::find_if(append_entries_args_.rbegin(), append_entries_args_.rend(),
+				[&node](const std::tuple<std::string, raft::rpc::append_entries>& a) -> bool
+				{
+					return std::get<0>(a) == node;
+				}));
+	};
+
+	//Each follower's sent the nop as soon as its log matches, then hail
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(last_append("foo"), 3, true));
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(last_append("bar"), 3, true));
+	const auto foo_nop = last_append("foo");
+	const auto bar_nop = last_append("bar");
+	BOOST_REQUIRE_EQUAL(foo_nop.entries().size(), 1);
+	BOOST_REQUIRE_EQUAL(bar_nop.entries().size(), 1);
+
+	sut.append(Json::Value("hail"));
+	sut.timeout();
+	auto foo = last_append("foo");
+	auto bar = last_append("bar");
+	BOOST_REQUIRE_EQUAL(foo.entries().size(), 1);
+	BOOST_REQUIRE_EQUAL(bar.entries().size(), 1);
+
+	//Both followers get the log's own payloads
+	BOOST_CHECK(std::get<1>(foo_nop.entries()[0]) == sut.log()[3].payload());
+	BOOST_CHECK(std::get<1>(bar_nop.entries()[0]) == sut.log()[3].payload());
+	BOOST_CHECK(std::get<1>(foo.entries()[0]) == sut.log()[4].payload());
+	BOOST_CHECK(std::get<1>(bar.entries()[0]) == sut.log()[4].payload());
+	BOOST_CHECK(std::get<1>(foo.entries()[0])->action() == Json::Value("hail"));
+
+	//Splicing in the serialised payloads gives the same message
+	BOOST_CHECK_EQUAL(json_help::write(json_help::parse(foo.serialise())), json_help::write(foo));
+	BOOST_CHECK_EQUAL(raft::rpc::append_entries(json_help::parse(foo.serialise())).entries().size(), 1);
+}
+
+//! Elects sut leader of term 3 over foo and bar, then appends entries 3--12
+static void lead_with_backlog(raft::State& sut, test_fixture& fixture)
+{
+	sut.timeout();
+	for(const auto& request : fixture.request_vote_args_)
+		sut.request_vote_response(std::get<0>(request),
+				raft::rpc::request_vote_response(std::get<1>(request), 3, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	for(int i = 3; i <= 12; ++i)
+		sut.append(Json::Value(i));
+}
+
+//! The append_entries sent to node, in order
+static std::vector<raft::rpc::append_entries> sent_to(const test_fixture& fixture, const std::string& node)
+{
+	std::vector<raft::rpc::append_entries> sent;
+	for(const auto& args : fixture.append_entries_args_)
+		if(std::get<0>(args) == node)
+			sent.push_back(std::get<1>(args));
+
+	return sent;
+}
+
+BOOST_FIXTURE_TEST_CASE(leader_pipelines_batches_up_to_window, test_fixture)
+{
+	write_for_stale();
+
+	raft::State::Options options;
+	options.transfer_limit = 2;
+	options.pipeline_window = 3;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	lead_with_backlog(sut, *this);
+
+	//Once foo's log matches, three batches go without waiting
+	auto probe = sent_to(*this, "foo").back();
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(probe, 3, true));
+
+	auto sent = sent_to(*this, "foo");
+	BOOST_REQUIRE_EQUAL(sent.size(), 3);
+	for(unsigned i = 0; i < sent.size(); ++i)
+	{
+		BOOST_CHECK_EQUAL(sent[i].prev_log_index(), 2 + 2 * i);
+		BOOST_CHECK_EQUAL(sent[i].entries().size(), 2);
+	}
+
+	//With the window full, heartbeats carry no entries
+	append_entries_args_.clear();
+	sut.timeout();
+	BOOST_REQUIRE_EQUAL(sent_to(*this, "foo").size(), 1);
+	BOOST_CHECK_EQUAL(sent_to(*this, "foo")[0].prev_log_index(), 8);
+	BOOST_CHECK(sent_to(*this, "foo")[0].entries().empty());
+
+	//Each acknowledgement makes room for one more batch
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent[0], 3, true));
+	BOOST_REQUIRE_EQUAL(sent_to(*this, "foo").size(), 1);
+	BOOST_CHECK_EQUAL(sent_to(*this, "foo")[0].prev_log_index(), 8);
+	BOOST_CHECK_EQUAL(sent_to(*this, "foo")[0].entries().size(), 2);
+
+	//Acknowledging a later batch covers the earlier ones
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent[2], 3, true));
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 8);
+	BOOST_REQUIRE_EQUAL(sent_to(*this, "foo").size(), 1);
+	BOOST_CHECK_EQUAL(sent_to(*this, "foo")[0].prev_log_index(), 10);
+
+	//so one arriving late doesn't move foo backwards
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent[1], 3, true));
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 8);
+	BOOST_CHECK(sent_to(*this, "foo").empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(commit_sent_on_without_waiting_for_heartbeat, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), notifying_handler());
+
+	sut.timeout();
+	auto request = std::get<1>(request_vote_args_.back());
+	sut.request_vote_response("foo", raft::rpc::request_vote_response(request, 1, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	sut.append(Json::Value("hail"));
+	sut.append(Json::Value("eris"));
+	auto entries = raft::rpc::append_entries(1, "eris", 0, 0,
+			std::vector<std::tuple<uint32_t, Json::Value>>{
+				std::make_tuple(1u, Json::Value("hail")),
+				std::make_tuple(1u, Json::Value("eris"))}, 0);
+
+	//Nothing's sent until the notification's run, so both commits share it
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(entries, 1, true));
+	BOOST_REQUIRE_EQUAL(sut.log().commit_index(), 2);
+	BOOST_CHECK_EQUAL(notify_requests_, 1);
+	BOOST_CHECK(append_entries_args_.empty());
+
+	sut.notify_commit();
+	BOOST_REQUIRE_EQUAL(sent_to(*this, "foo").size(), 1);
+	BOOST_CHECK_EQUAL(sent_to(*this, "foo")[0].leader_commit(), 2);
+	BOOST_REQUIRE_EQUAL(sent_to(*this, "bar").size(), 1);
+	BOOST_CHECK_EQUAL(sent_to(*this, "bar")[0].leader_commit(), 2);
+
+	//Followers already told aren't sent it again
+	append_entries_args_.clear();
+	sut.notify_commit();
+	BOOST_CHECK(append_entries_args_.empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(rejection_rewinds_pipeline, test_fixture)
+{
+	write_for_stale();
+
+	raft::State::Options options;
+	options.transfer_limit = 2;
+	options.pipeline_window = 3;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	lead_with_backlog(sut, *this);
+
+	auto probe = sent_to(*this, "foo").back();
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(probe, 3, true));
+	auto sent = sent_to(*this, "foo");
+	BOOST_REQUIRE_EQUAL(sent.size(), 3);
+
+	//foo lost the second batch, so goes back to probing just before it
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent[1], 3, false));
+	BOOST_REQUIRE_EQUAL(sent_to(*this, "foo").size(), 1);
+	probe = sent_to(*this, "foo")[0];
+	BOOST_CHECK_EQUAL(probe.prev_log_index(), 3);
+	BOOST_CHECK(probe.entries().empty());
+
+	//The third batch's rejection was caused by the second's, so is ignored
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent[2], 3, false));
+	BOOST_CHECK(sent_to(*this, "foo").empty());
+
+	//Once the probe matches, the pipeline restarts from there
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(probe, 3, true));
+	sent = sent_to(*this, "foo");
+	BOOST_REQUIRE_EQUAL(sent.size(), 3);
+	BOOST_CHECK_EQUAL(sent[0].prev_log_index(), 3);
+	BOOST_CHECK_EQUAL(sent[2].prev_log_index(), 7);
+}
+
+BOOST_FIXTURE_TEST_CASE(resent_entries_keep_later_ones, test_fixture)
+{
+	write_for_stale();
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+
+	std::vector<std::tuple<uint32_t, Json::Value>> entries{
+		std::make_tuple(3u, Json::Value("hail")),
+		std::make_tuple(3u, Json::Value("eris")),
+		std::make_tuple(3u, Json::Value("fnord"))};
+	BOOST_REQUIRE(std::get<1>(sut.append_entries(raft::rpc::append_entries(3, "foo", 2, 2, entries, 0))));
+
+	//An earlier batch arriving again doesn't truncate the log
+	entries.resize(1);
+	BOOST_REQUIRE(std::get<1>(sut.append_entries(raft::rpc::append_entries(3, "foo", 2, 2, entries, 0))));
+	BOOST_REQUIRE_EQUAL(sut.log().last_index(), 5);
+	BOOST_CHECK_EQUAL(sut.log()[5].action().asString(), "fnord");
+}
+
+BOOST_AUTO_TEST_CASE(append_entries_response_is_compact)
+{
+	std::vector<std::tuple<uint32_t, Json::Value>> entries{
+		std::make_tuple(2u, Json::Value("hail")),
+		std::make_tuple(2u, Json::Value("eris"))};
+	raft::rpc::append_entries request(2, "foo", 1, 4, entries, 3);
+	BOOST_CHECK_EQUAL(request.version(), raft::rpc::protocol_version);
+
+	Json::Value json = raft::rpc::append_entries_response(request, 2, true);
+	BOOST_CHECK(!json.isMember("request"));
+
+	raft::rpc::append_entries_response sut(json);
+	BOOST_CHECK_EQUAL(sut.version(), raft::rpc::protocol_version);
+	BOOST_CHECK_EQUAL(sut.term(), 2);
+	BOOST_CHECK(sut.success());
+	BOOST_CHECK_EQUAL(sut.prev_log_index(), 4);
+	BOOST_CHECK_EQUAL(sut.match_index(), 6);
+
+	raft::rpc::append_entries_response rejection(
+			Json::Value(raft::rpc::append_entries_response(request, 2, false, 3)));
+	BOOST_CHECK(!rejection.success());
+	BOOST_CHECK_EQUAL(rejection.prev_log_index(), 4);
+	BOOST_CHECK_EQUAL(rejection.match_index(), 0);
+	BOOST_CHECK_EQUAL(rejection.conflict_index(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(version_one_requests_answered_in_kind)
+{
+	//As sent by a leader from before responses were compact
+	auto request_json = json_help::parse(R"({"type":"append_entries","term":2,"leader_id":"foo",)"
+			R"("prev_log_term":1,"prev_log_index":4,"entries":[[2,"hail"]],"leader_commit":3})");
+	raft::rpc::append_entries request(request_json);
+	BOOST_CHECK_EQUAL(request.version(), 1);
+
+	Json::Value json = raft::rpc::append_entries_response(request, 2, true);
+	BOOST_REQUIRE(json.isMember("request"));
+	BOOST_CHECK_EQUAL(json["request"]["prev_log_index"].asUInt(), 4);
+
+	//and old responses are understood
+	raft::rpc::append_entries_response sut(json);
+	BOOST_CHECK_EQUAL(sut.version(), 1);
+	BOOST_CHECK(sut.success());
+	BOOST_CHECK_EQUAL(sut.prev_log_index(), 4);
+	BOOST_CHECK_EQUAL(sut.match_index(), 5);
+}
+
+BOOST_FIXTURE_TEST_CASE(lagging_follower_hints_its_last_index, test_fixture)
+{
+	write_for_stale();
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+
+	auto result = sut.append_entries(raft::rpc::append_entries(3, "foo", 3, 10, {}, 0));
+	BOOST_CHECK(!std::get<1>(result));
+	BOOST_CHECK_EQUAL(std::get<2>(result), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(leader_rewinds_to_conflict_hint, test_fixture)
+{
+	write_for_stale();
+
+	raft::State::Options options;
+	options.transfer_limit = 2;
+	options.pipeline_window = 3;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	lead_with_backlog(sut, *this);
+
+	auto probe = sent_to(*this, "foo").back();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(probe, 3, true));
+	auto sent = sent_to(*this, "foo");
+	BOOST_REQUIRE(sent.size() >= 3);
+
+	//foo's log ends before the third batch, and says so
+	append_entries_args_.clear();
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent.back(), 3, false, 5));
+	BOOST_REQUIRE_EQUAL(sent_to(*this, "foo").size(), 1);
+	BOOST_CHECK_EQUAL(sent_to(*this, "foo")[0].prev_log_index(), 4);
+}
+
+//! Write a log made of runs of entries, each a term and the number in it
+static void write_runs(const std::string& path, const std::vector<std::tuple<uint32_t, uint32_t>>& runs)
+{
+	std::ofstream of(path);
+	of << R"({"term":1,"type":"vote","for":"foo"})" << '\n';
+
+	uint32_t index = 0;
+	for(const auto& run : runs)
+		for(uint32_t i = 0; i < std::get<1>(run); ++i)
+		{
+			++index;
+			of << R"({"term":)" << std::get<0>(run) << R"(,"type":"entry","spawn_term":)"
+				<< std::get<0>(run) << R"(,"index":)" << index << R"(,"action":)" << index << "}\n";
+		}
+}
+
+BOOST_FIXTURE_TEST_CASE(divergent_follower_converges_in_few_rounds, test_fixture)
+{
+	//foo kept a long run of uncommitted entries from an old leader in term
+	//2, and missed most of term 2 and all of term 3
+	const std::string follower_log = tmp_log().string() + "-foo";
+	struct remove_follower_log
+	{
+		const std::string& path;
+		~remove_follower_log()
+		{
+			fs::remove_all(path);
+			fs::remove(path + ".json");
+		}
+	} cleanup{follower_log};
+
+	write_runs(tmp_log().string(), {std::make_tuple(1u, 50u), std::make_tuple(2u, 50u),
+			std::make_tuple(3u, 150u)});
+	write_runs(follower_log, {std::make_tuple(1u, 50u), std::make_tuple(2u, 300u)});
+
+	raft::State sut("eris", {"foo"}, tmp_log().string(), handler());
+	raft::State follower("foo", {"eris"}, follower_log, handler());
+
+	sut.timeout();
+	for(const auto& request : request_vote_args_)
+		sut.request_vote_response(std::get<0>(request),
+				raft::rpc::request_vote_response(std::get<1>(request), 4, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	//Each round delivers everything sent to foo and returns its responses
+	unsigned rounds = 0;
+	while(rounds < 1000 && !(follower.log().last_index() == sut.log().last_index()
+				&& follower.log().match(sut.log()[sut.log().last_index()].term(), sut.log().last_index())))
+	{
+		auto sent = sent_to(*this, "foo");
+		append_entries_args_.clear();
+		BOOST_REQUIRE(!sent.empty());
+
+		for(const auto& request : sent)
+		{
+			auto ret = follower.append_entries(request);
+			sut.append_entries_response("foo", raft::rpc::append_entries_response(request,
+						std::get<0>(ret), std::get<1>(ret), std::get<2>(ret), std::get<3>(ret)));
+		}
+		++rounds;
+	}
+
+	BOOST_TEST_MESSAGE("Converged in " << rounds << " rounds");
+	//Stepping back an entry at a time would take more than two hundred
+	BOOST_CHECK_LE(rounds, 5);
+	BOOST_CHECK_EQUAL(follower.log()[100].action().asUInt(), 100);
+	BOOST_CHECK_EQUAL(follower.log()[101].term(), 4);
+}
+
+//! Elect sut leader of term 1 with an empty log
+static void lead_empty(raft::State& sut, test_fixture& fixture)
+{
+	sut.timeout();
+	for(const auto& request : fixture.request_vote_args_)
+		sut.request_vote_response(std::get<0>(request),
+				raft::rpc::request_vote_response(std::get<1>(request), 1, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+}
+
+BOOST_FIXTURE_TEST_CASE(read_confirmed_by_heartbeat_quorum, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_empty(sut, *this);
+	auto before = sent_to(*this, "foo").back();
+
+	std::vector<bool> reads;
+	append_entries_args_.clear();
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+
+	//A heartbeat round goes out instead of a log write
+	BOOST_CHECK(reads.empty());
+	BOOST_CHECK_EQUAL(sut.log().last_index(), 0);
+	auto round = sent_to(*this, "foo");
+	BOOST_REQUIRE_EQUAL(round.size(), 1);
+	BOOST_CHECK_GT(round[0].read_seq(), before.read_seq());
+
+	//An answer to a heartbeat sent before the read doesn't confirm it
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(before, 1, true));
+	BOOST_CHECK(reads.empty());
+
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(round[0], 1, true));
+	BOOST_REQUIRE_EQUAL(reads.size(), 1);
+	BOOST_CHECK(reads[0]);
+}
+
+BOOST_FIXTURE_TEST_CASE(read_waits_for_commit_in_term, test_fixture)
+{
+	write_for_stale();
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_with_backlog(sut, *this);
+
+	std::vector<bool> reads;
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+
+	//foo answers, but until something's committed in this term we don't
+	//know what's been committed
+	auto sent = sent_to(*this, "foo");
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent.back(), 3, false, 2));
+	BOOST_CHECK(reads.empty());
+
+	//Once foo has everything, it's committed, then applied, then read
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(
+				raft::rpc::append_entries(3, "eris", 2, 2,
+					std::vector<std::tuple<uint32_t, Json::Value>>(10, std::make_tuple(3u, Json::Value(0))),
+					0, sent.back().read_seq()), 3, true));
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 12);
+	BOOST_REQUIRE_EQUAL(reads.size(), 1);
+	BOOST_CHECK(reads[0]);
+}
+
+BOOST_FIXTURE_TEST_CASE(reads_fail_when_leadership_lost, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_empty(sut, *this);
+
+	std::vector<bool> reads;
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+	BOOST_CHECK(reads.empty());
+
+	sut.append_entries(raft::rpc::append_entries(2, "foo", 0, 0, {}, 0));
+	BOOST_REQUIRE_EQUAL(reads.size(), 1);
+	BOOST_CHECK(!reads[0]);
+
+	//and without a leader there's no one to ask
+	raft::State candidate("foo", {"eris", "bar"}, tmp_log().string() + "-foo", handler());
+	candidate.timeout();
+	candidate.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+	BOOST_REQUIRE_EQUAL(reads.size(), 2);
+	BOOST_CHECK(!reads[1]);
+	fs::remove_all(tmp_log().string() + "-foo");
+}
+
+BOOST_FIXTURE_TEST_CASE(follower_reads_through_leader, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0, {}, 0));
+
+	std::vector<bool> reads;
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+	BOOST_REQUIRE_EQUAL(read_index_args_.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(read_index_args_[0]), "foo");
+
+	//The request survives the trip
+	raft::rpc::read_index request(Json::Value(std::get<1>(read_index_args_[0])));
+	BOOST_CHECK_EQUAL(request.term(), 1);
+
+	//The leader has committed an entry we haven't got yet
+	sut.read_index_response("foo", raft::rpc::read_index_response(
+				Json::Value(raft::rpc::read_index_response(request, 1, true, 1))));
+	BOOST_CHECK(reads.empty());
+
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0,
+				{std::make_tuple(1, Json::Value("hail"))}, 1));
+	BOOST_REQUIRE_EQUAL(reads.size(), 1);
+	BOOST_CHECK(reads[0]);
+	BOOST_CHECK_EQUAL(commit_args_.size(), 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(leader_answers_read_index, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_empty(sut, *this);
+
+	std::vector<raft::rpc::read_index_response> responses;
+	auto respond = [&responses](const raft::rpc::read_index_response& rpc) {responses.push_back(rpc);};
+
+	sut.read_index(raft::rpc::read_index(1, 7), respond);
+	BOOST_CHECK(responses.empty());
+
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(sent_to(*this, "bar").back(), 1, true));
+	BOOST_REQUIRE_EQUAL(responses.size(), 1);
+	BOOST_CHECK(responses[0].success());
+	BOOST_CHECK_EQUAL(responses[0].id(), 7);
+	BOOST_CHECK_EQUAL(responses[0].index(), 0);
+
+	//Another term's follower is refused
+	sut.read_index(raft::rpc::read_index(0, 8), respond);
+	BOOST_REQUIRE_EQUAL(responses.size(), 2);
+	BOOST_CHECK(!responses[1].success());
+}
+
+BOOST_FIXTURE_TEST_CASE(lease_serves_reads_without_heartbeats, test_fixture)
+{
+	raft::State::Options options;
+	options.lease_duration = 100;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	lead_empty(sut, *this);
+
+	//The election's heartbeats are answered 10ms after they're sent
+	now_ += std::chrono::milliseconds(10);
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent_to(*this, "foo").back(), 1, true));
+
+	std::vector<bool> reads;
+	append_entries_args_.clear();
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+	BOOST_REQUIRE_EQUAL(reads.size(), 1);
+	BOOST_CHECK(reads[0]);
+	BOOST_CHECK(append_entries_args_.empty());
+
+	//The lease runs from when the heartbeats were sent
+	now_ += std::chrono::milliseconds(90);
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+	BOOST_CHECK_EQUAL(reads.size(), 1);
+	BOOST_CHECK(!append_entries_args_.empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer_ends_lease, test_fixture)
+{
+	raft::State::Options options;
+	options.lease_duration = 100;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	lead_empty(sut, *this);
+
+	now_ += std::chrono::milliseconds(10);
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(sent_to(*this, "foo").back(), 1, true));
+
+	//foo's up to date, so it's told to stand straight away
+	BOOST_REQUIRE(sut.transfer_leadership(std::string("foo"), nullptr));
+	BOOST_REQUIRE_EQUAL(timeout_now_args_.size(), 1);
+
+	//foo's votes don't wait for the lease, so it can't vouch for reads
+	std::vector<bool> reads;
+	append_entries_args_.clear();
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+	BOOST_CHECK(reads.empty());
+	BOOST_CHECK(!append_entries_args_.empty());
+
+	//bar answering the round confirms the read, but doesn't start a lease
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(sent_to(*this, "bar").back(), 1, true));
+	BOOST_REQUIRE_EQUAL(reads.size(), 1);
+	BOOST_CHECK(reads[0]);
+
+	append_entries_args_.clear();
+	sut.read([&reads](bool confirmed) {reads.push_back(confirmed);});
+	BOOST_CHECK_EQUAL(reads.size(), 1);
+	BOOST_CHECK(!append_entries_args_.empty());
+
+	//foo's election refuses what's left
+	sut.request_vote(raft::rpc::request_vote(2, "foo", 0, 0, true));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
+	BOOST_REQUIRE_EQUAL(reads.size(), 2);
+	BOOST_CHECK(!reads[1]);
+}
+
+BOOST_FIXTURE_TEST_CASE(votes_refused_during_lease, test_fixture)
+{
+	raft::State::Options options;
+	options.lease_duration = 100;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0, {}, 0));
+
+	now_ += std::chrono::milliseconds(50);
+	auto vote = sut.request_vote(raft::rpc::request_vote(2, "bar", 0, 0));
+	BOOST_CHECK(!std::get<1>(vote));
+	BOOST_CHECK_EQUAL(sut.term(), 1);
+
+	now_ += std::chrono::milliseconds(50);
+	vote = sut.request_vote(raft::rpc::request_vote(2, "bar", 0, 0));
+	BOOST_CHECK(std::get<1>(vote));
+	BOOST_CHECK_EQUAL(sut.term(), 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(batch_sent_in_one_round, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_empty(sut, *this);
+
+	//bar's log is known to match; foo's isn't yet
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(sent_to(*this, "bar").back(), 1, true));
+
+	append_entries_args_.clear();
+	sut.append(std::vector<Json::Value>{Json::Value("hail"), Json::Value("eris"), Json::Value("fnord")});
+	BOOST_CHECK_EQUAL(sut.log().last_index(), 3);
+
+	auto sent = sent_to(*this, "bar");
+	BOOST_REQUIRE_EQUAL(sent.size(), 1);
+	BOOST_CHECK_EQUAL(sent[0].prev_log_index(), 0);
+	BOOST_CHECK_EQUAL(sent[0].entries().size(), 3);
+	BOOST_CHECK(sent_to(*this, "foo").empty());
+
+	//Only the leader takes batches
+	raft::State follower("foo", {"eris", "bar"}, tmp_log().string() + "-foo", handler());
+	BOOST_CHECK_THROW(follower.append(std::vector<Json::Value>{Json::Value("hail")}), std::logic_error);
+	fs::remove_all(tmp_log().string() + "-foo");
+}
+
+BOOST_FIXTURE_TEST_CASE(last_entry_sent_when_window_frees, test_fixture)
+{
+	raft::State::Options options;
+	options.pipeline_window = 1;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	lead_empty(sut, *this);
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(sent_to(*this, "bar").back(), 1, true));
+
+	sut.append(std::vector<Json::Value>{Json::Value("hail")});
+	auto batch = sent_to(*this, "bar").back();
+
+	//The window's full, so the next entry waits
+	append_entries_args_.clear();
+	sut.append(std::vector<Json::Value>{Json::Value("eris")});
+	BOOST_CHECK(sent_to(*this, "bar").empty());
+
+	//It's sent as soon as the first is acknowledged, not at the next heartbeat
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(batch, 1, true));
+	auto sent = sent_to(*this, "bar");
+	BOOST_REQUIRE_EQUAL(sent.size(), 1);
+	BOOST_CHECK_EQUAL(sent[0].prev_log_index(), 1);
+	BOOST_REQUIRE_EQUAL(sent[0].entries().size(), 1);
+	BOOST_CHECK(std::get<1>(sent[0].entries()[0])->action() == Json::Value("eris"));
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer_waits_for_target_to_catch_up, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_empty(sut, *this);
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(sent_to(*this, "bar").back(), 1, true));
+	sut.append(std::vector<Json::Value>{Json::Value("hail"), Json::Value("eris")});
+	auto batch = sent_to(*this, "bar").back();
+
+	std::vector<bool> done;
+	BOOST_REQUIRE(sut.transfer_leadership(std::string("bar"),
+				[&done](bool transferred) {done.push_back(transferred);}));
+
+	//bar hasn't got everything yet, and nothing more is taken meanwhile
+	BOOST_CHECK(timeout_now_args_.empty());
+	BOOST_CHECK_THROW(sut.append(std::vector<Json::Value>{Json::Value("fnord")}), std::logic_error);
+	BOOST_CHECK_THROW(sut.append(Json::Value("fnord")), std::logic_error);
+	BOOST_CHECK_EQUAL(sut.log().last_index(), 2);
+	BOOST_CHECK(!sut.transfer_leadership(std::string("foo"), nullptr));
+
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(batch, 1, true));
+	BOOST_REQUIRE_EQUAL(timeout_now_args_.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(timeout_now_args_[0]), "bar");
+	BOOST_CHECK_EQUAL(std::get<1>(timeout_now_args_[0]).term(), 1);
+	BOOST_CHECK_EQUAL(std::get<1>(timeout_now_args_[0]).leader_id(), "eris");
+	BOOST_CHECK(done.empty());
+
+	//bar's election ends the transfer
+	auto vote = sut.request_vote(raft::rpc::request_vote(2, "bar", 1, 2, true));
+	BOOST_CHECK(std::get<1>(vote));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
+	BOOST_REQUIRE_EQUAL(done.size(), 1);
+	BOOST_CHECK(done[0]);
+}
+
+BOOST_FIXTURE_TEST_CASE(caught_up_needs_recent_answers, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	BOOST_CHECK(!sut.caught_up("bar"));
+
+	lead_empty(sut, *this);
+	BOOST_CHECK(!sut.caught_up("bar"));
+
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(sent_to(*this, "bar").back(), 1, true));
+	BOOST_CHECK(sut.caught_up("bar"));
+	BOOST_CHECK(!sut.caught_up("foo"));
+	BOOST_CHECK(!sut.caught_up("discordia"));
+
+	//Entries in flight don't hold it back
+	sut.append(std::vector<Json::Value>{Json::Value("hail")});
+	BOOST_CHECK(sut.caught_up("bar"));
+
+	//Two rounds of heartbeats without an answer do
+	sut.timeout();
+	BOOST_CHECK(sut.caught_up("bar"));
+	sut.timeout();
+	BOOST_CHECK(!sut.caught_up("bar"));
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer_needs_leader_and_known_node, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	BOOST_CHECK(!sut.transfer_leadership(boost::none, nullptr));
+
+	lead_empty(sut, *this);
+	BOOST_CHECK(!sut.transfer_leadership(std::string("discordia"), nullptr));
+
+	//Without a target, the follower with most of the log is picked
+	sut.append(Json::Value("hail"));
+	sut.append_entries_response("foo", raft::rpc::append_entries_response(
+				raft::rpc::append_entries(1, "eris", 0, 0,
+					std::vector<std::tuple<uint32_t, Json::Value>>{std::make_tuple(1u, Json::Value("hail"))}, 0),
+				1, true));
+	BOOST_REQUIRE(sut.transfer_leadership(boost::none, nullptr));
+	BOOST_REQUIRE_EQUAL(timeout_now_args_.size(), 1);
+	BOOST_CHECK_EQUAL(std::get<0>(timeout_now_args_[0]), "foo");
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer_abandoned_after_rounds, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_empty(sut, *this);
+
+	std::vector<bool> done;
+	BOOST_REQUIRE(sut.transfer_leadership(std::string("foo"),
+				[&done](bool transferred) {done.push_back(transferred);}));
+
+	//foo never campaigns
+	for(uint32_t i = 1; i < raft::State::transfer_rounds; ++i)
+		sut.timeout();
+	BOOST_CHECK(done.empty());
+	//and it's reminded each round
+	BOOST_CHECK_EQUAL(timeout_now_args_.size(), raft::State::transfer_rounds);
+
+	sut.timeout();
+	BOOST_REQUIRE_EQUAL(done.size(), 1);
+	BOOST_CHECK(!done[0]);
+
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::leader_state);
+	sut.append(std::vector<Json::Value>{Json::Value("hail")});
+	BOOST_CHECK_EQUAL(sut.log().last_index(), 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(timeout_now_starts_election, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0, {}, 0));
+
+	//Only our leader can hand over
+	sut.timeout_now(raft::rpc::timeout_now(1, "bar"));
+	sut.timeout_now(raft::rpc::timeout_now(0, "foo"));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
+	BOOST_CHECK(request_vote_args_.empty());
+
+	sut.timeout_now(raft::rpc::timeout_now(1, "foo"));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::candidate_state);
+	BOOST_CHECK_EQUAL(sut.term(), 2);
+	BOOST_REQUIRE_EQUAL(request_vote_args_.size(), 2);
+	for(const auto& request : request_vote_args_)
+		BOOST_CHECK(std::get<1>(request).transfer());
+
+	//The flag survives the wire
+	auto rv = std::get<1>(request_vote_args_[0]);
+	BOOST_CHECK(raft::rpc::request_vote(rv).transfer());
+	BOOST_CHECK(raft::rpc::request_vote(static_cast<Json::Value>(rv)).transfer());
+	BOOST_CHECK(!raft::rpc::request_vote(static_cast<Json::Value>(raft::rpc::request_vote(2, "eris", 0, 0))).transfer());
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer_votes_granted_during_lease, test_fixture)
+{
+	raft::State::Options options;
+	options.lease_duration = 100;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0, {}, 0));
+
+	now_ += std::chrono::milliseconds(50);
+	auto vote = sut.request_vote(raft::rpc::request_vote(2, "bar", 0, 0, true));
+	BOOST_CHECK(std::get<1>(vote));
+	BOOST_CHECK_EQUAL(sut.term(), 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(partitioned_node_keeps_its_term, test_fixture)
+{
+	raft::State::Options options;
+	options.pre_vote = true;
+	raft::State sut("bar", {"eris", "foo"}, tmp_log().string(), handler(),
+			options);
+	sut.append_entries(raft::rpc::append_entries(1, "eris", 0, 0, {}, 0));
+
+	//Cut off, its timeouts only ask about the next term
+	for(int i = 0; i < 5; ++i)
+		sut.timeout();
+
+	BOOST_CHECK_EQUAL(sut.term(), 1);
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
+	BOOST_CHECK(!sut.leader());
+	BOOST_REQUIRE_EQUAL(request_vote_args_.size(), 10);
+	for(const auto& request : request_vote_args_)
+	{
+		BOOST_CHECK(std::get<1>(request).pre_vote());
+		BOOST_CHECK_EQUAL(std::get<1>(request).term(), 2);
+	}
+
+	//The flag survives the wire
+	auto rv = std::get<1>(request_vote_args_[0]);
+	BOOST_CHECK(raft::rpc::request_vote(static_cast<Json::Value>(rv)).pre_vote());
+	BOOST_CHECK(raft::rpc::request_vote_response(static_cast<Json::Value>(
+					raft::rpc::request_vote_response(rv, 1, false))).request().pre_vote());
+}
+
+BOOST_FIXTURE_TEST_CASE(rejoining_node_does_not_depose_leader, test_fixture)
+{
+	raft::State leader("eris", {"foo", "bar"}, tmp_log().string(), handler());
+	lead_empty(leader, *this);
+	leader.append(Json::Value("hail"));
+
+	raft::State foo("foo", {"eris", "bar"}, tmp_log().string() + "-foo", handler());
+	foo.append_entries(raft::rpc::append_entries(1, "eris", 0, 0,
+				std::vector<std::tuple<uint32_t, Json::Value>>{std::make_tuple(1u, Json::Value("hail"))}, 0));
+
+	//bar was partitioned while its term ran on
+	raft::State::Options bar_options;
+	bar_options.pre_vote = true;
+	raft::State bar("bar", {"eris", "foo"}, tmp_log().string() + "-bar", handler(),
+			bar_options);
+	request_vote_args_.clear();
+	bar.timeout();
+	BOOST_REQUIRE_EQUAL(request_vote_args_.size(), 2);
+
+	//Neither the leader nor a node that's heard from it will help
+	for(const auto& request : request_vote_args_)
+	{
+		raft::State& voter = std::get<0>(request) == "eris" ? leader : foo;
+		auto ret = voter.request_vote(std::get<1>(request));
+		BOOST_CHECK(!std::get<1>(ret));
+		bar.request_vote_response(std::get<0>(request), raft::rpc::request_vote_response(
+					std::get<1>(request), std::get<0>(ret), std::get<1>(ret)));
+	}
+
+	BOOST_CHECK_EQUAL(leader.state(), raft::State::leader_state);
+	BOOST_CHECK_EQUAL(leader.term(), 1);
+	BOOST_CHECK_EQUAL(foo.term(), 1);
+	BOOST_CHECK_EQUAL(bar.term(), 1);
+	BOOST_CHECK_EQUAL(bar.state(), raft::State::follower_state);
+
+	//and the leader's heartbeat brings it back into line
+	bar.append_entries(raft::rpc::append_entries(1, "eris", 0, 0, {}, 0));
+	BOOST_CHECK_EQUAL(*bar.leader(), "eris");
+
+	fs::remove_all(tmp_log().string() + "-foo");
+	fs::remove_all(tmp_log().string() + "-bar");
+}
+
+BOOST_FIXTURE_TEST_CASE(election_follows_winning_pre_vote, test_fixture)
+{
+	raft::State::Options options;
+	options.pre_vote = true;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler(),
+			options);
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0,
+				std::vector<std::tuple<uint32_t, Json::Value>>{std::make_tuple(1u, Json::Value("hail"))}, 0));
+
+	//bar's timeout has fired too, so it's lost its leader
+	raft::State::Options bar_options;
+	bar_options.pre_vote = true;
+	raft::State bar("bar", {"eris", "foo"}, tmp_log().string() + "-bar", handler(),
+			bar_options);
+	bar.append_entries(raft::rpc::append_entries(1, "foo", 0, 0,
+				std::vector<std::tuple<uint32_t, Json::Value>>{std::make_tuple(1u, Json::Value("hail"))}, 0));
+	bar.timeout();
+
+	request_vote_args_.clear();
+	sut.timeout();
+	auto request = std::get<1>(request_vote_args_.back());
+	BOOST_REQUIRE(request.pre_vote());
+
+	//A candidate with less of the log than bar wouldn't get it
+	BOOST_CHECK(!std::get<1>(bar.request_vote(raft::rpc::request_vote(2, "foo", 0, 0, false, true))));
+
+	auto ret = bar.request_vote(request);
+	BOOST_REQUIRE(std::get<1>(ret));
+	//Granting a pre-vote doesn't take up the term or spend the vote
+	BOOST_CHECK_EQUAL(bar.term(), 1);
+	BOOST_CHECK(!bar.log().last_vote());
+
+	request_vote_args_.clear();
+	sut.request_vote_response("bar", raft::rpc::request_vote_response(request, std::get<0>(ret), std::get<1>(ret)));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::candidate_state);
+	BOOST_CHECK_EQUAL(sut.term(), 2);
+	BOOST_REQUIRE_EQUAL(request_vote_args_.size(), 2);
+	BOOST_CHECK(!std::get<1>(request_vote_args_[0]).pre_vote());
+
+	//and a late pre-vote for the old round is ignored
+	sut.request_vote_response("foo", raft::rpc::request_vote_response(request, 1, true));
+	BOOST_CHECK_EQUAL(sut.term(), 2);
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::candidate_state);
+
+	fs::remove_all(tmp_log().string() + "-bar");
+}
+
+BOOST_FIXTURE_TEST_CASE(learners_excluded_from_quorum, test_fixture)
+{
+	raft::State::Options options;
+	options.learners = {"hung_mung", "mal"};
+	raft::State sut("eris", {"foo", "bar", "hung_mung", "mal"}, tmp_log().string(), handler(),
+			options);
+
+	//Only the voters are asked, and one of them is enough
+	sut.timeout();
+	BOOST_REQUIRE_EQUAL(request_vote_args_.size(), 2);
+	for(const auto& request : request_vote_args_)
+		BOOST_CHECK(std::get<0>(request) == "foo" || std::get<0>(request) == "bar");
+
+	//A learner's vote doesn't count
+	auto request = std::get<1>(request_vote_args_[0]);
+	sut.request_vote_response("mal", raft::rpc::request_vote_response(request, 1, true));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::candidate_state);
+	sut.request_vote_response("foo", raft::rpc::request_vote_response(request, 1, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	//Learners are sent the log as well
+	BOOST_CHECK_EQUAL(sent_to(*this, "mal").size(), 1);
+
+	sut.append(Json::Value("hail"));
+	auto entry = raft::rpc::append_entries(1, "eris", 0, 0,
+			std::vector<std::tuple<uint32_t, Json::Value>>{std::make_tuple(1u, Json::Value("hail"))}, 0);
+
+	sut.append_entries_response("hung_mung", raft::rpc::append_entries_response(entry, 1, true));
+	sut.append_entries_response("mal", raft::rpc::append_entries_response(entry, 1, true));
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 0);
+
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(entry, 1, true));
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 1);
+
+	//and leadership can't be handed to one
+	BOOST_CHECK(!sut.transfer_leadership(std::string("mal"), nullptr));
+}
+
+BOOST_FIXTURE_TEST_CASE(learner_never_stands_or_votes, test_fixture)
+{
+	raft::State::Options options;
+	options.pre_vote = true;
+	options.learners = {"mal"};
+	raft::State sut("mal", {"eris", "foo", "bar"}, tmp_log().string(), handler(),
+			options);
+
+	sut.timeout();
+	sut.timeout();
+	BOOST_CHECK(request_vote_args_.empty());
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
+	BOOST_CHECK_EQUAL(sut.term(), 0);
+
+	BOOST_CHECK(!std::get<1>(sut.request_vote(raft::rpc::request_vote(1, "foo", 0, 0))));
+
+	//It follows the log all the same
+	auto ret = sut.append_entries(raft::rpc::append_entries(1, "eris", 0, 0,
+				std::vector<std::tuple<uint32_t, Json::Value>>{std::make_tuple(1u, Json::Value("hail"))}, 1));
+	BOOST_CHECK(std::get<1>(ret));
+	BOOST_REQUIRE_EQUAL(commit_args_.size(), 1);
+
+	sut.timeout_now(raft::rpc::timeout_now(1, "eris"));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
+	BOOST_CHECK(request_vote_args_.empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(sole_voter_commits_alone, test_fixture)
+{
+	raft::State::Options options;
+	options.learners = {"mal"};
+	raft::State sut("eris", {"mal"}, tmp_log().string(), handler(),
+			options);
+
+	sut.timeout();
+	BOOST_CHECK(request_vote_args_.empty());
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	sut.append(std::vector<Json::Value>{Json::Value("hail"), Json::Value("eris")});
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 2);
+	BOOST_CHECK_EQUAL(commit_args_.size(), 2);
+}
+
+//! Passes the leader's append_entries for follower on, and the answers back,
+//! until there are none left.
+static void deliver(test_fixture& fixture, raft::State& leader, raft::State& follower)
+{
+	for(std::size_t i = 0; i < fixture.append_entries_args_.size(); ++i)
+	{
+		if(std::get<0>(fixture.append_entries_args_[i]) != follower.id())
+			continue;
+
+		const raft::rpc::append_entries rpc = std::get<1>(fixture.append_entries_args_[i]);
+		auto ret = follower.append_entries(rpc);
+		leader.append_entries_response(follower.id(), raft::rpc::append_entries_response(rpc,
+					std::get<0>(ret), std::get<1>(ret), std::get<2>(ret), std::get<3>(ret)));
+	}
+
+	fixture.append_entries_args_.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(membership_grows_through_joint_configuration, test_fixture)
+{
+	{
+		raft::State sut("eris", std::vector<std::string>{}, tmp_log().string(), handler());
+		raft::State foo("foo", {"eris"}, tmp_log().string() + "-foo", handler());
+
+		sut.timeout();
+		BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+		boost::optional<bool> changed;
+		BOOST_REQUIRE(sut.change_membership(raft::rpc::configuration({"eris", "foo"}, {}),
+					[&changed](bool result) {changed = result;}));
+
+		//The joint configuration is in force at once, so foo's needed to commit
+		BOOST_REQUIRE(sut.configuration().joint());
+		BOOST_CHECK(sut.configuration().voting("foo"));
+		BOOST_CHECK_EQUAL(sut.log().commit_index(), 0);
+
+		//Only one change at a time
+		BOOST_CHECK(!sut.change_membership(raft::rpc::configuration({"eris"}, {}), nullptr));
+
+		//Heartbeats bring foo up to date
+		for(int i = 0; i < 3; ++i)
+		{
+			sut.timeout();
+			deliver(*this, sut, foo);
+		}
+
+		//Both configurations are committed, and neither applied
+		BOOST_CHECK_EQUAL(sut.log().commit_index(), 2);
+		BOOST_CHECK(!sut.configuration().joint());
+		BOOST_CHECK(sut.configuration().voters() == std::set<std::string>({"eris", "foo"}));
+		BOOST_REQUIRE(changed);
+		BOOST_CHECK(*changed);
+		BOOST_CHECK(commit_args_.empty());
+
+		//The follower's taken it up too
+		BOOST_CHECK(foo.configuration() == sut.configuration());
+
+		//and a single vote is no longer a majority
+		sut.append(Json::Value("hail"));
+		BOOST_CHECK_EQUAL(sut.log().commit_index(), 2);
+		sut.timeout();
+		deliver(*this, sut, foo);
+		BOOST_CHECK_EQUAL(sut.log().commit_index(), 3);
+	}
+
+	//The membership's read back from the log on restart
+	raft::State sut("eris", std::vector<std::string>{}, tmp_log().string(), handler());
+	BOOST_CHECK(sut.configuration().voters() == std::set<std::string>({"eris", "foo"}));
+	BOOST_CHECK(sut.nodes() == std::vector<std::string>{"foo"});
+
+	fs::remove_all(tmp_log().string() + "-foo");
+}
+
+BOOST_FIXTURE_TEST_CASE(removed_leader_steps_down, test_fixture)
+{
+	raft::State sut("eris", {"foo"}, tmp_log().string(), handler());
+	raft::State foo("foo", {"eris"}, tmp_log().string() + "-foo", handler());
+
+	sut.timeout();
+	auto request = std::get<1>(request_vote_args_.back());
+	sut.request_vote_response("foo", raft::rpc::request_vote_response(request, 1, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+	deliver(*this, sut, foo);
+
+	boost::optional<bool> changed;
+	BOOST_REQUIRE(sut.change_membership(raft::rpc::configuration({"foo"}, {}),
+				[&changed](bool result) {changed = result;}));
+
+	//Still a voter until the new configuration's committed
+	BOOST_CHECK(sut.configuration().voting("eris"));
+	for(int i = 0; i < 3 && sut.state() == raft::State::leader_state; ++i)
+	{
+		sut.timeout();
+		deliver(*this, sut, foo);
+	}
+
+	BOOST_REQUIRE(changed);
+	BOOST_CHECK(*changed);
+	BOOST_CHECK(!sut.configuration().voting("eris"));
+	BOOST_CHECK_EQUAL(sut.state(), raft::State::follower_state);
+	BOOST_CHECK(foo.configuration().voters() == std::set<std::string>({"foo"}));
+
+	fs::remove_all(tmp_log().string() + "-foo");
+}
+
+BOOST_FIXTURE_TEST_CASE(membership_change_abandoned_with_leadership, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+
+	//Followers can't change the membership
+	BOOST_CHECK(!sut.change_membership(raft::rpc::configuration({"eris", "foo"}, {}), nullptr));
+
+	sut.timeout();
+	auto request = std::get<1>(request_vote_args_.back());
+	sut.request_vote_response("foo", raft::rpc::request_vote_response(request, 1, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	//There must be someone left to vote
+	BOOST_CHECK(!sut.change_membership(raft::rpc::configuration({}, {"eris"}), nullptr));
+
+	boost::optional<bool> changed;
+	BOOST_REQUIRE(sut.change_membership(raft::rpc::configuration({"eris", "foo"}, {"bar"}),
+				[&changed](bool result) {changed = result;}));
+
+	//Old voters keep voting until the change is done
+	BOOST_REQUIRE(sut.configuration().new_voters());
+	BOOST_CHECK(!sut.configuration().new_voters()->count("bar"));
+	BOOST_CHECK(sut.configuration().voting("bar"));
+
+	sut.append_entries(raft::rpc::append_entries(2, "foo", 0, 0, {}, 0));
+	BOOST_REQUIRE(changed);
+	BOOST_CHECK(!*changed);
+}
+
+BOOST_FIXTURE_TEST_CASE(snapshot_requested_after_interval, test_fixture)
+{
+	raft::State::Options options;
+	options.snapshot_interval = 3;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), snapshot_handler(),
+			options);
+
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0,
+			{
+				std::make_tuple(1, Json::Value("hail")),
+				std::make_tuple(1, Json::Value("eris")),
+			}, 2));
+
+	BOOST_CHECK_EQUAL(commit_args_.size(), 2);
+	BOOST_CHECK(request_snapshot_args_.empty());
+
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 1, 2,
+			{
+				std::make_tuple(1, Json::Value("fnord")),
+				std::make_tuple(1, Json::Value("kallisti")),
+			}, 4));
+
+	BOOST_REQUIRE_EQUAL(request_snapshot_args_.size(), 1);
+	BOOST_CHECK_EQUAL(request_snapshot_args_[0], 4);
+
+	Json::Value state;
+	state["hail"] = "eris";
+	sut.snapshot(4, state);
+
+	BOOST_CHECK_EQUAL(sut.log().snapshot_index(), 4);
+	BOOST_CHECK_EQUAL(sut.log().last_index(), 4);
+
+	//Entries covered by the snapshot are skipped if they're resent
+	auto ret = sut.append_entries(raft::rpc::append_entries(1, "foo", 2, 1,
+			{
+				std::make_tuple(1, Json::Value("eris")),
+				std::make_tuple(1, Json::Value("fnord")),
+				std::make_tuple(1, Json::Value("kallisti")),
+				std::make_tuple(1, Json::Value("discordia")),
+			}, 4));
+
+	BOOST_CHECK(std::get<1>(ret));
+	BOOST_CHECK_EQUAL(sut.log().last_index(), 5);
+}
+
+BOOST_FIXTURE_TEST_CASE(snapshot_restored_on_startup, test_fixture)
+{
+	{
+		raft::Log log(tmp_log());
+		log.write(raft::log::NewTerm(1));
+		log.write(raft::log::LogEntry(1, 1, 1, Json::Value("hail")));
+		log.write(raft::log::LogEntry(1, 2, 1, Json::Value("eris")));
+		log.commit_index(2);
+		log.compact(1, R"({"hail":"eris"})");
+	}
+
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), snapshot_handler());
+
+	BOOST_REQUIRE_EQUAL(restore_args_.size(), 1);
+	BOOST_CHECK_EQUAL(restore_args_[0]["hail"].asString(), "eris");
+
+	//Only the entry after the snapshot is applied
+	BOOST_REQUIRE_EQUAL(commit_args_.size(), 1);
+	BOOST_CHECK(commit_args_[0] == Json::Value("eris"));
+}
+
+BOOST_FIXTURE_TEST_CASE(checkpointed_entries_not_applied_again, test_fixture)
+{
+	Json::Value state;
+	state["hail"] = "eris";
+
+	{
+		raft::State::Options options;
+		options.checkpoint_interval = 2;
+		raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), snapshot_handler(),
+				options);
+
+		sut.append_entries(raft::rpc::append_entries(1, "foo", 0, 0,
+				{
+					std::make_tuple(1, Json::Value("hail")),
+					std::make_tuple(1, Json::Value("eris")),
+					std::make_tuple(1, Json::Value("fnord")),
+					std::make_tuple(1, Json::Value("kallisti")),
+				}, 3));
+
+		BOOST_REQUIRE_EQUAL(request_snapshot_args_.size(), 1);
+		BOOST_CHECK_EQUAL(request_snapshot_args_[0], 3);
+		sut.snapshot(3, state);
+
+		//A checkpoint leaves the log alone
+		BOOST_CHECK_EQUAL(sut.log().snapshot_index(), 0);
+		BOOST_CHECK_EQUAL(sut.log().last_index(), 4);
+	}
+
+	commit_args_.clear();
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), snapshot_handler());
+
+	//The checkpoint stands in for the entries it covers
+	BOOST_REQUIRE_EQUAL(restore_args_.size(), 1);
+	BOOST_CHECK(restore_args_[0] == state);
+	BOOST_CHECK(commit_args_.empty());
+	BOOST_CHECK_EQUAL(sut.log().commit_index(), 3);
+
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 1, 4, {}, 4));
+	BOOST_REQUIRE_EQUAL(commit_args_.size(), 1);
+	BOOST_CHECK(commit_args_[0] == Json::Value("kallisti"));
+}
+
+BOOST_FIXTURE_TEST_CASE(torn_checkpoint_ignored, test_fixture)
+{
+	{
+		raft::Log log(tmp_log());
+		log.write(raft::log::NewTerm(1));
+		log.write(raft::log::LogEntry(1, 1, 1, Json::Value("hail")));
+		log.write(raft::log::LogEntry(1, 2, 1, Json::Value("eris")));
+	}
+
+	{
+		std::ofstream out(tmp_log().string() + ".applied");
+		out << R"({"index":2,"sta)";
+	}
+
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), snapshot_handler());
+	BOOST_CHECK(restore_args_.empty());
+
+	//The entries are applied from the log instead
+	sut.append_entries(raft::rpc::append_entries(1, "foo", 1, 2, {}, 2));
+	BOOST_REQUIRE_EQUAL(commit_args_.size(), 2);
+	BOOST_CHECK(commit_args_[0] == Json::Value("hail"));
+	BOOST_CHECK(commit_args_[1] == Json::Value("eris"));
+}
+
+BOOST_FIXTURE_TEST_CASE(leader_sends_snapshot_in_chunks, test_fixture)
+{
+	//A snapshot with a multibyte character straddling the first chunk
+	const std::string data = "{\"k\":\"\xc3\xa9\"}";
+	{
+		raft::Log log(tmp_log());
+		log.write(raft::log::NewTerm(2));
+		log.write(raft::log::LogEntry(2, 1, 1, Json::Value("hail")));
+		log.write(raft::log::LogEntry(2, 2, 2, Json::Value("eris")));
+		log.commit_index(2);
+		log.compact(2, data);
+	}
+
+	raft::State::Options options;
+	options.snapshot_chunk_size = 7;
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), snapshot_handler(),
+			options);
+	restore_args_.clear();
+
+	sut.timeout();
+
+	auto bar_request = std::find_if(request_vote_args_.begin(), request_vote_args_.end(),
+			[](const std::tuple<std::string, raft::rpc::request_vote>& a) -> bool
+			{
+				return std::get<0>(a) == "bar";
+			});
+
+	sut.request_vote_response("bar", raft::rpc::request_vote_response(std::get<1>(*bar_request), 3, true));
+	BOOST_REQUIRE_EQUAL(sut.state(), raft::State::leader_state);
+
+	auto bar_append = std::find_if(append_entries_args_.begin(), append_entries_args_.end(),
+			[](const std::tuple<std::string, raft::rpc::append_entries>& a) -> bool
+			{
+				return std::get<0>(a) == "bar";
+			});
+
+	//bar's log is empty, and what it needs has been compacted
+	sut.append_entries_response("bar", raft::rpc::append_entries_response(std::get<1>(*bar_append), 3, false));
+
+	std::string received;
+	raft::State follower("bar", {"eris", "foo"}, (tmp_log().string() + ".bar"), snapshot_handler());
+
+	while(!install_snapshot_args_.empty())
+	{
+		auto request = std::get<1>(install_snapshot_args_.front());
+		BOOST_REQUIRE_EQUAL(std::get<0>(install_snapshot_args_.front()), "bar");
+		install_snapshot_args_.erase(install_snapshot_args_.begin());
+
+		BOOST_CHECK_EQUAL(request.last_included_index(), 2);
+		BOOST_CHECK_EQUAL(request.last_included_term(), 2);
+		BOOST_CHECK_EQUAL(request.offset(), received.size());
+		//Chunks never split a character
+		BOOST_CHECK((static_cast<unsigned char>(request.data()[0]) & 0xc0) != 0x80);
+		received += request.data();
+
+		auto ret = follower.install_snapshot(request);
+		BOOST_REQUIRE(std::get<1>(ret));
+
+		sut.install_snapshot_response("bar", raft::rpc::install_snapshot_response(
+					request, std::get<0>(ret), std::get<1>(ret), std::get<2>(ret)));
+	}
+
+	fs::remove_all(tmp_log().string() + ".bar");
+
+	BOOST_CHECK_EQUAL(received, data);
+
+	BOOST_REQUIRE_EQUAL(restore_args_.size(), 1);
+	BOOST_CHECK_EQUAL(restore_args_[0]["k"].asString(), "\xc3\xa9");
+	BOOST_CHECK_EQUAL(follower.log().snapshot_index(), 2);
+
+	//With the snapshot installed, bar's heartbeats follow on from it
+	append_entries_args_.clear();
+	sut.timeout();
+
+	bar_append = std::find_if(append_entries_args_.begin(), append_entries_args_.end(),
+			[](const std::tuple<std::string, raft::rpc::append_entries>& a) -> bool
+			{
+				return std::get<0>(a) == "bar";
+			});
+
+	BOOST_REQUIRE(bar_append != append_entries_args_.end());
+	BOOST_CHECK_EQUAL(std::get<1>(*bar_append).prev_log_index(), 2);
+	BOOST_CHECK_EQUAL(std::get<1>(*bar_append).prev_log_term(), 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(snapshot_installed_without_snapshot_handlers, test_fixture)
+{
+	raft::State sut("eris", {"foo", "bar"}, tmp_log().string(), handler());
+
+	auto ret = sut.install_snapshot(raft::rpc::install_snapshot(1, "foo", 1, 2, 0,
+				R"({"hail":"eris"})", true));
+
+	//There's nothing to restore it into, but the log still moves on
+	BOOST_CHECK(std::get<1>(ret));
+	BOOST_CHECK(restore_args_.empty());
+	BOOST_CHECK_EQUAL(sut.log().snapshot_index(), 2);
+}